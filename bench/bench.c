@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "sqlite3.h"
+#include <assert.h>
+
+sqlite3 *db;
+
+#include "../test/db_functions.c"
+
+/*
+
+MICRO-BENCHMARKS OF THE STORED PROCEDURES ENGINE
+
+Each benchmark prepares a single statement and executes it repeatedly,
+stepping until all the rows are returned. The latency of each execution
+is recorded, and the results are printed as JSON, one benchmark per line:
+
+{"benchmarks": [
+{"name": "call_roundtrip", "n": 1, "ops": 123456, "ops_per_sec": 411520.0, "p50_us": 2.31, "p99_us": 4.02},
+...
+]}
+
+Usage:
+
+  runbench [-t milliseconds] [filter]
+
+  -t      minimum running time of each benchmark (default: 300)
+  filter  only run the benchmarks whose name contains this string
+
+*/
+
+// limits of each benchmark
+#define BENCH_MIN_OPS      100
+#define BENCH_MAX_OPS      1000000
+#define BENCH_WARMUP_OPS   10
+
+// rows on the bench_data table
+#define BENCH_DATA_ROWS    10000
+
+int bench_time_ms = 300;
+char *bench_filter = NULL;
+int bench_count = 0;
+
+/****************************************************************************/
+
+double now_us(){
+#ifdef _WIN32
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER counter;
+  if( freq.QuadPart==0 ) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart * 1e6 / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+#endif
+}
+
+int compare_double(const void *a, const void *b){
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+double percentile(double *samples, int count, double p){
+  int pos = (int) ceil(p * count) - 1;
+  if( pos<0 ) pos = 0;
+  if( pos>=count ) pos = count - 1;
+  return samples[pos];
+}
+
+/****************************************************************************/
+
+/*
+** Execute the statement once, stepping over all the returned rows.
+*/
+void run_once(sqlite3_stmt *stmt, char *sql){
+  int rc;
+
+  do{
+    rc = sqlite3_step(stmt);
+  }while( rc==SQLITE_ROW );
+
+  if( rc!=SQLITE_DONE ){
+    print_error(rc, sqlite3_errmsg(db), sql, __FUNCTION__, __LINE__);
+    QUIT_TEST();
+  }
+
+  sqlite3_reset(stmt);
+}
+
+/*
+** Execute the SQL command repeatedly, for at least the configured time,
+** and print the results.
+*/
+void bench_fn(char *name, int n, char *sql, const char *function, int line){
+  sqlite3_stmt *stmt = NULL;
+  double *samples;
+  double start, end, total;
+  int rc, i, count = 0;
+
+  if( bench_filter && strstr(name, bench_filter)==NULL ) return;
+
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if( rc!=SQLITE_OK ){
+    print_error(rc, "sqlite3_prepare", sql, function, line);
+    QUIT_TEST();
+  }
+
+  samples = malloc(BENCH_MAX_OPS * sizeof(double));
+  assert(samples!=NULL);
+
+  for( i=0; i<BENCH_WARMUP_OPS; i++ ){
+    run_once(stmt, sql);
+  }
+
+  total = 0;
+  while( count<BENCH_MAX_OPS &&
+         (count<BENCH_MIN_OPS || total<bench_time_ms * 1000.0) ){
+    start = now_us();
+    run_once(stmt, sql);
+    end = now_us();
+    samples[count++] = end - start;
+    total += end - start;
+  }
+
+  sqlite3_finalize(stmt);
+
+  qsort(samples, count, sizeof(double), compare_double);
+
+  printf("%s{\"name\": \"%s\", \"n\": %d, \"ops\": %d, \"ops_per_sec\": %.1f, "
+         "\"p50_us\": %.2f, \"p99_us\": %.2f}",
+         bench_count>0 ? ",\n" : "", name, n, count,
+         count / (total / 1e6),
+         percentile(samples, count, 0.50),
+         percentile(samples, count, 0.99));
+  fflush(stdout);
+  bench_count++;
+
+  free(samples);
+}
+
+#define bench(name, n, sql) bench_fn(name, n, sql, __FUNCTION__, __LINE__)
+
+/****************************************************************************/
+
+/*
+** Return a CALL command with a list literal of n integers.
+*/
+char* call_with_list(char *procedure, int n){
+  char *sql = sqlite3_mprintf("CALL %s([", procedure);
+  int i;
+
+  for( i=1; i<=n; i++ ){
+    sql = sqlite3_mprintf("%z%s%d", sql, i>1 ? "," : "", i);
+  }
+  sql = sqlite3_mprintf("%z])", sql);
+  assert(sql!=NULL);
+  return sql;
+}
+
+/****************************************************************************/
+
+int main(int argc, char **argv){
+  int sizes[] = { 10, 100, 1000 };
+  int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  char *sql;
+  int rc, i;
+
+  for( i=1; i<argc; i++ ){
+    if( strcmp(argv[i], "-t")==0 && i+1<argc ){
+      bench_time_ms = atoi(argv[++i]);
+    }else{
+      bench_filter = argv[i];
+    }
+  }
+
+  rc = sqlite3_open(":memory:", &db);
+  assert(rc==SQLITE_OK);
+
+  db_execute("CREATE TABLE bench_data (id INTEGER PRIMARY KEY, name TEXT, value REAL)");
+  sql = sqlite3_mprintf(
+    "INSERT INTO bench_data SELECT x, 'item ' || x, x * 1.5 FROM"
+    " (WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < %d)"
+    " SELECT x FROM c)", BENCH_DATA_ROWS);
+  db_execute(sql);
+  sqlite3_free(sql);
+
+  db_execute("CREATE TABLE bench_log (id INTEGER PRIMARY KEY, value)");
+
+  db_execute(
+    "CREATE PROCEDURE bench_echo(@value) BEGIN"
+    " RETURN @value;"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE bench_insert(@value) BEGIN"
+    " INSERT INTO bench_log (value) VALUES (@value);"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE bench_loop(@n) BEGIN"
+    " SET @i = 0;"
+    " SET @sum = 0;"
+    " LOOP"
+    "   SET @i = @i + 1;"
+    "   IF @i > @n THEN BREAK; END IF;"
+    "   SET @sum = @sum + @i * 2;"
+    " END LOOP;"
+    " RETURN @sum;"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE bench_foreach_list(@list) BEGIN"
+    " SET @sum = 0;"
+    " FOREACH @item IN @list DO"
+    "   SET @sum = @sum + @item;"
+    " END LOOP;"
+    " RETURN @sum;"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE bench_foreach_select(@n) BEGIN"
+    " SET @sum = 0;"
+    " FOREACH @id, @name, @value IN SELECT * FROM bench_data WHERE id <= @n DO"
+    "   SET @sum = @sum + @value;"
+    " END LOOP;"
+    " RETURN @sum;"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE bench_set_rows(@n) BEGIN"
+    " SET @rows = (SELECT * FROM bench_data WHERE id <= @n);"
+    " RETURN 1;"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE bench_return_rows(@n) BEGIN"
+    " SET @rows = (SELECT * FROM bench_data WHERE id <= @n);"
+    " RETURN @rows;"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE bench_return_select(@n) BEGIN"
+    " RETURN SELECT * FROM bench_data WHERE id <= @n;"
+    "END"
+  );
+
+  printf("{\"benchmarks\": [\n");
+
+  // CALL round-trip
+
+  bench("call_roundtrip", 1, "CALL bench_echo(123)");
+  bench("call_write", 1, "CALL bench_insert(123)");
+  db_execute("DELETE FROM bench_log");
+
+  // loops, lists and result sets of increasing sizes
+
+  for( i=0; i<num_sizes; i++ ){
+    int n = sizes[i];
+
+    sql = sqlite3_mprintf("CALL bench_loop(%d)", n);
+    bench("loop", n, sql);
+    sqlite3_free(sql);
+
+    sql = call_with_list("bench_foreach_list", n);
+    bench("foreach_list", n, sql);
+    sqlite3_free(sql);
+
+    sql = sqlite3_mprintf("CALL bench_foreach_select(%d)", n);
+    bench("foreach_select", n, sql);
+    sqlite3_free(sql);
+
+    sql = sqlite3_mprintf("CALL bench_set_rows(%d)", n);
+    bench("set_rows", n, sql);
+    sqlite3_free(sql);
+
+    sql = sqlite3_mprintf("CALL bench_return_rows(%d)", n);
+    bench("return_rows", n, sql);
+    sqlite3_free(sql);
+
+    sql = sqlite3_mprintf("CALL bench_return_select(%d)", n);
+    bench("return_select", n, sql);
+    sqlite3_free(sql);
+  }
+
+  printf("\n]}\n");
+
+  sqlite3_close(db);
+  return 0;
+}
@@ -19704,6 +19704,7 @@ static const char *(azHelp[]) = {
 #ifndef SQLITE_SHELL_FIDDLE
   ".check GLOB              Fail if output since .testcase does not match",
   ".clone NEWDB             Clone data into NEWDB from the existing database",
+  ".compileproc NAME ?FILE? Emit a stored procedure as C source for an extension",
 #endif
   ".connection [close] [#]  Open or close an auxiliary database connection",
   ".databases               List names and files of attached databases",
@@ -23212,6 +23213,43 @@ static int do_meta_command(char *zLine, ShellState *p){
   }else
 #endif /* !defined(SQLITE_SHELL_FIDDLE) */
 
+#ifndef SQLITE_SHELL_FIDDLE
+  if( c=='c' && n>=3 && cli_strncmp(azArg[0], "compileproc", n)==0 ){
+    sqlite3_stmt *pStmt = 0;
+    FILE *out = p->out;
+    if( nArg<2 || nArg>3 ){
+      raw_printf(stderr, "Usage: .compileproc NAME ?FILE?\n");
+      rc = 1;
+      goto meta_command_exit;
+    }
+    if( nArg==3 ){
+      failIfSafeMode(p, "cannot run .compileproc with a FILE in safe mode");
+    }
+    open_db(p, 0);
+    rc = sqlite3_prepare_v2(p->db, "SELECT sp_compile_c(?1)", -1, &pStmt, 0);
+    if( rc==SQLITE_OK ){
+      sqlite3_bind_text(pStmt, 1, azArg[1], -1, SQLITE_STATIC);
+      rc = sqlite3_step(pStmt);
+    }
+    if( rc!=SQLITE_ROW ){
+      utf8_printf(stderr, "Error: %s\n", sqlite3_errmsg(p->db));
+      rc = 1;
+    }else{
+      if( nArg==3 ){
+        out = output_file_open(azArg[2], 1);
+      }
+      if( out==0 ){
+        rc = 1;
+      }else{
+        utf8_printf(out, "%s", (const char*)sqlite3_column_text(pStmt, 0));
+        if( out!=p->out ) output_file_close(out);
+        rc = 0;
+      }
+    }
+    sqlite3_finalize(pStmt);
+  }else
+#endif /* !defined(SQLITE_SHELL_FIDDLE) */
+
   if( c=='c' && cli_strncmp(azArg[0], "connection", n)==0 ){
     if( nArg==1 ){
       /* List available connections */
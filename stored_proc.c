@@ -1,5 +1,14 @@
 #include <stdbool.h>
 
+// vectorized kernels of the list functions. AVX2 is detected at run time
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && \
+    (defined(__GNUC__) || defined(__clang__)) && !defined(SQLITE_SP_OMIT_SIMD)
+#define SP_LIST_SIMD  1
+#include <immintrin.h>
+#else
+#define SP_LIST_SIMD  0
+#endif
+
 #ifdef SQLITE_DEBUG
 #define XTRACE(...)   printf(__VA_ARGS__)
 #else
@@ -25,9 +34,14 @@
 #define CMD_TYPE_FOREACH    15
 
 
+// flags of the parsed command
 #define CMD_FLAG_STORE_AS_LIST   1
-#define CMD_FLAG_DYNAMIC_SQL     2
-#define CMD_FLAG_EXECUTED        4
+#define CMD_FLAG_RETURN_ROWS     32  /* RETURN forwards the rows of a statement */
+#define CMD_FLAG_RETURN_NEXT     64  /* RETURN NEXT: returns a row and continues */
+// flags of the command state, on the call frame
+#define CMD_FLAG_DYNAMIC_SQL     2   /* the expression was prefixed with SELECT */
+#define CMD_FLAG_EXPR_CHECKED    8   /* the expression was checked for native evaluation */
+#define CMD_FLAG_NATIVE_EXPR     16  /* the expression is evaluated without SQLite */
 
 
 #define POS_RESULT_ROW      2
@@ -41,47 +55,156 @@ struct sqlite3_var {
   int len;                /* variable name size */
   u8 type;  //affinity;   /* defined type. SQLITE_INTEGER, REAL, TEXT or BLOB */
   int declared_in_pos;    /* position in the procedure where it was declared */
-  sqlite3_value value;    /* contains a value or a pointer to a list struct */
-  sqlite3_var *next;      /* next in the global list */
-  sqlite3_var *nextUsed;  /* temporary use */
+  int slot;               /* position of the value on the frame->values array */
 };
 
 #define VAR_POS_PARAMETER  -2
 
+// the value of a variable. it contains a value or a pointer to a list struct.
+// the values array can be moved when a variable is added, so the pointer
+// must not be kept across calls to addFrameVariable()
+#define variableValue(frame, slot)  (&(frame)->values[slot])
+
+// must be used after modifying the value of a variable, so the prepared
+// statements that use it are bound again. the version 0 is never used
+#define variableChanged(frame, slot) do { \
+  u32 *changed_version = &(frame)->versions[slot]; \
+  if( ++(*changed_version)==0 ) *changed_version = 1; \
+} while(0)
+
 // when a sqlite3_var contains a list, the sqlite3_value has a pointer to a sqlite3_list structure
 
 typedef struct sqlite3_list sqlite3_list;
+typedef struct sp_arena sp_arena;
 
+/*
+** The lists built on execution are reference counted: the values that point
+** to them share the same storage, and the list is released with the last
+** one. The lists are not modified after they are built, so a list with more
+** than one reference must be copied before being modified.
+** The parsed lists have no count (nref is 0). They are kept by the parsed
+** command, that can be shared by connections on other threads.
+** The lists whose items have the same type are packed: the storage of the
+** values holds an array of integers or doubles, or the offsets of the
+** strings followed by their text. Use listItem() to read the items.
+*/
 struct sqlite3_list {
     int num_items;
+    int nref;                   /* references to the list, 0 if not counted */
+    sp_arena *arena;            /* call arena with the list memory, or NULL */
+    u8 type;                    /* LIST_VALUES or the type of the packed items */
     sqlite3_value value[1];
 };
 
+// storage of the list items
+#define LIST_VALUES    0        /* sqlite3_value objects, of any type */
+#define LIST_INTEGERS  1        /* packed i64 array */
+#define LIST_REALS     2        /* packed double array */
+#define LIST_TEXTS     3        /* u32 offsets of the strings, then the text */
+
+#define listInts(list)     ((i64*)(list)->value)
+#define listReals(list)    ((double*)(list)->value)
+#define listOffsets(list)  ((u32*)(list)->value)
+#define listText(list)     ((char*)&listOffsets(list)[(list)->num_items + 1])
+
 typedef struct stored_proc stored_proc;
 typedef struct command command;
+typedef struct sp_connection sp_connection;
+typedef struct pooled_stmt pooled_stmt;
+typedef struct bind_slot bind_slot;
+typedef struct native_expr native_expr;
+typedef struct expr_op expr_op;
+typedef struct sp_arena_block sp_arena_block;
+typedef struct sp_op sp_op;
+typedef struct sp_native_api sp_native_api;
+typedef struct sp_native_proc sp_native_proc;
+typedef struct block_parser block_parser;
+typedef struct if_block if_block;
+typedef struct loop_block loop_block;
+typedef struct sp_code sp_code;
+typedef struct call_frame call_frame;
+typedef struct cmd_state cmd_state;
+typedef struct sp_profile sp_profile;
+typedef struct sp_cmd_profile sp_cmd_profile;
+typedef struct sp_histogram sp_histogram;
+typedef struct stored_func stored_func;
+
+/*
+** The variable bound to a parameter of a command statement, resolved when
+** the statement is prepared, and the version of the value that is bound.
+*/
+struct bind_slot {
+    int slot;                   /* -1 if the parameter is not a variable */
+    u32 version;                /* 0 if the parameter is not bound */
+};
+
+/*
+** An instruction of a native expression program. The program is stored in
+** postfix order and evaluated on a small stack of Mem cells.
+*/
+struct expr_op {
+    u8 opcode;                  /* one of the EXPR_* codes */
+    int p1;                     /* variable slot or literal index */
+};
+
+struct native_expr {
+    expr_op *ops;               /* the program */
+    int num_ops, num_alloc_ops;
+    Mem *literals;              /* constant values used by the program */
+    int num_literals, num_alloc_literals;
+    Mem *stack;                 /* evaluation stack */
+    int max_depth;              /* number of cells on the stack */
+};
+
+/*
+** Memory for the temporary lists and strings of a procedure call. The
+** allocations are not released one by one: the whole arena is reset when
+** the call finishes.
+*/
+struct sp_arena {
+    sp_arena_block *block;      /* current block, followed by the older ones */
+    sqlite3_int64 memory;       /* bytes allocated on the blocks */
+};
+
+/*
+** An instruction of the procedure program. The control flow commands are
+** compiled into jumps, and the other commands are executed by their
+** executeXXX() functions.
+*/
+struct sp_op {
+    u8 opcode;                  /* one of the SP_OP_* codes */
+    int p2;                     /* jump destination */
+    command *cmd;
+};
 
+/*
+** A parsed command. It is not modified after the procedure is parsed: the
+** state of its execution is kept on a cmd_state, on the call frame.
+*/
 struct command {
     int type;
     char *sql, *sql2;
     int  nsql, nsql2;
-    sqlite3_stmt *stmt;         /* used in STATEMENT, SET, FOREACH and RETURN */
     sqlite3_list *input_list;   /* parsed LIST, used in SET, FOREACH and CALL commands */
-    sqlite3_var  *input_var;    /* used in the FOREACH command */
-    unsigned int current_item;  /* used in the FOREACH command */
+    int input_var;              /* variable slot used in the FOREACH command, or -1 */
+    char *fused_sql;            /* FOREACH executed as a single statement, or NULL */
+    int nfused_sql;
 
     int flags;
 
-    stored_proc *procedure;     /* used in CALL command */
-
     int next_if_cmd;            /* used in ELSEIF, ELSE, END IF */
     int related_cmd;            /* used in LOOP, BREAK, CONTINUE, END LOOP, FOREACH */
 
-    sqlite3_var **vars;         /* variables used in this command (array of pointers to) */
+    int *vars;                  /* variables used in this command (array of slots) */
     unsigned int num_vars;
 };
 
+/*
+** A parsed procedure. Once loaded it is only read, so it can be shared by
+** the connections and executed by many calls at the same time.
+*/
 struct stored_proc {
-    sqlite3 *db;
+    sqlite3 *db;                    // the connection that parsed it
     char name[128];
     bool is_function;
     char *code;
@@ -90,45 +213,356 @@ struct stored_proc {
     command* cmds;                  // an array of commands (pointer to allocated memory)
     unsigned int num_alloc_cmds;    // the current size of the array (number of elements)
     unsigned int num_cmds;
-    // variables
-    sqlite3_var* vars;
-    //unsigned int num_vars;
+    // variables, indexed by slot
+    sqlite3_var **vars;             // an array of pointers to the variable definitions
+    int num_vars;
+    int num_alloc_vars;
+    Hash var_names;                 // variable definitions by name
     // parameters = variables declared in the procedure header
-    sqlite3_var** params;  // an array of pointers to variables
+    int *params;           // an array of variable slots
     unsigned int num_params;
+    // hash of the name and code, identifies the statements on the pool
+    u64 version;
+    // true if no command can modify the database, except for the CALLs
+    bool read_only;
+    // true if it calls other procedures. they are checked when the call is
+    // prepared, to know if the whole call is read-only
+    bool has_calls;
+    // true if it can modify the stored_procedures table, directly or by
+    // calling other procedures
+    bool changes_catalog;
+    // the commands compiled into a program with resolved jumps
+    sp_op *program;
+    int num_ops;
+};
+
+/*
+** The parsed form of a procedure, shared by the call frames of all the
+** connections of the process.
+*/
+struct sp_code {
+    stored_proc *parsed;
+    u64 version;                    // hash of the name and code
+    int ref_count;                  // number of frames using it
+    sp_code *next;                  // next entry on the same bucket
+};
+
+/*
+** The execution state of a command, kept on the call frame.
+*/
+struct cmd_state {
+    sqlite3_stmt *stmt;         /* used in STATEMENT, SET, FOREACH and RETURN */
+    char *sql;                  /* the expression with SELECT, if CMD_FLAG_DYNAMIC_SQL */
+    int nsql;
+    unsigned int current_item;  /* used in the FOREACH command */
+    Mem loop_list;              /* reference to the list iterated by FOREACH */
+    int list_size_hint;         /* rows stored by the last execution, used in SET */
+
+    int flags;
+
+    int *vars;                  /* variables set by the expression of a RETURN */
+    unsigned int num_vars;
+
+    bind_slot *binds;           /* variable bound to each statement parameter */
+    int num_binds;
+
+    native_expr *expr;          /* used in IF, ELSEIF, ASSERT, SET and RETURN */
+};
+
+/*
+** The activation frame of a procedure call. It holds all the state of an
+** execution, so the same parsed procedure can be executed by nested and
+** concurrent calls. Each procedure_call has its own frame, and the idle
+** frames are kept on the connection cache with their prepared statements.
+*/
+struct call_frame {
+    stored_proc *procedure;         // the parsed procedure, read-only
+    sp_code *shared;                // the reference to it
+    sqlite3 *db;
+    sp_connection *conn;
+    // state of the commands, by position
+    cmd_state *cmds;
+    // the values of the variables, by slot. the variables of the procedure
+    // are followed by the ones created on execution
+    sqlite3_value *values;
+    u32 *versions;                  // incremented when a value is modified
+    int num_vars;
+    int num_alloc_vars;
+    sqlite3_var **new_vars;         // definitions of the variables created on execution
     // result
     sqlite3_list *result_list;
     int current_row;
+    sqlite3_stmt *result_stmt;      // statement whose rows are being returned
+    // a generator is suspended after each RETURN NEXT, and resumed at this
+    // position of the program when the next row is read
+    bool suspended;
+    int resume_pos;
+    // statistics of the procedure, if profiling. the command being measured
+    // and when it started, and the rows it read
+    sp_profile *profile;
+    command *profiled_cmd;
+    sqlite3_int64 profile_start;
+    sqlite3_int64 profile_rows;
+    // latency histogram of the procedure, and when the current CALL started
+    sp_histogram *latency;
+    sqlite3_int64 call_start;
     // aMem and nMem from Vdbe are temporarily stored here
     sqlite3_value *aMem;
     int nMem;
+    // schema version in which the procedure was loaded
+    int schema_cookie;
+    int schema_generation;
+    // state of the database when the code was last read from the
+    // stored_procedures table: the data version of the main database (or -1
+    // if unknown) and the count of rows modified by the connection
+    sqlite3_int64 data_version;
+    sqlite3_int64 total_changes;
+    bool replaced;                  // the stored code is another one
+    // set while the function is executed from a SQL expression
+    sqlite3_context *function_ctx;
+    // temporary lists and strings of the current call
+    sp_arena arena;
+    // statements used by the native implementation, by statement id
+    sqlite3_stmt **native_stmts;
+    int num_native_stmts;
+    // next idle frame on the connection cache
+    call_frame *next_cached;
+};
+
+// the state of a command of the frame procedure
+#define commandState(frame, cmd)  (&(frame)->cmds[(cmd) - (frame)->procedure->cmds])
+
+/*
+** Interface of the procedures compiled into C by sp_compile_c(). It must
+** match the definitions emitted on the generated source.
+**
+** The compiled extension registers its sp_native_proc on the connection by
+** calling sp_register_native() with the descriptor bound as a pointer of
+** type "sp_native_proc". It is used instead of the parsed procedure when the
+** version (hash of the name and code) matches the code stored on the
+** database.
+*/
+#define SP_NATIVE_MAGIC  0x53504e31
+
+struct sp_native_api {
+    sqlite3 *db;
+    void *ctx;
+    /* return the prepared statement with the given id, reset */
+    sqlite3_stmt *(*xStatement)(void *ctx, int id, const char *sql);
+    /* set the returned row. a NULL value is a SQL NULL */
+    int (*xResultRow)(void *ctx, int num_cols, sqlite3_value **values);
 };
 
+struct sp_native_proc {
+    unsigned int magic;         /* SP_NATIVE_MAGIC */
+    const char *name;
+    sqlite3_uint64 version;     /* hash of the name and code */
+    int num_params;
+    int num_statements;
+    int (*xExecute)(sp_native_api *api, sqlite3_value **params, char **pzErr);
+};
 
 struct procedure_call {
-    stored_proc *procedure;
+    call_frame *frame;
     sqlite3_list *input_list;
+    int *var_numbers;           /* number of the variable bound to each argument, or 0 */
+    sp_connection *conn;
+    sp_native_proc *native;     /* compiled implementation, if loaded */
+};
+
+/*
+** Per-connection state of the stored procedures engine.
+** It is kept as the user data of the sp_config() SQL function, so it is
+** created on the first use and released when the connection is closed.
+*/
+struct sp_connection {
+    sqlite3 *db;
+    // idle call frames, by procedure name
+    Hash procedures;
+    bool cache_enabled;
+    // idle prepared statements from the procedure bodies
+    pooled_stmt **pool_buckets;     // hash table, by version and command position
+    pooled_stmt *pool_first;        // most recently used
+    pooled_stmt *pool_last;         // least recently used
+    int pool_count;
+    sqlite3_int64 pool_memory;
+    int pool_max_count;
+    sqlite3_int64 pool_max_memory;
+    bool pool_attached;             // the sp_statements table is connected
+    // stored functions registered as SQL functions
+    int num_functions;
+    bool functions_loaded;
+    int functions_cookie;           // schema version of the registration
+    int functions_generation;
+    int function_depth;             // nesting level of the executing functions
+    stored_func *functions;         // registered stored functions
+    // native implementations loaded by extensions, by procedure name
+    Hash natives;
+    // execution statistics of the commands, by procedure name
+    Hash profiles;
+    bool profile_enabled;
+    // latency histograms of the CALLs, by procedure name. the list is also
+    // read by other connections, through the registry
+    Hash latencies;
+    sp_histogram *histograms;
+    bool latency_enabled;
+    sp_connection *next_registered;
+};
+
+/*
+** User data of a registered stored function.
+*/
+struct stored_func {
+    sp_connection *conn;            // NULL after the connection state is released
+    char name[128];
+    int num_args;                   // declared parameters, or -1
+    call_frame *frame;              // idle frame of the last row, with its statements
+    stored_func *next;              // on the list of the connection
+};
+
+/*
+** A prepared statement kept on the connection pool while not used by a
+** procedure instance. It is identified by the procedure version and by
+** the position of the command on the procedure.
+*/
+struct pooled_stmt {
+    u64 version;
+    int cmd_pos;
+    sqlite3_stmt *stmt;
+    int memory;
+    char name[128];                 // procedure name, for the sp_statements table
+    pooled_stmt *next_in_bucket;
+    pooled_stmt *prev_used, *next_used;
+};
+
+/*
+** Execution statistics of a command, collected while the profiling is
+** enabled. The type and SQL are copied, as the parsed procedure can be
+** released while the statistics are kept.
+*/
+struct sp_cmd_profile {
+    int type;
+    char *sql;
+    sqlite3_int64 count;            // number of executions
+    sqlite3_int64 total_ns;         // wall time
+    sqlite3_int64 max_ns;
+    sqlite3_int64 rows;             // rows read or modified
+    sqlite3_int64 vm_steps;         // counters of the prepared statement
+    sqlite3_int64 fullscan_steps;
+    sqlite3_int64 sorts;
+    sqlite3_int64 autoindexes;
+    sqlite3_int64 native_count;     // executions on the native evaluator
+};
+
+/*
+** Statistics of a version of a procedure. They are kept until the
+** connection is closed, as executing frames can point to them.
+*/
+struct sp_profile {
+    char name[128];
+    u64 version;
+    int num_cmds;
+    sp_profile *next;               // other versions of the same procedure
+    sp_cmd_profile cmds[1];
+};
+
+// the histogram buckets are log-linear: each power of 2 is divided in 16
+// linear sub-buckets, so the error is below 1/16 of the value. the values
+// are in nanoseconds, up to 2^48 (78 hours)
+#define SP_HIST_SUB_BITS   4
+#define SP_HIST_SUB_COUNT  (1 << SP_HIST_SUB_BITS)
+#define SP_HIST_MAX_EXP    47
+#define SP_HIST_BUCKETS    ((SP_HIST_MAX_EXP - SP_HIST_SUB_BITS + 2) * SP_HIST_SUB_COUNT)
+
+/*
+** Latency histogram of the CALLs of a procedure on a connection. It is only
+** modified by its connection, without locks, and can be read at the same
+** time by other connections.
+*/
+struct sp_histogram {
+    char name[128];
+    u64 count;
+    u64 max_ns;
+    u64 buckets[SP_HIST_BUCKETS];
+    sp_histogram *next;             // next on the connection
+};
+
+/*
+** The blocks opened while parsing a procedure body, used to match the IF,
+** ELSEIF, ELSE and END IF commands, and the loops with their END LOOP,
+** BREAK and CONTINUE commands. Each parse has its own, so procedures can be
+** prepared by many connections at the same time.
+*/
+struct block_parser {
+    if_block *if_stack;
+    loop_block *loop_stack;
+};
+
+struct if_block {
+    if_block *next;
+    int first_cmd;
+    int last_cmd;
+};
+
+struct loop_block {
+    loop_block *next;
+    int type;                   // CMD_TYPE_LOOP or CMD_TYPE_FOREACH
+    int start_cmd;
 };
 
 
 ////////////////////////////////////////////////////////////////////////////////
 
-SQLITE_PRIVATE sqlite3_var* findVariable(stored_proc *procedure, char *name, int len);
+SQLITE_PRIVATE int findVariable(stored_proc *procedure, char *name, int len);
+SQLITE_PRIVATE void sqlite3_free_list(sqlite3_list *list);
 
 SQLITE_PRIVATE int parse_variables_list(
   stored_proc* procedure,
   int cmd_pos,
   char** psql,
   unsigned int *pnum_vars,
-  sqlite3_var **pvar_list
+  int **pslots
 );
 
 SQLITE_PRIVATE int parse_input_list(Parse *pParse, stored_proc* procedure, int cmd_pos, char** psql);
+SQLITE_PRIVATE int fuseForeachLoop(stored_proc *procedure, int pos);
 
-SQLITE_PRIVATE int parse_procedure_body(Parse *pParse, stored_proc* procedure, char** psql);
+SQLITE_PRIVATE int parse_procedure_body(
+  Parse *pParse, stored_proc* procedure, block_parser *blocks, char** psql
+);
 
 SQLITE_PRIVATE void releaseProcedure(stored_proc* procedure);
 SQLITE_PRIVATE void releaseProcedureCall(procedure_call* call);
+SQLITE_PRIVATE void releaseCallFrame(call_frame *frame);
+
+SQLITE_PRIVATE sp_connection* getConnectionContext(sqlite3 *db);
+SQLITE_PRIVATE call_frame* takeCachedFrame(sp_connection *conn, const char *name);
+SQLITE_PRIVATE void cacheFrame(sp_connection *conn, call_frame *frame);
+SQLITE_PRIVATE int prepareCommand(call_frame *frame, command *cmd, char *sql, int nsql);
+SQLITE_PRIVATE int compileProcedureProgram(stored_proc *procedure);
+SQLITE_PRIVATE int executeProcedureBody(Vdbe *v, call_frame *frame);
+SQLITE_PRIVATE sp_profile* getProcedureProfile(sp_connection *conn, stored_proc *procedure);
+SQLITE_PRIVATE void profileCommand(call_frame *frame, command *cmd);
+SQLITE_PRIVATE void resetStatementCounters(sqlite3_stmt *stmt);
+SQLITE_PRIVATE sqlite3_int64 spClockNs(void);
+SQLITE_PRIVATE void recordCallLatency(call_frame *frame);
+SQLITE_PRIVATE void attachStatementPool(Parse *pParse, sp_connection *conn);
+SQLITE_PRIVATE bool isReadOnlyProcedure(stored_proc *procedure, bool *pcalls);
+SQLITE_PRIVATE void registerStoredFunctions(Parse *pParse, sp_connection *conn);
+SQLITE_PRIVATE bool isBuiltinFunction(const char *name);
+SQLITE_PRIVATE void releaseFunctionFrames(sp_connection *conn);
+SQLITE_PRIVATE sp_native_proc* findNativeProcedure(sp_connection *conn, stored_proc *procedure);
+SQLITE_PRIVATE void spRegisterNativeFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+SQLITE_PRIVATE int executeNativeProcedure(Vdbe *v, procedure_call *call);
+SQLITE_PRIVATE void spCompileCFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+SQLITE_PRIVATE int loadStoredFunction(
+  sp_connection *conn, char *name, call_frame **pframe, char **pzErr
+);
+SQLITE_PRIVATE sqlite3_stmt* takePooledStatement(sp_connection *conn, u64 version, int cmd_pos);
+SQLITE_PRIVATE void poolVersionStatement(
+  sp_connection *conn, u64 version, const char *name, int cmd_pos,
+  sqlite3_stmt *stmt
+);
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -241,6 +675,20 @@ SQLITE_PRIVATE sqlite3_list* get_list_from_value(sqlite3_value *pVal){
   return sqlite3_value_pointer(pVal, "list");
 }
 
+/*
+** Make the value point to the list, sharing it with the other values.
+** The lists on the arena of another call and the parsed lists are not
+** counted: their owners keep them while this call is executed.
+*/
+SQLITE_PRIVATE void shareListValue(call_frame *frame, sqlite3_value *value, sqlite3_list *list){
+  if( list->nref>0 && (list->arena==NULL || list->arena==&frame->arena) ){
+    list->nref++;
+    sqlite3ValueSetList(value, list, sqlite3_free_list);
+  }else{
+    sqlite3ValueSetList(value, list, NULL);
+  }
+}
+
 /*
 ** Fill the sqlite3_value object with the value of the given token.
 **
@@ -329,22 +777,400 @@ SQLITE_PRIVATE int sqlite3ValueFromToken(
   return rc;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// CALL ARENA
+////////////////////////////////////////////////////////////////////////////////
+
+// size of the first block of an arena. the next ones are bigger
+#define SP_ARENA_BLOCK_SIZE   4096
+#define SP_ARENA_MAX_BLOCK    (64 * 1024)
+// limit per call. above it, the temporary values are allocated on the heap,
+// so a long loop does not keep all its garbage until the call finishes
+#define SP_ARENA_MAX_MEMORY   (4 * 1024 * 1024)
+
+struct sp_arena_block {
+    sp_arena_block *next;
+    int size;                   /* usable bytes */
+    int used;
+};
+
+#define arenaBlockData(block)  ((char*)(block) + ROUND8(sizeof(sp_arena_block)))
+
+/*
+** Allocate memory from the arena, aligned to 8 bytes.
+** Return NULL if out of memory or if the arena reached its limit. Then the
+** caller must use the heap.
+*/
+SQLITE_PRIVATE void* arenaAlloc(sp_arena *arena, int n){
+    sp_arena_block *block = arena->block;
+    void *p;
+
+    n = ROUND8(n);
+    if (block == NULL || block->used + n > block->size) {
+        int size = block ? block->size * 2 : SP_ARENA_BLOCK_SIZE;
+        if (size > SP_ARENA_MAX_BLOCK) size = SP_ARENA_MAX_BLOCK;
+        if (size < n) size = n;
+        if (arena->memory + size > SP_ARENA_MAX_MEMORY) return NULL;
+        block = sqlite3Malloc(ROUND8(sizeof(sp_arena_block)) + size);
+        if (!block) return NULL;
+        block->size = size;
+        block->used = 0;
+        block->next = arena->block;
+        arena->block = block;
+        arena->memory += size;
+    }
+
+    p = arenaBlockData(block) + block->used;
+    block->used += n;
+    return p;
+}
+
+/*
+** Release all the allocations at once. The current block is kept for the
+** next call, unless it was allocated for a single big value.
+*/
+SQLITE_PRIVATE void arenaReset(sp_arena *arena){
+    sp_arena_block *block = arena->block;
+
+    if (block == NULL) return;
+
+    if (block->size > SP_ARENA_MAX_BLOCK) {
+        block->next = NULL;
+    }
+    while (block->next) {
+        sp_arena_block *next = block->next;
+        block->next = next->next;
+        sqlite3_free(next);
+    }
+    if (block->size > SP_ARENA_MAX_BLOCK) {
+        sqlite3_free(block);
+        arena->block = NULL;
+        arena->memory = 0;
+    } else {
+        block->used = 0;
+        arena->memory = block->size;
+    }
+}
+
+/*
+** Release the memory of the arena.
+*/
+SQLITE_PRIVATE void arenaRelease(sp_arena *arena){
+    while (arena->block) {
+        sp_arena_block *block = arena->block;
+        arena->block = block->next;
+        sqlite3_free(block);
+    }
+    arena->memory = 0;
+}
+
+/*
+** Copy a value to an empty destination, storing the string or blob content
+** on the arena. If it does not fit, the content is copied to the heap and
+** owned by the destination, so the value must always be released.
+*/
+SQLITE_PRIVATE int arenaCopyValue(sp_arena *arena, sqlite3_value *to, sqlite3_value *from){
+    assert((to->flags & MEM_Dyn) == 0 && to->szMalloc == 0);
+
+    if ((from->flags & (MEM_Str|MEM_Blob)) && (from->flags & MEM_Zero) == 0) {
+        char *z = arenaAlloc(arena, from->n + 2);
+        if (z) {
+            memcpy(z, from->z, from->n);
+            z[from->n] = 0;
+            z[from->n + 1] = 0;
+            // MEM_Ephem: the copies of the value get their own content,
+            // as the arena is reused by the next call
+            sqlite3VdbeMemShallowCopy(to, from, MEM_Ephem);
+            to->flags &= ~(MEM_Dyn|MEM_Static);
+            to->flags |= MEM_Ephem;
+            if (to->flags & MEM_Str) to->flags |= MEM_Term;
+            to->z = z;
+            return SQLITE_OK;
+        }
+    }
+
+    return sqlite3VdbeMemCopy(to, from);
+}
+
+/*
+** Move a value that can leave the call, like a returned value or a column
+** of a nested CALL. If the content points to memory that is reused later
+** (MEM_Ephem), like the call arena of the callee, it is copied.
+*/
+SQLITE_PRIVATE int moveValue(sqlite3_value *to, sqlite3_value *from){
+    sqlite3VdbeMemMove(to, from);
+    if (to->flags & MEM_Ephem) {
+        return sqlite3VdbeMemMakeWriteable(to);
+    }
+    return SQLITE_OK;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // LISTS
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
-** Release the content of the list, recursively.
-** If the value contains a sub-list, then the sub-list is also released.
+** Release a reference to the list. The content is released with the last
+** reference, recursively: if a value contains a sub-list, then the sub-list
+** is also released.
+** The memory of a list allocated on a call arena is released when the arena
+** is reset.
 */
 SQLITE_PRIVATE void sqlite3_free_list(sqlite3_list *list) {
     if (list == NULL) return;
-    for (int i = 0; i < list->num_items; i++) {
+    // other values still point to the list
+    if (list->nref > 1) {
+        list->nref--;
+        return;
+    }
+    // the packed items have no memory to release
+    for (int i = 0; list->type == LIST_VALUES && i < list->num_items; i++) {
         // release the value
         // if it contains a list, it is released recursively
         sqlite3VdbeMemRelease(&list->value[i]);
     }
-    sqlite3_free(list);
+    if (list->arena == NULL) {
+        sqlite3_free(list);
+    }
+}
+
+/*
+** Initialize the header of a new list, with a single reference.
+*/
+#define listInit(list, num, list_arena) do { \
+    (list)->num_items = (num); \
+    (list)->nref = 1; \
+    (list)->arena = (list_arena); \
+    (list)->type = LIST_VALUES; \
+} while(0)
+
+/*
+** Size of a packed list with the supplied number of integers or doubles.
+*/
+#define packedListSize(num_items) \
+    (offsetof(sqlite3_list, value) + (num_items) * sizeof(i64))
+
+/*
+** Return an item of the list. The items of a packed list are stored on the
+** supplied cell, that must be initialized. The strings point to the list
+** memory (MEM_Ephem), so the cell does not need to be released.
+*/
+SQLITE_PRIVATE sqlite3_value* listItem(sqlite3_list *list, int i, Mem *cell) {
+    switch (list->type) {
+    case LIST_INTEGERS:
+        sqlite3VdbeMemSetInt64(cell, listInts(list)[i]);
+        return cell;
+    case LIST_REALS:
+        sqlite3VdbeMemSetDouble(cell, listReals(list)[i]);
+        return cell;
+    case LIST_TEXTS: {
+        u32 *offsets = listOffsets(list);
+        sqlite3VdbeMemSetStr(cell, listText(list) + offsets[i],
+                             offsets[i + 1] - offsets[i] - 1, SQLITE_UTF8, SQLITE_STATIC);
+        cell->flags = (cell->flags & ~MEM_Static) | MEM_Ephem | MEM_Term;
+        return cell;
+    }
+    }
+    return &list->value[i];
+}
+
+// the list stored on an item, or NULL. the packed lists have no sub-lists
+#define listSubList(list, i) \
+    ((list)->type == LIST_VALUES ? get_list_from_value(&(list)->value[i]) : NULL)
+
+/*
+** Return the type of the packed storage for the values of the list, or
+** LIST_VALUES if they cannot be packed. The variables, sub-lists and other
+** values with subtypes are not packed.
+*/
+SQLITE_PRIVATE int packedListType(sqlite3_list *list) {
+    int type = sqlite3_value_type(&list->value[0]);
+    int i;
+
+    if (type != SQLITE_INTEGER && type != SQLITE_FLOAT && type != SQLITE_TEXT) {
+        return LIST_VALUES;
+    }
+    for (i = 0; i < list->num_items; i++) {
+        sqlite3_value *value = &list->value[i];
+        if (sqlite3_value_type(value) != type || (value->flags & MEM_Subtype)) {
+            return LIST_VALUES;
+        }
+    }
+    if (type == SQLITE_INTEGER) return LIST_INTEGERS;
+    if (type == SQLITE_FLOAT) return LIST_REALS;
+    return LIST_TEXTS;
+}
+
+/*
+** Store the values of a finished list on a packed array, if all of them have
+** the same type. The numbers are moved in place, and the strings are copied
+** to a new list on the heap. Returns the list to be used, that is the same
+** one if it is not packed, also when there is no memory for the strings.
+*/
+SQLITE_PRIVATE sqlite3_list* listPack(sqlite3_list *list) {
+    int n = list->num_items;
+    int type, i;
+
+    if (list->type != LIST_VALUES || n == 0) return list;
+    type = packedListType(list);
+
+    // each number is written over the storage of values already read
+    if (type == LIST_INTEGERS) {
+        for (i = 0; i < n; i++) {
+            i64 value = sqlite3_value_int64(&list->value[i]);
+            listInts(list)[i] = value;
+        }
+    } else if (type == LIST_REALS) {
+        for (i = 0; i < n; i++) {
+            double value = sqlite3_value_double(&list->value[i]);
+            listReals(list)[i] = value;
+        }
+    } else if (type == LIST_TEXTS) {
+        sqlite3_list *packed;
+        u32 *offsets;
+        char *text;
+        i64 num_bytes = 0;
+        for (i = 0; i < n; i++) {
+            num_bytes += sqlite3_value_bytes(&list->value[i]) + 1;
+        }
+        if (num_bytes > 0x7fffffff) return list;
+        packed = sqlite3Malloc(offsetof(sqlite3_list, value) +
+                               (n + 1) * sizeof(u32) + num_bytes);
+        if (packed == NULL) return list;
+        listInit(packed, n, NULL);
+        packed->nref = list->nref;
+        offsets = listOffsets(packed);
+        text = listText(packed);
+        offsets[0] = 0;
+        for (i = 0; i < n; i++) {
+            sqlite3_value *value = &list->value[i];
+            int len = sqlite3_value_bytes(value);
+            memcpy(&text[offsets[i]], sqlite3_value_text(value), len);
+            text[offsets[i] + len] = 0;
+            offsets[i + 1] = offsets[i] + len + 1;
+        }
+        packed->type = LIST_TEXTS;
+        list->nref = 1;
+        sqlite3_free_list(list);
+        return packed;
+    }
+
+    list->type = type;
+    return list;
+}
+
+/*
+** Size of an sqlite3_list object with the supplied number of values.
+** The structure already contains the first value.
+*/
+#define listSize(num_items) \
+    (sizeof(sqlite3_list) + ((num_items) > 1 ? (num_items) - 1 : 0) * sizeof(sqlite3_value))
+
+// initial number of values when there is no size hint
+#define LIST_MIN_ALLOC  4
+
+/*
+** A list under construction. The allocated space grows geometrically, so
+** appending n values moves O(n) bytes, and it is shrunk to the final size
+** when the list is finished.
+** Temporary lists are built on the call arena. If the arena is full, the
+** list is moved to the heap and the builder arena is cleared.
+*/
+typedef struct list_builder list_builder;
+
+struct list_builder {
+    sqlite3_list *list;
+    int num_alloc;              /* number of values allocated on the list */
+    sp_arena *arena;            /* NULL if the list is on the heap */
+    bool pack;                  /* pack the values when the list is finished */
+};
+
+/*
+** Start a new list, on the arena if supplied. The size hint is the expected
+** number of values, or 0 if it is not known.
+*/
+SQLITE_PRIVATE int listBuilderInit(list_builder *builder, sp_arena *arena, int size_hint){
+    int num_alloc = (size_hint > 0) ? size_hint : LIST_MIN_ALLOC;
+    builder->list = arena ? arenaAlloc(arena, listSize(num_alloc)) : NULL;
+    builder->arena = builder->list ? arena : NULL;
+    if (!builder->list) {
+        builder->list = sqlite3Malloc(listSize(num_alloc));
+    }
+    if (!builder->list) {
+        builder->num_alloc = 0;
+        return SQLITE_NOMEM;
+    }
+    listInit(builder->list, 0, builder->arena);
+    builder->num_alloc = num_alloc;
+    builder->pack = true;
+    return SQLITE_OK;
+}
+
+/*
+** Append a new NULL value to the list and return it.
+** The returned pointer is valid until the next call to this function.
+*/
+SQLITE_PRIVATE sqlite3_value* listBuilderAppend(list_builder *builder, sqlite3 *db){
+    sqlite3_list *list = builder->list;
+    sqlite3_value *value;
+
+    if (list->num_items == builder->num_alloc) {
+        int num_alloc = builder->num_alloc * 2;
+        if (builder->arena) {
+            // the old space is released with the arena
+            list = arenaAlloc(builder->arena, listSize(num_alloc));
+            if (!list) {
+                list = sqlite3Malloc(listSize(num_alloc));
+                if (!list) return NULL;
+                builder->arena = NULL;
+            }
+            memcpy(list, builder->list, listSize(builder->list->num_items));
+            list->arena = builder->arena;
+        } else {
+            list = sqlite3Realloc(list, listSize(num_alloc));
+            if (!list) return NULL;
+        }
+        builder->list = list;
+        builder->num_alloc = num_alloc;
+    }
+
+    value = &list->value[list->num_items++];
+    sqlite3VdbeMemInit(value, db, MEM_Null);
+    return value;
+}
+
+/*
+** Finish the list, packing the values if they have the same type and
+** releasing the unused space, and return it.
+*/
+SQLITE_PRIVATE sqlite3_list* listBuilderFinish(list_builder *builder){
+    sqlite3_list *list = builder->list;
+
+    if (builder->pack) list = listPack(list);
+
+    if (list == builder->list && builder->arena == NULL) {
+        sqlite3_list *new_list = NULL;
+        if (list->type != LIST_VALUES) {
+            new_list = sqlite3Realloc(list, packedListSize(list->num_items));
+        } else if (list->num_items < builder->num_alloc && builder->num_alloc > 1) {
+            new_list = sqlite3Realloc(list, listSize(list->num_items));
+        }
+        // if it fails, just keep the bigger allocation
+        if (new_list) list = new_list;
+    }
+
+    builder->list = NULL;
+    builder->num_alloc = 0;
+    return list;
+}
+
+/*
+** Release a list that was not finished.
+*/
+SQLITE_PRIVATE void listBuilderAbort(list_builder *builder){
+    sqlite3_free_list(builder->list);
+    builder->list = NULL;
+    builder->num_alloc = 0;
 }
 
 /*
@@ -361,7 +1187,7 @@ SQLITE_PRIVATE int parse_list(
     char list_open, list_close;
     int rc = SQLITE_OK;
     int n, tokenType;
-    sqlite3_list* list = NULL;
+    list_builder builder;
 
     // set the list delimiters
     if (is_function) {
@@ -380,39 +1206,36 @@ SQLITE_PRIVATE int parse_list(
     sql++;
     while (sqlite3Isspace(*sql)) sql++;
 
+    // start the list. it is kept with the parsed command, not on an arena
+    rc = listBuilderInit(&builder, NULL, 0);
+    if (rc != SQLITE_OK) return rc;
+    // the lists with variables are not packed
+    builder.pack = true;
+
     // parse the list values
     while (1) {
-        if (list == NULL) {
-            // allocate the list object with 1 item
-            list = sqlite3MallocZero( sizeof(sqlite3_list) );
-            if (!list) return SQLITE_NOMEM;
-        } else {
-            // increment the list size by 1 item
-            sqlite3_list* new_list;
-            new_list = sqlite3Realloc(list, sizeof(sqlite3_list) +
-                         (list->num_items) * sizeof(sqlite3_value));
-            if (!new_list) {
-              sqlite3_free_list(list);
-              return SQLITE_NOMEM;
-            }
-            list = new_list;
-            memset(&list->value[list->num_items], 0, sizeof(sqlite3_value));
-        }
-        // get a reference to the new value
-        sqlite3_value *value = &list->value[list->num_items];
-
-        // initialize the value
-        sqlite3VdbeMemInit(value, pParse->db, MEM_Null);
+        sqlite3_value *value;
 
         // get the next token
         n = sqlite3GetToken((u8*)sql, &tokenType);
 
+        if (n == 1 && *sql == list_close) {
+            // this is an empty list
+            sql++;
+            break;
+        }
+
+        // add a new value to the list
+        value = listBuilderAppend(&builder, pParse->db);
+        if (!value) {
+            listBuilderAbort(&builder);
+            return SQLITE_NOMEM;
+        }
+
         if (tokenType == TK_VARIABLE) {
             // if parsing a stored procedure, then the variable must exist
             if (procedure) {
-                sqlite3_var *var;
-                var = findVariable(procedure, sql, n);
-                if (!var) {
+                if (findVariable(procedure, sql, n) < 0) {
                     sqlite3ErrorMsg(pParse, "variable must exist: %.*s", n, sql);
                     goto loc_invalid;
                 }
@@ -430,15 +1253,11 @@ SQLITE_PRIVATE int parse_list(
             }
             // store the pointer to the internal list on the value
             sqlite3ValueSetList(value, internal_list, sqlite3_free_list);
-        } else if (n == 1 && *sql == list_close) {
-            // this is an empty list
-            sql++;
-            break;
         } else {
             // retrieve the value from the token
             rc = sqlite3ValueFromToken(&sql, n, tokenType, SQLITE_UTF8, value);
 #ifdef SQLITE_DEBUG
-            printf("parse_list() pos=%d value=", list->num_items);
+            printf("parse_list() pos=%d value=", builder.list->num_items - 1);
             memTracePrint(value);
             puts("");
 #endif
@@ -447,9 +1266,6 @@ SQLITE_PRIVATE int parse_list(
             }
         }
 
-        // we have a new value
-        list->num_items++;
-
         // skip whitespaces
         while (sqlite3Isspace(*sql)) sql++;
 
@@ -469,11 +1285,13 @@ SQLITE_PRIVATE int parse_list(
     while (sqlite3Isspace(*sql)) sql++;
 
     *psql = sql;
-    *plist = list;
+    *plist = listBuilderFinish(&builder);
+    // the parsed lists are not reference counted
+    (*plist)->nref = 0;
     return SQLITE_OK;
 
 loc_invalid:
-    if (list) sqlite3_free_list(list);
+    listBuilderAbort(&builder);
     if (rc == SQLITE_OK) rc = SQLITE_ERROR;
     if (pParse->zErrMsg == NULL) {
       sqlite3ErrorMsg(pParse, "invalid token: %s", sql);
@@ -487,124 +1305,292 @@ loc_invalid:
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
-** Add a new local variable to the list or return the existing
-** one with the supplied name.
+** Add a new local variable to the procedure or return the existing
+** one with the supplied name. Returns the variable slot, or -1 on error.
+** It is used while parsing: the variables created on execution are added
+** to the call frame.
 */
-SQLITE_PRIVATE sqlite3_var* addVariable(
+SQLITE_PRIVATE int addVariable(
   stored_proc *procedure, char *name, int len, u8 type, bool *pExists
 ){
   sqlite3_var *var;
+  int slot;
 
   if( pExists ) *pExists = false;
 
   /* check the variable name size */
   if( len>sizeof(var->name)-1 ){
     procedure->error_msg = sqlite3_mprintf("variable name must be up to 31 bytes long: %.*s", len, name);
-    return NULL;
+    return -1;
   }
 
   /* check if already exists */
-  for( var=procedure->vars; var; var=var->next ){
-    /* use case sensitive variables */
-    if( var->len==len && sqlite3_strnicmp(var->name, name, len)==0 ){
-      if( pExists ) *pExists = true;
-      return var;
-    }
+  slot = findVariable(procedure, name, len);
+  if( slot>=0 ){
+    if( pExists ) *pExists = true;
+    return slot;
   }
 
-  var = sqlite3MallocZero(sizeof(struct sqlite3_var));
-  if( !var ){
-    procedure->error_msg = sqlite3_mprintf("out of memory");
-    return NULL;
+  /* make room for the new variable */
+  if( procedure->num_vars==procedure->num_alloc_vars ){
+    int num_alloc = procedure->num_alloc_vars ? procedure->num_alloc_vars * 2 : 8;
+    sqlite3_var **new_vars;
+    new_vars = sqlite3Realloc(procedure->vars, num_alloc * sizeof(sqlite3_var*));
+    if( !new_vars ) goto loc_no_memory;
+    procedure->vars = new_vars;
+    procedure->num_alloc_vars = num_alloc;
   }
 
+  var = sqlite3MallocZero(sizeof(struct sqlite3_var));
+  if( !var ) goto loc_no_memory;
+
   strncpy(var->name, name, len);
   var->len = len;
   var->type = type;
+  var->slot = procedure->num_vars;
 
-  /* initialize the value */
-  sqlite3VdbeMemInit(&var->value, procedure->db, MEM_Null);
+  /* the hash key is the name stored on the variable */
+  if( sqlite3HashInsert(&procedure->var_names, var->name, var)==var ){
+    sqlite3_free(var);
+    goto loc_no_memory;
+  }
+
+  procedure->vars[var->slot] = var;
+  procedure->num_vars++;
 
-  /* add to the list of variables */
-  var->next = procedure->vars;
-  procedure->vars = var;
+  return var->slot;
 
-  return var;
+loc_no_memory:
+  procedure->error_msg = sqlite3_mprintf("out of memory");
+  return -1;
 }
 
 /*
 ** Find a local variable with the supplied name.
+** Returns the variable slot, or -1 if it does not exist.
 */
-SQLITE_PRIVATE sqlite3_var* findVariable(stored_proc *procedure, char *name, int len){
+SQLITE_PRIVATE int findVariable(stored_proc *procedure, char *name, int len){
   sqlite3_var *var;
+  char zName[sizeof(var->name)];
 
   /* check the variable name size */
   if( len>sizeof(var->name)-1 ){
     procedure->error_msg = sqlite3_mprintf("variable name must be up to 31 bytes long: %.*s", len, name);
-    return NULL;
+    return -1;
   }
 
-  /* check if already exists */
-  for( var=procedure->vars; var; var=var->next ){
-    /* use case sensitive variables */
-    if( var->len==len && sqlite3_strnicmp(var->name, name, len)==0 ){
-      return var;
-    }
-  }
+  /* the names are case insensitive, as the hash keys */
+  memcpy(zName, name, len);
+  zName[len] = '\0';
+  var = (sqlite3_var*) sqlite3HashFind(&procedure->var_names, zName);
 
-  return NULL;
+  return var ? var->slot : -1;
 }
 
 /*
 ** Drop all local variables.
 */
 SQLITE_PRIVATE void dropAllVariables(stored_proc *procedure){
+  int i;
 
   assert( procedure!=NULL );
 
-  /* clear the list of variables */
-  while( procedure->vars ){
-    sqlite3_var *current = procedure->vars;
-    // if it is a list, free it
-    //sqlite3_list *list = get_list_from_value(&current->value);
-    //if( list ) sqlite3_free_list(list);
-    // the free function may be called by sqlite3VdbeMemRelease
-    // release the value
-    sqlite3VdbeMemRelease((Mem*)&current->value);
-    // release the variable
-    sqlite3_var *next = current->next;
-    sqlite3_free(current);
-    procedure->vars = next;
+  sqlite3HashClear(&procedure->var_names);
+
+  for( i=0; i<procedure->num_vars; i++ ){
+    sqlite3_free(procedure->vars[i]);
   }
+  sqlite3_free(procedure->vars);
+  procedure->vars = NULL;
+  procedure->num_vars = 0;
+  procedure->num_alloc_vars = 0;
 
 }
 
 /*
-** Bind values of local variables to the prepared statement.
+** Return the definition of a variable of the call frame.
+*/
+SQLITE_PRIVATE sqlite3_var* frameVariable(call_frame *frame, int slot){
+  stored_proc *procedure = frame->procedure;
+  if( slot<procedure->num_vars ){
+    return procedure->vars[slot];
+  }
+  return frame->new_vars[slot - procedure->num_vars];
+}
+
+/*
+** Find a variable of the procedure or one created on the call frame.
+** Returns the variable slot, or -1 if it does not exist.
+*/
+SQLITE_PRIVATE int findFrameVariable(call_frame *frame, char *name, int len){
+  stored_proc *procedure = frame->procedure;
+  int slot, i;
+
+  if( len>sizeof(((sqlite3_var*)0)->name)-1 ) return -1;
+
+  slot = findVariable(procedure, name, len);
+  if( slot>=0 ) return slot;
+
+  // the variables created on execution are few
+  for( i=0; i<frame->num_vars - procedure->num_vars; i++ ){
+    sqlite3_var *var = frame->new_vars[i];
+    if( var->len==len && sqlite3_strnicmp(var->name, name, len)==0 ){
+      return var->slot;
+    }
+  }
+  return -1;
+}
+
+/*
+** Add a variable to the call frame, on execution, or return the existing
+** one with the supplied name. The parsed procedure is not modified.
+** Returns the variable slot, or -1 if out of memory or the name is too long.
 */
-SQLITE_PRIVATE void bindLocalVariables(stored_proc *procedure, sqlite3_stmt *stmt){
+SQLITE_PRIVATE int addFrameVariable(call_frame *frame, char *name, int len){
+  int num_parsed = frame->procedure->num_vars;
   sqlite3_var *var;
+  int slot;
+
+  if( len>sizeof(var->name)-1 ) return -1;
+
+  slot = findFrameVariable(frame, name, len);
+  if( slot>=0 ) return slot;
+
+  /* make room for the new variable */
+  if( frame->num_vars==frame->num_alloc_vars ){
+    int num_alloc = frame->num_alloc_vars ? frame->num_alloc_vars * 2 : 8;
+    sqlite3_var **new_vars;
+    sqlite3_value *new_values;
+    u32 *new_versions;
+    new_vars = sqlite3Realloc(frame->new_vars, (num_alloc - num_parsed) * sizeof(sqlite3_var*));
+    if( !new_vars ) return -1;
+    frame->new_vars = new_vars;
+    new_values = sqlite3Realloc(frame->values, num_alloc * sizeof(sqlite3_value));
+    if( !new_values ) return -1;
+    frame->values = new_values;
+    new_versions = sqlite3Realloc(frame->versions, num_alloc * sizeof(u32));
+    if( !new_versions ) return -1;
+    frame->versions = new_versions;
+    frame->num_alloc_vars = num_alloc;
+  }
+
+  var = sqlite3MallocZero(sizeof(struct sqlite3_var));
+  if( !var ) return -1;
+
+  strncpy(var->name, name, len);
+  var->len = len;
+  var->slot = frame->num_vars;
+
+  sqlite3VdbeMemInit(&frame->values[var->slot], frame->db, MEM_Null);
+  frame->versions[var->slot] = 1;
+
+  frame->new_vars[var->slot - num_parsed] = var;
+  frame->num_vars++;
+
+  return var->slot;
+}
+
+/*
+** Bind the value of a variable to a statement parameter. The lists are bound
+** as pointers, so they can be read by the sp_list table.
+*/
+SQLITE_PRIVATE int bindVariableValue(sqlite3_stmt *stmt, int idx, sqlite3_value *value){
+  sqlite3_list *list = get_list_from_value(value);
+  if( list ){
+    return sqlite3_bind_pointer(stmt, idx, list, "list", NULL);
+  }
+  return sqlite3_bind_value(stmt, idx, value);
+}
 
-  XTRACE("bindLocalVariables count=%d \n", sqlite3_bind_parameter_count(stmt));
+/*
+** Bind values of local variables to the prepared statement.
+*/
+SQLITE_PRIVATE void bindLocalVariables(call_frame *frame, sqlite3_stmt *stmt){
+  int count, idx;
+
+  count = sqlite3_bind_parameter_count(stmt);
+  XTRACE("bindLocalVariables count=%d \n", count);
+
+  /* for each statement parameter, check if it is a variable */
+  for( idx=1; idx<=count; idx++ ){
+    const char *name = sqlite3_bind_parameter_name(stmt, idx);
+    int slot;
+    if( name==NULL ) continue;
+    slot = findFrameVariable(frame, (char*)name, strlen(name));
+    XTRACE("bindLocalVariables %s slot=%d \n", name, slot);
+    if( slot>=0 ){
+      bindVariableValue(stmt, idx, variableValue(frame, slot));
+    }
+  }
 
-  if( !procedure->vars || sqlite3_bind_parameter_count(stmt)==0 ) return;
+}
 
-  /* for each declared variable, check if being used in the statement */
-  for( var=procedure->vars; var; var=var->next ){
-    int idx = sqlite3_bind_parameter_index(stmt, var->name);
-    XTRACE("bindLocalVariables %s idx=%d \n", var->name, idx);
-    if( idx>0 ){
-      sqlite3_bind_value(stmt, idx, &var->value);
+/*
+** Resolve the variables bound to the parameters of a command statement.
+** Called when the statement is prepared or taken from the pool, which is
+** when it has no values bound.
+*/
+SQLITE_PRIVATE int prepareCommandBinds(call_frame *frame, cmd_state *state){
+  int count, i;
+
+  if( state->stmt==NULL ) return SQLITE_OK;
+
+  // the map is built once, the statements of the command use the same SQL
+  count = sqlite3_bind_parameter_count(state->stmt);
+  if( state->binds==NULL && count>0 ){
+    state->binds = sqlite3MallocZero(count * sizeof(bind_slot));
+    if( state->binds==NULL ) return SQLITE_NOMEM;
+    state->num_binds = count;
+    for( i=0; i<count; i++ ){
+      const char *name = sqlite3_bind_parameter_name(state->stmt, i+1);
+      int len;
+      state->binds[i].slot = -1;
+      if( name==NULL ) continue;
+      len = strlen(name);
+      if( len>sizeof(((sqlite3_var*)0)->name)-1 ) continue;
+      if( name[0]=='@' ){
+        // the variable can be created later, by a SET command
+        state->binds[i].slot = addFrameVariable(frame, (char*)name, len);
+        if( state->binds[i].slot<0 ) return SQLITE_NOMEM;
+      }else{
+        state->binds[i].slot = findFrameVariable(frame, (char*)name, len);
+      }
     }
   }
+  assert( state->num_binds==count );
+
+  for( i=0; i<state->num_binds; i++ ){
+    state->binds[i].version = 0;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Bind the values of the variables used by a command statement.
+** Only the variables modified since the last binding are bound again.
+*/
+SQLITE_PRIVATE void bindCommandVariables(call_frame *frame, cmd_state *state){
+  bind_slot *bind = state->binds;
+  int i;
 
+  for( i=1; i<=state->num_binds; i++, bind++ ){
+    if( bind->slot>=0 ){
+      u32 version = frame->versions[bind->slot];
+      if( bind->version!=version ){
+        bindVariableValue(state->stmt, i, variableValue(frame, bind->slot));
+        bind->version = version;
+      }
+    }
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // COMMANDS
 ////////////////////////////////////////////////////////////////////////////////
 
-SQLITE_PRIVATE int parse_new_command(Parse *pParse, stored_proc* procedure, int type, char** psql);
+SQLITE_PRIVATE int parse_new_command(
+  Parse *pParse, stored_proc* procedure, block_parser *blocks, int type, char** psql
+);
 
 SQLITE_PRIVATE int parseDeclareStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
 SQLITE_PRIVATE int parseSetStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
@@ -612,20 +1598,19 @@ SQLITE_PRIVATE int parseReturnStatement(Parse *pParse, stored_proc* procedure, i
 SQLITE_PRIVATE int parseRaiseStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
 SQLITE_PRIVATE int parseAssertStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
 
-SQLITE_PRIVATE int parseIfStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
-SQLITE_PRIVATE int parseElseIfStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
-SQLITE_PRIVATE int parseElseStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
-SQLITE_PRIVATE int parseEndIfStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
+SQLITE_PRIVATE int parseIfStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
+SQLITE_PRIVATE int parseElseIfStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
+SQLITE_PRIVATE int parseElseStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
+SQLITE_PRIVATE int parseEndIfStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
 
-SQLITE_PRIVATE int parseLoopStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
-SQLITE_PRIVATE int parseEndLoopStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
-SQLITE_PRIVATE int parseBreakStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
-SQLITE_PRIVATE int parseContinueStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
+SQLITE_PRIVATE int parseLoopStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
+SQLITE_PRIVATE int parseEndLoopStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
+SQLITE_PRIVATE int parseBreakStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
+SQLITE_PRIVATE int parseContinueStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
 
-SQLITE_PRIVATE int parseForEachStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql);
+SQLITE_PRIVATE int parseForEachStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql);
 
 
-#ifdef SQLITE_DEBUG
 // returns the command type name in string format
 SQLITE_PRIVATE char* command_type_str(int type) {
     switch (type) {
@@ -665,7 +1650,6 @@ SQLITE_PRIVATE char* command_type_str(int type) {
     }
     return "UNKNOWN";
 }
-#endif
 
 // new_command using arrays:
 // - allocate an array of 16 commands if the array is not yet allocated (cmds == NULL),
@@ -691,7 +1675,7 @@ SQLITE_PRIVATE int new_command(stored_proc* procedure, int type) {
     int pos = procedure->num_cmds;
     procedure->num_cmds++;
     procedure->cmds[pos].type = type;
-    procedure->cmds[pos].procedure = procedure;
+    procedure->cmds[pos].input_var = -1;
     return pos;
 }
 
@@ -700,15 +1684,31 @@ SQLITE_PRIVATE int new_command(stored_proc* procedure, int type) {
 // PROCEDURE PARSING
 ////////////////////////////////////////////////////////////////////////////////
 
+/*
+** Release the blocks left open by a procedure body with invalid syntax.
+*/
+SQLITE_PRIVATE void releaseBlockParser(block_parser *blocks) {
+    while (blocks->if_stack) {
+        if_block *ifb = blocks->if_stack;
+        blocks->if_stack = ifb->next;
+        sqlite3_free(ifb);
+    }
+    while (blocks->loop_stack) {
+        loop_block *loopb = blocks->loop_stack;
+        blocks->loop_stack = loopb->next;
+        sqlite3_free(loopb);
+    }
+}
+
 /*
 ** Parse a stored procedure.
 ** The SQL command must start with "PROCEDURE". The "CREATE [OR REPLACE]" is not stored.
 */
 SQLITE_PRIVATE int parseStoredProcedure(Parse *pParse, stored_proc* procedure, char** psql) {
+    block_parser blocks = {0};
     char* sql = *psql;
     int rc = SQLITE_OK;
-    int n, tokenType, i;
-    sqlite3_var *varList, *var;
+    int n, tokenType;
 
     if (sqlite3_strnicmp(sql, "PROCEDURE ", 10) == 0) {
       //procedure->is_function = false;
@@ -759,18 +1759,13 @@ SQLITE_PRIVATE int parseStoredProcedure(Parse *pParse, stored_proc* procedure, c
     }
 
     // parse the procedure parameters
+    // and store the list of parameters into the procedure object
     rc = parse_variables_list(procedure, VAR_POS_PARAMETER, &sql,
-                              &procedure->num_params, &varList);
+                              &procedure->num_params, &procedure->params);
     if (rc != SQLITE_OK) {
         goto loc_invalid;
     }
 
-    // store the list of parameters into the procedure object
-    procedure->params = sqlite3_malloc( procedure->num_params * sizeof(sqlite3_var*) );
-    for( i=0, var=varList; var; i++, var=var->nextUsed ){
-      procedure->params[i] = var;
-    }
-
     // check for the ")" character
     if (*sql != ')') {
         goto loc_invalid;
@@ -793,11 +1788,22 @@ loc_skip_params:
     while (sqlite3Isspace(*sql)) sql++;
 
     // parse the procedure body
-    rc = parse_procedure_body(pParse, procedure, &sql);
+    rc = parse_procedure_body(pParse, procedure, &blocks, &sql);
     if (rc != SQLITE_OK) {
         goto loc_invalid;
     }
 
+    // all the blocks must be closed
+    if (blocks.if_stack) {
+        sqlite3ErrorMsg(pParse, "IF without END IF");
+        goto loc_invalid;
+    }
+    if (blocks.loop_stack) {
+        sqlite3ErrorMsg(pParse, "%s without END LOOP",
+              blocks.loop_stack->type == CMD_TYPE_FOREACH ? "FOREACH" : "LOOP");
+        goto loc_invalid;
+    }
+
     // check for the "END" keyword
     if (sqlite3_strnicmp(sql, "END", 3) != 0) {
         goto loc_invalid;
@@ -820,6 +1826,7 @@ loc_skip_params:
 
     return SQLITE_OK;
 loc_invalid:
+    releaseBlockParser(&blocks);
     if (rc == SQLITE_OK) rc = SQLITE_ERROR;
     if (pParse->zErrMsg == NULL) {
       if (procedure->error_msg != NULL) {
@@ -836,7 +1843,9 @@ loc_invalid:
 /*
 ** Parse the body of a stored procedure or function.
 */
-SQLITE_PRIVATE int parse_procedure_body(Parse *pParse, stored_proc* procedure, char **psql) {
+SQLITE_PRIVATE int parse_procedure_body(
+  Parse *pParse, stored_proc* procedure, block_parser *blocks, char **psql
+){
     char* sql = *psql;
     int rc = SQLITE_OK;
 
@@ -844,45 +1853,45 @@ SQLITE_PRIVATE int parse_procedure_body(Parse *pParse, stored_proc* procedure, c
 
         // if the SQL command starts with "DECLARE", then it is a variable declaration
         if (sqlite3_strnicmp(sql, "DECLARE", 7) == 0 && sqlite3Isspace(sql[7])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_DECLARE, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_DECLARE, &sql);
 
         // if the SQL command starts with "SET", then it is a variable assignment
         } else if (sqlite3_strnicmp(sql, "SET", 3) == 0 && sqlite3Isspace(sql[3])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_SET, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_SET, &sql);
 
         // if the SQL command starts with "RETURN", then it is a return statement
         } else if (sqlite3_strnicmp(sql, "RETURN", 6) == 0) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_RETURN, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_RETURN, &sql);
 
         // if the SQL command starts with "RAISE", then it is a raise statement
         } else if (sqlite3_strnicmp(sql, "RAISE", 5) == 0) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_RAISE, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_RAISE, &sql);
 
         // if the SQL command starts with "ASSERT", then it is an assert statement
         } else if (sqlite3_strnicmp(sql, "ASSERT", 5) == 0) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_ASSERT, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_ASSERT, &sql);
 
         // process IF, ELSEIF, ELSE and END IF
         } else if (sqlite3_strnicmp(sql, "IF", 2) == 0 && sqlite3Isspace(sql[2])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_IF, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_IF, &sql);
         } else if (sqlite3_strnicmp(sql, "ELSEIF", 6) == 0 && sqlite3Isspace(sql[6])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_ELSEIF, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_ELSEIF, &sql);
         } else if (sqlite3_strnicmp(sql, "ELSE", 4) == 0 && sqlite3Isspace(sql[4])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_ELSE, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_ELSE, &sql);
         } else if (sqlite3_strnicmp(sql, "END IF;", 7) == 0) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_ENDIF, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_ENDIF, &sql);
 
         // process LOOP, ENDLOOP, BREAK, CONTINUE and FOREACH
         } else if (sqlite3_strnicmp(sql, "LOOP", 4) == 0 && sqlite3Isspace(sql[4])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_LOOP, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_LOOP, &sql);
         } else if (sqlite3_strnicmp(sql, "END LOOP;", 9) == 0) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_ENDLOOP, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_ENDLOOP, &sql);
         } else if (sqlite3_strnicmp(sql, "BREAK", 5) == 0 && !sqlite3Isalpha(sql[5])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_BREAK, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_BREAK, &sql);
         } else if (sqlite3_strnicmp(sql, "CONTINUE", 8) == 0 && !sqlite3Isalpha(sql[8])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_CONTINUE, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_CONTINUE, &sql);
         } else if (sqlite3_strnicmp(sql, "FOREACH", 7) == 0 && sqlite3Isspace(sql[7])) {
-            rc = parse_new_command(pParse, procedure, CMD_TYPE_FOREACH, &sql);
+            rc = parse_new_command(pParse, procedure, blocks, CMD_TYPE_FOREACH, &sql);
 
         // if the statement is just "END", then it is the end of the procedure
         } else if (sqlite3_strnicmp(sql, "END", 3) == 0 && !sqlite3Isalpha(sql[3])) {
@@ -945,14 +1954,16 @@ SQLITE_PRIVATE int parse_variables_list(
   int cmd_pos,
   char** psql,
   unsigned int *pnum_vars,
-  sqlite3_var **pvar_list
+  int **pslots
 ){
   char* sql = *psql;
   int rc = SQLITE_OK;
   int num_vars = 0;
-  int n;
+  int num_alloc = 0;
+  int *slots = NULL;
+  int n, i;
   int tokenType;
-  sqlite3_var *varList=NULL, *lastVar=NULL, *var, *v;
+  int slot;
   bool expect_type = false;
 
   /* can it contain a variable type? */
@@ -961,11 +1972,6 @@ SQLITE_PRIVATE int parse_variables_list(
     expect_type = true;
   }
 
-  // iterate over the list of variables and clear the nextUsed pointer
-  for(var=procedure->vars; var; var=var->next){
-    var->nextUsed = NULL;
-  }
-
   while (sql && *sql) {
 
     /* skip spaces */
@@ -981,24 +1987,31 @@ SQLITE_PRIVATE int parse_variables_list(
     //sql += n;
 
     /* create a new variable or retrieve existing */
-    //var = addVariable(procedure, cmd_pos, sql, n, NULL);
-    var = addVariable(procedure, sql, n, 0, NULL);
-    if( !var ) return SQLITE_ERROR;
+    slot = addVariable(procedure, sql, n, 0, NULL);
+    if( slot<0 ){
+      sqlite3_free(slots);
+      return SQLITE_ERROR;
+    }
     /* check if already on the list of used variables */
-    for( v=varList; v; v=v->nextUsed ){
-      if( v==var ){
-        procedure->error_msg = sqlite3_mprintf("variable can only be used once: %s", v->name);
+    for( i=0; i<num_vars; i++ ){
+      if( slots[i]==slot ){
+        procedure->error_msg = sqlite3_mprintf("variable can only be used once: %s",
+                                               procedure->vars[slot]->name);
         goto loc_invalid_token;
       }
     }
     /* add it to the list of used variables */
-    var->nextUsed = NULL;
-    if( lastVar )
-      lastVar->nextUsed = var;
-    else
-      varList = var;
-    lastVar = var;
-    num_vars++;
+    if( num_vars==num_alloc ){
+      int *new_slots;
+      num_alloc = num_alloc ? num_alloc * 2 : 4;
+      new_slots = sqlite3Realloc(slots, num_alloc * sizeof(int));
+      if( !new_slots ){
+        sqlite3_free(slots);
+        return SQLITE_NOMEM;
+      }
+      slots = new_slots;
+    }
+    slots[num_vars++] = slot;
 
     /* skip the variable name */
     sql += n;
@@ -1033,10 +2046,15 @@ SQLITE_PRIVATE int parse_variables_list(
 
   *psql = sql;
   *pnum_vars = num_vars;
-  if( pvar_list ) *pvar_list = varList;
+  if( pslots ){
+    *pslots = slots;
+  }else{
+    sqlite3_free(slots);
+  }
   return SQLITE_OK;
 
 loc_invalid_token:
+  sqlite3_free(slots);
   if (rc == SQLITE_OK) rc = SQLITE_ERROR;
   if (procedure->error_msg == NULL) {
     procedure->error_msg = sqlite3_mprintf("invalid token: %s", sql);
@@ -1045,7 +2063,9 @@ loc_invalid_token:
   return rc;
 }
 
-SQLITE_PRIVATE int parse_new_command(Parse *pParse, stored_proc* procedure, int type, char** psql) {
+SQLITE_PRIVATE int parse_new_command(
+  Parse *pParse, stored_proc* procedure, block_parser *blocks, int type, char** psql
+) {
 
     int pos = new_command(procedure, type);
     if (pos < 0) return SQLITE_NOMEM;
@@ -1064,25 +2084,25 @@ SQLITE_PRIVATE int parse_new_command(Parse *pParse, stored_proc* procedure, int
             return parseAssertStatement(pParse, procedure, pos, psql);
 
         case CMD_TYPE_IF:
-            return parseIfStatement(pParse, procedure, pos, psql);
+            return parseIfStatement(pParse, procedure, blocks, pos, psql);
         case CMD_TYPE_ELSEIF:
-            return parseElseIfStatement(pParse, procedure, pos, psql);
+            return parseElseIfStatement(pParse, procedure, blocks, pos, psql);
         case CMD_TYPE_ELSE:
-            return parseElseStatement(pParse, procedure, pos, psql);
+            return parseElseStatement(pParse, procedure, blocks, pos, psql);
         case CMD_TYPE_ENDIF:
-            return parseEndIfStatement(pParse, procedure, pos, psql);
+            return parseEndIfStatement(pParse, procedure, blocks, pos, psql);
 
         case CMD_TYPE_LOOP:
-            return parseLoopStatement(pParse, procedure, pos, psql);
+            return parseLoopStatement(pParse, procedure, blocks, pos, psql);
         case CMD_TYPE_ENDLOOP:
-            return parseEndLoopStatement(pParse, procedure, pos, psql);
+            return parseEndLoopStatement(pParse, procedure, blocks, pos, psql);
         case CMD_TYPE_BREAK:
-            return parseBreakStatement(pParse, procedure, pos, psql);
+            return parseBreakStatement(pParse, procedure, blocks, pos, psql);
         case CMD_TYPE_CONTINUE:
-            return parseContinueStatement(pParse, procedure, pos, psql);
+            return parseContinueStatement(pParse, procedure, blocks, pos, psql);
 
         case CMD_TYPE_FOREACH:
-            return parseForEachStatement(pParse, procedure, pos, psql);
+            return parseForEachStatement(pParse, procedure, blocks, pos, psql);
 
         default:
             return SQLITE_ERROR;
@@ -1146,8 +2166,6 @@ SQLITE_PRIVATE int parseSetStatement(
   char *sql = *psql;
   int n, tokenType;
   int rc = SQLITE_OK;
-  int i;
-  sqlite3_var *var, *used_vars;
 
   XTRACE("parsing: %s\n", (char*)sql);
 
@@ -1155,8 +2173,8 @@ SQLITE_PRIVATE int parseSetStatement(
   sql += 4;
   while( sqlite3Isspace(*sql) ) sql++;
 
-  /* parse the variables */
-  rc = parse_variables_list(procedure, pos, &sql, &cmd->num_vars, &used_vars);
+  /* parse the variables and store the list of used variables */
+  rc = parse_variables_list(procedure, pos, &sql, &cmd->num_vars, &cmd->vars);
   if (rc != SQLITE_OK) {
       goto loc_invalid;
   }
@@ -1220,13 +2238,6 @@ SQLITE_PRIVATE int parseSetStatement(
     }
   }
 
-  // store the list of used variables
-  cmd->vars = sqlite3_malloc( cmd->num_vars * sizeof(sqlite3_var*) );
-  if( !cmd->vars ) return SQLITE_NOMEM;
-  for( i=0, var=used_vars; var; i++, var=var->nextUsed ){
-    cmd->vars[i] = var;
-  }
-
   /* skip spaces */
   while( sqlite3Isspace(*sql) ) sql++;
 
@@ -1247,9 +2258,9 @@ SQLITE_PRIVATE int parseReturnStatement(Parse *pParse, stored_proc* procedure, i
     command *cmd = &procedure->cmds[pos];
     char *sql = *psql;
     char *expression;
-    int rc;
-    int i;
-    sqlite3_var *var, *used_vars;
+    int rc, n, tokenType;
+    int *used_vars = NULL;
+    bool enclosed = false;
 
     // skip "RETURN" and whitespaces
     sql += 6;
@@ -1258,19 +2269,64 @@ SQLITE_PRIVATE int parseReturnStatement(Parse *pParse, stored_proc* procedure, i
     // if there is nothing to return, then skip the semicolon
     if (*sql == ';') goto loc_skip_semicolon;
 
+    // RETURN NEXT returns a row and continues the execution when the caller
+    // reads the next one
+    if (sqlite3_strnicmp(sql, "NEXT", 4) == 0 && sqlite3Isspace(sql[4])) {
+        if (procedure->is_function) {
+            sqlite3ErrorMsg(pParse, "RETURN NEXT cannot be used in functions");
+            goto loc_invalid;
+        }
+        cmd->flags |= CMD_FLAG_RETURN_NEXT;
+        sql += 4;
+        while (sqlite3Isspace(*sql)) sql++;
+        if (*sql == ';') {
+            sqlite3ErrorMsg(pParse, "RETURN NEXT without values");
+            goto loc_invalid;
+        }
+        expression = sql;
+        goto loc_parse_values;
+    }
+
+    // a statement returns its rows to the caller as they are read:
+    // RETURN SELECT * FROM users WHERE ...;
+    // RETURN (UPDATE users SET active=1 WHERE active=0 RETURNING id, name);
+    // a parenthesized SELECT is still a scalar subquery
+    n = sqlite3GetToken((u8*)sql, &tokenType);
+    if (tokenType == TK_LP) {
+        char *next = sql + n;
+        while (sqlite3Isspace(*next)) next++;
+        sqlite3GetToken((u8*)next, &tokenType);
+        if (tokenType == TK_INSERT || tokenType == TK_UPDATE || tokenType == TK_DELETE) {
+            enclosed = true;
+            sql = next;
+        }
+    }
+    if (enclosed || tokenType == TK_SELECT || tokenType == TK_WITH || tokenType == TK_VALUES) {
+        cmd->flags |= CMD_FLAG_RETURN_ROWS;
+        cmd->sql = sql;
+        cmd->nsql = skip_sql_command(&sql);
+        if (enclosed) {
+            // skip the closing parenthesis
+            while (cmd->nsql > 0 && sqlite3Isspace(cmd->sql[cmd->nsql-1])) cmd->nsql--;
+            if (cmd->nsql == 0 || cmd->sql[cmd->nsql-1] != ')') {
+                sqlite3ErrorMsg(pParse, "expected ')'");
+                goto loc_invalid;
+            }
+            cmd->nsql--;
+        }
+        goto loc_skip_spaces;
+    }
+
     // keep a copy of the expression
     expression = sql;
 
+loc_parse_values:
     // parse the list of variables
     rc = parse_variables_list(procedure, pos, &sql, &cmd->num_vars, &used_vars);
     if (rc == SQLITE_OK && *sql == ';') {
 
         // store the list of used variables
-        cmd->vars = sqlite3_malloc( cmd->num_vars * sizeof(sqlite3_var*) );
-        if( !cmd->vars ) return SQLITE_NOMEM;
-        for( i=0, var=used_vars; var; i++, var=var->nextUsed ){
-          cmd->vars[i] = var;
-        }
+        cmd->vars = used_vars;
 
 loc_skip_semicolon:
         // skip the semicolon
@@ -1279,6 +2335,8 @@ loc_skip_semicolon:
     } else {
 
         rc = SQLITE_OK;
+        sqlite3_free(used_vars);
+        cmd->num_vars = 0;
         if( procedure->error_msg ){
           sqlite3_free(procedure->error_msg);
           procedure->error_msg = NULL;
@@ -1291,6 +2349,7 @@ loc_skip_semicolon:
 
     }
 
+loc_skip_spaces:
     // skip whitespaces
     while (sqlite3Isspace(*sql)) sql++;
 
@@ -1387,26 +2446,15 @@ SQLITE_PRIVATE int parseAssertStatement(Parse *pParse, stored_proc* procedure, i
 // IF, ELSEIF, ELSE and END IF statements
 
 
-// declare the if_block struct
-typedef struct if_block {
-    struct if_block* next;
-    int first_cmd;
-    int last_cmd;
-} if_block;
-
-// declare the if_block stack
-if_block* if_stack = NULL;
-
-SQLITE_PRIVATE int parseIfStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseIfStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     command *cmd = &procedure->cmds[pos];
     char* sql = *psql;
 
     // this is a new IF block, push a new IF block controller on the stack
-    if_block* ifb = malloc(sizeof(if_block));
+    if_block* ifb = sqlite3MallocZero(sizeof(if_block));
     if (!ifb) return SQLITE_NOMEM;
-    memset(ifb, 0, sizeof(if_block));
-    ifb->next = if_stack;
-    if_stack = ifb;
+    ifb->next = blocks->if_stack;
+    blocks->if_stack = ifb;
 
     // store the first command position
     ifb->first_cmd = pos;
@@ -1431,12 +2479,12 @@ SQLITE_PRIVATE int parseIfStatement(Parse *pParse, stored_proc* procedure, int p
     return SQLITE_OK;
 }
 
-SQLITE_PRIVATE int parseElseIfStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseElseIfStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     command *cmd = &procedure->cmds[pos];
     char* sql = *psql;
 
     // get the current IF block controller from the stack
-    if_block* ifb = if_stack;
+    if_block* ifb = blocks->if_stack;
     if (!ifb) {
         sqlite3ErrorMsg(pParse, "ELSEIF without IF");
         return SQLITE_ERROR;
@@ -1474,12 +2522,12 @@ SQLITE_PRIVATE int parseElseIfStatement(Parse *pParse, stored_proc* procedure, i
     return SQLITE_OK;
 }
 
-SQLITE_PRIVATE int parseElseStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseElseStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     command *cmd = &procedure->cmds[pos];
     char* sql = *psql;
 
     // get the current IF block controller from the stack
-    if_block* ifb = if_stack;
+    if_block* ifb = blocks->if_stack;
     if (!ifb) {
       sqlite3ErrorMsg(pParse, "ELSE without IF");
       return SQLITE_ERROR;
@@ -1508,11 +2556,11 @@ SQLITE_PRIVATE int parseElseStatement(Parse *pParse, stored_proc* procedure, int
     return SQLITE_OK;
 }
 
-SQLITE_PRIVATE int parseEndIfStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseEndIfStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     char* sql = *psql;
 
     // get the current IF block controller from the stack
-    if_block* ifb = if_stack;
+    if_block* ifb = blocks->if_stack;
     if (!ifb) {
       sqlite3ErrorMsg(pParse, "END IF without IF");
       return SQLITE_ERROR;
@@ -1525,8 +2573,8 @@ SQLITE_PRIVATE int parseEndIfStatement(Parse *pParse, stored_proc* procedure, in
     procedure->cmds[last_if_cmd].next_if_cmd = pos;
 
     // pop the current IF block controller from the stack
-    if_stack = ifb->next;
-    free(ifb);
+    blocks->if_stack = ifb->next;
+    sqlite3_free(ifb);
 
 
     // skip "END IF;" and whitespaces
@@ -1543,25 +2591,14 @@ SQLITE_PRIVATE int parseEndIfStatement(Parse *pParse, stored_proc* procedure, in
 // LOOP, ENDLOOP and BREAK statements
 
 
-// declare the loop_block struct
-typedef struct loop_block {
-    struct loop_block* next;
-    int type;  // CMD_TYPE_LOOP or CMD_TYPE_FOREACH
-    int start_cmd;
-} loop_block;
-
-// declare the loop_block stack
-loop_block* loop_stack = NULL;
-
-SQLITE_PRIVATE int parseLoopStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseLoopStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     char* sql = *psql;
 
     // this is a new LOOP block, push a new LOOP block controller on the stack
-    loop_block* loopb = malloc(sizeof(loop_block));
+    loop_block* loopb = sqlite3MallocZero(sizeof(loop_block));
     if (!loopb) return SQLITE_NOMEM;
-    memset(loopb, 0, sizeof(loop_block));
-    loopb->next = loop_stack;
-    loop_stack = loopb;
+    loopb->next = blocks->loop_stack;
+    blocks->loop_stack = loopb;
 
     loopb->type = CMD_TYPE_LOOP;
     loopb->start_cmd = pos;
@@ -1576,11 +2613,11 @@ SQLITE_PRIVATE int parseLoopStatement(Parse *pParse, stored_proc* procedure, int
     return SQLITE_OK;
 }
 
-SQLITE_PRIVATE int parseEndLoopStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseEndLoopStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     char* sql = *psql;
 
     // get the current LOOP block controller from the stack
-    loop_block* loopb = loop_stack;
+    loop_block* loopb = blocks->loop_stack;
     if (!loopb) {
       sqlite3ErrorMsg(pParse, "END LOOP without LOOP");
       return SQLITE_ERROR;
@@ -1598,8 +2635,15 @@ SQLITE_PRIVATE int parseEndLoopStatement(Parse *pParse, stored_proc* procedure,
     procedure->cmds[pos].related_cmd = start_loop_pos;
 
     // pop the current LOOP block controller from the stack
-    loop_stack = loopb->next;
-    free(loopb);
+    blocks->loop_stack = loopb->next;
+    sqlite3_free(loopb);
+
+    // a FOREACH over a list with a single command can be a single statement
+    if (procedure->cmds[start_loop_pos].type == CMD_TYPE_FOREACH &&
+        pos == start_loop_pos + 2) {
+        int rc = fuseForeachLoop(procedure, start_loop_pos);
+        if (rc != SQLITE_OK) return rc;
+    }
 
 
     // skip "END LOOP;" and whitespaces
@@ -1612,11 +2656,11 @@ SQLITE_PRIVATE int parseEndLoopStatement(Parse *pParse, stored_proc* procedure,
     return SQLITE_OK;
 }
 
-SQLITE_PRIVATE int parseBreakStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseBreakStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     char* sql = *psql;
 
     // get the current LOOP block controller from the stack
-    loop_block* loopb = loop_stack;
+    loop_block* loopb = blocks->loop_stack;
     if (!loopb) {
       sqlite3ErrorMsg(pParse, "BREAK statement without a LOOP block");
       return SQLITE_ERROR;
@@ -1670,11 +2714,11 @@ loc_invalid:
     return SQLITE_ERROR;
 }
 
-SQLITE_PRIVATE int parseContinueStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseContinueStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     char* sql = *psql;
 
     // get the current LOOP block controller from the stack
-    loop_block* loopb = loop_stack;
+    loop_block* loopb = blocks->loop_stack;
     if (!loopb) {
       sqlite3ErrorMsg(pParse, "CONTINUE statement without a LOOP block");
       *psql = sql;
@@ -1758,20 +2802,17 @@ END LOOP;
 
 */
 
-SQLITE_PRIVATE int parseForEachStatement(Parse *pParse, stored_proc* procedure, int pos, char** psql) {
+SQLITE_PRIVATE int parseForEachStatement(Parse *pParse, stored_proc* procedure, block_parser *blocks, int pos, char** psql) {
     command* cmd = &procedure->cmds[pos];
     char* sql = *psql;
     int rc = SQLITE_OK;
-    int i;
     int n, tokenType;
-    sqlite3_var *var, *used_vars;
 
     // this is a new loop block, push a new loop block controller onto the stack
-    loop_block* loopb = malloc(sizeof(loop_block));
+    loop_block* loopb = sqlite3MallocZero(sizeof(loop_block));
     if (!loopb) return SQLITE_NOMEM;
-    memset(loopb, 0, sizeof(loop_block));
-    loopb->next = loop_stack;
-    loop_stack = loopb;
+    loopb->next = blocks->loop_stack;
+    blocks->loop_stack = loopb;
 
     loopb->type = CMD_TYPE_FOREACH;
     loopb->start_cmd = pos;
@@ -1788,17 +2829,11 @@ SQLITE_PRIVATE int parseForEachStatement(Parse *pParse, stored_proc* procedure,
         sql += 6;
         while (sqlite3Isspace(*sql)) sql++;
     } else {
-      // parse the list of variables
-      rc = parse_variables_list(procedure, pos, &sql, &cmd->num_vars, &used_vars);
+      // parse and store the list of used variables
+      rc = parse_variables_list(procedure, pos, &sql, &cmd->num_vars, &cmd->vars);
       if (rc != SQLITE_OK) {
           goto loc_invalid;
       }
-      // store the list of used variables
-      cmd->vars = sqlite3_malloc( cmd->num_vars * sizeof(sqlite3_var*) );
-      if( !cmd->vars ) return SQLITE_NOMEM;
-      for( i=0, var=used_vars; var; i++, var=var->nextUsed ){
-        cmd->vars[i] = var;
-      }
     }
 
     // skip "IN" and whitespaces
@@ -1822,12 +2857,10 @@ SQLITE_PRIVATE int parseForEachStatement(Parse *pParse, stored_proc* procedure,
         n = sqlite3GetToken((u8*)sql, &tokenType);
         if (tokenType == TK_VARIABLE) {
             // get the input variable, that must exist
-            var = findVariable(procedure, sql, n);
-            if (!var) {
+            cmd->input_var = findVariable(procedure, sql, n);
+            if (cmd->input_var < 0) {
                 goto loc_invalid;
             }
-            // save the pointer to the input variable in the command
-            cmd->input_var = var;
             // skip the variable name
             sql += n;
         } else {
@@ -1893,6 +2926,230 @@ SQLITE_PRIVATE int parse_input_list(
     return SQLITE_OK;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// SHARED PROCEDURE CODE
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+** A procedure is parsed once per process. The parsed form is shared by the
+** connections that use it, identified by the procedure name and the hash of
+** its code: the connections to the same database find the same entry, and a
+** replaced procedure gets a new one. The entries are reference counted by
+** the call frames and released with the last of them.
+**
+** The parsed procedure is not modified after it is shared. The execution
+** state is kept on the call frames: the values of the variables, the
+** prepared statements and the FOREACH cursors.
+*/
+
+#define SP_SHARED_BUCKETS  64
+
+static sp_code *sharedCodeBuckets[SP_SHARED_BUCKETS];
+
+/*
+** Return a mutex of the engine, allocated on the first call and kept until
+** the process ends, so the locks of the engine do not contend with the core
+** of SQLite. The main mutex is only held to allocate it, and is used instead
+** if it cannot be allocated.
+*/
+SQLITE_PRIVATE sqlite3_mutex* privateMutex(sqlite3_mutex **pmutex){
+  sqlite3_mutex *mutex = AtomicLoad(pmutex);
+  sqlite3_mutex *main_mutex;
+
+  if( mutex ){
+    sqlite3MemoryBarrier();
+    return mutex;
+  }
+
+  main_mutex = sqlite3MutexAlloc(SQLITE_MUTEX_STATIC_MAIN);
+  sqlite3_mutex_enter(main_mutex);
+  mutex = *pmutex;
+  if( mutex==NULL ){
+    mutex = sqlite3MutexAlloc(SQLITE_MUTEX_FAST);
+    if( mutex==NULL ) mutex = main_mutex;
+    sqlite3MemoryBarrier();
+    AtomicStore(pmutex, mutex);
+  }
+  sqlite3_mutex_leave(main_mutex);
+  return mutex;
+}
+
+static sqlite3_mutex *sharedCodeMutexPtr;
+
+// the entries and their reference counts are protected by this mutex. it is
+// only held to update them, never while calling other SQLite functions
+#define sharedCodeMutex()  privateMutex(&sharedCodeMutexPtr)
+
+/*
+** Find the shared code of a procedure and take a reference to it.
+** Returns NULL if it is not loaded.
+*/
+SQLITE_PRIVATE sp_code* findSharedCode(u64 version, const char *code){
+  sqlite3_mutex *mutex = sharedCodeMutex();
+  sp_code *shared;
+
+  sqlite3_mutex_enter(mutex);
+  for( shared=sharedCodeBuckets[version % SP_SHARED_BUCKETS]; shared;
+       shared=shared->next ){
+    if( shared->version==version && strcmp(shared->parsed->code, code)==0 ){
+      shared->ref_count++;
+      break;
+    }
+  }
+  sqlite3_mutex_leave(mutex);
+
+  return shared;
+}
+
+/*
+** Make the values of a parsed list independent of the connection that parsed
+** it, so the list can be used by other connections and outlive it. The
+** memory allocated from the connection lookaside is copied to the heap.
+*/
+SQLITE_PRIVATE int detachListValues(sqlite3_list *list){
+  int i, rc;
+
+  // the packed lists are allocated on the heap
+  for( i=0; list->type==LIST_VALUES && i<list->num_items; i++ ){
+    sqlite3_value *value = &list->value[i];
+    sqlite3_list *sub_list = get_list_from_value(value);
+    if( sub_list ){
+      rc = detachListValues(sub_list);
+      if( rc ) return rc;
+    }else if( value->szMalloc>0 ){
+      Mem copy;
+      sqlite3VdbeMemInit(&copy, NULL, MEM_Null);
+      rc = sqlite3VdbeMemCopy(&copy, value);
+      if( rc ) return rc;
+      sqlite3VdbeMemMove(value, &copy);
+    }
+    value->db = NULL;
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Release the parsed procedure when the last reference to the shared code
+** is released.
+*/
+SQLITE_PRIVATE void releaseSharedCode(sp_code *shared){
+  sqlite3_mutex *mutex = sharedCodeMutex();
+  sp_code **pentry;
+  bool unused;
+
+  sqlite3_mutex_enter(mutex);
+  unused = --shared->ref_count==0;
+  if( unused ){
+    pentry = &sharedCodeBuckets[shared->version % SP_SHARED_BUCKETS];
+    while( *pentry!=shared ) pentry = &(*pentry)->next;
+    *pentry = shared->next;
+  }
+  sqlite3_mutex_leave(mutex);
+
+  if( unused ){
+    releaseProcedure(shared->parsed);
+    sqlite3_free(shared);
+  }
+}
+
+/*
+** Share a procedure that was just parsed, taking a reference to it. If the
+** same code was shared by another connection in the meantime, that entry is
+** used and the procedure is released. Returns NULL if out of memory.
+*/
+SQLITE_PRIVATE sp_code* shareParsedProcedure(stored_proc *procedure){
+  sqlite3_mutex *mutex = sharedCodeMutex();
+  sp_code *shared, *entry, **pbucket;
+  unsigned int n;
+
+  // the parsed procedure does not belong to a connection anymore
+  for( n=0; n<procedure->num_cmds; n++ ){
+    sqlite3_list *input_list = procedure->cmds[n].input_list;
+    if( input_list && detachListValues(input_list)!=SQLITE_OK ){
+      releaseProcedure(procedure);
+      return NULL;
+    }
+  }
+  procedure->db = NULL;
+
+  shared = (sp_code*) sqlite3MallocZero(sizeof(sp_code));
+  if( shared==NULL ){
+    releaseProcedure(procedure);
+    return NULL;
+  }
+  shared->parsed = procedure;
+  shared->version = procedure->version;
+  shared->ref_count = 1;
+
+  sqlite3_mutex_enter(mutex);
+  pbucket = &sharedCodeBuckets[shared->version % SP_SHARED_BUCKETS];
+  for( entry=*pbucket; entry; entry=entry->next ){
+    if( entry->version==shared->version &&
+        strcmp(entry->parsed->code, procedure->code)==0 ){
+      entry->ref_count++;
+      break;
+    }
+  }
+  if( entry==NULL ){
+    shared->next = *pbucket;
+    *pbucket = shared;
+  }
+  sqlite3_mutex_leave(mutex);
+
+  if( entry ){
+    releaseProcedure(procedure);
+    sqlite3_free(shared);
+    shared = entry;
+  }
+  return shared;
+}
+
+/*
+** Create a call frame to execute a shared procedure on the connection.
+** It takes over the reference to the shared code, which is released with
+** the frame. Returns NULL if out of memory.
+*/
+SQLITE_PRIVATE call_frame* newCallFrame(
+  sqlite3 *db, sp_connection *conn, sp_code *shared
+){
+  stored_proc *procedure = shared->parsed;
+  call_frame *frame;
+  int i;
+
+  frame = (call_frame*) sqlite3MallocZero(sizeof(call_frame));
+  if( frame==NULL ){
+    releaseSharedCode(shared);
+    return NULL;
+  }
+  frame->procedure = procedure;
+  frame->shared = shared;
+  frame->db = db;
+  frame->conn = conn;
+
+  if( procedure->num_cmds>0 ){
+    frame->cmds = sqlite3MallocZero(procedure->num_cmds * sizeof(cmd_state));
+    if( frame->cmds==NULL ) goto loc_no_memory;
+  }
+
+  // the variables of the procedure, on the same slots
+  frame->num_alloc_vars = procedure->num_vars>0 ? procedure->num_vars : 8;
+  frame->values = sqlite3_malloc(frame->num_alloc_vars * sizeof(sqlite3_value));
+  frame->versions = sqlite3_malloc(frame->num_alloc_vars * sizeof(u32));
+  if( frame->values==NULL || frame->versions==NULL ) goto loc_no_memory;
+  for( i=0; i<procedure->num_vars; i++ ){
+    sqlite3VdbeMemInit(&frame->values[i], db, MEM_Null);
+    frame->versions[i] = 1;
+  }
+  frame->num_vars = procedure->num_vars;
+
+  return frame;
+
+loc_no_memory:
+  releaseCallFrame(frame);
+  return NULL;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // PROCEDURE "COMPILATION"
 ////////////////////////////////////////////////////////////////////////////////
@@ -1918,6 +3175,13 @@ SQLITE_PRIVATE void prepareNewStoredProcedure(Parse *pParse, char **psql, bool o
       goto loc_exit;
     }
 
+    // the function would replace the built-in one on the whole connection
+    if (procedure->is_function && isBuiltinFunction(procedure->name)) {
+      sqlite3ErrorMsg(pParse, "cannot replace the built-in function %s()", procedure->name);
+      rc = SQLITE_ERROR;
+      goto loc_exit;
+    }
+
     // remove the last ';' and keep only up to 'END'
     end = (*psql) - 1;
     while( end > sql && sqlite3Isspace(*end) ) end--;
@@ -1955,6 +3219,9 @@ SQLITE_PRIVATE void prepareNewStoredProcedure(Parse *pParse, char **psql, bool o
     Vdbe *v = sqlite3GetVdbe(pParse);
     if (v == NULL) { rc = SQLITE_NOMEM; goto loc_exit; }
 
+    // the table is modified on a write transaction
+    sqlite3BeginWriteOperation(pParse, 0, 0);
+
     // create the stored_procedures table if it does not exist
     const char *sql2 =
         "CREATE TABLE IF NOT EXISTS stored_procedures ("
@@ -1974,6 +3241,15 @@ SQLITE_PRIVATE void prepareNewStoredProcedure(Parse *pParse, char **psql, bool o
         nsql, sql);
     sqlite3VdbeAddOp4(v, OP_SqlExec, 0, 0, 0, sql2, P4_DYNAMIC);
 
+    // the cached procedures are not invalidated here: each CALL checks on
+    // execution if the code was replaced. the functions are referenced by
+    // the other statements, resolved when they are prepared, so a change of
+    // the schema cookie makes them prepared again on all the connections,
+    // with the functions registered again
+    if (procedure->is_function) {
+      sqlite3ChangeCookie(pParse, 0);
+    }
+
     // finish coding the VDBE program
     sqlite3FinishCoding(pParse);
 
@@ -1989,20 +3265,63 @@ loc_exit:
     }
 }
 
+// identifies the query of the stored code on the statement pool
+#define SP_CATALOG_VERSION  0
+
+/*
+** Return the data version of the main database, used to check later if the
+** stored code can have been modified. Like PRAGMA data_version, it changes
+** when another connection commits a modification to the database.
+** Returns -1 when the code read cannot be checked this way: when there is no
+** transaction on the database, or when there can be modifications of this
+** connection not yet committed, as they can be rolled back without changing
+** the version. It is the case of an explicit write transaction, and of write
+** statements running besides the num_writers executing ones.
+*/
+SQLITE_PRIVATE sqlite3_int64 readDataVersion(sqlite3 *db, int num_writers){
+  Btree *pBt = db->aDb[0].pBt;
+  u32 version;
+
+  if( pBt==NULL ) return -1;
+  switch( sqlite3BtreeTxnState(pBt) ){
+    case SQLITE_TXN_NONE:
+      return -1;
+    case SQLITE_TXN_WRITE:
+      if( !db->autoCommit || db->nVdbeWrite>num_writers ) return -1;
+      break;
+  }
+  sqlite3BtreeEnter(pBt);
+  sqlite3BtreeGetMeta(pBt, BTREE_DATA_VERSION, &version);
+  sqlite3BtreeLeave(pBt);
+  return version;
+}
+
 /*
-** Get a stored procedure from the database
+** Get a stored procedure from the database. The query is kept on the
+** statement pool of the connection, if supplied. The data version read with
+** the code is returned on pdata_version, if supplied.
 */
-SQLITE_PRIVATE int getStoredProcedure(sqlite3* db, char* name, int name_len, char** pcode) {
+SQLITE_PRIVATE int getStoredProcedure(
+    sqlite3* db, sp_connection *conn, char* name, int name_len, char** pcode,
+    sqlite3_int64 *pdata_version
+) {
     sqlite3_stmt* stmt = NULL;
     int rc = SQLITE_OK;
     char* code = NULL;
 
+    if (pdata_version) *pdata_version = -1;
+
     // prepare the statement
-    rc = sqlite3_prepare_v2(db,
-                            "SELECT code FROM stored_procedures WHERE name = ?",
-                            -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        goto loc_exit;
+    if (conn) {
+        stmt = takePooledStatement(conn, SP_CATALOG_VERSION, 0);
+    }
+    if (stmt == NULL) {
+        rc = sqlite3_prepare_v3(db,
+                                "SELECT code FROM stored_procedures WHERE name = ?",
+                                -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            goto loc_exit;
+        }
     }
 
     // bind the name parameter
@@ -2016,6 +3335,8 @@ SQLITE_PRIVATE int getStoredProcedure(sqlite3* db, char* name, int name_len, cha
     if (rc == SQLITE_ROW) {
         // get the code
         code = sqlite3StrDup((char*)sqlite3_column_text(stmt, 0));
+        // the read transaction is open while the statement is on the row
+        if (pdata_version) *pdata_version = readDataVersion(db, 0);
         rc = SQLITE_OK;
     } else if (rc == SQLITE_DONE) {
         // no stored procedure found
@@ -2024,49 +3345,328 @@ SQLITE_PRIVATE int getStoredProcedure(sqlite3* db, char* name, int name_len, cha
 
 loc_exit:
     if (stmt != NULL) {
-        sqlite3_finalize(stmt);
+        if (conn) {
+            poolVersionStatement(conn, SP_CATALOG_VERSION, "stored_procedures", 0, stmt);
+        } else {
+            sqlite3_finalize(stmt);
+        }
     }
     *pcode = code;
     return rc;
 }
 
 /*
-** Parse a stored procedure call
+** Compute the FNV-1a hash of the procedure name and code.
 */
-SQLITE_PRIVATE int parseProcedureCall(
-    Parse *pParse, char** psql, char** name, int* name_len, sqlite3_list** pparams
-){
-    char* sql = *psql;
-    int n;
-    int rc = SQLITE_OK;
-    int tokenType;
-    sqlite3_list* list = NULL;
+SQLITE_PRIVATE u64 hashProcedureCode(const char *name, const char *code){
+  u64 h = 0xcbf29ce484222325ULL;
+  const unsigned char *p;
 
-    // skip whitespaces
-    while (sqlite3Isspace(*sql)) sql++;
+  for( p=(const unsigned char*)name; *p; p++ ){
+    h = (h ^ *p) * 0x100000001b3ULL;
+  }
+  h = (h ^ 0) * 0x100000001b3ULL;
+  for( p=(const unsigned char*)code; *p; p++ ){
+    h = (h ^ *p) * 0x100000001b3ULL;
+  }
+  return h;
+}
 
-    // get the procedure name
-    n = sqlite3GetToken((u8*)sql, &tokenType);
-    if (tokenType != TK_ID) {
-        goto loc_invalid;
+/*
+** Check if the SQL command only reads from the database.
+** Any token that can start a modification (including words like the replace()
+** function) makes it not read-only. A nested CALL also does, unless pcalls is
+** supplied: then it is set to true, and the called procedure must be checked
+** with calledProceduresReadOnly().
+*/
+SQLITE_PRIVATE bool isReadOnlyCommand(char *sql, int nsql, bool *pcalls){
+  char *end = sql + nsql;
+  int n, token_type;
+
+  while( sql < end && (n = sqlite3GetToken((u8*)sql, &token_type)) != 0 ){
+    switch( token_type ){
+      case TK_INSERT:
+      case TK_UPDATE:
+      case TK_DELETE:
+      case TK_REPLACE:
+      case TK_CREATE:
+      case TK_DROP:
+      case TK_ALTER:
+      case TK_PRAGMA:
+      case TK_VACUUM:
+      case TK_REINDEX:
+      case TK_ANALYZE:
+      case TK_ATTACH:
+      case TK_DETACH:
+      case TK_BEGIN:
+      case TK_COMMIT:
+      case TK_ROLLBACK:
+      case TK_SAVEPOINT:
+      case TK_RELEASE:
+        return false;
+      case TK_ID:
+        if( n==4 && sqlite3_strnicmp(sql, "CALL", 4)==0 ){
+          if( pcalls==NULL ) return false;
+          *pcalls = true;
+        }
+        break;
     }
-    // return the procedure name and length
-    *name = sql;
-    *name_len = n;
-    // skip the procedure name
     sql += n;
+  }
 
-    // skip whitespaces
-    while (sqlite3Isspace(*sql)) sql++;
+  return true;
+}
 
-    // parse the input parameters into an sqlite3_list object
-    rc = parse_list(pParse, NULL, &sql, true, &list);
-    if (rc != SQLITE_OK) {
-        goto loc_invalid;
+/*
+** Check if the SQL command refers to the stored_procedures table or calls
+** another procedure.
+*/
+SQLITE_PRIVATE bool refersToCatalog(char *sql, int nsql){
+  char *end = sql + nsql;
+  int n, token_type;
+
+  while( sql < end && (n = sqlite3GetToken((u8*)sql, &token_type)) != 0 ){
+    if( token_type==TK_ID ){
+      char *name = sql;
+      int len = n;
+      if( len>2 && (name[0]=='"' || name[0]=='`' || name[0]=='[') ){
+        name++;
+        len -= 2;
+      }
+      if( len==17 && sqlite3_strnicmp(name, "stored_procedures", 17)==0 ) return true;
+      if( len==4 && sqlite3_strnicmp(name, "CALL", 4)==0 ) return true;
     }
+    sql += n;
+  }
 
-    // skip whitespaces
-    while (sqlite3Isspace(*sql)) sql++;
+  return false;
+}
+
+/*
+** Check if the procedure can modify the code stored on the stored_procedures
+** table, directly or by calling other procedures.
+*/
+SQLITE_PRIVATE bool canChangeCatalog(stored_proc *procedure){
+  unsigned int i;
+
+  for( i=0; i<procedure->num_cmds; i++ ){
+    command *cmd = &procedure->cmds[i];
+    if( cmd->sql && refersToCatalog(cmd->sql, cmd->nsql) ) return true;
+    if( cmd->sql2 && refersToCatalog(cmd->sql2, cmd->nsql2) ) return true;
+  }
+
+  return false;
+}
+
+/*
+** Check if the stored procedure only reads from the database. If pcalls is
+** supplied, the CALLs to other procedures are accepted and reported on it.
+*/
+SQLITE_PRIVATE bool isReadOnlyProcedure(stored_proc *procedure, bool *pcalls){
+  unsigned int i;
+
+  if( pcalls ) *pcalls = false;
+
+  for( i=0; i<procedure->num_cmds; i++ ){
+    command *cmd = &procedure->cmds[i];
+    if( cmd->sql && !isReadOnlyCommand(cmd->sql, cmd->nsql, pcalls) ) return false;
+    if( cmd->sql2 && !isReadOnlyCommand(cmd->sql2, cmd->nsql2, pcalls) ) return false;
+  }
+
+  return true;
+}
+
+/*
+** Return a parsed stored procedure, from the connection cache when available,
+** or else created from the shared code, or by loading and parsing its code
+** from the stored_procedures table.
+*/
+SQLITE_PRIVATE int loadStoredProcedure(
+  Parse *pParse, sp_connection *conn, char *name, int name_len,
+  call_frame **pframe
+){
+  sqlite3 *db = pParse->db;
+  stored_proc *procedure = NULL;
+  call_frame *frame;
+  sp_code *shared = NULL;
+  char zName[sizeof(procedure->name)];
+  char *code = NULL, *code2;
+  sqlite3_int64 data_version;
+  int rc;
+
+  *pframe = NULL;
+
+  // make sure the schema is loaded, so the cached entries can be validated
+  rc = sqlite3ReadSchema(pParse);
+  if( rc!=SQLITE_OK ) return rc;
+
+  // check if there is an idle frame of the procedure on the cache
+  if( name_len < (int)sizeof(zName) ){
+    memcpy(zName, name, name_len);
+    zName[name_len] = '\0';
+    frame = takeCachedFrame(conn, zName);
+    if( frame ){
+      *pframe = frame;
+      return SQLITE_OK;
+    }
+  }
+
+  // get the stored procedure from the database
+  rc = getStoredProcedure(db, conn, name, name_len, &code, &data_version);
+  // if the stored procedure does not exist, return an error
+  if( rc==SQLITE_NOTFOUND || (rc==SQLITE_OK && code==NULL) ){
+    if( pParse->zErrMsg==NULL ){
+      sqlite3ErrorMsg(pParse, "Stored procedure not found: %.*s", name_len, name);
+    }
+    return SQLITE_ERROR;
+  }
+  if( rc!=SQLITE_OK ){
+    if( pParse->zErrMsg==NULL ){
+      sqlite3ErrorMsg(pParse, "Error loading stored procedure: %s", sqlite3_errmsg(db));
+    }
+    return rc;
+  }
+
+  // the same code can be already parsed by another connection
+  if( name_len < (int)sizeof(zName) ){
+    shared = findSharedCode(hashProcedureCode(zName, code), code);
+  }
+
+  if( shared ){
+    sqlite3_free(code);
+  }else{
+    // allocate a new stored_proc object
+    procedure = (stored_proc*) sqlite3MallocZero(sizeof(stored_proc));
+    if( procedure==NULL ){
+      sqlite3_free(code);
+      return SQLITE_NOMEM;
+    }
+    procedure->db = db;
+    procedure->code = code;
+
+    // parse the stored procedure to be executed
+    code2 = code;
+    rc = parseStoredProcedure(pParse, procedure, &code2);
+    if( rc!=SQLITE_OK ){
+      if( pParse->zErrMsg==NULL ){
+        sqlite3ErrorMsg(pParse, "Error parsing stored procedure: %s",
+              sqlite3_errmsg(db));
+      }
+      releaseProcedure(procedure);
+      return rc;
+    }
+
+    // the prepared statements are shared by the instances of the same version
+    procedure->version = hashProcedureCode(procedure->name, code);
+    // read-only procedures do not need a statement transaction. the called
+    // procedures are checked when the call is prepared
+    procedure->read_only = isReadOnlyProcedure(procedure, &procedure->has_calls);
+    procedure->changes_catalog = !procedure->read_only && canChangeCatalog(procedure);
+    // the program is compiled before sharing, as the procedure is not
+    // modified after that
+    rc = compileProcedureProgram(procedure);
+    if( rc!=SQLITE_OK ){
+      releaseProcedure(procedure);
+      return rc;
+    }
+
+    // make it available to the other connections
+    shared = shareParsedProcedure(procedure);
+    if( shared==NULL ) return SQLITE_NOMEM;
+  }
+
+  // the frame keeps the execution state of this call
+  frame = newCallFrame(db, conn, shared);
+  if( frame==NULL ) return SQLITE_NOMEM;
+  // store the schema version used to validate the cached frame later
+  frame->schema_cookie = db->aDb[0].pSchema->schema_cookie;
+  frame->schema_generation = db->aDb[0].pSchema->iGeneration;
+  // and the state of the database when the code was read
+  frame->data_version = data_version;
+  frame->total_changes = db->nTotalChange;
+
+  *pframe = frame;
+  return SQLITE_OK;
+}
+
+/*
+** Check, on execution, if the code of the procedure is still the one stored
+** on the stored_procedures table. The table is only read again when the
+** database can have been modified since the code was read: by another
+** connection, detected with the data version, or by this one, detected with
+** its count of modified rows. The executing statement is a writer if it has
+** a write transaction. It returns SQLITE_SCHEMA if the procedure was replaced
+** or removed. The idle frames of the procedure are then released.
+*/
+SQLITE_PRIVATE int checkStoredCode(call_frame *frame, bool writer){
+  sqlite3 *db = frame->db;
+  stored_proc *procedure = frame->procedure;
+  sqlite3_int64 data_version = readDataVersion(db, writer ? 1 : 0);
+  call_frame *idle;
+  char *code = NULL;
+  int rc;
+
+  if( data_version>=0 && data_version==frame->data_version &&
+      db->nTotalChange==frame->total_changes ){
+    return SQLITE_OK;
+  }
+
+  rc = getStoredProcedure(db, frame->conn, procedure->name,
+                          strlen(procedure->name), &code, NULL);
+  if( rc==SQLITE_OK && code && strcmp(code, procedure->code)==0 ){
+    sqlite3_free(code);
+    frame->data_version = data_version;
+    frame->total_changes = db->nTotalChange;
+    return SQLITE_OK;
+  }
+  sqlite3_free(code);
+  if( rc!=SQLITE_OK && rc!=SQLITE_NOTFOUND ) return rc;
+
+  XTRACE("procedure replaced: %s\n", procedure->name);
+  frame->replaced = true;
+  while( (idle = takeCachedFrame(frame->conn, procedure->name))!=NULL ){
+    releaseCallFrame(idle);
+  }
+  return SQLITE_SCHEMA;
+}
+
+/*
+** Parse a stored procedure call
+*/
+SQLITE_PRIVATE int parseProcedureCall(
+    Parse *pParse, char** psql, char** name, int* name_len, sqlite3_list** pparams
+){
+    char* sql = *psql;
+    int n;
+    int rc = SQLITE_OK;
+    int tokenType;
+    sqlite3_list* list = NULL;
+
+    // skip whitespaces
+    while (sqlite3Isspace(*sql)) sql++;
+
+    // get the procedure name
+    n = sqlite3GetToken((u8*)sql, &tokenType);
+    if (tokenType != TK_ID) {
+        goto loc_invalid;
+    }
+    // return the procedure name and length
+    *name = sql;
+    *name_len = n;
+    // skip the procedure name
+    sql += n;
+
+    // skip whitespaces
+    while (sqlite3Isspace(*sql)) sql++;
+
+    // parse the input parameters into an sqlite3_list object
+    rc = parse_list(pParse, NULL, &sql, true, &list);
+    if (rc != SQLITE_OK) {
+        goto loc_invalid;
+    }
+
+    // skip whitespaces
+    while (sqlite3Isspace(*sql)) sql++;
 
     // return the current parsing position on the psql pointer
     *psql = sql;
@@ -2082,13 +3682,18 @@ loc_invalid:
 }
 
 /*
-** Process the input parameters of a stored procedure call
-** 
+** Process the input parameters of a stored procedure call. The variables
+** are numbered on the CALL statement, and their numbers are kept on the
+** call. The parsed list is not modified.
 */
-SQLITE_PRIVATE int processCallParameters(Parse *pParse, sqlite3_list *input_list) {
+SQLITE_PRIVATE int processCallParameters(Parse *pParse, procedure_call *call) {
+    sqlite3_list *input_list = call->input_list;
     int count = 0;
     int i;
 
+    // the packed lists have no variables
+    if (input_list->type != LIST_VALUES) return SQLITE_OK;
+
     // count how many variables are there in the input list
     for (i = 0; i < input_list->num_items; i++) {
         if (is_variable(&input_list->value[i])) {
@@ -2099,6 +3704,8 @@ SQLITE_PRIVATE int processCallParameters(Parse *pParse, sqlite3_list *input_list
     if (count > 0) {
         Expr aExpr[1];
         Expr *pExpr = &aExpr[0];
+        call->var_numbers = sqlite3MallocZero(input_list->num_items * sizeof(int));
+        if (call->var_numbers == NULL) return SQLITE_NOMEM;
         // iterate the input_list
         for (i = 0; i < input_list->num_items; i++) {
             sqlite3_value *value = &input_list->value[i];
@@ -2109,10 +3716,7 @@ SQLITE_PRIVATE int processCallParameters(Parse *pParse, sqlite3_list *input_list
                 pExpr->u.zToken = value->z;
                 // assign a number to the variable
                 sqlite3ExprAssignVarNumber(pParse, pExpr, (u32)value->n);
-                // replace the variable identifier (string) with the variable number
-                sqlite3VdbeMemSetInt64(value, pExpr->iColumn);
-                // mark it as a variable
-                value->eSubtype = 'v';
+                call->var_numbers[i] = pExpr->iColumn;
             }
         }
     }
@@ -2120,21 +3724,111 @@ SQLITE_PRIVATE int processCallParameters(Parse *pParse, sqlite3_list *input_list
     return SQLITE_OK;
 }
 
+// maximum nesting of the calls followed to check if a procedure is read-only
+#define SP_MAX_READONLY_DEPTH  16
+
+SQLITE_PRIVATE bool calledProceduresReadOnly(
+  sp_connection *conn, stored_proc *procedure, const char **stack, int depth
+);
+
+/*
+** Check if the procedures called by the SQL command only read from the
+** database. The procedures that are being checked (on recursive calls) are
+** not checked again.
+*/
+SQLITE_PRIVATE bool callsAreReadOnly(
+  sp_connection *conn, char *sql, int nsql, const char **stack, int depth
+){
+  char *end = sql + nsql;
+  char zName[sizeof(((stored_proc*)0)->name)];
+  int n, token_type, i;
+
+  while( sql < end && (n = sqlite3GetToken((u8*)sql, &token_type)) != 0 ){
+    call_frame *frame;
+    stored_proc *called;
+    char *zErr = NULL;
+    bool read_only;
+
+    sql += n;
+    if( token_type!=TK_ID || n!=4 || sqlite3_strnicmp(sql - n, "CALL", 4)!=0 ){
+      continue;
+    }
+
+    // get the procedure name
+    while( sql < end && sqlite3Isspace(*sql) ) sql++;
+    n = sqlite3GetToken((u8*)sql, &token_type);
+    if( token_type!=TK_ID || n>=(int)sizeof(zName) || sql + n > end ) return false;
+    memcpy(zName, sql, n);
+    zName[n] = '\0';
+    sql += n;
+
+    for( i=0; i<depth; i++ ){
+      if( strcmp(stack[i], zName)==0 ) break;
+    }
+    if( i<depth ) continue;
+
+    // procedures that cannot be loaded fail when called
+    if( loadStoredFunction(conn, zName, &frame, &zErr)!=SQLITE_OK ){
+      sqlite3_free(zErr);
+      return false;
+    }
+    called = frame->procedure;
+    read_only = called->read_only && (!called->has_calls ||
+                calledProceduresReadOnly(conn, called, stack, depth));
+    cacheFrame(conn, frame);
+    if( !read_only ) return false;
+  }
+
+  return true;
+}
+
+/*
+** Check if the procedures called by a read-only procedure, and the ones
+** called by them, also only read from the database.
+*/
+SQLITE_PRIVATE bool calledProceduresReadOnly(
+  sp_connection *conn, stored_proc *procedure, const char **stack, int depth
+){
+  unsigned int i;
+
+  if( conn==NULL || depth>=SP_MAX_READONLY_DEPTH ) return false;
+  stack[depth++] = procedure->name;
+
+  for( i=0; i<procedure->num_cmds; i++ ){
+    command *cmd = &procedure->cmds[i];
+    if( cmd->sql && !callsAreReadOnly(conn, cmd->sql, cmd->nsql, stack, depth) ){
+      return false;
+    }
+    if( cmd->sql2 && !callsAreReadOnly(conn, cmd->sql2, cmd->nsql2, stack, depth) ){
+      return false;
+    }
+  }
+
+  return true;
+}
+
 /*
 ** Compile the stored procedure call into a prepared statement
 */
 SQLITE_PRIVATE void prepareProcedureCall(Parse *pParse, char **psql) {
     sqlite3 *db = pParse->db;
+    sp_connection *conn;
     procedure_call *call = NULL;
-    stored_proc *procedure = NULL;
+    call_frame *frame = NULL;
+    stored_proc *procedure;
     char *sql = *psql;
-    char *name, *code=NULL, *code2;
+    char *name;
     int name_len;
     int rc = SQLITE_OK;
+    bool read_only;
     Vdbe *v = NULL;
 
+    // get the connection state, used to cache the parsed procedures
+    conn = getConnectionContext(db);
+
     call = (procedure_call*) sqlite3MallocZero(sizeof(procedure_call));
     if (call == NULL) { rc = SQLITE_NOMEM; goto loc_exit; }
+    call->conn = conn;
 
     // parse the CALL statement
     rc = parseProcedureCall(pParse, &sql, &name, &name_len, &call->input_list);
@@ -2145,24 +3839,15 @@ SQLITE_PRIVATE void prepareProcedureCall(Parse *pParse, char **psql) {
       goto loc_exit;
     }
 
-    // get the stored procedure from the database
-    rc = getStoredProcedure(db, name, name_len, &code);
-    // if the stored procedure does not exist, return an error
-    if (rc == SQLITE_NOTFOUND || code == NULL) {
-      if (pParse->zErrMsg == NULL) {
-        sqlite3ErrorMsg(pParse, "Stored procedure not found: %.*s", name_len, name);
-      }
-      goto loc_exit;
-    }
+    // get the stored procedure from the cache or from the database
+    rc = loadStoredProcedure(pParse, conn, name, name_len, &frame);
     if (rc != SQLITE_OK) {
-      if (pParse->zErrMsg == NULL) {
-        sqlite3ErrorMsg(pParse, "Error loading stored procedure: %s", sqlite3_errmsg(db));
-      }
       goto loc_exit;
     }
+    procedure = frame->procedure;
 
     // process the variables in the input list
-    rc = processCallParameters(pParse, call->input_list);
+    rc = processCallParameters(pParse, call);
     if (rc != SQLITE_OK) {
       if (pParse->zErrMsg == NULL) {
         sqlite3ErrorMsg(pParse, "Error processing stored procedure parameters: %s",
@@ -2171,26 +3856,6 @@ SQLITE_PRIVATE void prepareProcedureCall(Parse *pParse, char **psql) {
       goto loc_exit;
     }
 
-    // allocate a new stored_proc object
-    procedure = (stored_proc*) sqlite3MallocZero(sizeof(stored_proc));
-    if (procedure == NULL) {
-      rc = SQLITE_NOMEM;
-      goto loc_exit;
-    }
-    procedure->db = pParse->db;
-    procedure->code = code;
-
-    // parse the stored procedure to be executed
-    code2 = code;
-    rc = parseStoredProcedure(pParse, procedure, &code2);
-    if (rc != SQLITE_OK) {
-      if (pParse->zErrMsg == NULL) {
-        sqlite3ErrorMsg(pParse, "Error parsing stored procedure: %s",
-              sqlite3_errmsg(db));
-      }
-      goto loc_exit;
-    }
-
     // the CALL command cannot be used with functions
     if (procedure->is_function) {
       if (pParse->zErrMsg == NULL) {
@@ -2223,8 +3888,11 @@ SQLITE_PRIVATE void prepareProcedureCall(Parse *pParse, char **psql) {
     }
 #endif
 
-    // store the procedure object in the call object
-    call->procedure = procedure;
+    // use the compiled implementation, if loaded for this version
+    call->native = findNativeProcedure(conn, procedure);
+
+    // store the call frame in the call object
+    call->frame = frame;
 
     // compile the stored procedure call into a prepared statement
     v = sqlite3GetVdbe(pParse);
@@ -2241,6 +3909,42 @@ SQLITE_PRIVATE void prepareProcedureCall(Parse *pParse, char **psql) {
     sqlite3VdbeAddOp0(v, OP_Noop);  /* replaced by a OP_NextResult opcode */
     assert( POS_NEXT_RESULT==sqlite3VdbeCurrentAddr(v)-1 );
 
+    // verify the schema cookie on execution. the replacement of the
+    // procedure is checked by executeStoredProcedure()
+    sqlite3CodeVerifySchema(pParse, 0);
+
+    // the procedures that only read, and only call procedures that read, do
+    // not take the write lock
+    read_only = procedure->read_only;
+    if (read_only && procedure->has_calls) {
+      const char *stack[SP_MAX_READONLY_DEPTH];
+      read_only = calledProceduresReadOnly(conn, procedure, stack, 0);
+    }
+
+    if (read_only) {
+      // the read transactions of all the databases are started before the
+      // body is executed and kept until the CALL statement finishes, so all
+      // the body statements read from the same snapshot. as no write lock is
+      // taken, it can run on read-only connections and on WAL readers while
+      // another connection writes
+      sqlite3CodeVerifyNamedSchema(pParse, 0);
+    } else {
+      // the call runs inside a statement transaction, so the changes made by
+      // a failed execution are rolled back when the CALL statement halts,
+      // without using a named savepoint. it is opened on all the databases,
+      // including the attached ones, as the body can write to any of them
+      int i;
+      for (i = 0; i < db->nDb; i++) {
+        if (i == 0 || db->aDb[i].pBt) {
+          sqlite3BeginWriteOperation(pParse, 1, i);
+        }
+      }
+      sqlite3MayAbort(pParse);
+    }
+
+    // the body statements are kept on the connection pool after the call
+    attachStatementPool(pParse, conn);
+
     sqlite3FinishCoding(pParse);
 
 
@@ -2255,15 +3959,12 @@ loc_exit:
         v->pCall = NULL;
       }
       if (call) {
-        call->procedure = NULL;
+        call->frame = NULL;
         releaseProcedureCall(call);
       }
-      if (procedure) {
-        procedure->code = NULL;
-        releaseProcedure(procedure);
-      }
-      if (code) {
-        sqlite3_free(code);
+      if (frame) {
+        // return it to the cache
+        cacheFrame(conn, frame);
       }
       if (pParse->rc == SQLITE_OK) {
         pParse->rc = rc;
@@ -2276,1205 +3977,6443 @@ loc_exit:
 // the execute step should execute the stored procedure by iterating and processing each command on the stored_proc object
 
 ////////////////////////////////////////////////////////////////////////////////
-// PROCEDURE EXECUTION
+// PROCEDURE PROGRAM
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
-** Execute an expression and return the result.
+** The commands of a procedure are compiled into a flat program before the
+** first execution. The IF, ELSEIF, ELSE, LOOP, BREAK, CONTINUE and END LOOP
+** commands become jumps with resolved destinations, so the program does not
+** need to follow the command links or to keep the state of the IF blocks.
 */
-SQLITE_PRIVATE int execute_expression(Vdbe *v, command *cmd, bool* bool_result){
-  int rc = SQLITE_OK;
-  sqlite3* db = v->db;
-
-  // if the CMD_FLAG_DYNAMIC_SQL is not set
-  if( (cmd->flags & CMD_FLAG_DYNAMIC_SQL)==0 ){
-    // add "SELECT" to the expression
-    cmd->sql = sqlite3_mprintf("SELECT %.*s", cmd->nsql, cmd->sql);
-    cmd->nsql += 7;
-    if( cmd->sql==NULL ) return SQLITE_NOMEM;
-    // mark that this SQL command string is dynamically allocated
-    cmd->flags |= CMD_FLAG_DYNAMIC_SQL;
-  }
-
-  if( cmd->stmt==NULL ){
-    // prepare the expression
-    rc = sqlite3_prepare_v2(db, cmd->sql, cmd->nsql, &cmd->stmt, NULL);
-  } else {
-    // reset the statement
-    rc = sqlite3_reset(cmd->stmt);
-  }
-  if( rc ) goto loc_error;
-
-  // bind variables
-  bindLocalVariables(cmd->procedure, cmd->stmt);
 
-  // execute the expression
-  rc = sqlite3_step(cmd->stmt);
-  if( rc!=SQLITE_ROW ){
-    sqlite3VdbeError(v, "expression did not return a result");
-    goto loc_error;
-  }
+#define SP_OP_HALT       0
+#define SP_OP_GOTO       1    /* jump to p2 */
+#define SP_OP_IF_FALSE   2    /* evaluate the expression, jump to p2 if false */
+#define SP_OP_SET        3
+#define SP_OP_STATEMENT  4
+#define SP_OP_ASSERT     5
+#define SP_OP_FOREACH    6    /* load the next item, jump to p2 when done */
+#define SP_OP_RETURN     7
+#define SP_OP_RAISE      8
+#define SP_OP_RETURN_NEXT 9   /* return a row and suspend the execution */
 
-  // get the result
-  if( bool_result ) {
-    *bool_result = sqlite3_column_int(cmd->stmt, 0);
-  }else{
-    sqlite3_var *var;
-    // get the number of result columns
-    int num_cols = sqlite3_column_count(cmd->stmt);
-    if( num_cols==0 ){
-      sqlite3VdbeError(v, "expression did not return a result");
-      goto loc_error;
-    }
-    // allocate variables to store the result
-    cmd->num_vars = num_cols;
-    cmd->vars = sqlite3_malloc( num_cols * sizeof(sqlite3_var*) );
-    if( !cmd->vars ) return SQLITE_NOMEM;
-    // for each result column
-    for(int i=0; i<num_cols; i++){
-      char buf[32];
-      // get the column name
-      char *name = (char*) sqlite3_column_name(cmd->stmt, i);
-      if( !name ){
-        // if the column name is not available, use the column index
-        sprintf(buf, "col%d", i+1);
-        name = buf;
-      }
-      // create a new variable
-      var = addVariable(cmd->procedure, name, strlen(name), 0, NULL);
-      if( !var ) return SQLITE_NOMEM;
-      cmd->vars[i] = var;
-      // get the column value
-      sqlite3_value *value = sqlite3_column_value(cmd->stmt, i);
-      // move the column value to the variable
-      sqlite3VdbeMemMove(&var->value, value);
+/*
+** Return the position of the END IF command of the block that contains the
+** supplied IF, ELSEIF or ELSE command.
+*/
+SQLITE_PRIVATE int findEndIfCommand(stored_proc *procedure, command *cmd){
+    int pos = cmd->next_if_cmd;
+    while (procedure->cmds[pos].type != CMD_TYPE_ENDIF) {
+        pos = procedure->cmds[pos].next_if_cmd;
     }
-  }
-
-  // make sure the statement returns no more rows
-  rc = sqlite3_step(cmd->stmt);
-  if( rc==SQLITE_ROW ){
-    sqlite3VdbeError(v, "expression returned more than one row");
-    goto loc_error;
-  }else if( rc!=SQLITE_DONE ){
-    goto loc_error;
-  }
-
-  return SQLITE_OK;
-loc_error:
-  if( v->zErrMsg==NULL ){
-    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
-  }
-  return rc;
+    return pos;
 }
 
-SQLITE_PRIVATE int db_query_str(stored_proc *procedure, char *sql, char **presult){
-  sqlite3* db = procedure->db;
-  sqlite3_stmt *stmt = NULL;
-  int rc = SQLITE_OK;
+/*
+** Add an instruction to the program. The destination is the position of a
+** command, converted to an address when the program is finished.
+*/
+#define emitProgramOp(op_code, dest, command) do { \
+    sp_op *new_op = &ops[num_ops++]; \
+    new_op->opcode = (op_code); \
+    new_op->p2 = (dest); \
+    new_op->cmd = (command); \
+} while(0)
 
-  // prepare the expression
-  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if( rc ) goto loc_exit;
+/*
+** Compile the procedure commands into a program.
+*/
+SQLITE_PRIVATE int compileProcedureProgram(stored_proc *procedure){
+    sp_op *ops;
+    int *addr;      /* address of each command on the program */
+    int num_ops = 0;
+    int pos, i;
 
-  // bind variables
-  bindLocalVariables(procedure, stmt);
+    assert(procedure->program == NULL);
 
-  // execute the expression
-  rc = sqlite3_step(stmt);
-  if( rc!=SQLITE_ROW ){
-    if( rc==SQLITE_DONE ){
-      rc = SQLITE_ERROR;
+    // each command generates at most 2 instructions
+    ops = sqlite3Malloc((2 * procedure->num_cmds + 1) * sizeof(sp_op));
+    addr = sqlite3Malloc((procedure->num_cmds + 1) * sizeof(int));
+    if (ops == NULL || addr == NULL) {
+        sqlite3_free(ops);
+        sqlite3_free(addr);
+        return SQLITE_NOMEM;
     }
-    goto loc_exit;
-  }
 
-  // get the result
-  *presult = sqlite3StrDup((char*)sqlite3_column_text(stmt, 0));
+    for (pos = 0; pos < procedure->num_cmds; pos++) {
+        command *cmd = &procedure->cmds[pos];
 
-  // make sure the statement returns no more rows
-  rc = sqlite3_step(stmt);
-  if( rc==SQLITE_ROW ){
-    rc = SQLITE_ERROR;
-  }else if( rc==SQLITE_DONE ){
-    rc = SQLITE_OK;
-  }
+        if (cmd->type == CMD_TYPE_ELSEIF || cmd->type == CMD_TYPE_ELSE) {
+            // the previous branch was executed: skip to the END IF
+            emitProgramOp(SP_OP_GOTO, findEndIfCommand(procedure, cmd), NULL);
+        }
+        addr[pos] = num_ops;
 
-loc_exit:
-  sqlite3_finalize(stmt);
-  return rc;
+        switch (cmd->type) {
+        case CMD_TYPE_IF:
+        case CMD_TYPE_ELSEIF:
+            emitProgramOp(SP_OP_IF_FALSE, cmd->next_if_cmd, cmd);
+            break;
+        case CMD_TYPE_ENDLOOP:
+        case CMD_TYPE_CONTINUE:
+            // back to the LOOP or FOREACH command
+            emitProgramOp(SP_OP_GOTO, cmd->related_cmd, NULL);
+            break;
+        case CMD_TYPE_BREAK:
+            // to the command after the END LOOP
+            emitProgramOp(SP_OP_GOTO, procedure->cmds[cmd->related_cmd].related_cmd + 1, NULL);
+            break;
+        case CMD_TYPE_FOREACH:
+            emitProgramOp(SP_OP_FOREACH, cmd->related_cmd + 1, cmd);
+            break;
+        case CMD_TYPE_SET:
+            emitProgramOp(SP_OP_SET, 0, cmd);
+            break;
+        case CMD_TYPE_STATEMENT:
+            emitProgramOp(SP_OP_STATEMENT, 0, cmd);
+            break;
+        case CMD_TYPE_ASSERT:
+            emitProgramOp(SP_OP_ASSERT, 0, cmd);
+            break;
+        case CMD_TYPE_RETURN:
+            if (cmd->flags & CMD_FLAG_RETURN_NEXT) {
+                emitProgramOp(SP_OP_RETURN_NEXT, 0, cmd);
+            } else {
+                emitProgramOp(SP_OP_RETURN, 0, cmd);
+            }
+            break;
+        case CMD_TYPE_RAISE:
+            emitProgramOp(SP_OP_RAISE, 0, cmd);
+            break;
+        default:
+            // DECLARE, ELSE, END IF and LOOP generate no instruction
+            break;
+        }
+    }
+    addr[pos] = num_ops;
+    emitProgramOp(SP_OP_HALT, 0, NULL);
+
+    // convert the command positions to addresses
+    for (i = 0; i < num_ops; i++) {
+        switch (ops[i].opcode) {
+        case SP_OP_GOTO:
+        case SP_OP_IF_FALSE:
+        case SP_OP_FOREACH:
+            ops[i].p2 = addr[ops[i].p2];
+            break;
+        }
+    }
+
+    sqlite3_free(addr);
+    procedure->program = ops;
+    procedure->num_ops = num_ops;
+    return SQLITE_OK;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// NATIVE EXPRESSIONS
+////////////////////////////////////////////////////////////////////////////////
+
 /*
-** Copy the values from the input list to the procedure parameters.
+** Simple expressions, made only of local variables, literals, parenthesis and
+** the arithmetic, concatenation, comparison and logical operators, are compiled
+** to a postfix program and evaluated directly on Mem cells, without preparing
+** and stepping a "SELECT <expression>" statement.
+**
+** Anything else (function calls, subqueries, CASE, CAST, LIKE, IN, BETWEEN,
+** bitwise operators...) is not compiled, and the expression is evaluated by
+** SQLite as before. The same happens when the evaluation finds operand types
+** that need the conversions done by SQLite (like text in arithmetic).
 */
-SQLITE_PRIVATE void copyProcedureParameters(Vdbe *v, procedure_call *call) {
-  stored_proc *procedure = call->procedure;
-  sqlite3_list *input_list = call->input_list;
-  int pos;
 
-  assert(input_list->num_items == procedure->num_params);
+#define EXPR_VARIABLE    1
+#define EXPR_LITERAL     2
+#define EXPR_NEGATIVE    3
+#define EXPR_NOT         4
+#define EXPR_ISNULL      5
+#define EXPR_NOTNULL     6
+#define EXPR_ADD         7
+#define EXPR_SUB         8
+#define EXPR_MUL         9
+#define EXPR_DIV        10
+#define EXPR_REM        11
+#define EXPR_CONCAT     12
+#define EXPR_EQ         13
+#define EXPR_NE         14
+#define EXPR_LT         15
+#define EXPR_LE         16
+#define EXPR_GT         17
+#define EXPR_GE         18
+#define EXPR_IS         19
+#define EXPR_ISNOT      20
+#define EXPR_AND        21
+#define EXPR_OR         22
+
+// maximum nesting of parenthesis and unary operators
+#define EXPR_MAX_NESTING  64
+
+typedef struct expr_parser expr_parser;
+
+struct expr_parser {
+  call_frame *frame;
+  native_expr *expr;
+  char *sql;          /* current token */
+  char *end;          /* end of the expression */
+  int token;          /* type of the current token, 0 at the end */
+  int n;              /* size of the current token */
+  int nesting;        /* current nesting level */
+  int depth;          /* number of values on the stack at this point */
+};
 
-  // iterate the input list
-  for (pos = 0; pos < input_list->num_items; pos++) {
-    // get the input value
-    Mem *input = &input_list->value[pos];
-    // get the parameter value
-    Mem *param = &procedure->params[pos]->value;
-
-    // check if the input value is a variable
-    if (input->eSubtype == 'v' && (input->flags & MEM_Int)!=0) {
-      assert(v->aVar!=0 && input->u.i>0 && input->u.i<=v->nVar);
-      // get the variable number
-      int var_number = input->u.i;
-      // get the variable value
-      Mem *var = &v->aVar[var_number - 1];
-      // copy the variable value to the parameter
-      sqlite3VdbeMemShallowCopy(param, var, MEM_Static);
-    } else {
-      // copy the input value to the parameter
-      sqlite3VdbeMemShallowCopy(param, input, MEM_Static);
-    }
-#ifdef SQLITE_DEBUG
-    printf("copyProcedureParameters() pos=%d value=", pos);
-    memTracePrint(param);
-    puts("");
-#endif
-  }
+SQLITE_PRIVATE int exprParseOr(expr_parser *p);
+SQLITE_PRIVATE int exprParseUnary(expr_parser *p);
 
+/*
+** Move to the next token of the expression, skipping spaces and comments.
+*/
+SQLITE_PRIVATE void exprNextToken(expr_parser *p){
+  p->sql += p->n;
+  while( p->sql < p->end ){
+    p->n = sqlite3GetToken((u8*)p->sql, &p->token);
+    if( p->sql + p->n > p->end ){
+      // the token goes beyond the expression
+      p->token = TK_ILLEGAL;
+      return;
+    }
+    if( p->token!=TK_SPACE && p->token!=TK_COMMENT ) return;
+    p->sql += p->n;
+  }
+  p->token = 0;
+  p->n = 0;
 }
 
-SQLITE_PRIVATE void sqlite3ChangeOpcode(Vdbe *v, int pos, int opcode, int p1, int p2){
-  VdbeOp *pOp = &v->aOp[pos];
-  pOp->opcode = opcode;
-  pOp->p1 = p1;
-  pOp->p2 = p2;
+/*
+** Add an instruction to the program.
+*/
+SQLITE_PRIVATE int exprEmit(expr_parser *p, u8 opcode, int p1){
+  native_expr *expr = p->expr;
+
+  if( expr->num_ops==expr->num_alloc_ops ){
+    int num_alloc = expr->num_alloc_ops ? expr->num_alloc_ops * 2 : 8;
+    expr_op *new_ops = sqlite3Realloc(expr->ops, num_alloc * sizeof(expr_op));
+    if( !new_ops ) return SQLITE_NOMEM;
+    expr->ops = new_ops;
+    expr->num_alloc_ops = num_alloc;
+  }
+  expr->ops[expr->num_ops].opcode = opcode;
+  expr->ops[expr->num_ops].p1 = p1;
+  expr->num_ops++;
+
+  // keep track of the stack size
+  switch( opcode ){
+    case EXPR_VARIABLE:
+    case EXPR_LITERAL:
+      p->depth++;
+      if( p->depth>expr->max_depth ) expr->max_depth = p->depth;
+      break;
+    case EXPR_NEGATIVE:
+    case EXPR_NOT:
+    case EXPR_ISNULL:
+    case EXPR_NOTNULL:
+      break;
+    default:
+      p->depth--;
+  }
+  return SQLITE_OK;
 }
 
-SQLITE_PRIVATE int sqlite3VdbeNextResult(Vdbe *v){
-  stored_proc *procedure = v->pCall->procedure;
-  int num_cols = 0;
-  int i;
-
-  // check if the procedure has a result set
-  sqlite3_list *list = procedure->result_list;
-  if( !list ){
-    // no result set
-    return SQLITE_DONE;
+/*
+** Add a literal to the program and return the Mem cell that will hold it.
+*/
+SQLITE_PRIVATE Mem* exprAddLiteral(expr_parser *p){
+  native_expr *expr = p->expr;
+  Mem *literal;
+
+  if( expr->num_literals==expr->num_alloc_literals ){
+    int num_alloc = expr->num_alloc_literals ? expr->num_alloc_literals * 2 : 4;
+    Mem *new_literals = sqlite3Realloc(expr->literals, num_alloc * sizeof(Mem));
+    if( !new_literals ) return NULL;
+    expr->literals = new_literals;
+    expr->num_alloc_literals = num_alloc;
   }
+  literal = &expr->literals[expr->num_literals];
+  sqlite3VdbeMemInit(literal, p->frame->db, MEM_Null);
+  if( exprEmit(p, EXPR_LITERAL, expr->num_literals) ) return NULL;
+  expr->num_literals++;
+  return literal;
+}
 
-  // increment the current row
-  procedure->current_row++;
-  // check if there are more rows to return
-  if( procedure->current_row >= list->num_items ){
-    // no more rows
-    return SQLITE_DONE;
+/*
+** primary: literal | @variable | "(" expression ")"
+*/
+SQLITE_PRIVATE int exprParsePrimary(expr_parser *p){
+  char *sql = p->sql;
+  int n = p->n;
+  Mem *literal;
+  int rc;
+
+  switch( p->token ){
+    case TK_INTEGER: {
+      i64 value;
+      // hexadecimal and too large values are handled by SQLite
+      if( sqlite3Atoi64(sql, &value, n, SQLITE_UTF8)!=0 ) return SQLITE_ERROR;
+      literal = exprAddLiteral(p);
+      if( !literal ) return SQLITE_NOMEM;
+      sqlite3VdbeMemSetInt64(literal, value);
+      break;
+    }
+    case TK_FLOAT: {
+      double value;
+      if( sqlite3AtoF(sql, &value, n, SQLITE_UTF8)<=0 ) return SQLITE_ERROR;
+      literal = exprAddLiteral(p);
+      if( !literal ) return SQLITE_NOMEM;
+      sqlite3VdbeMemSetDouble(literal, value);
+      break;
+    }
+    case TK_STRING: {
+      char *value;
+      literal = exprAddLiteral(p);
+      if( !literal ) return SQLITE_NOMEM;
+      value = sqlite3DbStrNDup(p->frame->db, sql, n);
+      if( !value ) return SQLITE_NOMEM;
+      sqlite3Dequote(value);
+      sqlite3VdbeMemSetStr(literal, value, -1, SQLITE_UTF8, SQLITE_DYNAMIC);
+      break;
+    }
+    case TK_NULL:
+      literal = exprAddLiteral(p);
+      if( !literal ) return SQLITE_NOMEM;
+      break;
+    case TK_VARIABLE: {
+      int slot;
+      // other kinds of parameters are handled by SQLite
+      if( sql[0]!='@' ) return SQLITE_ERROR;
+      slot = addFrameVariable(p->frame, sql, n);
+      if( slot<0 ) return SQLITE_ERROR;
+      rc = exprEmit(p, EXPR_VARIABLE, slot);
+      if( rc ) return rc;
+      break;
+    }
+    case TK_LP:
+      if( ++p->nesting>EXPR_MAX_NESTING ) return SQLITE_ERROR;
+      exprNextToken(p);
+      rc = exprParseOr(p);
+      if( rc ) return rc;
+      if( p->token!=TK_RP ) return SQLITE_ERROR;
+      p->nesting--;
+      break;
+    default:
+      return SQLITE_ERROR;
   }
 
-  // get the list value
-  Mem *row_value = &list->value[procedure->current_row];
+  exprNextToken(p);
+  return SQLITE_OK;
+}
 
-  // check if it is a list
-  list = get_list_from_value(row_value);
-  if( list ){
-    // copy the values from the list to the result set
-    for( i=0; i<list->num_items; i++ ){
-      // get the list value
-      Mem *value = &list->value[i];
-      // copy the value to the result set
-      sqlite3VdbeMemShallowCopy(&v->aMem[i+1], value, MEM_Static);
+/*
+** unary: ("-" | "+") unary | primary
+*/
+SQLITE_PRIVATE int exprParseUnary(expr_parser *p){
+  int rc;
+
+  if( p->token==TK_MINUS || p->token==TK_PLUS ){
+    int token = p->token;
+    if( ++p->nesting>EXPR_MAX_NESTING ) return SQLITE_ERROR;
+    exprNextToken(p);
+    rc = exprParseUnary(p);
+    if( rc ) return rc;
+    p->nesting--;
+    if( token==TK_MINUS ){
+      return exprEmit(p, EXPR_NEGATIVE, 0);
     }
-    num_cols = list->num_items;
-  } else {
-    // copy the value to the result set
-    sqlite3VdbeMemMove(&v->aMem[1], row_value);
-    //sqlite3VdbeMemShallowCopy(&v->aMem[1], row_value, MEM_Static);
-    num_cols = 1;
+    return SQLITE_OK;
   }
 
-  sqlite3VdbeSetNumCols(v, num_cols);
-  //sqlite3VdbeSetColName(v, 0, COLNAME_NAME, "rows deleted", SQLITE_STATIC);
-
-  // update the result opcode with the number of columns
-  sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_ResultRow, 1, num_cols);
-
-  return SQLITE_ROW;
+  return exprParsePrimary(p);
 }
 
 /*
-** Execute a return command.
+** concat: unary ("||" unary)*
 */
-SQLITE_PRIVATE int executeReturnCommand(Vdbe *v, command *cmd) {
-  stored_proc *procedure = cmd->procedure;
-  int rc = SQLITE_OK;
-  int i;
-
-  if( cmd->num_vars==0 && cmd->sql==NULL ){
-    // no result set
-    return SQLITE_OK;
+SQLITE_PRIVATE int exprParseConcat(expr_parser *p){
+  int rc = exprParseUnary(p);
+  while( rc==SQLITE_OK && p->token==TK_CONCAT ){
+    exprNextToken(p);
+    rc = exprParseUnary(p);
+    if( rc==SQLITE_OK ) rc = exprEmit(p, EXPR_CONCAT, 0);
   }
+  return rc;
+}
 
-  assert( procedure!=NULL );
-
-  if ( procedure->aMem==NULL && v->aMem!=NULL ) {
-    // copy the aMem array to the procedure object
-    procedure->aMem = v->aMem;
-    procedure->nMem = v->nMem;
-    // clear the aMem array from the Vdbe object
-    v->aMem = NULL;
-    v->nMem = 0;
+/*
+** term: concat (("*" | "/" | "%") concat)*
+*/
+SQLITE_PRIVATE int exprParseTerm(expr_parser *p){
+  int rc = exprParseConcat(p);
+  while( rc==SQLITE_OK ){
+    u8 opcode;
+    switch( p->token ){
+      case TK_STAR:  opcode = EXPR_MUL; break;
+      case TK_SLASH: opcode = EXPR_DIV; break;
+      case TK_REM:   opcode = EXPR_REM; break;
+      default:       return SQLITE_OK;
+    }
+    exprNextToken(p);
+    rc = exprParseConcat(p);
+    if( rc==SQLITE_OK ) rc = exprEmit(p, opcode, 0);
   }
+  return rc;
+}
 
-  // release memory from the previous result set
-  if( v->aMem ){
-    // release each memory cell
-    for(i=0; i<v->nMem; i++){
-      sqlite3VdbeMemRelease(&v->aMem[i]);
-    }
-    // release the memory
-    sqlite3DbFree(v->db, v->aMem);
-    v->aMem = NULL;
-    v->nMem = 0;
+/*
+** sum: term (("+" | "-") term)*
+*/
+SQLITE_PRIVATE int exprParseSum(expr_parser *p){
+  int rc = exprParseTerm(p);
+  while( rc==SQLITE_OK && (p->token==TK_PLUS || p->token==TK_MINUS) ){
+    u8 opcode = (p->token==TK_PLUS) ? EXPR_ADD : EXPR_SUB;
+    exprNextToken(p);
+    rc = exprParseTerm(p);
+    if( rc==SQLITE_OK ) rc = exprEmit(p, opcode, 0);
   }
+  return rc;
+}
 
-  // if it returns an expression
-  if( cmd->sql!=NULL ){
-    // evaluate the expression
-    rc = execute_expression(v, cmd, NULL);
-    if( rc ) return rc;
+/*
+** comparison: sum (("<" | "<=" | ">" | ">=") sum)*
+*/
+SQLITE_PRIVATE int exprParseComparison(expr_parser *p){
+  int rc = exprParseSum(p);
+  while( rc==SQLITE_OK ){
+    u8 opcode;
+    switch( p->token ){
+      case TK_LT: opcode = EXPR_LT; break;
+      case TK_LE: opcode = EXPR_LE; break;
+      case TK_GT: opcode = EXPR_GT; break;
+      case TK_GE: opcode = EXPR_GE; break;
+      default:    return SQLITE_OK;
+    }
+    exprNextToken(p);
+    rc = exprParseSum(p);
+    if( rc==SQLITE_OK ) rc = exprEmit(p, opcode, 0);
   }
+  return rc;
+}
 
-  // if returning a result set (many rows)
-  if( cmd->num_vars==1 && is_list(&cmd->vars[0]->value) ){
-    // get the list
-    sqlite3_list *list = get_list_from_value(&cmd->vars[0]->value);
-    // get the number of rows
-    int num_rows = list->num_items;
-    // iterate the rows to get the maximum number of columns
-    int num_cols = 1;
-    for( i=0; i<num_rows; i++ ){
-      // get the list value
-      Mem *value = &list->value[i];
-      // get the list
-      sqlite3_list *row = get_list_from_value(value);
-      if( row ){
-        // get the number of columns
-        int row_num_cols = row->num_items;
-        // check if the number of columns is greater than the current maximum
-        if( row_num_cols>num_cols ){
-          num_cols = row_num_cols;
+/*
+** equality: comparison (("=" | "==" | "!=" | "<>" | "IS" ["NOT"]) comparison
+**                       | "ISNULL" | "NOTNULL" | "NOT NULL")*
+*/
+SQLITE_PRIVATE int exprParseEquality(expr_parser *p){
+  int rc = exprParseComparison(p);
+  while( rc==SQLITE_OK ){
+    u8 opcode;
+    switch( p->token ){
+      case TK_EQ:
+        opcode = EXPR_EQ;
+        break;
+      case TK_NE:
+        opcode = EXPR_NE;
+        break;
+      case TK_IS:
+        exprNextToken(p);
+        if( p->token==TK_NOT ){
+          exprNextToken(p);
+          opcode = EXPR_ISNOT;
+        }else{
+          opcode = EXPR_IS;
         }
-      }
-    }
-    // allocate the memory for the result set
-    v->nMem = num_cols + 1;  // v->aMem[0] is reserved
-    v->aMem = sqlite3DbMallocZero(v->db, sizeof(Mem) * v->nMem);
-    if( v->aMem==NULL ){
-      return SQLITE_NOMEM;
-    }
-    // initialize the memory cells
-    for(i=0; i<v->nMem; i++){
-      sqlite3VdbeMemInit(&v->aMem[i], v->db, MEM_Null);
-    }
-
-    // save the source list in the procedure object
-    procedure->result_list = list;
-    // save the position of the current row
-    procedure->current_row = -1;
-
-    // change the next opcode to OP_NextResult
-    sqlite3ChangeOpcode(v, POS_NEXT_RESULT, OP_NextResult, 0, POS_RESULT_ROW);
-
-    // it is also called by the OP_NextResult opcode:
-    sqlite3VdbeNextResult(v);
-
-  } else {
-
-    // allocate the memory for the result set
-    v->nMem = cmd->num_vars + 1;  // v->aMem[0] is reserved
-    v->aMem = sqlite3DbMallocZero(v->db, sizeof(Mem) * v->nMem);
-    if( v->aMem==0 ){
-      return SQLITE_NOMEM;
-    }
-    // initialize the memory cells
-    for(i=0; i<v->nMem; i++){
-      sqlite3VdbeMemInit(&v->aMem[i], v->db, MEM_Null);
-    }
-
-    // move the values from the variables to the result set
-    for( i=0; i<cmd->num_vars; i++ ){
-      sqlite3_value *value = &cmd->vars[i]->value;
-      // lists cannot be returned with multiple parameters
-      if( is_list(value) ){
-        // set the error message
-        sqlite3VdbeError(v, "cannot return a list with multiple parameters");
-        // return the error code
-        return SQLITE_ERROR;
-      }
-      // copy the value to the result set (aMem[0] is reserved)
-      XTRACE("copying value %lld\n", value->u.i);
-      sqlite3VdbeMemMove(&v->aMem[i+1], value);
-      //sqlite3VdbeMemShallowCopy(&v->aMem[i+1], value, MEM_Static);
-      //sqlite3VdbeMemCopy(&v->aMem[i+1], value);
+        rc = exprParseComparison(p);
+        if( rc==SQLITE_OK ) rc = exprEmit(p, opcode, 0);
+        continue;
+      case TK_ISNULL:
+        exprNextToken(p);
+        rc = exprEmit(p, EXPR_ISNULL, 0);
+        continue;
+      case TK_NOTNULL:
+        exprNextToken(p);
+        rc = exprEmit(p, EXPR_NOTNULL, 0);
+        continue;
+      case TK_NOT:
+        // only "NOT NULL" is supported here. NOT LIKE, NOT IN... are not
+        exprNextToken(p);
+        if( p->token!=TK_NULL ) return SQLITE_ERROR;
+        exprNextToken(p);
+        rc = exprEmit(p, EXPR_NOTNULL, 0);
+        continue;
+      default:
+        return SQLITE_OK;
     }
-
-    //v->nResColumn = cmd->num_vars;
-    sqlite3VdbeSetNumCols(v, cmd->num_vars);
-
-    // change the result opcode to OP_ResultRow
-    sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_ResultRow, 1, cmd->num_vars);
+    exprNextToken(p);
+    rc = exprParseComparison(p);
+    if( rc==SQLITE_OK ) rc = exprEmit(p, opcode, 0);
   }
-
   return rc;
 }
 
 /*
-** Execute a RAISE command.
+** not: "NOT" not | equality
 */
-SQLITE_PRIVATE int executeRaiseCommand(Vdbe *v, command *cmd) {
-  stored_proc *procedure = cmd->procedure;
-  sqlite3 *db = procedure->db;
-  char *sql, *msg=NULL;
-  int rc = SQLITE_OK;
-
-  // get the SQL statement
-  sql = sqlite3_mprintf("SELECT printf(%.*s)", cmd->nsql, cmd->sql);
-  if( sql==NULL ){
-    return SQLITE_NOMEM;
-  }
+SQLITE_PRIVATE int exprParseNot(expr_parser *p){
+  int rc;
 
-  // evaluate the expression
-  rc = db_query_str(procedure, sql, &msg);
-  sqlite3_free(sql);
-  if( rc ){
-    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
-    return rc;
+  if( p->token==TK_NOT ){
+    if( ++p->nesting>EXPR_MAX_NESTING ) return SQLITE_ERROR;
+    exprNextToken(p);
+    rc = exprParseNot(p);
+    if( rc ) return rc;
+    p->nesting--;
+    return exprEmit(p, EXPR_NOT, 0);
   }
 
-  // set the error message
-  sqlite3VdbeError(v, "%s", msg);
-  sqlite3_free(msg);
+  return exprParseEquality(p);
+}
 
-  // return the error code
+/*
+** and: not ("AND" not)*
+*/
+SQLITE_PRIVATE int exprParseAnd(expr_parser *p){
+  int rc = exprParseNot(p);
+  while( rc==SQLITE_OK && p->token==TK_AND ){
+    exprNextToken(p);
+    rc = exprParseNot(p);
+    if( rc==SQLITE_OK ) rc = exprEmit(p, EXPR_AND, 0);
+  }
   return rc;
 }
 
 /*
-** Execute an ASSERT statement.
+** expression: and ("OR" and)*
 */
-SQLITE_PRIVATE int executeAssertCommand(Vdbe *v, command *cmd) {
-  stored_proc *procedure = cmd->procedure;
-  sqlite3 *db = procedure->db;
-  char *sql, *msg=NULL;
-  int rc = SQLITE_OK;
-  bool result;
-
-  // evaluate the condition expression
-  rc = execute_expression(v, cmd, &result);
-  if (rc != SQLITE_OK) {
-    return rc;
+SQLITE_PRIVATE int exprParseOr(expr_parser *p){
+  int rc = exprParseAnd(p);
+  while( rc==SQLITE_OK && p->token==TK_OR ){
+    exprNextToken(p);
+    rc = exprParseAnd(p);
+    if( rc==SQLITE_OK ) rc = exprEmit(p, EXPR_OR, 0);
   }
-
-  // if the condition is true, we're done
-  if (result) {
-    return SQLITE_OK;
-  }
-
-  // condition failed - evaluate the error message expression
-  sql = sqlite3_mprintf("SELECT printf(%.*s)", cmd->nsql2, cmd->sql2);
-  if (sql == NULL) {
-    return SQLITE_NOMEM;
-  }
-
-  // get the formatted error message
-  rc = db_query_str(procedure, sql, &msg);
-  sqlite3_free(sql);
-  if (rc != SQLITE_OK) {
-    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
-    return rc;
-  }
-
-  // set the error message
-  sqlite3VdbeError(v, "Assertion failed: %s", msg);
-  sqlite3_free(msg);
-
-  // return the error code
-  return SQLITE_ERROR;
-}
+  return rc;
+}
 
 /*
-** Execute a statement command.
+** Release a native expression program.
 */
-SQLITE_PRIVATE int executeStatementCommand(Vdbe *v, command *cmd) {
-  stored_proc *procedure = cmd->procedure;
-  sqlite3 *db = procedure->db;
-  int rc = SQLITE_OK;
-
-  // reject transaction commands
-  if( cmd->sql[0]=='B' || cmd->sql[0]=='C' || cmd->sql[0]=='R' ||
-      cmd->sql[0]=='S' ){
-    if( (cmd->nsql>=5 && sqlite3_strnicmp(cmd->sql, "BEGIN", 5)==0) ||
-        (cmd->nsql>=6 && sqlite3_strnicmp(cmd->sql, "COMMIT", 6)==0) ||
-        (cmd->nsql>=8 && sqlite3_strnicmp(cmd->sql, "ROLLBACK", 8)==0) ||
-        (cmd->nsql>=8 && sqlite3_strnicmp(cmd->sql, "SAVEPOINT", 8)==0) ||
-        (cmd->nsql>=7 && sqlite3_strnicmp(cmd->sql, "RELEASE", 7)==0) ){
-      // set the error message
-      sqlite3VdbeError(v, "transaction commands are not allowed in stored procedures");
-      // return the error code
-      return SQLITE_ERROR;
-    }
-  }else
-  if( cmd->sql[0]=='A' || cmd->sql[0]=='D' ){
-    if( (cmd->nsql>=6 && sqlite3_strnicmp(cmd->sql, "ATTACH", 6)==0) ||
-        (cmd->nsql>=6 && sqlite3_strnicmp(cmd->sql, "DETACH", 6)==0) ){
-      // set the error message
-      sqlite3VdbeError(v, "attach/detach commands are not allowed in stored procedures");
-      // return the error code
-      return SQLITE_ERROR;
-    }
+SQLITE_PRIVATE void releaseNativeExpression(native_expr *expr){
+  int i;
+  for( i=0; i<expr->num_literals; i++ ){
+    sqlite3VdbeMemRelease(&expr->literals[i]);
   }
-
-  // prepare the statement if it is not prepared yet
-  if( cmd->stmt==NULL ){
-    // parse the SQL statement
-    rc = sqlite3_prepare_v2(db, cmd->sql, cmd->nsql, &cmd->stmt, NULL);
-    if( rc!=SQLITE_OK ){
-      goto loc_error;
+  if( expr->stack ){
+    for( i=0; i<expr->max_depth; i++ ){
+      sqlite3VdbeMemRelease(&expr->stack[i]);
     }
   }
+  sqlite3_free(expr->literals);
+  sqlite3_free(expr->stack);
+  sqlite3_free(expr->ops);
+  sqlite3_free(expr);
+}
 
-  // bind local variable values used on the prepared statement
-  if( procedure->vars!=NULL ){
-    bindLocalVariables(procedure, cmd->stmt);
-  }
+/*
+** Compile the expression to a native program and store it on the command
+** state. Returns SQLITE_ERROR if the expression is not supported.
+*/
+SQLITE_PRIVATE int compileNativeExpression(
+  call_frame *frame, cmd_state *state, char *sql, int nsql
+){
+  native_expr *expr;
+  expr_parser p;
+  int rc, i;
+
+  expr = sqlite3MallocZero(sizeof(native_expr));
+  if( !expr ) return SQLITE_NOMEM;
+
+  memset(&p, 0, sizeof(expr_parser));
+  p.frame = frame;
+  p.expr = expr;
+  p.sql = sql;
+  p.end = sql + nsql;
+
+  exprNextToken(&p);
+  rc = exprParseOr(&p);
+  // the whole expression must be consumed
+  if( rc==SQLITE_OK && p.token!=0 ) rc = SQLITE_ERROR;
+  if( rc ) goto loc_exit;
 
-  // execute the prepared statement
-  do {
-    rc = sqlite3_step(cmd->stmt);
-  } while (rc == SQLITE_ROW);
+  assert( p.depth==1 );
 
-  // if the statement was executed successfully, set the return code to SQLITE_OK
-  if( rc==SQLITE_DONE ){
-    rc = SQLITE_OK;
+  // allocate the evaluation stack
+  expr->stack = sqlite3MallocZero(expr->max_depth * sizeof(Mem));
+  if( !expr->stack ){
+    rc = SQLITE_NOMEM;
+    goto loc_exit;
   }
-
-  // reset the prepared statement
-  sqlite3_reset(cmd->stmt);
-
-  // check if there was an error
-  if( rc!=SQLITE_OK ){
-    goto loc_error;
+  for( i=0; i<expr->max_depth; i++ ){
+    sqlite3VdbeMemInit(&expr->stack[i], frame->db, MEM_Null);
   }
 
-  return rc;
+  state->expr = expr;
 
-loc_error:
-  // if there was an error, set the error message
-  if( v->zErrMsg==NULL ){
-    //
+loc_exit:
+  if( rc ){
+    // the error is reported if the expression is evaluated by SQLite
+    releaseNativeExpression(expr);
   }
-  // return the error code
   return rc;
 }
 
 /*
-** Execute a SET command.
+** Execute an arithmetic operation, storing the result on the first operand.
+** Returns SQLITE_MISMATCH if an operand must be converted by SQLite.
 */
-SQLITE_PRIVATE int executeSetCommand(Vdbe *v, command *cmd) {
-  stored_proc *procedure = cmd->procedure;
-  int rc = SQLITE_OK;
-
-  // similar to the STATEMENT command: execute the prepared statement and store
-  // the returned values in the defined variables
-
-  sqlite3_list *parent_list = NULL;
-  void (*free_func)(sqlite3_list*) = sqlite3_free_list;
-  int num_rows = 0;
-
-  if (cmd->flags & CMD_FLAG_STORE_AS_LIST) {
-    // exactly one variable to store the list
-    if( cmd->num_vars != 1 ){
-      sqlite3VdbeError(v, "expected a single variable to store the result");
-      rc = SQLITE_ERROR;
-      goto loc_exit;
+SQLITE_PRIVATE int exprArithmetic(u8 opcode, Mem *a, Mem *b){
+  int type_a = sqlite3_value_type(a);
+  int type_b = sqlite3_value_type(b);
+  double r1, r2;
+
+  if( type_a==SQLITE_NULL || type_b==SQLITE_NULL ) goto loc_null;
+  if( type_a!=SQLITE_INTEGER && type_a!=SQLITE_FLOAT ) return SQLITE_MISMATCH;
+  if( type_b!=SQLITE_INTEGER && type_b!=SQLITE_FLOAT ) return SQLITE_MISMATCH;
+
+  if( type_a==SQLITE_INTEGER && type_b==SQLITE_INTEGER ){
+    i64 i1 = sqlite3_value_int64(a);
+    i64 i2 = sqlite3_value_int64(b);
+    switch( opcode ){
+      case EXPR_ADD: if( sqlite3AddInt64(&i1, i2) ) goto loc_real; break;
+      case EXPR_SUB: if( sqlite3SubInt64(&i1, i2) ) goto loc_real; break;
+      case EXPR_MUL: if( sqlite3MulInt64(&i1, i2) ) goto loc_real; break;
+      case EXPR_DIV:
+        if( i2==0 ) goto loc_null;
+        if( i2==-1 && i1==SMALLEST_INT64 ) goto loc_real;
+        i1 /= i2;
+        break;
+      default:
+        if( i2==0 ) goto loc_null;
+        if( i2==-1 ) i2 = 1;
+        i1 %= i2;
+        break;
     }
+    sqlite3VdbeMemSetInt64(a, i1);
+    return SQLITE_OK;
   }
 
-  // is the input a LIST?
-  if (cmd->input_list != NULL) {
-    assert(cmd->stmt == NULL);
-    assert(cmd->flags & CMD_FLAG_STORE_AS_LIST);
-    // get the pointer to the input list
-    parent_list = cmd->input_list;
-    // do not release it if the variable is set to another value
-    free_func = NULL;
-    // make the variable point to the input list
-    goto loc_set_values;
+loc_real:
+  r1 = sqlite3_value_double(a);
+  r2 = sqlite3_value_double(b);
+  switch( opcode ){
+    case EXPR_ADD: r1 += r2; break;
+    case EXPR_SUB: r1 -= r2; break;
+    case EXPR_MUL: r1 *= r2; break;
+    case EXPR_DIV:
+      if( r2==(double)0 ) goto loc_null;
+      r1 /= r2;
+      break;
+    default: {
+      i64 i1 = sqlite3_value_int64(a);
+      i64 i2 = sqlite3_value_int64(b);
+      if( i2==0 ) goto loc_null;
+      if( i2==-1 ) i2 = 1;
+      r1 = (double)(i1 % i2);
+      break;
+    }
   }
+  if( sqlite3IsNaN(r1) ) goto loc_null;
+  sqlite3VdbeMemSetDouble(a, r1);
+  return SQLITE_OK;
 
-  // then the input must be a SQL statement
+loc_null:
+  sqlite3VdbeMemSetNull(a);
+  return SQLITE_OK;
+}
 
-  // check if the prepared statement is available
-  if( cmd->stmt == NULL ){
-    char *new_sql = NULL;
-    char *sql = cmd->sql;
-    int nsql = cmd->nsql;
-    int n, tokenType;
-    /* Read the next token */
-    n = sqlite3GetToken((u8*)sql, &tokenType);
-    if( n > cmd->nsql ){
-      // this should not happen
-      sqlite3VdbeError(v, "invalid token: %s", sql);
-      rc = SQLITE_ERROR;
-      goto loc_exit;
-    }
-    //keywordCode(sql, n, &tokenType);
-    if( tokenType==TK_ID ){
-      // check if it is a CALL, then set tokenType to TK_CALL
-      if( n==4 && sqlite3_strnicmp(sql, "CALL", 4)==0 ){
-        tokenType = TK_CALL;
-      }
-    }
-    switch( tokenType ){
-      case TK_SELECT:
-      case TK_INSERT:
-      case TK_UPDATE:
-      case TK_DELETE:
-      case TK_CALL:
-        // just use the statement as it is
-        break;
-      default:
-        // otherwise, add "SELECT " to the beginning of the statement
-        new_sql = sqlite3_mprintf("SELECT %s", sql);
-        if( !new_sql ){
-          sqlite3VdbeError(v, "out of memory");
-          rc = SQLITE_NOMEM;
-          goto loc_exit;
-        }
-        sql = new_sql;
-        nsql = strlen(sql);
-    }
-    // parse the statement
-    rc = sqlite3_prepare_v2(procedure->db, sql, nsql, &cmd->stmt, NULL);
-    if (new_sql) sqlite3_free(new_sql);
-    if (rc != SQLITE_OK) {
-      sqlite3VdbeError(v, "error parsing statement: %s", sqlite3_errmsg(procedure->db));
-      goto loc_exit;
-    }
-    if (cmd->stmt == NULL) {
-      sqlite3VdbeError(v, "SET command without input");
-      rc = SQLITE_ERROR;
-      goto loc_exit;
-    }
+/*
+** Concatenate 2 values, storing the result on the first operand.
+*/
+SQLITE_PRIVATE int exprConcat(Mem *a, Mem *b){
+  const char *z1, *z2;
+  char *result;
+  int n1, n2;
 
-  }else{
-    // reset the prepared statement
-    sqlite3_reset(cmd->stmt);
+  if( sqlite3_value_type(a)==SQLITE_NULL || sqlite3_value_type(b)==SQLITE_NULL ){
+    sqlite3VdbeMemSetNull(a);
+    return SQLITE_OK;
   }
-
-  // bind local variable values used on the prepared statement
-  if( procedure->vars!=NULL ){
-    bindLocalVariables(procedure, cmd->stmt);
+  if( sqlite3_value_type(a)==SQLITE_BLOB || sqlite3_value_type(b)==SQLITE_BLOB ){
+    return SQLITE_MISMATCH;
   }
 
-  // execute the prepared statement
-  do {
-    rc = sqlite3_step(cmd->stmt);
-    if (rc == SQLITE_ROW) {
-      // get the number of columns returned
-      int num_cols = sqlite3_column_count(cmd->stmt);
-      if (num_cols == 0) {
-        sqlite3VdbeError(v, "no columns returned");
-        rc = SQLITE_ERROR;
-        goto loc_exit;
-      }
-      // increment the number of rows returned
-      num_rows++;
-      // if the statement is expected to return many rows, store them on a list variable
-      if (cmd->flags & CMD_FLAG_STORE_AS_LIST) {
+  z1 = (const char*) sqlite3_value_text(a);
+  n1 = sqlite3_value_bytes(a);
+  z2 = (const char*) sqlite3_value_text(b);
+  n2 = sqlite3_value_bytes(b);
+  if( !z1 || !z2 ) return SQLITE_NOMEM;
 
-        // allocate an sqlite3_list object with the proper number of values
-        sqlite3_list *list = (sqlite3_list*) sqlite3MallocZero(
-            sizeof(sqlite3_list) + sizeof(sqlite3_value) * (num_cols-1));
-        if (list == NULL) {
-          rc = SQLITE_NOMEM;
-          goto loc_exit;
-        }
-        // store the number of items in the list
-        list->num_items = num_cols;
-        // store the result in the list
-        for (int ncol = 0; ncol < num_cols; ncol++) {
-          sqlite3_value *list_value = &list->value[ncol];
-          sqlite3_value *col_value = sqlite3_column_value(cmd->stmt, ncol);
-          sqlite3VdbeMemInit(list_value, procedure->db, MEM_Null);
-          sqlite3VdbeMemCopy(list_value, col_value);
-        }
+  result = sqlite3DbMallocRawNN(a->db, n1 + n2 + 1);
+  if( !result ) return SQLITE_NOMEM;
+  memcpy(result, z1, n1);
+  memcpy(result + n1, z2, n2);
+  result[n1 + n2] = 0;
 
-        // prepare to store the list in the parent list
-        if( parent_list==NULL ){
-          // allocate the parent list
-          parent_list = (sqlite3_list*) sqlite3MallocZero(sizeof(sqlite3_list));
-          if( parent_list==NULL ){
-            sqlite3_free(list);
-            rc = SQLITE_NOMEM;
-            goto loc_exit;
-          }
-          parent_list->num_items = 1;
-        }else{
-          // allocate more space
-          sqlite3_list *new_list = (sqlite3_list*) sqlite3Realloc(
-              parent_list, sizeof(sqlite3_list) +
-              (sizeof(sqlite3_value) * parent_list->num_items));
-          if( new_list==NULL ){
-            sqlite3_free(list);
-            rc = SQLITE_NOMEM;
-            goto loc_exit;
+  return sqlite3VdbeMemSetStr(a, result, n1 + n2, SQLITE_UTF8, SQLITE_DYNAMIC);
+}
+
+/*
+** Evaluate a native expression program. On success the result is stored on
+** the first cell of the stack, that is returned on presult.
+** Returns SQLITE_MISMATCH if the expression must be evaluated by SQLite.
+*/
+SQLITE_PRIVATE int evaluateNativeExpression(
+  call_frame *frame, native_expr *expr, Mem **presult
+){
+  // truth tables for AND and OR. 0 = false, 1 = true, 2 = NULL
+  static const unsigned char and_logic[] = { 0, 0, 0, 0, 1, 2, 0, 2, 2 };
+  static const unsigned char or_logic[] = { 0, 1, 2, 1, 1, 1, 2, 1, 2 };
+  Mem *stack = expr->stack;
+  int sp = -1;
+  int i, rc;
+
+  for( i=0; i<expr->num_ops; i++ ){
+    expr_op *op = &expr->ops[i];
+    Mem *a, *b;
+    int res;
+
+    switch( op->opcode ){
+      case EXPR_VARIABLE: {
+        Mem *value = variableValue(frame, op->p1);
+        // lists are handled by SQLite
+        if( is_list(value) ) return SQLITE_MISMATCH;
+        sqlite3VdbeMemShallowCopy(&stack[++sp], value, MEM_Ephem);
+        break;
+      }
+      case EXPR_LITERAL:
+        sqlite3VdbeMemShallowCopy(&stack[++sp], &expr->literals[op->p1], MEM_Static);
+        break;
+
+      case EXPR_NEGATIVE:
+        a = &stack[sp];
+        switch( sqlite3_value_type(a) ){
+          case SQLITE_NULL:
+            break;
+          case SQLITE_INTEGER: {
+            i64 value = sqlite3_value_int64(a);
+            if( value==SMALLEST_INT64 ){
+              sqlite3VdbeMemSetDouble(a, -(double)value);
+            }else{
+              sqlite3VdbeMemSetInt64(a, -value);
+            }
+            break;
           }
-          parent_list = new_list;
-          parent_list->num_items++;
+          case SQLITE_FLOAT:
+            sqlite3VdbeMemSetDouble(a, -sqlite3_value_double(a));
+            break;
+          default:
+            return SQLITE_MISMATCH;
         }
-        // store the list in the parent list
-        sqlite3_value *value = &parent_list->value[parent_list->num_items-1];
-        sqlite3VdbeMemInit(value, procedure->db, MEM_Null);
-        sqlite3ValueSetList(value, list, sqlite3_free_list);
+        break;
+      case EXPR_NOT:
+        a = &stack[sp];
+        if( sqlite3_value_type(a)!=SQLITE_NULL ){
+          sqlite3VdbeMemSetInt64(a, !sqlite3VdbeBooleanValue(a, 0));
+        }
+        break;
+      case EXPR_ISNULL:
+      case EXPR_NOTNULL:
+        a = &stack[sp];
+        res = (sqlite3_value_type(a)==SQLITE_NULL);
+        sqlite3VdbeMemSetInt64(a, (op->opcode==EXPR_ISNULL) ? res : !res);
+        break;
 
-      } else {
+      case EXPR_ADD:
+      case EXPR_SUB:
+      case EXPR_MUL:
+      case EXPR_DIV:
+      case EXPR_REM:
+        b = &stack[sp--];
+        a = &stack[sp];
+        rc = exprArithmetic(op->opcode, a, b);
+        if( rc ) return rc;
+        break;
+      case EXPR_CONCAT:
+        b = &stack[sp--];
+        a = &stack[sp];
+        rc = exprConcat(a, b);
+        if( rc ) return rc;
+        break;
 
-        // throw an error if more than one row is returned
-        if( num_rows>1 ){
-          sqlite3VdbeError(v, "statement returns more than one row");
-          rc = SQLITE_ERROR;
-          goto loc_exit;
+      case EXPR_EQ:
+      case EXPR_NE:
+      case EXPR_LT:
+      case EXPR_LE:
+      case EXPR_GT:
+      case EXPR_GE:
+        b = &stack[sp--];
+        a = &stack[sp];
+        if( sqlite3_value_type(a)==SQLITE_NULL || sqlite3_value_type(b)==SQLITE_NULL ){
+          sqlite3VdbeMemSetNull(a);
+          break;
         }
-
-        // check the number of columns returned
-        if( num_cols!=cmd->num_vars ){
-          sqlite3VdbeError(v, "statement returns %d values but has %d variables to set",
-                              num_cols, cmd->num_vars);
-          rc = SQLITE_ERROR;
-          goto loc_exit;
+        res = sqlite3MemCompare(a, b, 0);
+        switch( op->opcode ){
+          case EXPR_EQ: res = (res==0); break;
+          case EXPR_NE: res = (res!=0); break;
+          case EXPR_LT: res = (res<0);  break;
+          case EXPR_LE: res = (res<=0); break;
+          case EXPR_GT: res = (res>0);  break;
+          default:      res = (res>=0); break;
         }
-
-        // store the result in the defined variables
-        for( int ncol=0; ncol<cmd->num_vars; ncol++ ){
-          sqlite3_var *var = cmd->vars[ncol];
-          sqlite3_value *col_value = sqlite3_column_value(cmd->stmt, ncol);
-          sqlite3VdbeMemCopy(&var->value, col_value);
-          if( var->type==SQLITE_AFF_REAL ){
-            sqlite3_value_numeric_type(&var->value);
-          }else if( var->type!=0 && var->type!=SQLITE_AFF_BLOB ){
-            sqlite3ValueApplyAffinity(&var->value, var->type, SQLITE_UTF8);  // or ENC(db)
-          }
+        sqlite3VdbeMemSetInt64(a, res);
+        break;
+      case EXPR_IS:
+      case EXPR_ISNOT: {
+        int null_a, null_b;
+        b = &stack[sp--];
+        a = &stack[sp];
+        null_a = (sqlite3_value_type(a)==SQLITE_NULL);
+        null_b = (sqlite3_value_type(b)==SQLITE_NULL);
+        if( null_a || null_b ){
+          res = (null_a && null_b);
+        }else{
+          res = (sqlite3MemCompare(a, b, 0)==0);
         }
+        sqlite3VdbeMemSetInt64(a, (op->opcode==EXPR_IS) ? res : !res);
+        break;
+      }
 
+      case EXPR_AND:
+      case EXPR_OR: {
+        int v1, v2;
+        b = &stack[sp--];
+        a = &stack[sp];
+        v1 = sqlite3VdbeBooleanValue(a, 2);
+        v2 = sqlite3VdbeBooleanValue(b, 2);
+        if( op->opcode==EXPR_AND ){
+          res = and_logic[v1*3+v2];
+        }else{
+          res = or_logic[v1*3+v2];
+        }
+        if( res==2 ){
+          sqlite3VdbeMemSetNull(a);
+        }else{
+          sqlite3VdbeMemSetInt64(a, res);
+        }
+        break;
       }
 
+      default:
+        return SQLITE_MISMATCH;
     }
-  } while (rc == SQLITE_ROW);
-
-  if (rc == SQLITE_DONE) {
-    rc = SQLITE_OK;
   }
 
-  // check if the statement was executed successfully
-  if (rc != SQLITE_OK) {
-    goto loc_error;
-  }
+  assert( sp==0 );
+  *presult = &stack[0];
+  return SQLITE_OK;
+}
 
-  // reset the prepared statement
-  //sqlite3_reset(cmd->stmt);
+/*
+** Evaluate the expression of a command without SQLite, if it is simple enough.
+** The expression is compiled on the first execution. Returns SQLITE_OK with
+** presult set to NULL when the expression must be evaluated by SQLite.
+*/
+SQLITE_PRIVATE int executeNativeExpression(
+  call_frame *frame, command *cmd, char *sql, int nsql, Mem **presult
+){
+  cmd_state *state = commandState(frame, cmd);
+  int rc;
 
-loc_set_values:
+  *presult = NULL;
 
-  if (cmd->flags & CMD_FLAG_STORE_AS_LIST) {
-    // store the parent list in the defined variable
-    sqlite3_var *var = cmd->vars[0];
-    if (parent_list) {
-      sqlite3ValueSetList(&var->value, parent_list, free_func);
-    } else {
-      // no row was returned
-      sqlite3VdbeMemSetNull(&var->value);
-    }
-  } else {
-    // if there is no returned rows, set the defined variables to NULL
-    if (num_rows == 0) {
-      for (int nvar = 0; nvar < cmd->num_vars; nvar++) {
-        sqlite3_var *var = cmd->vars[nvar];
-        sqlite3VdbeMemSetNull(&var->value);
-      }
+  if( (state->flags & CMD_FLAG_EXPR_CHECKED)==0 ){
+    state->flags |= CMD_FLAG_EXPR_CHECKED;
+    if( compileNativeExpression(frame, state, sql, nsql)==SQLITE_OK ){
+      state->flags |= CMD_FLAG_NATIVE_EXPR;
     }
   }
 
-loc_exit:
-  // in case of error, release allocated resources
-  //! TODO
-  return rc;
-loc_error:
-  if( rc==SQLITE_OK ) rc = SQLITE_ERROR;
-  if( v->zErrMsg==NULL ){
-  //sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
-    sqlite3VdbeError(v, "%s", sqlite3ErrStr(rc));
+  if( (state->flags & CMD_FLAG_NATIVE_EXPR)==0 ){
+    return SQLITE_OK;
   }
-  goto loc_exit;
+
+  rc = evaluateNativeExpression(frame, state->expr, presult);
+  if( rc==SQLITE_MISMATCH ){
+    // the values need conversions done by SQLite. use it from now on
+    state->flags &= ~CMD_FLAG_NATIVE_EXPR;
+    *presult = NULL;
+    rc = SQLITE_OK;
+  }
+  return rc;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// PROCEDURE EXECUTION
+////////////////////////////////////////////////////////////////////////////////
+
 /*
-** Execute a foreach command.
-** Retrieve the next item from the list or the next row from the SQL statement
-** and save the result in the defined variables.
-** If there is a new row, return SQLITE_ROW. Otherwise, return SQLITE_DONE.
-**
-** Check if already executing using the cmd->current_item variable. Use it as the
-** index of the next item to retrieve from the list. For SQL statements, just
-** call sqlite3_step() to retrieve the next row and increment the cmd->current_item.
-** The input is a list if cmd->input_list is not NULL.
-** The input is a SQL statement if cmd->sql is not NULL.
-** If the input is a SQL statement, parse it into the cmd->stmt variable if not yet done.
+** Execute an expression and return the result.
 */
-SQLITE_PRIVATE int executeForeachCommand(Vdbe *v, stored_proc *procedure, command *cmd) {
-  sqlite3 *db = v->db;
+SQLITE_PRIVATE int execute_expression(
+  Vdbe *v, call_frame *frame, command *cmd, bool* bool_result
+){
+  cmd_state *state = commandState(frame, cmd);
   int rc = SQLITE_OK;
-  int num_cols = 0;
-  sqlite3_list *input_list = NULL;
-  sqlite3_value *row_value = NULL;
-  sqlite3_list *row_list = NULL;
-  bool has_dynamic_values = false;
+  sqlite3* db = v->db;
+  Mem *result;
 
-  if (cmd->input_var) {
-    // retrieve the list from the input variable
-    input_list = get_list_from_value(&cmd->input_var->value);
-    if (input_list == NULL) {
-      sqlite3VdbeError(v, "the input variable %s does not contain a list",
-                          cmd->input_var->name);
-      goto loc_error;
+  // simple expressions are evaluated without a prepared statement
+  if( (state->flags & CMD_FLAG_DYNAMIC_SQL)==0 && (cmd->flags & CMD_FLAG_RETURN_ROWS)==0 ){
+    rc = executeNativeExpression(frame, cmd, cmd->sql, cmd->nsql, &result);
+    if( rc ) return rc;
+    if( result ){
+      int slot;
+      if( bool_result ){
+        *bool_result = sqlite3_value_int(result);
+        return SQLITE_OK;
+      }
+      // the result is stored on a reserved variable
+      if( state->vars==NULL || state->num_vars!=1 ){
+        sqlite3_free(state->vars);
+        state->num_vars = 0;
+        state->vars = sqlite3_malloc( sizeof(int) );
+        if( !state->vars ) return SQLITE_NOMEM;
+        slot = addFrameVariable(frame, "(expression)", 12);
+        if( slot<0 ) return SQLITE_NOMEM;
+        state->vars[0] = slot;
+        state->num_vars = 1;
+      }
+      slot = state->vars[0];
+      // the result can point to the value of a variable
+      rc = sqlite3VdbeMemMakeWriteable(result);
+      if( rc ) return rc;
+      sqlite3VdbeMemMove(variableValue(frame, slot), result);
+      variableChanged(frame, slot);
+      return SQLITE_OK;
     }
-  } else if (cmd->input_list) {
-    input_list = cmd->input_list;
   }
 
-  // retrieve the next item from the list or the next row from the SQL statement
-  if (input_list) {
-    if (cmd->current_item >= input_list->num_items) {
-      // no more items
-      cmd->current_item = 0;
-      rc = SQLITE_DONE;
-      goto loc_exit;
+  // if the CMD_FLAG_DYNAMIC_SQL is not set
+  if( (state->flags & CMD_FLAG_DYNAMIC_SQL)==0 ){
+    // add "SELECT" to the expression. the parsed command is not modified.
+    // a returned statement (on stored functions) is used as it is
+    if( cmd->flags & CMD_FLAG_RETURN_ROWS ){
+      state->sql = sqlite3_mprintf("%.*s", cmd->nsql, cmd->sql);
+      state->nsql = cmd->nsql;
+    }else{
+      state->sql = sqlite3_mprintf("SELECT %.*s", cmd->nsql, cmd->sql);
+      state->nsql = cmd->nsql + 7;
     }
-    // retrieve the next item from the list
-    row_value = &input_list->value[cmd->current_item];
-    // if the row contains a list, retrieve it
-    row_list = get_list_from_value(row_value);
-    // increment the current item
-    cmd->current_item++;
+    if( state->sql==NULL ) return SQLITE_NOMEM;
+    // mark that this SQL command string is dynamically allocated
+    state->flags |= CMD_FLAG_DYNAMIC_SQL;
+  }
+
+  if( state->stmt==NULL ){
+    // prepare the expression or take it from the statement pool
+    rc = prepareCommand(frame, cmd, state->sql, state->nsql);
   } else {
-    // retrieve the next row from the SQL statement
-    if (cmd->current_item == 0) {
-      if (cmd->stmt == NULL) {
-        // parse the SQL statement
-        rc = sqlite3_prepare_v2(db, cmd->sql, cmd->nsql, &cmd->stmt, NULL);
-        if (rc != SQLITE_OK) {
-          goto loc_error;
-        }
-      } else {
-        // reset the prepared statement
-        sqlite3_reset(cmd->stmt);
+    // reset the statement
+    rc = sqlite3_reset(state->stmt);
+  }
+  if( rc ) goto loc_error;
+
+  // bind variables
+  bindCommandVariables(frame, state);
+
+  // execute the expression
+  rc = sqlite3_step(state->stmt);
+  if( rc!=SQLITE_ROW ){
+    sqlite3VdbeError(v, "expression did not return a result");
+    goto loc_error;
+  }
+
+  // get the result
+  if( bool_result ) {
+    *bool_result = sqlite3_column_int(state->stmt, 0);
+  }else{
+    int slot;
+    // get the number of result columns
+    int num_cols = sqlite3_column_count(state->stmt);
+    if( num_cols==0 ){
+      sqlite3VdbeError(v, "expression did not return a result");
+      goto loc_error;
+    }
+    // allocate variables to store the result. the array is kept on the
+    // command state, so it is only allocated again if the number of columns
+    // changes
+    if( state->vars==NULL || state->num_vars!=num_cols ){
+      sqlite3_free(state->vars);
+      state->num_vars = 0;
+      state->vars = sqlite3_malloc( num_cols * sizeof(int) );
+      if( !state->vars ) return SQLITE_NOMEM;
+      state->num_vars = num_cols;
+    }
+    // for each result column
+    for(int i=0; i<num_cols; i++){
+      char buf[32];
+      // get the column name
+      char *name = (char*) sqlite3_column_name(state->stmt, i);
+      if( !name ){
+        // if the column name is not available, use the column index
+        sprintf(buf, "col%d", i+1);
+        name = buf;
       }
-      // bind the variables
-      bindLocalVariables(procedure, cmd->stmt);
+      // create a new variable
+      slot = addFrameVariable(frame, name, strlen(name));
+      if( slot<0 ) return SQLITE_NOMEM;
+      state->vars[i] = slot;
+      // get the column value
+      sqlite3_value *value = sqlite3_column_value(state->stmt, i);
+      // move the column value to the variable. it can point to the arena
+      // of a nested CALL, which is reused on the next execution
+      rc = moveValue(variableValue(frame, slot), value);
+      variableChanged(frame, slot);
+      if( rc ) goto loc_error;
     }
-    // execute the SQL statement
-    rc = sqlite3_step(cmd->stmt);
-    if (rc == SQLITE_ROW) {
-      // increment the current item
-      cmd->current_item++;
-    } else if (rc == SQLITE_DONE) {
-      // no more rows
-      cmd->current_item = 0;
-      goto loc_exit;
+  }
+
+  // make sure the statement returns no more rows
+  rc = sqlite3_step(state->stmt);
+  if( rc==SQLITE_ROW ){
+    sqlite3VdbeError(v, "expression returned more than one row");
+    goto loc_error;
+  }else if( rc!=SQLITE_DONE ){
+    goto loc_error;
+  }
+
+  return SQLITE_OK;
+loc_error:
+  if( v->zErrMsg==NULL ){
+    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
+  }
+  return rc;
+}
+
+SQLITE_PRIVATE int db_query_str(call_frame *frame, char *sql, char **presult){
+  sqlite3* db = frame->db;
+  sqlite3_stmt *stmt = NULL;
+  int rc = SQLITE_OK;
+
+  // prepare the expression
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if( rc ) goto loc_exit;
+
+  // bind variables
+  bindLocalVariables(frame, stmt);
+
+  // execute the expression
+  rc = sqlite3_step(stmt);
+  if( rc!=SQLITE_ROW ){
+    if( rc==SQLITE_DONE ){
+      rc = SQLITE_ERROR;
+    }
+    goto loc_exit;
+  }
+
+  // get the result
+  *presult = sqlite3StrDup((char*)sqlite3_column_text(stmt, 0));
+
+  // make sure the statement returns no more rows
+  rc = sqlite3_step(stmt);
+  if( rc==SQLITE_ROW ){
+    rc = SQLITE_ERROR;
+  }else if( rc==SQLITE_DONE ){
+    rc = SQLITE_OK;
+  }
+
+loc_exit:
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+/*
+** Copy the values from the input list to the procedure parameters. The
+** lists are shared with the parameters, like on FOREACH, so they are not
+** copied. The input list is not modified.
+*/
+SQLITE_PRIVATE void copyProcedureParameters(Vdbe *v, procedure_call *call) {
+  call_frame *frame = call->frame;
+  stored_proc *procedure = frame->procedure;
+  sqlite3_list *input_list = call->input_list;
+  int pos;
+
+  assert(input_list->num_items == procedure->num_params);
+
+  // iterate the input list
+  for (pos = 0; pos < input_list->num_items; pos++) {
+    // get the parameter value
+    Mem *param = variableValue(frame, procedure->params[pos]);
+    Mem *input;
+    sqlite3_list *list;
+    variableChanged(frame, procedure->params[pos]);
+
+    // get the input value: a bound variable, or an item of the parsed list.
+    // the packed items are stored directly on the parameter
+    if (call->var_numbers && call->var_numbers[pos] > 0) {
+      assert(v->aVar!=0 && call->var_numbers[pos]<=v->nVar);
+      input = &v->aVar[call->var_numbers[pos] - 1];
     } else {
-      goto loc_error;
+      input = listItem(input_list, pos, param);
     }
-    // if no variables are defined, retrieve them from the SQL statement
-    if (cmd->num_vars==0) {
-      has_dynamic_values = true;
+
+    // share the lists, and copy the other values to the parameter
+    list = input != param ? get_list_from_value(input) : NULL;
+    if (list) {
+      shareListValue(frame, param, list);
+    } else if (input != param) {
+      sqlite3VdbeMemShallowCopy(param, input, MEM_Static);
     }
+#ifdef SQLITE_DEBUG
+    printf("copyProcedureParameters() pos=%d value=", pos);
+    memTracePrint(param);
+    puts("");
+#endif
   }
 
-  // check the number of columns returned
-  if (row_list) {
-    num_cols = row_list->num_items;
-  } else if (row_value) {
-    num_cols = 1;
-  } else {
-    num_cols = sqlite3_column_count(cmd->stmt);
+}
+
+SQLITE_PRIVATE void sqlite3ChangeOpcode(Vdbe *v, int pos, int opcode, int p1, int p2){
+  VdbeOp *pOp = &v->aOp[pos];
+  pOp->opcode = opcode;
+  pOp->p1 = p1;
+  pOp->p2 = p2;
+}
+
+/*
+** Copy the current row of the returned statement to the result set. The
+** values are valid until the statement is stepped again, on the next row.
+*/
+SQLITE_PRIVATE void copyStatementRow(Vdbe *v, sqlite3_stmt *stmt, int num_cols){
+  int i;
+  for( i=0; i<num_cols; i++ ){
+    sqlite3_value *value = sqlite3_column_value(stmt, i);
+    sqlite3VdbeMemShallowCopy(&v->aMem[i+1], value, MEM_Ephem);
   }
-  if (num_cols != cmd->num_vars && has_dynamic_values==false) {
-    sqlite3VdbeError(v, "statement returns %d values but has %d variables to set",
-        num_cols, cmd->num_vars);
-    rc = SQLITE_ERROR;
-    goto loc_error;
+}
+
+/*
+** Step the statement of a RETURN command to the next row.
+*/
+SQLITE_PRIVATE int nextStatementResult(Vdbe *v, call_frame *frame){
+  sqlite3_stmt *stmt = frame->result_stmt;
+  int rc;
+
+  rc = sqlite3_step(stmt);
+  if( rc==SQLITE_ROW ){
+    copyStatementRow(v, stmt, sqlite3_column_count(stmt));
+    return SQLITE_ROW;
+  }
+  frame->result_stmt = NULL;
+  if( rc!=SQLITE_DONE ){
+    sqlite3VdbeError(v, "%s", sqlite3_errmsg(frame->db));
+  }
+  return rc;
+}
+
+/*
+** Continue the execution of a generator procedure, suspended by a RETURN
+** NEXT command. It returns SQLITE_ROW if the procedure returned a row, from
+** another RETURN NEXT or from a final RETURN, or SQLITE_DONE if it ended. An
+** error aborts the CALL statement, with the changes made since its start.
+*/
+SQLITE_PRIVATE int resumeProcedure(Vdbe *v, call_frame *frame){
+  int rc;
+
+  sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_Noop, 0, 0);
+
+  rc = executeProcedureBody(v, frame);
+  if( rc ) return rc;
+
+  if( v->aOp[POS_RESULT_ROW].opcode==OP_ResultRow ){
+    return SQLITE_ROW;
+  }
+  return SQLITE_DONE;
+}
+
+/*
+** Load the next row of the result set on the result opcode.
+*/
+SQLITE_PRIVATE int nextResultRow(Vdbe *v){
+  call_frame *frame = v->pCall->frame;
+  int num_cols = 0;
+  int i;
+
+  // the rows of a statement are read as they are requested
+  if( frame->result_stmt ){
+    return nextStatementResult(v, frame);
+  }
+
+  // a generator procedure runs until it returns the next row
+  if( frame->suspended ){
+    return resumeProcedure(v, frame);
+  }
+
+  // check if the procedure has a result set
+  sqlite3_list *list = frame->result_list;
+  if( !list ){
+    // no result set
+    return SQLITE_DONE;
+  }
+
+  // increment the current row
+  frame->current_row++;
+  // check if there are more rows to return
+  if( frame->current_row >= list->num_items ){
+    // no more rows
+    return SQLITE_DONE;
+  }
+
+  // get the list value. a packed item is stored directly on the result set
+  Mem *row_value = listItem(list, frame->current_row, &v->aMem[1]);
+
+  // check if it is a list
+  list = get_list_from_value(row_value);
+  if( list ){
+    // copy the values from the list to the result set
+    for( i=0; i<list->num_items; i++ ){
+      // get the list value
+      Mem *value = listItem(list, i, &v->aMem[i+1]);
+      // copy the value to the result set
+      if( value!=&v->aMem[i+1] ){
+        sqlite3VdbeMemShallowCopy(&v->aMem[i+1], value, MEM_Static);
+      }
+    }
+    num_cols = list->num_items;
+  } else {
+    // copy the value to the result set. the list can be a parsed one, shared
+    // with other call frames, so it is not modified
+    if( row_value!=&v->aMem[1] ){
+      sqlite3VdbeMemShallowCopy(&v->aMem[1], row_value, MEM_Static);
+    }
+    num_cols = 1;
   }
 
-//! should it allow overwrite the values of existing variables?
+  sqlite3VdbeSetNumCols(v, num_cols);
+  //sqlite3VdbeSetColName(v, 0, COLNAME_NAME, "rows deleted", SQLITE_STATIC);
+
+  // update the result opcode with the number of columns
+  sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_ResultRow, 1, num_cols);
+
+  return SQLITE_ROW;
+}
+
+/*
+** Set the OP_Halt that follows the OP_NextResult opcode to abort the CALL
+** statement with the given error, or to end it normally if rc is SQLITE_OK.
+** The rows read after the first one can fail, like when a streamed statement
+** or a resumed generator fails, and the OP_NextResult opcode ends the call on
+** any result other than SQLITE_ROW. Halting with OE_Abort makes sqlite3_step()
+** return the error, with the changes of the call rolled back.
+*/
+SQLITE_PRIVATE void setCallHaltError(Vdbe *v, int rc){
+  VdbeOp *pOp = &v->aOp[POS_NEXT_RESULT+1];
+
+  assert( pOp->opcode==OP_Halt );
+  if( pOp->p4type==P4_DYNAMIC ){
+    sqlite3DbFree(v->db, pOp->p4.z);
+  }
+  pOp->p4.z = NULL;
+  pOp->p4type = P4_NOTUSED;
+  sqlite3ChangeOpcode(v, POS_NEXT_RESULT+1, OP_Halt, rc, rc ? OE_Abort : 0);
+  if( rc ){
+    pOp->p4.z = sqlite3DbStrDup(v->db, v->zErrMsg ? v->zErrMsg : sqlite3ErrStr(rc));
+    if( pOp->p4.z ) pOp->p4type = P4_DYNAMIC;
+  }
+}
+
+/*
+** Called by the OP_NextResult opcode. The CALL ends when there are no more
+** rows, or with the error of the last row.
+*/
+SQLITE_PRIVATE int sqlite3VdbeNextResult(Vdbe *v){
+  call_frame *frame = v->pCall->frame;
+  int rc = nextResultRow(v);
+  if( rc!=SQLITE_ROW && frame->call_start ){
+    recordCallLatency(frame);
+  }
+  if( rc!=SQLITE_ROW && rc!=SQLITE_DONE ){
+    setCallHaltError(v, rc);
+  }
+  return rc;
+}
+
+/*
+** Release the memory cells of the previous result row. The aMem array of
+** the Vdbe is kept on the call frame, to be restored when it is reset.
+*/
+SQLITE_PRIVATE void releaseResultRow(Vdbe *v, call_frame *frame) {
+  int i;
+
+  if ( frame->aMem==NULL && v->aMem!=NULL ) {
+    // copy the aMem array to the call frame
+    frame->aMem = v->aMem;
+    frame->nMem = v->nMem;
+    // clear the aMem array from the Vdbe object
+    v->aMem = NULL;
+    v->nMem = 0;
+  }
+
+  // release memory from the previous result set
+  if( v->aMem ){
+    // release each memory cell
+    for(i=0; i<v->nMem; i++){
+      sqlite3VdbeMemRelease(&v->aMem[i]);
+    }
+    // release the memory
+    sqlite3DbFree(v->db, v->aMem);
+    v->aMem = NULL;
+    v->nMem = 0;
+  }
+}
+
+/*
+** Allocate the memory cells for a result row with num_cols columns.
+*/
+SQLITE_PRIVATE int allocResultRow(Vdbe *v, int num_cols) {
+  int i;
+
+  v->nMem = num_cols + 1;  // v->aMem[0] is reserved
+  v->aMem = sqlite3DbMallocZero(v->db, sizeof(Mem) * v->nMem);
+  if( v->aMem==NULL ){
+    v->nMem = 0;
+    return SQLITE_NOMEM;
+  }
+  // initialize the memory cells
+  for(i=0; i<v->nMem; i++){
+    sqlite3VdbeMemInit(&v->aMem[i], v->db, MEM_Null);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Execute a RETURN command with a statement. Only the first row is read
+** here. The next ones are read by the OP_NextResult opcode, when the caller
+** steps the CALL statement, so the result set is not stored in memory.
+*/
+SQLITE_PRIVATE int executeReturnRows(Vdbe *v, call_frame *frame, command *cmd) {
+  cmd_state *state = commandState(frame, cmd);
+  int num_cols, rc;
+
+  if( state->stmt==NULL ){
+    // prepare the statement or take it from the statement pool
+    rc = prepareCommand(frame, cmd, cmd->sql, cmd->nsql);
+    if( rc ){
+      sqlite3VdbeError(v, "error parsing statement: %s", sqlite3_errmsg(frame->db));
+      return rc;
+    }
+  }else{
+    sqlite3_reset(state->stmt);
+  }
+
+  bindCommandVariables(frame, state);
+
+  rc = sqlite3_step(state->stmt);
+  if( rc==SQLITE_DONE ){
+    // no rows to return
+    return SQLITE_OK;
+  }else if( rc!=SQLITE_ROW ){
+    sqlite3VdbeError(v, "%s", sqlite3_errmsg(frame->db));
+    return rc;
+  }
+
+  num_cols = sqlite3_column_count(state->stmt);
+  rc = allocResultRow(v, num_cols);
+  if( rc ) return rc;
+  copyStatementRow(v, state->stmt, num_cols);
+
+  frame->result_stmt = state->stmt;
+
+  sqlite3VdbeSetNumCols(v, num_cols);
+  sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_ResultRow, 1, num_cols);
+  sqlite3ChangeOpcode(v, POS_NEXT_RESULT, OP_NextResult, 0, POS_RESULT_ROW);
+
+  return SQLITE_OK;
+}
+
+/*
+** Execute a return command.
+*/
+SQLITE_PRIVATE int executeReturnCommand(Vdbe *v, call_frame *frame, command *cmd) {
+  int *vars = cmd->vars;
+  unsigned int num_vars = cmd->num_vars;
+  int rc = SQLITE_OK;
+  int i;
+
+  if( num_vars==0 && cmd->sql==NULL ){
+    // no result set
+    return SQLITE_OK;
+  }
+
+  releaseResultRow(v, frame);
+
+  // if it returns the rows of a statement
+  if( cmd->flags & CMD_FLAG_RETURN_ROWS ){
+    return executeReturnRows(v, frame, cmd);
+  }
+
+  // if it returns an expression
+  if( cmd->sql!=NULL ){
+    // evaluate the expression. the results are stored on the command state
+    cmd_state *state = commandState(frame, cmd);
+    rc = execute_expression(v, frame, cmd, NULL);
+    if( rc ) return rc;
+    vars = state->vars;
+    num_vars = state->num_vars;
+  }
+
+  // if returning a result set (many rows)
+  if( num_vars==1 && is_list(variableValue(frame, vars[0])) ){
+    // get the list
+    sqlite3_list *list = get_list_from_value(variableValue(frame, vars[0]));
+    // get the number of rows
+    int num_rows = list->num_items;
+    // iterate the rows to get the maximum number of columns
+    int num_cols = 1;
+    for( i=0; i<num_rows; i++ ){
+      // get the list
+      sqlite3_list *row = listSubList(list, i);
+      if( row ){
+        // get the number of columns
+        int row_num_cols = row->num_items;
+        // check if the number of columns is greater than the current maximum
+        if( row_num_cols>num_cols ){
+          num_cols = row_num_cols;
+        }
+      }
+    }
+    // allocate the memory for the result set
+    rc = allocResultRow(v, num_cols);
+    if( rc ) return rc;
+
+    // save the source list on the call frame
+    frame->result_list = list;
+    // save the position of the current row
+    frame->current_row = -1;
+
+    // change the next opcode to OP_NextResult
+    sqlite3ChangeOpcode(v, POS_NEXT_RESULT, OP_NextResult, 0, POS_RESULT_ROW);
+
+    // it is also called by the OP_NextResult opcode:
+    nextResultRow(v);
+
+  } else {
+
+    // allocate the memory for the result set
+    rc = allocResultRow(v, num_vars);
+    if( rc ) return rc;
+
+    // move the values from the variables to the result set
+    for( i=0; i<num_vars; i++ ){
+      sqlite3_value *value = variableValue(frame, vars[i]);
+      // lists cannot be returned with multiple parameters
+      if( is_list(value) ){
+        // set the error message
+        sqlite3VdbeError(v, "cannot return a list with multiple parameters");
+        // return the error code
+        return SQLITE_ERROR;
+      }
+      // copy the value to the result set (aMem[0] is reserved)
+      XTRACE("copying value %lld\n", value->u.i);
+      // the value can point to the call arena or to a loop list, which are
+      // released before the caller reads it
+      rc = moveValue(&v->aMem[i+1], value);
+      variableChanged(frame, vars[i]);
+      if( rc ) return rc;
+      //sqlite3VdbeMemShallowCopy(&v->aMem[i+1], value, MEM_Static);
+      //sqlite3VdbeMemCopy(&v->aMem[i+1], value);
+    }
+
+    //v->nResColumn = num_vars;
+    sqlite3VdbeSetNumCols(v, num_vars);
+
+    // change the result opcode to OP_ResultRow
+    sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_ResultRow, 1, num_vars);
+  }
+
+  return rc;
+}
+
+/*
+** Execute a RETURN NEXT command. The values are copied to the result row,
+** as the variables are still used when the execution continues.
+*/
+SQLITE_PRIVATE int executeReturnNext(Vdbe *v, call_frame *frame, command *cmd) {
+  int *vars = cmd->vars;
+  unsigned int num_vars = cmd->num_vars;
+  int rc;
+  int i;
+
+  releaseResultRow(v, frame);
+
+  // if it returns an expression
+  if( cmd->sql!=NULL ){
+    cmd_state *state = commandState(frame, cmd);
+    rc = execute_expression(v, frame, cmd, NULL);
+    if( rc ) return rc;
+    vars = state->vars;
+    num_vars = state->num_vars;
+  }
+
+  rc = allocResultRow(v, num_vars);
+  if( rc ) return rc;
+
+  for( i=0; i<num_vars; i++ ){
+    sqlite3_value *value = variableValue(frame, vars[i]);
+    if( is_list(value) ){
+      sqlite3VdbeError(v, "cannot return a list with RETURN NEXT");
+      return SQLITE_ERROR;
+    }
+    rc = sqlite3VdbeMemCopy(&v->aMem[i+1], value);
+    if( rc ) return rc;
+  }
+
+  sqlite3VdbeSetNumCols(v, num_vars);
+  sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_ResultRow, 1, num_vars);
+  sqlite3ChangeOpcode(v, POS_NEXT_RESULT, OP_NextResult, 0, POS_RESULT_ROW);
+
+  return SQLITE_OK;
+}
+
+/*
+** Execute a RETURN command of a stored function, storing the returned value
+** as the result of the SQL function.
+*/
+SQLITE_PRIVATE int executeFunctionReturn(Vdbe *v, call_frame *frame, command *cmd) {
+  int *vars = cmd->vars;
+  unsigned int num_vars = cmd->num_vars;
+  sqlite3_value *value;
+  int rc;
+
+  if( num_vars==0 && cmd->sql==NULL ){
+    // no value: the result is NULL
+    return SQLITE_OK;
+  }
+
+  // if it returns an expression
+  if( cmd->sql!=NULL ){
+    // evaluate the expression
+    cmd_state *state = commandState(frame, cmd);
+    rc = execute_expression(v, frame, cmd, NULL);
+    if( rc ) return rc;
+    vars = state->vars;
+    num_vars = state->num_vars;
+  }
+
+  if( num_vars!=1 ){
+    sqlite3VdbeError(v, "a function must return a single value");
+    return SQLITE_ERROR;
+  }
+
+  value = variableValue(frame, vars[0]);
+  if( is_list(value) ){
+    sqlite3VdbeError(v, "a function cannot return a list");
+    return SQLITE_ERROR;
+  }
+
+  // the value can point to the call arena, which is reset after the call
+  sqlite3_result_value(frame->function_ctx, value);
+  return sqlite3VdbeMemMakeWriteable(frame->function_ctx->pOut);
+}
+
+/*
+** Execute a RAISE command.
+*/
+SQLITE_PRIVATE int executeRaiseCommand(Vdbe *v, call_frame *frame, command *cmd) {
+  sqlite3 *db = frame->db;
+  char *sql, *msg=NULL;
+  int rc = SQLITE_OK;
+
+  // get the SQL statement
+  sql = sqlite3_mprintf("SELECT printf(%.*s)", cmd->nsql, cmd->sql);
+  if( sql==NULL ){
+    return SQLITE_NOMEM;
+  }
+
+  // evaluate the expression
+  rc = db_query_str(frame, sql, &msg);
+  sqlite3_free(sql);
+  if( rc ){
+    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  // set the error message
+  sqlite3VdbeError(v, "%s", msg);
+  sqlite3_free(msg);
+
+  // return the error code
+  return rc;
+}
+
+/*
+** Execute an ASSERT statement.
+*/
+SQLITE_PRIVATE int executeAssertCommand(Vdbe *v, call_frame *frame, command *cmd) {
+  sqlite3 *db = frame->db;
+  char *sql, *msg=NULL;
+  int rc = SQLITE_OK;
+  bool result;
+
+  // evaluate the condition expression
+  rc = execute_expression(v, frame, cmd, &result);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // if the condition is true, we're done
+  if (result) {
+    return SQLITE_OK;
+  }
+
+  // condition failed - evaluate the error message expression
+  sql = sqlite3_mprintf("SELECT printf(%.*s)", cmd->nsql2, cmd->sql2);
+  if (sql == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  // get the formatted error message
+  rc = db_query_str(frame, sql, &msg);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  // set the error message
+  sqlite3VdbeError(v, "Assertion failed: %s", msg);
+  sqlite3_free(msg);
+
+  // return the error code
+  return SQLITE_ERROR;
+}
+
+/*
+** Check if the statement command is allowed in a stored procedure.
+** Returns the error message if it is not, or NULL.
+*/
+SQLITE_PRIVATE const char* forbiddenStatementError(command *cmd) {
+
+  // reject transaction commands
+  if( cmd->sql[0]=='B' || cmd->sql[0]=='C' || cmd->sql[0]=='R' ||
+      cmd->sql[0]=='S' ){
+    if( (cmd->nsql>=5 && sqlite3_strnicmp(cmd->sql, "BEGIN", 5)==0) ||
+        (cmd->nsql>=6 && sqlite3_strnicmp(cmd->sql, "COMMIT", 6)==0) ||
+        (cmd->nsql>=8 && sqlite3_strnicmp(cmd->sql, "ROLLBACK", 8)==0) ||
+        (cmd->nsql>=8 && sqlite3_strnicmp(cmd->sql, "SAVEPOINT", 8)==0) ||
+        (cmd->nsql>=7 && sqlite3_strnicmp(cmd->sql, "RELEASE", 7)==0) ){
+      return "transaction commands are not allowed in stored procedures";
+    }
+  }else
+  if( cmd->sql[0]=='A' || cmd->sql[0]=='D' ){
+    if( (cmd->nsql>=6 && sqlite3_strnicmp(cmd->sql, "ATTACH", 6)==0) ||
+        (cmd->nsql>=6 && sqlite3_strnicmp(cmd->sql, "DETACH", 6)==0) ){
+      return "attach/detach commands are not allowed in stored procedures";
+    }
+  }
+
+  return NULL;
+}
+
+/*
+** Execute a statement command.
+*/
+SQLITE_PRIVATE int executeStatementCommand(Vdbe *v, call_frame *frame, command *cmd) {
+  cmd_state *state = commandState(frame, cmd);
+  const char *error_msg;
+  int rc = SQLITE_OK;
+
+  // reject transaction and attach commands
+  error_msg = forbiddenStatementError(cmd);
+  if( error_msg ){
+    sqlite3VdbeError(v, "%s", error_msg);
+    return SQLITE_ERROR;
+  }
+
+  // prepare the statement if it is not prepared yet
+  if( state->stmt==NULL ){
+    // parse the SQL statement or take it from the statement pool
+    rc = prepareCommand(frame, cmd, cmd->sql, cmd->nsql);
+    if( rc!=SQLITE_OK ){
+      goto loc_error;
+    }
+  }
+
+  // bind local variable values used on the prepared statement
+  bindCommandVariables(frame, state);
+
+  // execute the prepared statement
+  do {
+    rc = sqlite3_step(state->stmt);
+  } while (rc == SQLITE_ROW);
+
+  // if the statement was executed successfully, set the return code to SQLITE_OK
+  if( rc==SQLITE_DONE ){
+    rc = SQLITE_OK;
+  }
+
+  if( rc==SQLITE_OK && frame->profile && !sqlite3_stmt_readonly(state->stmt) ){
+    frame->profile_rows += sqlite3_changes64(frame->db);
+  }
+
+  // reset the prepared statement
+  sqlite3_reset(state->stmt);
+
+  // check if there was an error
+  if( rc!=SQLITE_OK ){
+    goto loc_error;
+  }
+
+  return rc;
+
+loc_error:
+  // if there was an error, set the error message
+  if( v->zErrMsg==NULL ){
+    //
+  }
+  // return the error code
+  return rc;
+}
+
+/*
+** Store a value on a variable, applying the variable type affinity.
+*/
+SQLITE_PRIVATE void setVariableValue(call_frame *frame, int slot, sqlite3_value *value){
+  sqlite3_var *var = frameVariable(frame, slot);
+  sqlite3_value *var_value = variableValue(frame, slot);
+  sqlite3_list *list = get_list_from_value(value);
+  if( list ){
+    // the list is shared, not copied
+    shareListValue(frame, var_value, list);
+    variableChanged(frame, slot);
+    return;
+  }
+  sqlite3VdbeMemCopy(var_value, value);
+  if( var->type==SQLITE_AFF_REAL ){
+    sqlite3_value_numeric_type(var_value);
+  }else if( var->type!=0 && var->type!=SQLITE_AFF_BLOB ){
+    sqlite3ValueApplyAffinity(var_value, var->type, SQLITE_UTF8);  // or ENC(db)
+  }
+  variableChanged(frame, slot);
+}
+
+/*
+** Check if the input of a SET command is a statement, used as it is, or an
+** expression that is evaluated with a SELECT.
+*/
+SQLITE_PRIVATE bool isSetInputStatement(char *sql) {
+  int n, tokenType;
+
+  n = sqlite3GetToken((u8*)sql, &tokenType);
+  if( tokenType==TK_ID ){
+    // check if it is a CALL, then set tokenType to TK_CALL
+    if( n==4 && sqlite3_strnicmp(sql, "CALL", 4)==0 ){
+      tokenType = TK_CALL;
+    }
+  }
+  switch( tokenType ){
+    case TK_SELECT:
+    case TK_INSERT:
+    case TK_UPDATE:
+    case TK_DELETE:
+    case TK_CALL:
+      return true;
+  }
+  return false;
+}
+
+/*
+** Execute a SET command.
+*/
+SQLITE_PRIVATE int executeSetCommand(Vdbe *v, call_frame *frame, command *cmd) {
+  cmd_state *state = commandState(frame, cmd);
+  int rc = SQLITE_OK;
+
+  // similar to the STATEMENT command: execute the prepared statement and store
+  // the returned values in the defined variables
+
+  sqlite3_list *parent_list = NULL;
+  void (*free_func)(sqlite3_list*) = sqlite3_free_list;
+  list_builder rows = {0};
+  int num_rows = 0;
+
+  if (cmd->flags & CMD_FLAG_STORE_AS_LIST) {
+    // exactly one variable to store the list
+    if( cmd->num_vars != 1 ){
+      sqlite3VdbeError(v, "expected a single variable to store the result");
+      rc = SQLITE_ERROR;
+      goto loc_exit;
+    }
+  }
+
+  // is the input a LIST?
+  if (cmd->input_list != NULL) {
+    assert(state->stmt == NULL);
+    assert(cmd->flags & CMD_FLAG_STORE_AS_LIST);
+    // get the pointer to the input list
+    parent_list = cmd->input_list;
+    // do not release it if the variable is set to another value
+    free_func = NULL;
+    // make the variable point to the input list
+    goto loc_set_values;
+  }
+
+  // then the input must be an expression or a SQL statement
+
+  // a simple expression assigned to a single variable is evaluated natively
+  if( cmd->num_vars==1 && (cmd->flags & CMD_FLAG_STORE_AS_LIST)==0 ){
+    sqlite3_value *result;
+    rc = executeNativeExpression(frame, cmd, cmd->sql, cmd->nsql, &result);
+    if( rc ) goto loc_error;
+    if( result ){
+      setVariableValue(frame, cmd->vars[0], result);
+      goto loc_exit;
+    }
+  }
+
+  // check if the prepared statement is available
+  if( state->stmt == NULL ){
+    char *new_sql = NULL;
+    char *sql = cmd->sql;
+    int nsql = cmd->nsql;
+    int n, tokenType;
+    /* Read the next token */
+    n = sqlite3GetToken((u8*)sql, &tokenType);
+    if( n > cmd->nsql ){
+      // this should not happen
+      sqlite3VdbeError(v, "invalid token: %s", sql);
+      rc = SQLITE_ERROR;
+      goto loc_exit;
+    }
+    // a statement is used as it is. otherwise, add "SELECT " to the
+    // beginning of the expression
+    if( !isSetInputStatement(sql) ){
+      new_sql = sqlite3_mprintf("SELECT %s", sql);
+      if( !new_sql ){
+        sqlite3VdbeError(v, "out of memory");
+        rc = SQLITE_NOMEM;
+        goto loc_exit;
+      }
+      sql = new_sql;
+      nsql = strlen(sql);
+    }
+    // parse the statement or take it from the statement pool
+    rc = prepareCommand(frame, cmd, sql, nsql);
+    if (new_sql) sqlite3_free(new_sql);
+    if (rc != SQLITE_OK) {
+      sqlite3VdbeError(v, "error parsing statement: %s", sqlite3_errmsg(frame->db));
+      goto loc_exit;
+    }
+    if (state->stmt == NULL) {
+      sqlite3VdbeError(v, "SET command without input");
+      rc = SQLITE_ERROR;
+      goto loc_exit;
+    }
+
+  }else{
+    // reset the prepared statement
+    sqlite3_reset(state->stmt);
+  }
+
+  // bind local variable values used on the prepared statement
+  bindCommandVariables(frame, state);
+
+  // execute the prepared statement
+  do {
+    rc = sqlite3_step(state->stmt);
+    if (rc == SQLITE_ROW) {
+      // get the number of columns returned
+      int num_cols = sqlite3_column_count(state->stmt);
+      if (num_cols == 0) {
+        sqlite3VdbeError(v, "no columns returned");
+        rc = SQLITE_ERROR;
+        goto loc_exit;
+      }
+      // increment the number of rows returned
+      num_rows++;
+      // if the statement is expected to return many rows, store them on a list variable
+      if (cmd->flags & CMD_FLAG_STORE_AS_LIST) {
+
+        // the rows whose columns are all INTEGER or all REAL are packed
+        int type = sqlite3_column_type(state->stmt, 0);
+        int list_type = (type == SQLITE_INTEGER) ? LIST_INTEGERS :
+                        (type == SQLITE_FLOAT) ? LIST_REALS : LIST_VALUES;
+        for (int ncol = 1; ncol < num_cols && list_type != LIST_VALUES; ncol++) {
+          if (sqlite3_column_type(state->stmt, ncol) != type) list_type = LIST_VALUES;
+        }
+        int size = list_type ? packedListSize(num_cols) : listSize(num_cols);
+
+        // allocate an sqlite3_list object with the proper number of values.
+        // the row and its strings are stored on the call arena, if possible
+        sp_arena *arena = &frame->arena;
+        sqlite3_list *list = (sqlite3_list*) arenaAlloc(arena, size);
+        if (list == NULL) {
+          arena = NULL;
+          list = (sqlite3_list*) sqlite3Malloc(size);
+          if (list == NULL) {
+            rc = SQLITE_NOMEM;
+            goto loc_exit;
+          }
+        }
+        // store the number of items in the list
+        listInit(list, num_cols, arena);
+        list->type = list_type;
+        // store the result in the list
+        for (int ncol = 0; ncol < num_cols && list_type == LIST_INTEGERS; ncol++) {
+          listInts(list)[ncol] = sqlite3_column_int64(state->stmt, ncol);
+        }
+        for (int ncol = 0; ncol < num_cols && list_type == LIST_REALS; ncol++) {
+          listReals(list)[ncol] = sqlite3_column_double(state->stmt, ncol);
+        }
+        for (int ncol = 0; ncol < num_cols && list_type == LIST_VALUES; ncol++) {
+          sqlite3_value *list_value = &list->value[ncol];
+          sqlite3_value *col_value = sqlite3_column_value(state->stmt, ncol);
+          sqlite3_list *col_list = get_list_from_value(col_value);
+          sqlite3VdbeMemInit(list_value, frame->db, MEM_Null);
+          if (col_list) {
+            // a list bound to the statement is shared
+            shareListValue(frame, list_value, col_list);
+          } else if (arena) {
+            arenaCopyValue(arena, list_value, col_value);
+          } else {
+            sqlite3VdbeMemCopy(list_value, col_value);
+          }
+        }
+
+        // start the parent list on the first row. the number of rows
+        // returned by the last execution is used as the size hint
+        if( rows.list==NULL ){
+          rc = listBuilderInit(&rows, &frame->arena, state->list_size_hint);
+          if( rc ){
+            sqlite3_free_list(list);
+            goto loc_exit;
+          }
+        }
+        // store the list in the parent list
+        sqlite3_value *value = listBuilderAppend(&rows, frame->db);
+        if( value==NULL ){
+          sqlite3_free_list(list);
+          rc = SQLITE_NOMEM;
+          goto loc_exit;
+        }
+        sqlite3ValueSetList(value, list, sqlite3_free_list);
+
+      } else {
+
+        // throw an error if more than one row is returned
+        if( num_rows>1 ){
+          sqlite3VdbeError(v, "statement returns more than one row");
+          rc = SQLITE_ERROR;
+          goto loc_exit;
+        }
+
+        // check the number of columns returned
+        if( num_cols!=cmd->num_vars ){
+          sqlite3VdbeError(v, "statement returns %d values but has %d variables to set",
+                              num_cols, cmd->num_vars);
+          rc = SQLITE_ERROR;
+          goto loc_exit;
+        }
+
+        // store the result in the defined variables
+        for( int ncol=0; ncol<cmd->num_vars; ncol++ ){
+          sqlite3_value *col_value = sqlite3_column_value(state->stmt, ncol);
+          setVariableValue(frame, cmd->vars[ncol], col_value);
+        }
+
+      }
+
+    }
+  } while (rc == SQLITE_ROW);
+
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  }
+
+  // check if the statement was executed successfully
+  if (rc != SQLITE_OK) {
+    goto loc_error;
+  }
+
+  if (frame->profile) {
+    frame->profile_rows += num_rows;
+  }
+
+  // release the unused space from the parent list
+  if( rows.list ){
+    state->list_size_hint = rows.list->num_items;
+    parent_list = listBuilderFinish(&rows);
+  }
+
+  // reset the prepared statement
+  //sqlite3_reset(state->stmt);
+
+loc_set_values:
+
+  if (cmd->flags & CMD_FLAG_STORE_AS_LIST) {
+    // store the parent list in the defined variable
+    int slot = cmd->vars[0];
+    if (parent_list) {
+      sqlite3ValueSetList(variableValue(frame, slot), parent_list, free_func);
+    } else {
+      // no row was returned
+      sqlite3VdbeMemSetNull(variableValue(frame, slot));
+    }
+    variableChanged(frame, slot);
+  } else {
+    // if there is no returned rows, set the defined variables to NULL
+    if (num_rows == 0) {
+      for (int nvar = 0; nvar < cmd->num_vars; nvar++) {
+        sqlite3VdbeMemSetNull(variableValue(frame, cmd->vars[nvar]));
+        variableChanged(frame, cmd->vars[nvar]);
+      }
+    }
+  }
+
+loc_exit:
+  // in case of error, release allocated resources
+  if( rows.list ){
+    listBuilderAbort(&rows);
+  }
+  return rc;
+loc_error:
+  if( rc==SQLITE_OK ) rc = SQLITE_ERROR;
+  if( v->zErrMsg==NULL ){
+  //sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
+    sqlite3VdbeError(v, "%s", sqlite3ErrStr(rc));
+  }
+  goto loc_exit;
+}
+
+/*
+** Execute a FOREACH loop over a list as a single statement, when it was
+** fused by fuseForeachLoop(). All the items except the last one are
+** inserted, and the loop continues on the last item, so its INSERT sets the
+** changes() and last_insert_rowid() like the loop does, even if the row is
+** ignored by a conflict clause or a trigger.
+** Nothing is done when some item does not have one value per loop variable:
+** the loop is then executed item by item, to fail on the same item as
+** before.
+*/
+SQLITE_PRIVATE int executeFusedForeach(
+  Vdbe *v, call_frame *frame, command *cmd, sqlite3_list *input_list
+){
+  cmd_state *state = commandState(frame, cmd);
+  int rc, i;
+
+  for( i=0; i<input_list->num_items; i++ ){
+    sqlite3_list *row = listSubList(input_list, i);
+    int num_cols = row ? row->num_items : 1;
+    if( num_cols!=cmd->num_vars ) return SQLITE_OK;
+  }
+
+  if( state->stmt==NULL ){
+    rc = prepareCommand(frame, cmd, cmd->fused_sql, cmd->nfused_sql);
+    if( rc!=SQLITE_OK ) return rc;
+  }
+  bindCommandVariables(frame, state);
+  sqlite3_bind_pointer(state->stmt,
+                       sqlite3_bind_parameter_index(state->stmt, ":sp_items"),
+                       input_list, "list", NULL);
+  sqlite3_bind_int(state->stmt,
+                   sqlite3_bind_parameter_index(state->stmt, ":sp_limit"),
+                   input_list->num_items - 1);
+
+  do {
+    rc = sqlite3_step(state->stmt);
+  } while (rc == SQLITE_ROW);
+  sqlite3_reset(state->stmt);
+  if( rc!=SQLITE_DONE ) return rc;
+
+  if( frame->profile ) frame->profile_rows += sqlite3_changes64(frame->db);
+
+  // the last item is executed by the loop body
+  state->current_item = input_list->num_items - 1;
+  return SQLITE_OK;
+}
+
+/*
+** Keep a reference to the list iterated by a FOREACH, so the items can be
+** stored on the loop variables without copies, even if the input variable
+** is set to another value inside the loop. Before the reference is moved to
+** another list, the loop variables that still point to the items of the
+** previous one receive their own copies.
+*/
+SQLITE_PRIVATE int setLoopList(
+  call_frame *frame, command *cmd, cmd_state *state, sqlite3_list *list
+){
+  if( get_list_from_value(&state->loop_list)==list ) return SQLITE_OK;
+  for( int i=0; i<cmd->num_vars; i++ ){
+    sqlite3_value *var_value = variableValue(frame, cmd->vars[i]);
+    if( var_value->flags & MEM_Ephem ){
+      int rc = sqlite3VdbeMemMakeWriteable(var_value);
+      if( rc ) return rc;
+    }
+  }
+  if( list ){
+    shareListValue(frame, &state->loop_list, list);
+  }else{
+    sqlite3VdbeMemSetNull(&state->loop_list);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Execute a foreach command.
+** Retrieve the next item from the list or the next row from the SQL statement
+** and save the result in the defined variables.
+** If there is a new row, return SQLITE_ROW. Otherwise, return SQLITE_DONE.
+**
+** Check if already executing using the state->current_item variable, on the
+** call frame. Use it as the index of the next item to retrieve from the list.
+** For SQL statements, just call sqlite3_step() to retrieve the next row and
+** increment the state->current_item.
+** The input is a list if cmd->input_list is not NULL.
+** The input is a SQL statement if cmd->sql is not NULL.
+** If the input is a SQL statement, parse it into the state->stmt variable if not yet done.
+*/
+SQLITE_PRIVATE int executeForeachCommand(Vdbe *v, call_frame *frame, command *cmd) {
+  cmd_state *state = commandState(frame, cmd);
+  sqlite3 *db = v->db;
+  int rc = SQLITE_OK;
+  int num_cols = 0;
+  sqlite3_list *input_list = NULL;
+  sqlite3_value *row_value = NULL;
+  sqlite3_list *row_list = NULL;
+  bool has_dynamic_values = false;
+  Mem cell;
+
+  sqlite3VdbeMemInit(&cell, db, MEM_Null);
+
+  if (cmd->input_var >= 0) {
+    // retrieve the list from the input variable
+    input_list = get_list_from_value(variableValue(frame, cmd->input_var));
+    if (input_list == NULL) {
+      sqlite3VdbeError(v, "the input variable %s does not contain a list",
+                          frameVariable(frame, cmd->input_var)->name);
+      goto loc_error;
+    }
+  } else if (cmd->input_list) {
+    input_list = cmd->input_list;
+  }
+
+  // execute the loop as a single statement, if possible
+  if (input_list && cmd->fused_sql && state->current_item == 0 &&
+      input_list->num_items > 1) {
+    rc = executeFusedForeach(v, frame, cmd, input_list);
+    if (rc != SQLITE_OK) goto loc_error;
+  }
+
+  // retrieve the next item from the list or the next row from the SQL statement
+  if (input_list) {
+    if (state->current_item >= input_list->num_items) {
+      // no more items
+      state->current_item = 0;
+      rc = setLoopList(frame, cmd, state, NULL);
+      if (rc == SQLITE_OK) rc = SQLITE_DONE;
+      goto loc_exit;
+    }
+    // the loop variables point to the items of the list
+    rc = setLoopList(frame, cmd, state, input_list);
+    if (rc != SQLITE_OK) goto loc_exit;
+    // retrieve the next item from the list
+    row_value = listItem(input_list, state->current_item, &cell);
+    // if the row contains a list, retrieve it
+    row_list = get_list_from_value(row_value);
+    // increment the current item
+    state->current_item++;
+  } else {
+    // retrieve the next row from the SQL statement
+    if (state->current_item == 0) {
+      if (state->stmt == NULL) {
+        // parse the SQL statement or take it from the statement pool
+        rc = prepareCommand(frame, cmd, cmd->sql, cmd->nsql);
+        if (rc != SQLITE_OK) {
+          goto loc_error;
+        }
+      } else {
+        // reset the prepared statement
+        sqlite3_reset(state->stmt);
+      }
+      // bind the variables
+      bindCommandVariables(frame, state);
+    }
+    // execute the SQL statement
+    rc = sqlite3_step(state->stmt);
+    if (rc == SQLITE_ROW) {
+      // increment the current item
+      state->current_item++;
+    } else if (rc == SQLITE_DONE) {
+      // no more rows
+      state->current_item = 0;
+      goto loc_exit;
+    } else {
+      goto loc_error;
+    }
+    // if no variables are defined, retrieve them from the SQL statement
+    if (cmd->num_vars==0) {
+      has_dynamic_values = true;
+    }
+  }
+
+  // check the number of columns returned
+  if (row_list) {
+    num_cols = row_list->num_items;
+  } else if (row_value) {
+    num_cols = 1;
+  } else {
+    num_cols = sqlite3_column_count(state->stmt);
+  }
+  if (num_cols != cmd->num_vars && has_dynamic_values==false) {
+    sqlite3VdbeError(v, "statement returns %d values but has %d variables to set",
+        num_cols, cmd->num_vars);
+    rc = SQLITE_ERROR;
+    goto loc_error;
+  }
+
+//! should it allow overwrite the values of existing variables?
+
+//! should the new variables be removed after the foreach command?
+
+  if (has_dynamic_values) {
+    // store the result in new variables
+    for (int ncol = 0; ncol < num_cols; ncol++) {
+      char col_name[sizeof(((sqlite3_var*)0)->name)];
+      const char *name;
+      sqlite3_value *col_value;
+      int slot;
+      name = sqlite3_column_name(state->stmt, ncol);
+      col_value = sqlite3_column_value(state->stmt, ncol);
+      if (name == NULL) {
+        rc = SQLITE_NOMEM;
+        goto loc_error;
+      }
+      // add '@' to the column name
+      if (strlen(name) + 1 >= sizeof(col_name)) {
+        sqlite3VdbeError(v, "variable name must be up to %d bytes long: @%s",
+                            (int)sizeof(col_name) - 1, name);
+        rc = SQLITE_ERROR;
+        goto loc_error;
+      }
+      sqlite3_snprintf(sizeof(col_name), col_name, "@%s", name);
+      // add a new variable
+      slot = addFrameVariable(frame, col_name, strlen(col_name));
+      if (slot < 0) {
+        rc = SQLITE_NOMEM;
+        goto loc_error;
+      }
+      // store the column value in the variable
+      sqlite3VdbeMemMove(variableValue(frame, slot), col_value);
+      variableChanged(frame, slot);
+    }
+  } else {
+    // store the result in the defined variables
+    for (int ncol = 0; ncol < cmd->num_vars; ncol++) {
+      sqlite3_value *var_value = variableValue(frame, cmd->vars[ncol]);
+      sqlite3_value *col_value;
+      if (row_value) {
+        // the list is kept by the loop, so the item is not copied
+        col_value = row_list ? listItem(row_list, ncol, &cell) : row_value;
+        sqlite3_list *sub_list = get_list_from_value(col_value);
+        if (sub_list) {
+          shareListValue(frame, var_value, sub_list);
+        } else {
+          sqlite3VdbeMemShallowCopy(var_value, col_value, MEM_Ephem);
+        }
+      } else {
+        // copy the content from the column to the variable
+        col_value = sqlite3_column_value(state->stmt, ncol);
+        sqlite3VdbeMemMove(var_value, col_value);
+      }
+      variableChanged(frame, cmd->vars[ncol]);
+    }
+  }
+
+  if (frame->profile) frame->profile_rows++;
+
+loc_exit:
+  return rc;
+loc_error:
+  if( v->zErrMsg==NULL ){
+    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
+  }
+  goto loc_exit;
+}
+
+/*
+** Execute the compiled program of a stored procedure or function.
+*/
+SQLITE_PRIVATE int executeProcedureProgram(Vdbe *v, call_frame *frame, int pc) {
+  stored_proc *procedure = frame->procedure;
+  sqlite3 *db = frame->db;
+  sp_op *op = NULL;
+  int rc = SQLITE_OK;
+  bool result;
+
+  while( 1 ){
+    op = &procedure->program[pc++];
+    if( frame->profile ) profileCommand(frame, op->cmd);
+    switch( op->opcode ){
+      case SP_OP_GOTO:
+        pc = op->p2;
+        break;
+      case SP_OP_IF_FALSE:
+        rc = execute_expression(v, frame, op->cmd, &result);
+        if( rc ) goto loc_error;
+        if( !result ) pc = op->p2;
+        break;
+      case SP_OP_SET:
+        rc = executeSetCommand(v, frame, op->cmd);
+        if( rc ) goto loc_error;
+        break;
+      case SP_OP_STATEMENT:
+        rc = executeStatementCommand(v, frame, op->cmd);
+        if( rc ) goto loc_error;
+        break;
+      case SP_OP_ASSERT:
+        rc = executeAssertCommand(v, frame, op->cmd);
+        if( rc ) goto loc_error;
+        break;
+      case SP_OP_FOREACH:
+        rc = executeForeachCommand(v, frame, op->cmd);
+        if( rc==SQLITE_DONE ){
+          pc = op->p2;
+        }else if( rc!=SQLITE_ROW && rc ){
+          goto loc_error;
+        }
+        rc = SQLITE_OK;
+        break;
+      case SP_OP_RETURN:
+        if( frame->function_ctx ){
+          rc = executeFunctionReturn(v, frame, op->cmd);
+        }else{
+          rc = executeReturnCommand(v, frame, op->cmd);
+        }
+        if( rc ) goto loc_error;
+        return SQLITE_OK;
+      case SP_OP_RETURN_NEXT:
+        rc = executeReturnNext(v, frame, op->cmd);
+        if( rc ) goto loc_error;
+        // continue on the next instruction when the next row is read
+        frame->suspended = true;
+        frame->resume_pos = pc;
+        return SQLITE_OK;
+      case SP_OP_RAISE:
+        rc = executeRaiseCommand(v, frame, op->cmd);
+        if( rc ) goto loc_error;
+        return SQLITE_ERROR;
+      case SP_OP_HALT:
+        return SQLITE_OK;
+    }
+  }
+
+loc_error:
+  if( v->zErrMsg==NULL ){
+    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
+  }
+  XTRACE("execution error (%s): %s\n", command_type_str(op->cmd->type), v->zErrMsg);
+  return rc;
+}
+
+/*
+** Execute the commands of a stored procedure or function.
+*/
+SQLITE_PRIVATE int executeProcedureBody(Vdbe *v, call_frame *frame) {
+  sp_connection *conn = frame->conn;
+  int rc, start = 0;
+
+  if( frame->suspended ){
+    // a suspended generator continues where it stopped
+    start = frame->resume_pos;
+    frame->suspended = false;
+  }else{
+    // the statistics are collected from the start of the call
+    frame->profile = NULL;
+    if( conn && conn->profile_enabled ){
+      frame->profile = getProcedureProfile(conn, frame->procedure);
+    }
+  }
+
+  rc = executeProcedureProgram(v, frame, start);
+
+  // end the measure of the last executed command
+  if( frame->profile ) profileCommand(frame, NULL);
+
+  return rc;
+}
+
+/*
+** Execute a stored procedure.
+** This function is called by the OP_CallProcedure opcode, on the execute step.
+*/
+SQLITE_PRIVATE int executeStoredProcedure(Vdbe *v, procedure_call *call) {
+  call_frame *frame = call->frame;
+  int rc;
+
+  // if the procedure was replaced since the CALL was prepared, the
+  // SQLITE_SCHEMA error makes it prepared again with the new code
+  rc = checkStoredCode(frame, !v->readOnly);
+  if( rc ) return rc;
+
+  // the latency is measured until the last row is read
+  if( frame->conn && frame->conn->latency_enabled ){
+    frame->call_start = spClockNs();
+  }
+
+  // reset the procedure
+  //resetCallFrame(v, frame);  -- already called by sqlite3_reset()
+
+  // reset the OP_ResultRow opcode to OP_Noop
+  sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_Noop, 0, 0);
+  // reset the OP_NextResult opcode to OP_Noop
+  sqlite3ChangeOpcode(v, POS_NEXT_RESULT, OP_Noop, 0, 0);
+  // and the OP_Halt that follows, if the last execution failed on a row
+  if( v->aOp[POS_NEXT_RESULT+1].p1 ){
+    setCallHaltError(v, SQLITE_OK);
+  }
+
+  // there is no savepoint here: if the execution fails, the changes are
+  // rolled back by the statement transaction of the CALL statement
+
+  // copy from the cmd->input_list to the parameter values (frame->values[])
+  // copy the declared variable values from the v->aVar[] array to the parameter values
+  copyProcedureParameters(v, call);
+
+  // execute the compiled implementation, if available
+  if( call->native ){
+    rc = executeNativeProcedure(v, call);
+  }else{
+    // execute the commands
+    rc = executeProcedureBody(v, frame);
+  }
+
+  // the rows modified by the procedure did not change its code
+  if( !frame->procedure->changes_catalog ){
+    frame->total_changes = frame->db->nTotalChange;
+  }
+
+  // if there are no more rows to read, the call ends here
+  if( frame->call_start &&
+      (rc || v->aOp[POS_NEXT_RESULT].opcode!=OP_NextResult) ){
+    recordCallLatency(frame);
+  }
+
+  return rc;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// RESET AND RELEASE
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+** Reset the state of a call frame.
+*/
+SQLITE_PRIVATE int resetCallFrame(Vdbe *v, call_frame *frame) {
+  // if the aMem array was moved to the call frame
+  if( frame->aMem!=NULL ){
+    // release memory from the previous result set
+    if( v->aMem ){
+      // release each memory cell
+      for(int i=0; i<v->nMem; i++){
+        sqlite3VdbeMemRelease(&v->aMem[i]);
+      }
+      // release the memory
+      sqlite3DbFree(v->db, v->aMem);
+      v->aMem = NULL;
+      v->nMem = 0;
+    }
+    // move the aMem array back to the Vdbe object
+    v->aMem = frame->aMem;
+    v->nMem = frame->nMem;
+    // clear the aMem array from the call frame
+    frame->aMem = NULL;
+    frame->nMem = 0;
+  }
+  // reset the variables. the statements keep the NULL bound to the ones
+  // that were not set, so they are not bound again
+  for( int i=0; i<frame->num_vars; i++ ){
+    sqlite3_value *value = variableValue(frame, i);
+    if( value->flags==MEM_Null ) continue;
+    sqlite3VdbeMemSetNull(value);
+    variableChanged(frame, i);
+  }
+  // the result list points to the value of a variable
+  frame->result_list = NULL;
+  frame->current_row = 0;
+  // the returned statement can be left before all its rows are read
+  if( frame->result_stmt ){
+    sqlite3_reset(frame->result_stmt);
+    frame->result_stmt = NULL;
+  }
+  // a suspended generator, or a RETURN inside a loop, can leave the FOREACH
+  // loops before they are done
+  for( int i=0; i<frame->procedure->num_cmds; i++ ){
+    cmd_state *state = &frame->cmds[i];
+    if( state->current_item>0 ){
+      if( state->stmt ) sqlite3_reset(state->stmt);
+      state->current_item = 0;
+    }
+    // the loop variables were already cleared
+    sqlite3VdbeMemSetNull(&state->loop_list);
+  }
+  frame->suspended = false;
+  frame->resume_pos = 0;
+  // a CALL that is reset before its last row is not measured
+  frame->call_start = 0;
+  // a native loop can be left before its statement is done
+  for( int i=0; i<frame->num_native_stmts; i++ ){
+    if( frame->native_stmts[i] ){
+      sqlite3_reset(frame->native_stmts[i]);
+    }
+  }
+  // no value points to the arena anymore
+  arenaReset(&frame->arena);
+  return SQLITE_OK;
+}
+
+/*
+** Reset the state of a procedure call.
+*/
+SQLITE_PRIVATE int resetProcedureCall(Vdbe *v, procedure_call *call) {
+  // reset the call frame, including the parameters
+  resetCallFrame(v, call->frame);
+  return SQLITE_OK;
+}
+
+/*
+** Release a parsed command.
+*/
+SQLITE_PRIVATE void releaseCommand(command* cmd) {
+  if (cmd->input_list) {
+    sqlite3_free_list(cmd->input_list);
+  }
+  if (cmd->fused_sql) {
+    sqlite3_free(cmd->fused_sql);
+  }
+  if (cmd->vars) {
+    sqlite3_free(cmd->vars);
+  }
+}
+
+/*
+** Release the state of a command.
+*/
+SQLITE_PRIVATE void releaseCommandState(cmd_state *state) {
+  if( state->flags & CMD_FLAG_DYNAMIC_SQL ){
+    sqlite3_free(state->sql);
+  }
+  if (state->stmt) {
+    sqlite3_finalize(state->stmt);
+  }
+  if (state->vars) {
+    sqlite3_free(state->vars);
+  }
+  if (state->binds) {
+    sqlite3_free(state->binds);
+  }
+  if (state->expr) {
+    releaseNativeExpression(state->expr);
+  }
+  sqlite3VdbeMemRelease(&state->loop_list);
+}
+
+/*
+** Release a stored procedure.
+*/
+SQLITE_PRIVATE void releaseProcedure(stored_proc* procedure) {
+    if (procedure->error_msg) {
+        sqlite3_free(procedure->error_msg);
+    }
+    if (procedure->cmds) {
+        for (int n = 0; n < procedure->num_cmds; n++) {
+            releaseCommand(&procedure->cmds[n]);
+        }
+        sqlite3_free(procedure->cmds);
+    }
+    if (procedure->params) {
+        sqlite3_free(procedure->params);
+    }
+    if (procedure->program) {
+        sqlite3_free(procedure->program);
+    }
+    dropAllVariables(procedure);
+    if (procedure->code) {
+        sqlite3_free(procedure->code);
+    }
+    sqlite3_free(procedure);
+}
+
+/*
+** Release a call frame and its reference to the shared procedure.
+*/
+SQLITE_PRIVATE void releaseCallFrame(call_frame *frame) {
+    stored_proc *procedure = frame->procedure;
+    int n;
+    if (frame->cmds) {
+        for (n = 0; n < procedure->num_cmds; n++) {
+            releaseCommandState(&frame->cmds[n]);
+        }
+        sqlite3_free(frame->cmds);
+    }
+    if (frame->values) {
+        // the free function of a list may be called by sqlite3VdbeMemRelease
+        for (n = 0; n < frame->num_vars; n++) {
+            sqlite3VdbeMemRelease(&frame->values[n]);
+        }
+        sqlite3_free(frame->values);
+    }
+    sqlite3_free(frame->versions);
+    if (frame->new_vars) {
+        for (n = 0; n < frame->num_vars - procedure->num_vars; n++) {
+            sqlite3_free(frame->new_vars[n]);
+        }
+        sqlite3_free(frame->new_vars);
+    }
+    if (frame->native_stmts) {
+        for (n = 0; n < frame->num_native_stmts; n++) {
+            sqlite3_finalize(frame->native_stmts[n]);
+        }
+        sqlite3_free(frame->native_stmts);
+    }
+    arenaRelease(&frame->arena);
+    releaseSharedCode(frame->shared);
+    sqlite3_free(frame);
+}
+
+SQLITE_PRIVATE void releaseProcedureCall(procedure_call *call) {
+    if (call->frame) {
+        // keep the call frame for the next calls
+        cacheFrame(call->conn, call->frame);
+    }
+    if (call->input_list) {
+        sqlite3_free_list(call->input_list);
+    }
+    sqlite3_free(call->var_numbers);
+    sqlite3_free(call);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// STATEMENT POOL
+////////////////////////////////////////////////////////////////////////////////
+
+// default limits of the statement pool, per connection
+#define SP_POOL_MAX_STATEMENTS  256
+#define SP_POOL_MAX_MEMORY      (8 * 1024 * 1024)
+
+#define SP_POOL_BUCKETS         128
+
+#define poolBucket(version, cmd_pos) \
+  ((unsigned int)(((version) ^ ((u64)(cmd_pos) * 0x9e3779b97f4a7c15ULL)) % SP_POOL_BUCKETS))
+
+/*
+** Remove an entry from the pool, without releasing it.
+*/
+SQLITE_PRIVATE void unlinkPooledStatement(sp_connection *conn, pooled_stmt *entry){
+  pooled_stmt **pp = &conn->pool_buckets[poolBucket(entry->version, entry->cmd_pos)];
+
+  while( *pp!=entry ) pp = &(*pp)->next_in_bucket;
+  *pp = entry->next_in_bucket;
+
+  if( entry->prev_used ){
+    entry->prev_used->next_used = entry->next_used;
+  }else{
+    conn->pool_first = entry->next_used;
+  }
+  if( entry->next_used ){
+    entry->next_used->prev_used = entry->prev_used;
+  }else{
+    conn->pool_last = entry->prev_used;
+  }
+
+  conn->pool_count--;
+  conn->pool_memory -= entry->memory;
+}
+
+/*
+** Finalize the least recently used statements until the pool is within
+** its limits.
+*/
+SQLITE_PRIVATE void evictPooledStatements(sp_connection *conn){
+  while( conn->pool_last && (conn->pool_count > conn->pool_max_count ||
+                             conn->pool_memory > conn->pool_max_memory) ){
+    pooled_stmt *entry = conn->pool_last;
+    unlinkPooledStatement(conn, entry);
+    sqlite3_finalize(entry->stmt);
+    sqlite3_free(entry);
+  }
+}
+
+/*
+** Finalize all the statements on the pool.
+*/
+SQLITE_PRIVATE void flushStatementPool(sp_connection *conn){
+  while( conn->pool_first ){
+    pooled_stmt *entry = conn->pool_first;
+    unlinkPooledStatement(conn, entry);
+    sqlite3_finalize(entry->stmt);
+    sqlite3_free(entry);
+  }
+  sqlite3_free(conn->pool_buckets);
+  conn->pool_buckets = NULL;
+}
+
+/*
+** Remove the statement of a procedure command from the pool and return it.
+** Return NULL if there is none.
+*/
+SQLITE_PRIVATE sqlite3_stmt* takePooledStatement(sp_connection *conn, u64 version, int cmd_pos){
+  pooled_stmt *entry;
+  sqlite3_stmt *stmt;
+
+  if( conn->pool_buckets==NULL ) return NULL;
+
+  for( entry=conn->pool_buckets[poolBucket(version, cmd_pos)]; entry;
+       entry=entry->next_in_bucket ){
+    if( entry->version==version && entry->cmd_pos==cmd_pos ) break;
+  }
+  if( entry==NULL ) return NULL;
+
+  unlinkPooledStatement(conn, entry);
+  stmt = entry->stmt;
+  sqlite3_free(entry);
+  return stmt;
+}
+
+/*
+** Store the statement of a procedure command on the pool, to be used by
+** other call frames of the same procedure version. The statement is finalized
+** if it cannot be stored.
+*/
+SQLITE_PRIVATE void poolStatement(
+  sp_connection *conn, stored_proc *procedure, int cmd_pos, sqlite3_stmt *stmt
+){
+  poolVersionStatement(conn, procedure->version, procedure->name, cmd_pos, stmt);
+}
+
+/*
+** Store a statement on the pool, identified by the version and position.
+*/
+SQLITE_PRIVATE void poolVersionStatement(
+  sp_connection *conn, u64 version, const char *name, int cmd_pos,
+  sqlite3_stmt *stmt
+){
+  pooled_stmt *entry;
+  unsigned int bucket;
+
+  // the pooled statements must be finalized before the connection is closed,
+  // what is done when the sp_statements table is disconnected
+  if( conn==NULL || !conn->pool_attached || conn->pool_max_count<=0 ){
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  if( conn->pool_buckets==NULL ){
+    conn->pool_buckets = sqlite3MallocZero(SP_POOL_BUCKETS * sizeof(pooled_stmt*));
+    if( conn->pool_buckets==NULL ){
+      sqlite3_finalize(stmt);
+      return;
+    }
+  }
+
+  entry = (pooled_stmt*) sqlite3MallocZero(sizeof(pooled_stmt));
+  if( entry==NULL ){
+    sqlite3_finalize(stmt);
+    return;
+  }
+  entry->version = version;
+  entry->cmd_pos = cmd_pos;
+  entry->stmt = stmt;
+  entry->memory = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_MEMUSED, 0);
+  strcpy(entry->name, name);
+
+  // add it to the bucket and as the most recently used
+  bucket = poolBucket(entry->version, cmd_pos);
+  entry->next_in_bucket = conn->pool_buckets[bucket];
+  conn->pool_buckets[bucket] = entry;
+  entry->next_used = conn->pool_first;
+  if( conn->pool_first ){
+    conn->pool_first->prev_used = entry;
+  }else{
+    conn->pool_last = entry;
+  }
+  conn->pool_first = entry;
+  conn->pool_count++;
+  conn->pool_memory += entry->memory;
+
+  evictPooledStatements(conn);
+}
+
+/*
+** Prepare the statement of a command, or take it from the pool when another
+** call frame of the same procedure version already prepared it.
+*/
+SQLITE_PRIVATE int prepareCommand(call_frame *frame, command *cmd, char *sql, int nsql){
+  stored_proc *procedure = frame->procedure;
+  cmd_state *state = commandState(frame, cmd);
+  sp_connection *conn = frame->conn;
+  int rc;
+
+  assert( state->stmt==NULL );
+
+  if( conn ){
+    state->stmt = takePooledStatement(conn, procedure->version,
+                                      (int)(cmd - procedure->cmds));
+    if( state->stmt ){
+      XTRACE("statement pool hit: %s #%d\n", procedure->name, (int)(cmd - procedure->cmds));
+      // the counters can be from before the profiling was enabled
+      if( conn->profile_enabled ) resetStatementCounters(state->stmt);
+      return prepareCommandBinds(frame, state);
+    }
+  }
+
+  rc = sqlite3_prepare_v3(frame->db, sql, nsql, SQLITE_PREPARE_PERSISTENT,
+                          &state->stmt, NULL);
+  if( rc!=SQLITE_OK ) return rc;
+
+  return prepareCommandBinds(frame, state);
+}
+
+/*
+** sp_statements
+**
+** Eponymous virtual table listing the statements on the pool. It is also
+** used to finalize them when the connection is closed: the virtual tables
+** are disconnected before the check for unfinalized statements.
+*/
+
+typedef struct sp_statements_vtab sp_statements_vtab;
+typedef struct sp_statements_cursor sp_statements_cursor;
+
+struct sp_statements_vtab {
+  sqlite3_vtab base;
+  sp_connection *conn;
+};
+
+struct sp_statements_cursor {
+  sqlite3_vtab_cursor base;
+  pooled_stmt *entry;
+  sqlite3_int64 rowid;
+};
+
+#define SP_STATEMENTS_PROCEDURE  0
+#define SP_STATEMENTS_COMMAND    1
+#define SP_STATEMENTS_SQL        2
+#define SP_STATEMENTS_MEMORY     3
+
+SQLITE_PRIVATE int spStatementsConnect(
+  sqlite3 *db, void *pAux, int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab, char **pzErr
+){
+  sp_connection *conn = (sp_connection*) pAux;
+  sp_statements_vtab *vtab;
+  int rc;
+
+  rc = sqlite3_declare_vtab(db,
+         "CREATE TABLE x(procedure TEXT, command INTEGER, sql TEXT, memory INTEGER)");
+  if( rc!=SQLITE_OK ) return rc;
+
+  vtab = (sp_statements_vtab*) sqlite3MallocZero(sizeof(sp_statements_vtab));
+  if( vtab==NULL ) return SQLITE_NOMEM;
+  vtab->conn = conn;
+  conn->pool_attached = true;
+
+  *ppVtab = &vtab->base;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spStatementsDisconnect(sqlite3_vtab *pVtab){
+  sp_statements_vtab *vtab = (sp_statements_vtab*) pVtab;
+  // the connection is being closed or the module was dropped. the frames
+  // kept by the stored functions also have statements
+  releaseFunctionFrames(vtab->conn);
+  flushStatementPool(vtab->conn);
+  vtab->conn->pool_attached = false;
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spStatementsBestIndex(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo){
+  pInfo->estimatedCost = 1000;
+  pInfo->estimatedRows = 100;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spStatementsOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor){
+  sp_statements_cursor *cur;
+
+  cur = (sp_statements_cursor*) sqlite3MallocZero(sizeof(sp_statements_cursor));
+  if( cur==NULL ) return SQLITE_NOMEM;
+  *ppCursor = &cur->base;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spStatementsClose(sqlite3_vtab_cursor *pCursor){
+  sqlite3_free(pCursor);
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spStatementsFilter(
+  sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  sp_statements_cursor *cur = (sp_statements_cursor*) pCursor;
+  sp_statements_vtab *vtab = (sp_statements_vtab*) pCursor->pVtab;
+  cur->entry = vtab->conn->pool_first;
+  cur->rowid = 1;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spStatementsNext(sqlite3_vtab_cursor *pCursor){
+  sp_statements_cursor *cur = (sp_statements_cursor*) pCursor;
+  cur->entry = cur->entry->next_used;
+  cur->rowid++;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spStatementsEof(sqlite3_vtab_cursor *pCursor){
+  sp_statements_cursor *cur = (sp_statements_cursor*) pCursor;
+  return cur->entry==NULL;
+}
+
+SQLITE_PRIVATE int spStatementsColumn(
+  sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i
+){
+  sp_statements_cursor *cur = (sp_statements_cursor*) pCursor;
+  pooled_stmt *entry = cur->entry;
+
+  switch( i ){
+    case SP_STATEMENTS_PROCEDURE:
+      sqlite3_result_text(ctx, entry->name, -1, SQLITE_TRANSIENT);
+      break;
+    case SP_STATEMENTS_COMMAND:
+      sqlite3_result_int(ctx, entry->cmd_pos + 1);
+      break;
+    case SP_STATEMENTS_SQL:
+      sqlite3_result_text(ctx, sqlite3_sql(entry->stmt), -1, SQLITE_TRANSIENT);
+      break;
+    case SP_STATEMENTS_MEMORY:
+      sqlite3_result_int(ctx, entry->memory);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spStatementsRowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid){
+  sp_statements_cursor *cur = (sp_statements_cursor*) pCursor;
+  *pRowid = cur->rowid;
+  return SQLITE_OK;
+}
+
+static sqlite3_module spStatementsModule = {
+  0,                       /* iVersion */
+  0,                       /* xCreate - eponymous only */
+  spStatementsConnect,     /* xConnect */
+  spStatementsBestIndex,   /* xBestIndex */
+  spStatementsDisconnect,  /* xDisconnect */
+  0,                       /* xDestroy */
+  spStatementsOpen,        /* xOpen */
+  spStatementsClose,       /* xClose */
+  spStatementsFilter,      /* xFilter */
+  spStatementsNext,        /* xNext */
+  spStatementsEof,         /* xEof */
+  spStatementsColumn,      /* xColumn */
+  spStatementsRowid,       /* xRowid */
+  0,                       /* xUpdate */
+  0,                       /* xBegin */
+  0,                       /* xSync */
+  0,                       /* xCommit */
+  0,                       /* xRollback */
+  0,                       /* xFindFunction */
+  0,                       /* xRename */
+  0,                       /* xSavepoint */
+  0,                       /* xRelease */
+  0,                       /* xRollbackTo */
+  0                        /* xShadowName */
+};
+
+/*
+** Connect the sp_statements table, so the statement pool is released when
+** the connection is closed. Until it is connected the statements are not
+** kept on the pool.
+*/
+SQLITE_PRIVATE void attachStatementPool(Parse *pParse, sp_connection *conn){
+  sqlite3 *db = pParse->db;
+  Module *pMod;
+
+  if( conn==NULL || conn->pool_attached ) return;
+
+  pMod = (Module*) sqlite3HashFind(&db->aModule, "sp_statements");
+  if( pMod==NULL || pMod->pModule!=&spStatementsModule ) return;
+
+  if( pMod->pEpoTab==NULL ){
+    sqlite3VtabEponymousTableInit(pParse, pMod);
+  }else if( sqlite3GetVTable(db, pMod->pEpoTab)==NULL ){
+    // it was disconnected by a sqlite3_close() call that returned SQLITE_BUSY
+    sqlite3VtabCallConnect(pParse, pMod->pEpoTab);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PROFILING
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+** The execution of each command is measured while the profiling is enabled
+** with sp_config('profile', 1). A command is measured from the start of its
+** execution until the start of the next command, or until the body stops.
+** When it is disabled the only cost is a check of the frame->profile
+** pointer on each command.
+*/
+
+/*
+** Return the time of a monotonic clock, in nanoseconds.
+*/
+SQLITE_PRIVATE sqlite3_int64 spClockNs(void){
+#if SQLITE_OS_WIN
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER counter;
+  if( freq.QuadPart==0 ) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (sqlite3_int64)((double)counter.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+** Read and clear the counters of a prepared statement.
+*/
+SQLITE_PRIVATE void resetStatementCounters(sqlite3_stmt *stmt){
+  sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+  sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+  sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+}
+
+/*
+** Return the statistics of the procedure version, creating them on the
+** first call. Returns NULL if out of memory.
+*/
+SQLITE_PRIVATE sp_profile* getProcedureProfile(sp_connection *conn, stored_proc *procedure){
+  sp_profile *head, *profile;
+  int i;
+
+  head = (sp_profile*) sqlite3HashFind(&conn->profiles, procedure->name);
+  for( profile=head; profile; profile=profile->next ){
+    if( profile->version==procedure->version ) return profile;
+  }
+
+  profile = (sp_profile*) sqlite3MallocZero(sizeof(sp_profile) +
+                          procedure->num_cmds * sizeof(sp_cmd_profile));
+  if( profile==NULL ) return NULL;
+  strcpy(profile->name, procedure->name);
+  profile->version = procedure->version;
+  profile->num_cmds = procedure->num_cmds;
+
+  for( i=0; i<procedure->num_cmds; i++ ){
+    command *cmd = &procedure->cmds[i];
+    profile->cmds[i].type = cmd->type;
+    if( cmd->fused_sql ){
+      // the statement that executes the loop
+      profile->cmds[i].sql = sqlite3_mprintf("%s", cmd->fused_sql);
+    }else if( cmd->sql ){
+      profile->cmds[i].sql = sqlite3_mprintf("%.*s", cmd->nsql, cmd->sql);
+    }
+  }
+
+  // the newest version comes first
+  profile->next = head;
+  if( sqlite3HashInsert(&conn->profiles, profile->name, profile)==profile ){
+    // out of memory
+    for( i=0; i<profile->num_cmds; i++ ){
+      sqlite3_free(profile->cmds[i].sql);
+    }
+    sqlite3_free(profile);
+    return NULL;
+  }
+  return profile;
+}
+
+/*
+** Finish the measure of the previous command and start the one of the
+** supplied command, which can be NULL when the execution stops.
+*/
+SQLITE_PRIVATE void profileCommand(call_frame *frame, command *cmd){
+  sqlite3_int64 now = spClockNs();
+  command *prev = frame->profiled_cmd;
+
+  if( prev ){
+    stored_proc *procedure = frame->procedure;
+    sp_cmd_profile *stats = &frame->profile->cmds[prev - procedure->cmds];
+    sqlite3_stmt *stmt = commandState(frame, prev)->stmt;
+    sqlite3_int64 elapsed = now - frame->profile_start;
+
+    stats->count++;
+    stats->total_ns += elapsed;
+    if( elapsed>stats->max_ns ) stats->max_ns = elapsed;
+    stats->rows += frame->profile_rows;
+    // cleared when the values need the conversions of SQLite
+    if( commandState(frame, prev)->flags & CMD_FLAG_NATIVE_EXPR ){
+      stats->native_count++;
+    }
+    if( stmt ){
+      stats->vm_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+      stats->fullscan_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+      stats->sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+      stats->autoindexes += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+    }
+  }
+
+  frame->profiled_cmd = cmd;
+  frame->profile_start = now;
+  frame->profile_rows = 0;
+}
+
+/*
+** Clear the collected statistics, keeping the allocated objects.
+*/
+SQLITE_PRIVATE void clearProcedureProfiles(sp_connection *conn){
+  HashElem *elem;
+
+  for( elem=sqliteHashFirst(&conn->profiles); elem; elem=sqliteHashNext(elem) ){
+    sp_profile *profile;
+    for( profile=sqliteHashData(elem); profile; profile=profile->next ){
+      int i;
+      for( i=0; i<profile->num_cmds; i++ ){
+        sp_cmd_profile *stats = &profile->cmds[i];
+        char *sql = stats->sql;
+        int type = stats->type;
+        memset(stats, 0, sizeof(sp_cmd_profile));
+        stats->type = type;
+        stats->sql = sql;
+      }
+    }
+  }
+}
+
+/*
+** Release the statistics. Called when the connection is closed.
+*/
+SQLITE_PRIVATE void releaseProcedureProfiles(sp_connection *conn){
+  HashElem *elem;
+
+  for( elem=sqliteHashFirst(&conn->profiles); elem; elem=sqliteHashNext(elem) ){
+    sp_profile *profile = (sp_profile*) sqliteHashData(elem);
+    while( profile ){
+      sp_profile *next = profile->next;
+      int i;
+      for( i=0; i<profile->num_cmds; i++ ){
+        sqlite3_free(profile->cmds[i].sql);
+      }
+      sqlite3_free(profile);
+      profile = next;
+    }
+  }
+  sqlite3HashClear(&conn->profiles);
+}
+
+/*
+** sp_profile
+**
+** Eponymous virtual table with the statistics of each command of the
+** profiled procedures, one row per procedure version and command. The
+** rows are the ones read by SET and FOREACH, or modified by statements.
+** The native_count has the executions whose expression was evaluated
+** without a prepared statement.
+*/
+
+typedef struct sp_profile_vtab sp_profile_vtab;
+typedef struct sp_profile_cursor sp_profile_cursor;
+
+struct sp_profile_vtab {
+  sqlite3_vtab base;
+  sp_connection *conn;
+};
+
+struct sp_profile_cursor {
+  sqlite3_vtab_cursor base;
+  HashElem *elem;
+  sp_profile *profile;
+  int cmd;
+  sqlite3_int64 rowid;
+};
+
+#define SP_PROFILE_PROCEDURE       0
+#define SP_PROFILE_COMMAND         1
+#define SP_PROFILE_TYPE            2
+#define SP_PROFILE_SQL             3
+#define SP_PROFILE_COUNT           4
+#define SP_PROFILE_TOTAL_US        5
+#define SP_PROFILE_MAX_US          6
+#define SP_PROFILE_ROWS            7
+#define SP_PROFILE_VM_STEPS        8
+#define SP_PROFILE_FULLSCAN_STEPS  9
+#define SP_PROFILE_SORTS           10
+#define SP_PROFILE_AUTOINDEXES     11
+#define SP_PROFILE_NATIVE_COUNT    12
+
+SQLITE_PRIVATE int spProfileConnect(
+  sqlite3 *db, void *pAux, int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab, char **pzErr
+){
+  sp_profile_vtab *vtab;
+  int rc;
+
+  rc = sqlite3_declare_vtab(db,
+         "CREATE TABLE x(procedure TEXT, command INTEGER, type TEXT, sql TEXT,"
+         " count INTEGER, total_us REAL, max_us REAL, rows INTEGER,"
+         " vm_steps INTEGER, fullscan_steps INTEGER, sorts INTEGER,"
+         " autoindexes INTEGER, native_count INTEGER)");
+  if( rc!=SQLITE_OK ) return rc;
+
+  vtab = (sp_profile_vtab*) sqlite3MallocZero(sizeof(sp_profile_vtab));
+  if( vtab==NULL ) return SQLITE_NOMEM;
+  vtab->conn = (sp_connection*) pAux;
+
+  *ppVtab = &vtab->base;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spProfileDisconnect(sqlite3_vtab *pVtab){
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spProfileBestIndex(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo){
+  pInfo->estimatedCost = 1000;
+  pInfo->estimatedRows = 100;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spProfileOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor){
+  sp_profile_cursor *cur;
+
+  cur = (sp_profile_cursor*) sqlite3MallocZero(sizeof(sp_profile_cursor));
+  if( cur==NULL ) return SQLITE_NOMEM;
+  *ppCursor = &cur->base;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spProfileClose(sqlite3_vtab_cursor *pCursor){
+  sqlite3_free(pCursor);
+  return SQLITE_OK;
+}
+
+/*
+** Move the cursor to the next command, skipping the procedures without
+** commands.
+*/
+SQLITE_PRIVATE void spProfileSkipEmpty(sp_profile_cursor *cur){
+  while( cur->profile && cur->cmd>=cur->profile->num_cmds ){
+    cur->cmd = 0;
+    cur->profile = cur->profile->next;
+    if( cur->profile==NULL ){
+      cur->elem = cur->elem ? sqliteHashNext(cur->elem) : NULL;
+      cur->profile = cur->elem ? (sp_profile*) sqliteHashData(cur->elem) : NULL;
+    }
+  }
+}
+
+SQLITE_PRIVATE int spProfileFilter(
+  sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  sp_profile_cursor *cur = (sp_profile_cursor*) pCursor;
+  sp_profile_vtab *vtab = (sp_profile_vtab*) pCursor->pVtab;
+  cur->elem = sqliteHashFirst(&vtab->conn->profiles);
+  cur->profile = cur->elem ? (sp_profile*) sqliteHashData(cur->elem) : NULL;
+  cur->cmd = 0;
+  cur->rowid = 1;
+  spProfileSkipEmpty(cur);
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spProfileNext(sqlite3_vtab_cursor *pCursor){
+  sp_profile_cursor *cur = (sp_profile_cursor*) pCursor;
+  cur->cmd++;
+  cur->rowid++;
+  spProfileSkipEmpty(cur);
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spProfileEof(sqlite3_vtab_cursor *pCursor){
+  sp_profile_cursor *cur = (sp_profile_cursor*) pCursor;
+  return cur->profile==NULL;
+}
+
+SQLITE_PRIVATE int spProfileColumn(
+  sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i
+){
+  sp_profile_cursor *cur = (sp_profile_cursor*) pCursor;
+  sp_cmd_profile *stats = &cur->profile->cmds[cur->cmd];
+
+  switch( i ){
+    case SP_PROFILE_PROCEDURE:
+      sqlite3_result_text(ctx, cur->profile->name, -1, SQLITE_TRANSIENT);
+      break;
+    case SP_PROFILE_COMMAND:
+      sqlite3_result_int(ctx, cur->cmd + 1);
+      break;
+    case SP_PROFILE_TYPE:
+      sqlite3_result_text(ctx, command_type_str(stats->type), -1, SQLITE_STATIC);
+      break;
+    case SP_PROFILE_SQL:
+      if( stats->sql ){
+        sqlite3_result_text(ctx, stats->sql, -1, SQLITE_TRANSIENT);
+      }
+      break;
+    case SP_PROFILE_COUNT:
+      sqlite3_result_int64(ctx, stats->count);
+      break;
+    case SP_PROFILE_TOTAL_US:
+      sqlite3_result_double(ctx, stats->total_ns / 1e3);
+      break;
+    case SP_PROFILE_MAX_US:
+      sqlite3_result_double(ctx, stats->max_ns / 1e3);
+      break;
+    case SP_PROFILE_ROWS:
+      sqlite3_result_int64(ctx, stats->rows);
+      break;
+    case SP_PROFILE_VM_STEPS:
+      sqlite3_result_int64(ctx, stats->vm_steps);
+      break;
+    case SP_PROFILE_FULLSCAN_STEPS:
+      sqlite3_result_int64(ctx, stats->fullscan_steps);
+      break;
+    case SP_PROFILE_SORTS:
+      sqlite3_result_int64(ctx, stats->sorts);
+      break;
+    case SP_PROFILE_AUTOINDEXES:
+      sqlite3_result_int64(ctx, stats->autoindexes);
+      break;
+    case SP_PROFILE_NATIVE_COUNT:
+      sqlite3_result_int64(ctx, stats->native_count);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spProfileRowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid){
+  sp_profile_cursor *cur = (sp_profile_cursor*) pCursor;
+  *pRowid = cur->rowid;
+  return SQLITE_OK;
+}
+
+static sqlite3_module spProfileModule = {
+  0,                       /* iVersion */
+  0,                       /* xCreate - eponymous only */
+  spProfileConnect,        /* xConnect */
+  spProfileBestIndex,      /* xBestIndex */
+  spProfileDisconnect,     /* xDisconnect */
+  0,                       /* xDestroy */
+  spProfileOpen,           /* xOpen */
+  spProfileClose,          /* xClose */
+  spProfileFilter,         /* xFilter */
+  spProfileNext,           /* xNext */
+  spProfileEof,            /* xEof */
+  spProfileColumn,         /* xColumn */
+  spProfileRowid,          /* xRowid */
+  0,                       /* xUpdate */
+  0,                       /* xBegin */
+  0,                       /* xSync */
+  0,                       /* xCommit */
+  0,                       /* xRollback */
+  0,                       /* xFindFunction */
+  0,                       /* xRename */
+  0,                       /* xSavepoint */
+  0,                       /* xRelease */
+  0,                       /* xRollbackTo */
+  0                        /* xShadowName */
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// LIST TABLE
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+** sp_list(@list)
+**
+** Eponymous table-valued function that returns the items of a list variable
+** as rows, so the list can be used in set-based statements:
+**
+**   INSERT INTO sale_items (sale_id, prod_id, qty, price)
+**     SELECT @sale_id, c1, c2, c3 FROM sp_list(@products);
+**   DELETE FROM t WHERE id IN (SELECT value FROM sp_list(@ids));
+**
+** The position column (also the rowid) is the 1-based position of the item.
+** When the item is a value it is returned on the value and c1 columns. When
+** it is a row (a list) its values are returned on the columns c1 to cN, and
+** the value column contains the row list.
+*/
+
+#define SP_LIST_MAX_COLUMNS  16
+
+typedef struct sp_list_cursor sp_list_cursor;
+
+struct sp_list_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_list *list;
+  int pos;                          // current item, 0-based
+  int end;                          // last item + 1
+};
+
+#define SP_LIST_POSITION  0
+#define SP_LIST_VALUE     1
+#define SP_LIST_C1        2
+#define SP_LIST_INPUT     (SP_LIST_C1 + SP_LIST_MAX_COLUMNS)
+
+// the constraints used by the cursor, on the idxNum
+#define SP_LIST_IDX_INPUT  1
+#define SP_LIST_IDX_EQ     2
+#define SP_LIST_IDX_LOWER  4
+#define SP_LIST_IDX_UPPER  8
+
+SQLITE_PRIVATE int spListConnect(
+  sqlite3 *db, void *pAux, int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab, char **pzErr
+){
+  sqlite3_vtab *vtab;
+  char *sql;
+  int rc, i;
+
+  sql = sqlite3_mprintf("CREATE TABLE x(position INTEGER, value");
+  for( i=1; sql && i<=SP_LIST_MAX_COLUMNS; i++ ){
+    sql = sqlite3_mprintf("%z, c%d", sql, i);
+  }
+  sql = sqlite3_mprintf("%z, list HIDDEN)", sql);
+  if( sql==NULL ) return SQLITE_NOMEM;
+
+  rc = sqlite3_declare_vtab(db, sql);
+  sqlite3_free(sql);
+  if( rc!=SQLITE_OK ) return rc;
+
+  vtab = (sqlite3_vtab*) sqlite3MallocZero(sizeof(sqlite3_vtab));
+  if( vtab==NULL ) return SQLITE_NOMEM;
+
+  *ppVtab = vtab;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spListDisconnect(sqlite3_vtab *pVtab){
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+/*
+** The list argument is required. The constraints on the position are used
+** to read only the matching items.
+*/
+SQLITE_PRIVATE int spListBestIndex(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo){
+  int input = -1, eq = -1, lower = -1, upper = -1;
+  int argv_index = 0;
+  double rows = 1000;
+  int i;
+
+  for( i=0; i<pInfo->nConstraint; i++ ){
+    const struct sqlite3_index_constraint *cons = &pInfo->aConstraint[i];
+    if( cons->iColumn==SP_LIST_INPUT ){
+      if( cons->op!=SQLITE_INDEX_CONSTRAINT_EQ || !cons->usable ){
+        return SQLITE_CONSTRAINT;
+      }
+      input = i;
+    }else if( cons->iColumn==SP_LIST_POSITION || cons->iColumn<0 ){
+      if( !cons->usable ) continue;
+      switch( cons->op ){
+        case SQLITE_INDEX_CONSTRAINT_EQ:
+          if( eq<0 ) eq = i;
+          break;
+        case SQLITE_INDEX_CONSTRAINT_GT:
+        case SQLITE_INDEX_CONSTRAINT_GE:
+          if( lower<0 ) lower = i;
+          break;
+        case SQLITE_INDEX_CONSTRAINT_LT:
+        case SQLITE_INDEX_CONSTRAINT_LE:
+          if( upper<0 ) upper = i;
+          break;
+      }
+    }
+  }
+
+  if( input<0 ){
+    // the list argument is required
+    return SQLITE_CONSTRAINT;
+  }
+
+  pInfo->idxNum = SP_LIST_IDX_INPUT;
+  pInfo->aConstraintUsage[input].argvIndex = ++argv_index;
+  pInfo->aConstraintUsage[input].omit = 1;
+
+  if( eq>=0 ){
+    pInfo->idxNum |= SP_LIST_IDX_EQ;
+    pInfo->aConstraintUsage[eq].argvIndex = ++argv_index;
+    pInfo->aConstraintUsage[eq].omit = 1;
+    rows = 1;
+  }else{
+    // the bounds are checked again by the core, as GT/LT are used as GE/LE
+    if( lower>=0 ){
+      pInfo->idxNum |= SP_LIST_IDX_LOWER;
+      pInfo->aConstraintUsage[lower].argvIndex = ++argv_index;
+      rows /= 4;
+    }
+    if( upper>=0 ){
+      pInfo->idxNum |= SP_LIST_IDX_UPPER;
+      pInfo->aConstraintUsage[upper].argvIndex = ++argv_index;
+      rows /= 4;
+    }
+  }
+
+  // the items are returned in order of position
+  if( pInfo->nOrderBy==1 && !pInfo->aOrderBy[0].desc &&
+      (pInfo->aOrderBy[0].iColumn==SP_LIST_POSITION ||
+       pInfo->aOrderBy[0].iColumn<0) ){
+    pInfo->orderByConsumed = 1;
+  }
+
+  pInfo->estimatedCost = rows;
+  pInfo->estimatedRows = (sqlite3_int64) rows;
+  if( eq>=0 ){
+    pInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+  }
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spListOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor){
+  sp_list_cursor *cur;
+
+  cur = (sp_list_cursor*) sqlite3MallocZero(sizeof(sp_list_cursor));
+  if( cur==NULL ) return SQLITE_NOMEM;
+  *ppCursor = &cur->base;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spListClose(sqlite3_vtab_cursor *pCursor){
+  sqlite3_free(pCursor);
+  return SQLITE_OK;
+}
+
+/*
+** Return the position on the value of a constraint, rounded up or down if
+** it is a real number. Returns false if it is not numeric.
+*/
+SQLITE_PRIVATE bool listPosition(sqlite3_value *value, bool round_up, sqlite3_int64 *ppos){
+  switch( sqlite3_value_numeric_type(value) ){
+    case SQLITE_INTEGER:
+      *ppos = sqlite3_value_int64(value);
+      return true;
+    case SQLITE_FLOAT: {
+      double d = sqlite3_value_double(value);
+      sqlite3_int64 pos;
+      if( d>=(double)LARGEST_INT64 ){
+        pos = LARGEST_INT64;
+      }else if( d<=(double)SMALLEST_INT64 ){
+        pos = SMALLEST_INT64;
+      }else{
+        pos = (sqlite3_int64) d;
+      }
+      if( round_up && (double)pos<d ) pos++;
+      if( !round_up && (double)pos>d ) pos--;
+      *ppos = pos;
+      return true;
+    }
+  }
+  return false;
+}
+
+SQLITE_PRIVATE int spListFilter(
+  sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  sp_list_cursor *cur = (sp_list_cursor*) pCursor;
+  sqlite3_int64 first = 1, last;
+  sqlite3_int64 pos;
+  int i = 0;
+
+  cur->list = NULL;
+  cur->pos = cur->end = 0;
+
+  if( (idxNum & SP_LIST_IDX_INPUT)==0 ) return SQLITE_OK;
+
+  cur->list = get_list_from_value(argv[i++]);
+  if( cur->list==NULL ){
+    if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return SQLITE_OK;
+    sqlite3_free(pCursor->pVtab->zErrMsg);
+    pCursor->pVtab->zErrMsg = sqlite3_mprintf("sp_list: the argument is not a list");
+    return SQLITE_ERROR;
+  }
+  last = cur->list->num_items;
+
+  if( idxNum & SP_LIST_IDX_EQ ){
+    sqlite3_value *value = argv[i++];
+    // a position that is not an integer does not match any item
+    if( !listPosition(value, false, &pos) || (double)pos!=sqlite3_value_double(value) ){
+      return SQLITE_OK;
+    }
+    first = last = pos;
+  }
+  if( idxNum & SP_LIST_IDX_LOWER ){
+    if( !listPosition(argv[i++], true, &pos) ) return SQLITE_OK;
+    if( pos>first ) first = pos;
+  }
+  if( idxNum & SP_LIST_IDX_UPPER ){
+    if( !listPosition(argv[i++], false, &pos) ) return SQLITE_OK;
+    if( pos<last ) last = pos;
+  }
+
+  if( first<1 ) first = 1;
+  if( last>cur->list->num_items ) last = cur->list->num_items;
+  if( first<=last ){
+    cur->pos = (int) first - 1;
+    cur->end = (int) last;
+  }
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spListNext(sqlite3_vtab_cursor *pCursor){
+  sp_list_cursor *cur = (sp_list_cursor*) pCursor;
+  cur->pos++;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spListEof(sqlite3_vtab_cursor *pCursor){
+  sp_list_cursor *cur = (sp_list_cursor*) pCursor;
+  return cur->pos>=cur->end;
+}
+
+SQLITE_PRIVATE int spListColumn(
+  sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i
+){
+  sp_list_cursor *cur = (sp_list_cursor*) pCursor;
+  Mem cell;
+  sqlite3_value *item;
+  sqlite3_list *row;
+
+  sqlite3VdbeMemInit(&cell, NULL, MEM_Null);
+  item = listItem(cur->list, cur->pos, &cell);
+  row = get_list_from_value(item);
+
+  if( i==SP_LIST_POSITION ){
+    sqlite3_result_int64(ctx, cur->pos + 1);
+  }else if( i==SP_LIST_VALUE ){
+    if( row ){
+      sqlite3_result_pointer(ctx, row, "list", NULL);
+    }else{
+      sqlite3_result_value(ctx, item);
+    }
+  }else if( i>=SP_LIST_C1 && i<SP_LIST_INPUT ){
+    int col = i - SP_LIST_C1;
+    if( row ){
+      if( col<row->num_items ){
+        sqlite3_value *value = listItem(row, col, &cell);
+        sqlite3_list *sub_list = get_list_from_value(value);
+        if( sub_list ){
+          sqlite3_result_pointer(ctx, sub_list, "list", NULL);
+        }else{
+          sqlite3_result_value(ctx, value);
+        }
+      }
+    }else if( col==0 ){
+      sqlite3_result_value(ctx, item);
+    }
+  }
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spListRowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid){
+  sp_list_cursor *cur = (sp_list_cursor*) pCursor;
+  *pRowid = cur->pos + 1;
+  return SQLITE_OK;
+}
+
+static sqlite3_module spListModule = {
+  0,                       /* iVersion */
+  0,                       /* xCreate - eponymous only */
+  spListConnect,           /* xConnect */
+  spListBestIndex,         /* xBestIndex */
+  spListDisconnect,        /* xDisconnect */
+  0,                       /* xDestroy */
+  spListOpen,              /* xOpen */
+  spListClose,             /* xClose */
+  spListFilter,            /* xFilter */
+  spListNext,              /* xNext */
+  spListEof,               /* xEof */
+  spListColumn,            /* xColumn */
+  spListRowid,             /* xRowid */
+  0,                       /* xUpdate */
+  0,                       /* xBegin */
+  0,                       /* xSync */
+  0,                       /* xCommit */
+  0,                       /* xRollback */
+  0,                       /* xFindFunction */
+  0,                       /* xRename */
+  0,                       /* xSavepoint */
+  0,                       /* xRelease */
+  0,                       /* xRollbackTo */
+  0                        /* xShadowName */
+};
+
+/*
+** FOREACH loops over a list whose body is a single INSERT of one row with
+** values made only of the loop variables, other variables and literals:
+**
+**   FOREACH @prod_id, @qty IN @products DO
+**     INSERT INTO sale_items (sale_id, prod_id, qty) VALUES (@sale_id, @prod_id, @qty);
+**   END LOOP;
+**
+** are executed as a single statement over the items of the list:
+**
+**   INSERT INTO sale_items (sale_id, prod_id, qty)
+**     SELECT @sale_id, sp_items.c1, sp_items.c2 FROM sp_list(:sp_items) AS sp_items
+**     ORDER BY sp_items.position LIMIT :sp_limit
+**
+** The last item is not included: it is inserted by the loop body, so the
+** changes() and last_insert_rowid() are the ones of its INSERT.
+** The rows are inserted in the same order, firing the same triggers and
+** failing on the same constraints. Function calls, subqueries and column
+** references are not accepted on the values, as they could see the rows
+** inserted by the previous items. UPDATE and DELETE are not fused: an item
+** can modify the rows of a previous one.
+*/
+
+/*
+** Check if the FOREACH loop at the given position can be executed as a
+** single statement, and store it on the fused_sql of the command.
+*/
+SQLITE_PRIVATE int fuseForeachLoop(stored_proc *procedure, int pos){
+  command *loop = &procedure->cmds[pos];
+  command *body = &procedure->cmds[pos + 1];
+  char *sql = body->sql;
+  char *end = body->sql + body->nsql;
+  char *values = NULL;
+  char *fused;
+  int depth = 0;
+  bool closed = false;
+  int n, tokenType, i;
+
+  if( loop->input_var<0 && loop->input_list==NULL ) return SQLITE_OK;
+  if( loop->num_vars==0 || loop->num_vars>SP_LIST_MAX_COLUMNS ) return SQLITE_OK;
+  if( body->type!=CMD_TYPE_STATEMENT ) return SQLITE_OK;
+
+  // INSERT INTO name[.name] [(columns)] VALUES
+  for( i=0; sql<end; sql+=n ){
+    n = sqlite3GetToken((u8*)sql, &tokenType);
+    if( n<=0 ) return SQLITE_OK;
+    if( tokenType==TK_SPACE || tokenType==TK_COMMENT ) continue;
+    if( i==0 && tokenType!=TK_INSERT ) return SQLITE_OK;
+    if( i==1 && tokenType!=TK_INTO ) return SQLITE_OK;
+    i++;
+    if( i<=2 ) continue;
+    if( tokenType==TK_VALUES ){
+      values = sql;
+      sql += n;
+      break;
+    }
+    if( tokenType!=TK_ID && tokenType!=TK_DOT && tokenType!=TK_LP &&
+        tokenType!=TK_RP && tokenType!=TK_COMMA ){
+      return SQLITE_OK;
+    }
+  }
+  if( values==NULL ) return SQLITE_OK;
+
+  fused = sqlite3_mprintf("%.*sSELECT ", (int)(values - body->sql), body->sql);
+
+  // a single row of values
+  for( ; sql<end && fused; sql+=n ){
+    n = sqlite3GetToken((u8*)sql, &tokenType);
+    if( n<=0 ) goto loc_not_fused;
+    if( tokenType==TK_SPACE || tokenType==TK_COMMENT ){
+      if( depth>0 ) fused = sqlite3_mprintf("%z ", fused);
+      continue;
+    }
+    // nothing can follow the row of values
+    if( closed ) goto loc_not_fused;
+    switch( tokenType ){
+      case TK_LP:
+        if( depth++==0 ) continue;
+        break;
+      case TK_RP:
+        if( depth==0 ) goto loc_not_fused;
+        if( --depth==0 ){
+          closed = true;
+          continue;
+        }
+        break;
+      case TK_VARIABLE: {
+        int slot = -1;
+        if( depth==0 || sql[0]!='@' ) goto loc_not_fused;
+        if( n<sizeof(((sqlite3_var*)0)->name) ){
+          slot = findVariable(procedure, sql, n);
+        }
+        for( i=loop->num_vars-1; slot>=0 && i>=0; i-- ){
+          if( loop->vars[i]==slot ) break;
+        }
+        if( slot>=0 && i>=0 ){
+          fused = sqlite3_mprintf("%zsp_items.c%d", fused, i + 1);
+          continue;
+        }
+        break;
+      }
+      case TK_COMMA:
+      case TK_INTEGER:
+      case TK_FLOAT:
+      case TK_STRING:
+      case TK_BLOB:
+      case TK_NULL:
+      case TK_PLUS:
+      case TK_MINUS:
+      case TK_STAR:
+      case TK_SLASH:
+      case TK_REM:
+      case TK_CONCAT:
+        if( depth==0 ) goto loc_not_fused;
+        break;
+      default:
+        goto loc_not_fused;
+    }
+    fused = sqlite3_mprintf("%z%.*s", fused, n, sql);
+  }
+  if( fused==NULL ) return SQLITE_NOMEM;
+  if( !closed ) goto loc_not_fused;
+
+  fused = sqlite3_mprintf("%z FROM sp_list(:sp_items) AS sp_items"
+                          " ORDER BY sp_items.position LIMIT :sp_limit", fused);
+  if( fused==NULL ) return SQLITE_NOMEM;
+
+  loop->fused_sql = fused;
+  loop->nfused_sql = strlen(fused);
+  return SQLITE_OK;
+
+loc_not_fused:
+  sqlite3_free(fused);
+  return SQLITE_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LIST FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+** Functions over the items of a list variable, so the procedures do not
+** need a FOREACH loop to compute them:
+**
+**   SET @total = list_sum(@prices);
+**   IF list_contains(@ids, @id) THEN ... END IF;
+**
+** The aggregates skip the NULL items and the sub-lists, like the aggregate
+** functions of SQLite skip the NULL values, but the rows with a single
+** column are used as their value. The items are compared with the rules of
+** SQLite, so list_contains([1,2], 2.0) is true.
+**
+** The packed lists of integers and real numbers are processed by vectorized
+** kernels: SSE2 when it is enabled on the build, and AVX2 when the CPU also
+** supports it, detected at run time. All the kernels return the same
+** results: the real numbers are added on 4 partial sums, by the position of
+** the item, also on the other lists, so the replicas compute the same sums
+** on any machine.
+*/
+
+#define LIST_FUNC_LEN       0
+#define LIST_FUNC_SUM       1
+#define LIST_FUNC_AVG       2
+#define LIST_FUNC_MIN       3
+#define LIST_FUNC_MAX       4
+#define LIST_FUNC_CONTAINS  5
+#define LIST_FUNC_INDEX_OF  6
+
+// partial sums of the real numbers
+#define LIST_SUM_LANES  4
+
+typedef struct list_function list_function;
+
+struct list_function {
+  const char *name;
+  int num_args;
+  int op;                           // one of the LIST_FUNC_* codes
+  void (*xFunc)(sqlite3_context*, int, sqlite3_value**);
+};
+
+#if SP_LIST_SIMD
+#define SP_TARGET_AVX2  __attribute__((target("avx2")))
+
+/*
+** Return true if the CPU supports the AVX2 instructions. The detection is
+** done once. The result is read and stored atomically, so a concurrent first
+** call just repeats it.
+*/
+SQLITE_PRIVATE bool listHasAvx2(void){
+  static int has_avx2 = -1;
+  int value = AtomicLoad(&has_avx2);
+  if( value<0 ){
+    __builtin_cpu_init();
+    value = __builtin_cpu_supports("avx2") ? 1 : 0;
+    AtomicStore(&has_avx2, value);
+  }
+  return value==1;
+}
+
+/*
+** The AVX2 kernels. They are compiled for AVX2 without enabling it on the
+** rest of the file, and only called when the CPU supports it.
+*/
+
+SQLITE_PRIVATE SP_TARGET_AVX2 void listRealsSumAvx2(const double *a, int n, double *lanes){
+  __m256d sum = _mm256_loadu_pd(lanes);
+  int i = 0;
+  for( ; i+4<=n; i+=4 ){
+    sum = _mm256_add_pd(sum, _mm256_loadu_pd(&a[i]));
+  }
+  _mm256_storeu_pd(lanes, sum);
+  for( ; i<n; i++ ){
+    lanes[i % LIST_SUM_LANES] += a[i];
+  }
+}
+
+SQLITE_PRIVATE SP_TARGET_AVX2 i64 listIntsSumAvx2(const i64 *a, int n){
+  __m256i acc = _mm256_setzero_si256();
+  i64 parts[4];
+  u64 sum;
+  int i = 0;
+  for( ; i+4<=n; i+=4 ){
+    acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i*)&a[i]));
+  }
+  _mm256_storeu_si256((__m256i*)parts, acc);
+  sum = (u64)parts[0] + (u64)parts[1] + (u64)parts[2] + (u64)parts[3];
+  for( ; i<n; i++ ){
+    sum += (u64)a[i];
+  }
+  return (i64)sum;
+}
+
+SQLITE_PRIVATE SP_TARGET_AVX2 void listIntsMinMaxAvx2(const i64 *a, int n, i64 *pmin, i64 *pmax){
+  __m256i min = _mm256_set1_epi64x(a[0]);
+  __m256i max = min;
+  i64 mins[4], maxs[4];
+  int i = 0, k;
+  for( ; i+4<=n; i+=4 ){
+    __m256i x = _mm256_loadu_si256((const __m256i*)&a[i]);
+    min = _mm256_blendv_epi8(min, x, _mm256_cmpgt_epi64(min, x));
+    max = _mm256_blendv_epi8(max, x, _mm256_cmpgt_epi64(x, max));
+  }
+  _mm256_storeu_si256((__m256i*)mins, min);
+  _mm256_storeu_si256((__m256i*)maxs, max);
+  for( k=1; k<4; k++ ){
+    if( mins[k]<mins[0] ) mins[0] = mins[k];
+    if( maxs[k]>maxs[0] ) maxs[0] = maxs[k];
+  }
+  for( ; i<n; i++ ){
+    if( a[i]<mins[0] ) mins[0] = a[i];
+    if( a[i]>maxs[0] ) maxs[0] = a[i];
+  }
+  *pmin = mins[0];
+  *pmax = maxs[0];
+}
+
+/*
+** Process the blocks of 4 real numbers on the lanes of the minimum and the
+** maximum, and return the position of the first item not processed.
+*/
+SQLITE_PRIVATE SP_TARGET_AVX2 int listRealsMinMaxAvx2(const double *a, int n, double *mins, double *maxs){
+  __m256d min = _mm256_loadu_pd(mins);
+  __m256d max = _mm256_loadu_pd(maxs);
+  int i = 0;
+  for( ; i+4<=n; i+=4 ){
+    __m256d x = _mm256_loadu_pd(&a[i]);
+    min = _mm256_min_pd(x, min);
+    max = _mm256_max_pd(x, max);
+  }
+  _mm256_storeu_pd(mins, min);
+  _mm256_storeu_pd(maxs, max);
+  return i;
+}
+
+SQLITE_PRIVATE SP_TARGET_AVX2 int listIntsFindAvx2(const i64 *a, int n, i64 value){
+  __m256i x = _mm256_set1_epi64x(value);
+  int i = 0;
+  for( ; i+4<=n; i+=4 ){
+    __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)&a[i]), x);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+    if( mask ) return i + __builtin_ctz(mask);
+  }
+  for( ; i<n; i++ ){
+    if( a[i]==value ) return i;
+  }
+  return -1;
+}
+
+SQLITE_PRIVATE SP_TARGET_AVX2 int listRealsFindAvx2(const double *a, int n, double value){
+  __m256d x = _mm256_set1_pd(value);
+  int i = 0;
+  for( ; i+4<=n; i+=4 ){
+    int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(&a[i]), x, _CMP_EQ_OQ));
+    if( mask ) return i + __builtin_ctz(mask);
+  }
+  for( ; i<n; i++ ){
+    if( a[i]==value ) return i;
+  }
+  return -1;
+}
+
+#endif
+
+/*
+** Add the real numbers on the partial sums, by the position of the item.
+*/
+SQLITE_PRIVATE void listRealsSum(const double *a, int n, double *lanes){
+  int i = 0;
+
+#if SP_LIST_SIMD
+  if( listHasAvx2() ){
+    listRealsSumAvx2(a, n, lanes);
+    return;
+  }
+  {
+    __m128d sum01 = _mm_loadu_pd(&lanes[0]);
+    __m128d sum23 = _mm_loadu_pd(&lanes[2]);
+    for( ; i+4<=n; i+=4 ){
+      sum01 = _mm_add_pd(sum01, _mm_loadu_pd(&a[i]));
+      sum23 = _mm_add_pd(sum23, _mm_loadu_pd(&a[i+2]));
+    }
+    _mm_storeu_pd(&lanes[0], sum01);
+    _mm_storeu_pd(&lanes[2], sum23);
+  }
+#endif
+
+  for( ; i<n; i++ ){
+    lanes[i % LIST_SUM_LANES] += a[i];
+  }
+}
+
+/*
+** Return the sum of the integers, if it cannot overflow in any order. The
+** caller checks the bounds with the minimum and maximum values.
+*/
+SQLITE_PRIVATE i64 listIntsSum(const i64 *a, int n){
+  u64 sum = 0;
+  int i = 0;
+
+#if SP_LIST_SIMD
+  if( listHasAvx2() ){
+    return listIntsSumAvx2(a, n);
+  }
+  {
+    __m128i acc = _mm_setzero_si128();
+    i64 parts[2];
+    for( ; i+2<=n; i+=2 ){
+      acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i*)&a[i]));
+    }
+    _mm_storeu_si128((__m128i*)parts, acc);
+    sum = (u64)parts[0] + (u64)parts[1];
+  }
+#endif
+
+  for( ; i<n; i++ ){
+    sum += (u64)a[i];
+  }
+  return (i64)sum;
+}
+
+/*
+** Find the minimum and the maximum of the integers. The list is not empty.
+*/
+SQLITE_PRIVATE void listIntsMinMax(const i64 *a, int n, i64 *pmin, i64 *pmax){
+  i64 min = a[0], max = a[0];
+  int i = 0;
+
+#if SP_LIST_SIMD
+  // SSE2 has no comparison of 64-bit integers
+  if( listHasAvx2() ){
+    listIntsMinMaxAvx2(a, n, pmin, pmax);
+    return;
+  }
+#endif
+
+  for( ; i<n; i++ ){
+    if( a[i]<min ) min = a[i];
+    if( a[i]>max ) max = a[i];
+  }
+  *pmin = min;
+  *pmax = max;
+}
+
+/*
+** Find the minimum and the maximum of the real numbers. The list is not
+** empty. Each lane keeps the first of the equal values, like the scalar
+** comparison, so the sign of a zero result does not depend on the kernel.
+*/
+SQLITE_PRIVATE void listRealsMinMax(const double *a, int n, double *pmin, double *pmax){
+  double min[LIST_SUM_LANES], max[LIST_SUM_LANES];
+  int i = 0, k;
+
+  for( k=0; k<LIST_SUM_LANES; k++ ){
+    min[k] = max[k] = a[0];
+  }
+
+#if SP_LIST_SIMD
+  if( listHasAvx2() ){
+    i = listRealsMinMaxAvx2(a, n, min, max);
+  }else{
+    __m128d min01 = _mm_loadu_pd(&min[0]), min23 = _mm_loadu_pd(&min[2]);
+    __m128d max01 = _mm_loadu_pd(&max[0]), max23 = _mm_loadu_pd(&max[2]);
+    for( ; i+4<=n; i+=4 ){
+      __m128d x01 = _mm_loadu_pd(&a[i]);
+      __m128d x23 = _mm_loadu_pd(&a[i+2]);
+      min01 = _mm_min_pd(x01, min01);
+      min23 = _mm_min_pd(x23, min23);
+      max01 = _mm_max_pd(x01, max01);
+      max23 = _mm_max_pd(x23, max23);
+    }
+    _mm_storeu_pd(&min[0], min01);
+    _mm_storeu_pd(&min[2], min23);
+    _mm_storeu_pd(&max[0], max01);
+    _mm_storeu_pd(&max[2], max23);
+  }
+#endif
+
+  for( ; i<n; i++ ){
+    k = i % LIST_SUM_LANES;
+    min[k] = a[i]<min[k] ? a[i] : min[k];
+    max[k] = a[i]>max[k] ? a[i] : max[k];
+  }
+  *pmin = min[0];
+  *pmax = max[0];
+  for( k=1; k<LIST_SUM_LANES; k++ ){
+    *pmin = min[k]<*pmin ? min[k] : *pmin;
+    *pmax = max[k]>*pmax ? max[k] : *pmax;
+  }
+}
+
+/*
+** Return the position of the first integer equal to the value, or -1.
+*/
+SQLITE_PRIVATE int listIntsFind(const i64 *a, int n, i64 value){
+  int i = 0;
+
+#if SP_LIST_SIMD
+  if( listHasAvx2() ){
+    return listIntsFindAvx2(a, n, value);
+  }
+  {
+    __m128i x = _mm_set1_epi64x(value);
+    for( ; i+2<=n; i+=2 ){
+      // compare the 32-bit halves, and join the results of each integer
+      __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)&a[i]), x);
+      eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2,3,0,1)));
+      int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+      if( mask ) return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for( ; i<n; i++ ){
+    if( a[i]==value ) return i;
+  }
+  return -1;
+}
+
+/*
+** Return the position of the first real number equal to the value, or -1.
+*/
+SQLITE_PRIVATE int listRealsFind(const double *a, int n, double value){
+  int i = 0;
+
+#if SP_LIST_SIMD
+  if( listHasAvx2() ){
+    return listRealsFindAvx2(a, n, value);
+  }
+  {
+    __m128d x = _mm_set1_pd(value);
+    for( ; i+2<=n; i+=2 ){
+      int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(&a[i]), x));
+      if( mask ) return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for( ; i<n; i++ ){
+    if( a[i]==value ) return i;
+  }
+  return -1;
+}
+
+/*
+** Return the list of the first argument, or NULL if it is NULL. Sets an
+** error if it is another value.
+*/
+SQLITE_PRIVATE sqlite3_list* listFunctionArgument(sqlite3_context *ctx, sqlite3_value *arg){
+  list_function *func = (list_function*) sqlite3_user_data(ctx);
+  sqlite3_list *list = get_list_from_value(arg);
+
+  if( list==NULL && sqlite3_value_type(arg)!=SQLITE_NULL ){
+    char *msg = sqlite3_mprintf("%s: the argument is not a list", func->name);
+    if( msg ){
+      sqlite3_result_error(ctx, msg, -1);
+      sqlite3_free(msg);
+    }else{
+      sqlite3_result_error_nomem(ctx);
+    }
+  }
+  return list;
+}
+
+/*
+** Return an item of the list for the list functions. The rows with a single
+** column, as stored by SET @list = (SELECT ...), are used as their value.
+*/
+SQLITE_PRIVATE sqlite3_value* listFunctionItem(sqlite3_list *list, int i, Mem *cell){
+  sqlite3_value *item = listItem(list, i, cell);
+  sqlite3_list *row = get_list_from_value(item);
+  if( row && row->num_items==1 ){
+    item = listItem(row, 0, cell);
+  }
+  return item;
+}
+
+/*
+** Store the result of an aggregate over the sum of the numbers. The sum of
+** the integers is used while it does not overflow and no other number is
+** added, as in the sum() and avg() functions.
+*/
+SQLITE_PRIVATE void listSumResult(
+  sqlite3_context *ctx, int op, int count, i64 sum, bool overflow, bool approx,
+  double *lanes
+){
+  double total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+  if( count==0 ) return;
+  if( op==LIST_FUNC_SUM ){
+    if( overflow ){
+      sqlite3_result_error(ctx, "integer overflow", -1);
+    }else if( approx ){
+      sqlite3_result_double(ctx, total);
+    }else{
+      sqlite3_result_int64(ctx, sum);
+    }
+  }else{
+    sqlite3_result_double(ctx, (overflow || approx) ? total / count : (double)sum / count);
+  }
+}
+
+/*
+** Aggregate a packed list of integers.
+*/
+SQLITE_PRIVATE void listIntsAggregate(sqlite3_context *ctx, int op, const i64 *a, int n){
+  double lanes[LIST_SUM_LANES] = {0};
+  bool overflow = false;
+  i64 min, max, limit, sum = 0;
+  int i;
+
+  listIntsMinMax(a, n, &min, &max);
+  if( op==LIST_FUNC_MIN ){
+    sqlite3_result_int64(ctx, min);
+    return;
+  }
+  if( op==LIST_FUNC_MAX ){
+    sqlite3_result_int64(ctx, max);
+    return;
+  }
+
+  // the sum cannot overflow, in any order, if all the values are within
+  // the limit. otherwise they are added in order, to fail as sum() does
+  limit = LARGEST_INT64 / n;
+  if( min>=-limit && max<=limit ){
+    sum = listIntsSum(a, n);
+  }else{
+    for( i=0; i<n && !overflow; i++ ){
+      overflow = sqlite3AddInt64(&sum, a[i]);
+    }
+    for( i=0; i<n && overflow; i++ ){
+      lanes[i % LIST_SUM_LANES] += (double)a[i];
+    }
+  }
+  listSumResult(ctx, op, n, sum, overflow, false, lanes);
+}
+
+/*
+** Aggregate a packed list of real numbers.
+*/
+SQLITE_PRIVATE void listRealsAggregate(sqlite3_context *ctx, int op, const double *a, int n){
+  double lanes[LIST_SUM_LANES] = {0};
+  double min, max;
+
+  if( op==LIST_FUNC_MIN || op==LIST_FUNC_MAX ){
+    listRealsMinMax(a, n, &min, &max);
+    sqlite3_result_double(ctx, op==LIST_FUNC_MIN ? min : max);
+    return;
+  }
+  listRealsSum(a, n, lanes);
+  listSumResult(ctx, op, n, 0, false, true, lanes);
+}
+
+/*
+** Aggregate a list of values, one item at a time. The values are converted
+** to numbers and compared as in the aggregate functions of SQLite.
+*/
+SQLITE_PRIVATE void listValuesAggregate(sqlite3_context *ctx, int op, sqlite3_list *list){
+  double lanes[LIST_SUM_LANES] = {0};
+  bool overflow = false, approx = false;
+  bool has_best = false;
+  Mem cell, best, number;
+  int i, count = 0;
+  i64 sum = 0;
+
+  sqlite3VdbeMemInit(&cell, NULL, MEM_Null);
+  sqlite3VdbeMemInit(&best, NULL, MEM_Null);
+  sqlite3VdbeMemInit(&number, NULL, MEM_Null);
+
+  for( i=0; i<list->num_items; i++ ){
+    sqlite3_value *item = listFunctionItem(list, i, &cell);
+    // the NULL values and the sub-lists are skipped
+    if( sqlite3_value_type(item)==SQLITE_NULL ) continue;
+    if( op==LIST_FUNC_MIN || op==LIST_FUNC_MAX ){
+      int cmp = has_best ? sqlite3MemCompare(item, &best, NULL) : 0;
+      if( !has_best || (op==LIST_FUNC_MIN ? cmp<0 : cmp>0) ){
+        // the item memory is kept by the list
+        sqlite3VdbeMemShallowCopy(&best, item, MEM_Ephem);
+        has_best = true;
+      }
+      continue;
+    }
+    // the conversion is made on a copy. the list can be shared
+    sqlite3VdbeMemShallowCopy(&number, item, MEM_Ephem);
+    count++;
+    if( sqlite3_value_numeric_type(&number)==SQLITE_INTEGER ){
+      i64 value = sqlite3_value_int64(&number);
+      lanes[i % LIST_SUM_LANES] += (double)value;
+      if( !approx && !overflow ) overflow = sqlite3AddInt64(&sum, value);
+    }else{
+      lanes[i % LIST_SUM_LANES] += sqlite3_value_double(&number);
+      approx = true;
+    }
+  }
+
+  if( op==LIST_FUNC_MIN || op==LIST_FUNC_MAX ){
+    if( has_best ) sqlite3_result_value(ctx, &best);
+    return;
+  }
+  listSumResult(ctx, op, count, sum, overflow, approx, lanes);
+}
+
+/*
+** list_sum(list), list_avg(list), list_min(list) and list_max(list)
+*/
+SQLITE_PRIVATE void listAggregateFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  list_function *func = (list_function*) sqlite3_user_data(ctx);
+  sqlite3_list *list = listFunctionArgument(ctx, argv[0]);
+
+  if( list==NULL || list->num_items==0 ) return;
+
+  switch( list->type ){
+    case LIST_INTEGERS:
+      listIntsAggregate(ctx, func->op, listInts(list), list->num_items);
+      break;
+    case LIST_REALS:
+      listRealsAggregate(ctx, func->op, listReals(list), list->num_items);
+      break;
+    default:
+      listValuesAggregate(ctx, func->op, list);
+      break;
+  }
+}
+
+/*
+** list_len(list)
+*/
+SQLITE_PRIVATE void listLenFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  sqlite3_list *list = listFunctionArgument(ctx, argv[0]);
+  if( list ) sqlite3_result_int(ctx, list->num_items);
+}
+
+/*
+** Convert the value to an integer that is equal to it, if there is one.
+*/
+SQLITE_PRIVATE bool listIntegerKey(sqlite3_value *value, i64 *pkey){
+  double r;
+  switch( sqlite3_value_type(value) ){
+    case SQLITE_INTEGER:
+      *pkey = sqlite3_value_int64(value);
+      return true;
+    case SQLITE_FLOAT:
+      r = sqlite3_value_double(value);
+      if( r>=-9223372036854775808.0 && r<9223372036854775808.0 && (double)(i64)r==r ){
+        *pkey = (i64)r;
+        return true;
+      }
+      break;
+  }
+  return false;
+}
+
+/*
+** Convert the value to a real number that is equal to it, if there is one.
+*/
+SQLITE_PRIVATE bool listRealKey(sqlite3_value *value, double *pkey){
+  i64 i;
+  switch( sqlite3_value_type(value) ){
+    case SQLITE_FLOAT:
+      *pkey = sqlite3_value_double(value);
+      return true;
+    case SQLITE_INTEGER:
+      i = sqlite3_value_int64(value);
+      *pkey = (double)i;
+      // the integers that are not exact on a double do not match any item
+      return *pkey<9223372036854775808.0 && (i64)*pkey==i;
+  }
+  return false;
+}
+
+/*
+** list_contains(list, value) and list_index_of(list, value). The position
+** is 1-based, as on the sp_list table, and 0 if the value is not found.
+*/
+SQLITE_PRIVATE void listFindFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  list_function *func = (list_function*) sqlite3_user_data(ctx);
+  sqlite3_list *list = listFunctionArgument(ctx, argv[0]);
+  sqlite3_value *value = argv[1];
+  int pos = -1;
+
+  if( list==NULL || sqlite3_value_type(value)==SQLITE_NULL ) return;
+
+  if( list->type==LIST_INTEGERS ){
+    i64 key;
+    if( listIntegerKey(value, &key) ){
+      pos = listIntsFind(listInts(list), list->num_items, key);
+    }
+  }else if( list->type==LIST_REALS ){
+    double key;
+    if( listRealKey(value, &key) ){
+      pos = listRealsFind(listReals(list), list->num_items, key);
+    }
+  }else{
+    Mem cell;
+    int i;
+    sqlite3VdbeMemInit(&cell, NULL, MEM_Null);
+    for( i=0; i<list->num_items; i++ ){
+      sqlite3_value *item = listFunctionItem(list, i, &cell);
+      if( sqlite3_value_type(item)==SQLITE_NULL ) continue;
+      if( sqlite3MemCompare(item, value, NULL)==0 ){
+        pos = i;
+        break;
+      }
+    }
+  }
+
+  if( func->op==LIST_FUNC_CONTAINS ){
+    sqlite3_result_int(ctx, pos>=0);
+  }else{
+    sqlite3_result_int(ctx, pos + 1);
+  }
+}
+
+static list_function listFunctions[] = {
+  { "list_len",       1, LIST_FUNC_LEN,       listLenFunc },
+  { "list_sum",       1, LIST_FUNC_SUM,       listAggregateFunc },
+  { "list_avg",       1, LIST_FUNC_AVG,       listAggregateFunc },
+  { "list_min",       1, LIST_FUNC_MIN,       listAggregateFunc },
+  { "list_max",       1, LIST_FUNC_MAX,       listAggregateFunc },
+  { "list_contains",  2, LIST_FUNC_CONTAINS,  listFindFunc },
+  { "list_index_of",  2, LIST_FUNC_INDEX_OF,  listFindFunc },
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// LATENCY HISTOGRAMS
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+** The wall time of each CALL, from its execution until the last row is
+** read, is recorded on a histogram of the procedure on the connection. The
+** histograms are only written by their connection, with relaxed atomic
+** stores, so recording does not take locks. The connections are linked on
+** a registry, used to merge the histograms of all of them.
+*/
+
+static sp_connection *latencyRegistry;
+static sqlite3_mutex *latencyRegistryMutexPtr;
+
+// the registry and the lists of histograms are protected by this mutex. it
+// is not used to record the values, and it is held while the histograms are
+// merged, so it is not the main mutex of SQLite
+#define latencyRegistryMutex()  privateMutex(&latencyRegistryMutexPtr)
+
+/*
+** Return the bucket of a value.
+*/
+SQLITE_PRIVATE int latencyBucket(u64 value){
+  int e = 0;
+
+  if( value<SP_HIST_SUB_COUNT ) return (int)value;
+  if( value>>(SP_HIST_MAX_EXP+1) ) return SP_HIST_BUCKETS - 1;
+
+#if defined(__GNUC__) || defined(__clang__)
+  e = 63 - __builtin_clzll(value);
+#else
+  { u64 x = value; while( x>>=1 ) e++; }
+#endif
+
+  return (e - SP_HIST_SUB_BITS + 1) * SP_HIST_SUB_COUNT +
+         (int)((value >> (e - SP_HIST_SUB_BITS)) & (SP_HIST_SUB_COUNT - 1));
+}
+
+/*
+** Return the highest value of a bucket.
+*/
+SQLITE_PRIVATE u64 latencyBucketLimit(int bucket){
+  int group = bucket / SP_HIST_SUB_COUNT;
+  int sub = bucket % SP_HIST_SUB_COUNT;
+  int e;
+
+  if( group==0 ) return bucket;
+  e = group + SP_HIST_SUB_BITS - 1;
+  return ((u64)(SP_HIST_SUB_COUNT + sub + 1) << (e - SP_HIST_SUB_BITS)) - 1;
+}
+
+/*
+** Return the latency histogram of the procedure on the connection, creating
+** it on the first call. Returns NULL if out of memory.
+*/
+SQLITE_PRIVATE sp_histogram* getLatencyHistogram(sp_connection *conn, const char *name){
+  sqlite3_mutex *mutex = latencyRegistryMutex();
+  sp_histogram *hist;
+
+  hist = (sp_histogram*) sqlite3HashFind(&conn->latencies, name);
+  if( hist ) return hist;
+
+  hist = (sp_histogram*) sqlite3MallocZero(sizeof(sp_histogram));
+  if( hist==NULL ) return NULL;
+  strcpy(hist->name, name);
+
+  if( sqlite3HashInsert(&conn->latencies, hist->name, hist)==hist ){
+    // out of memory
+    sqlite3_free(hist);
+    return NULL;
+  }
+
+  sqlite3_mutex_enter(mutex);
+  hist->next = conn->histograms;
+  conn->histograms = hist;
+  sqlite3_mutex_leave(mutex);
+
+  return hist;
+}
+
+/*
+** Record the latency of the CALL that is ending.
+*/
+SQLITE_PRIVATE void recordCallLatency(call_frame *frame){
+  sp_histogram *hist = frame->latency;
+  sqlite3_int64 elapsed = spClockNs() - frame->call_start;
+  u64 value = elapsed>0 ? (u64)elapsed : 0;
+  int bucket;
+
+  frame->call_start = 0;
+
+  if( hist==NULL ){
+    hist = getLatencyHistogram(frame->conn, frame->procedure->name);
+    if( hist==NULL ) return;
+    frame->latency = hist;
+  }
+
+  // only this connection writes to the histogram
+  bucket = latencyBucket(value);
+  AtomicStore(&hist->buckets[bucket], hist->buckets[bucket] + 1);
+  AtomicStore(&hist->count, hist->count + 1);
+  if( value>hist->max_ns ){
+    AtomicStore(&hist->max_ns, value);
+  }
+}
+
+/*
+** Add the connection to the registry.
+*/
+SQLITE_PRIVATE void registerConnection(sp_connection *conn){
+  sqlite3_mutex *mutex = latencyRegistryMutex();
+
+  sqlite3_mutex_enter(mutex);
+  conn->next_registered = latencyRegistry;
+  latencyRegistry = conn;
+  sqlite3_mutex_leave(mutex);
+}
+
+/*
+** Remove the connection from the registry and release its histograms.
+*/
+SQLITE_PRIVATE void unregisterConnection(sp_connection *conn){
+  sqlite3_mutex *mutex = latencyRegistryMutex();
+  sp_connection **pconn;
+  sp_histogram *hist;
+
+  sqlite3_mutex_enter(mutex);
+  for( pconn=&latencyRegistry; *pconn; pconn=&(*pconn)->next_registered ){
+    if( *pconn==conn ){
+      *pconn = conn->next_registered;
+      break;
+    }
+  }
+  hist = conn->histograms;
+  conn->histograms = NULL;
+  sqlite3_mutex_leave(mutex);
+
+  while( hist ){
+    sp_histogram *next = hist->next;
+    sqlite3_free(hist);
+    hist = next;
+  }
+  sqlite3HashClear(&conn->latencies);
+}
+
+/*
+** sp_latency [('all')]
+**
+** Eponymous virtual table with the latency percentiles of the CALLs of each
+** procedure, in microseconds. The histograms of the current connection are
+** used, or the ones of all the connections of the process, merged, when the
+** argument is 'all'.
+*/
+
+typedef struct sp_latency_vtab sp_latency_vtab;
+typedef struct sp_latency_cursor sp_latency_cursor;
+typedef struct sp_latency_row sp_latency_row;
+
+struct sp_latency_vtab {
+  sqlite3_vtab base;
+  sp_connection *conn;
+};
+
+struct sp_latency_row {
+  char name[128];
+  u64 count;
+  u64 p50, p90, p99, p999, max;     // in nanoseconds
+};
+
+struct sp_latency_cursor {
+  sqlite3_vtab_cursor base;
+  sp_latency_row *rows;
+  int num_rows;
+  int pos;
+};
+
+#define SP_LATENCY_PROCEDURE  0
+#define SP_LATENCY_COUNT      1
+#define SP_LATENCY_P50        2
+#define SP_LATENCY_P90        3
+#define SP_LATENCY_P99        4
+#define SP_LATENCY_P999       5
+#define SP_LATENCY_MAX        6
+#define SP_LATENCY_SCOPE      7
+
+SQLITE_PRIVATE int spLatencyConnect(
+  sqlite3 *db, void *pAux, int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab, char **pzErr
+){
+  sp_latency_vtab *vtab;
+  int rc;
+
+  rc = sqlite3_declare_vtab(db,
+         "CREATE TABLE x(procedure TEXT, count INTEGER, p50_us REAL,"
+         " p90_us REAL, p99_us REAL, p999_us REAL, max_us REAL, scope HIDDEN)");
+  if( rc!=SQLITE_OK ) return rc;
+
+  vtab = (sp_latency_vtab*) sqlite3MallocZero(sizeof(sp_latency_vtab));
+  if( vtab==NULL ) return SQLITE_NOMEM;
+  vtab->conn = (sp_connection*) pAux;
+
+  *ppVtab = &vtab->base;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spLatencyDisconnect(sqlite3_vtab *pVtab){
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spLatencyBestIndex(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo){
+  int i;
+
+  // the scope argument
+  for( i=0; i<pInfo->nConstraint; i++ ){
+    const struct sqlite3_index_constraint *cons = &pInfo->aConstraint[i];
+    if( cons->iColumn==SP_LATENCY_SCOPE ){
+      if( cons->op!=SQLITE_INDEX_CONSTRAINT_EQ || !cons->usable ){
+        return SQLITE_CONSTRAINT;
+      }
+      pInfo->aConstraintUsage[i].argvIndex = 1;
+      pInfo->aConstraintUsage[i].omit = 1;
+      pInfo->idxNum = 1;
+    }
+  }
+
+  pInfo->estimatedCost = 1000;
+  pInfo->estimatedRows = 100;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spLatencyOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor){
+  sp_latency_cursor *cur;
+
+  cur = (sp_latency_cursor*) sqlite3MallocZero(sizeof(sp_latency_cursor));
+  if( cur==NULL ) return SQLITE_NOMEM;
+  *ppCursor = &cur->base;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spLatencyClose(sqlite3_vtab_cursor *pCursor){
+  sp_latency_cursor *cur = (sp_latency_cursor*) pCursor;
+  sqlite3_free(cur->rows);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+/*
+** Return the value at the given percentile of a merged histogram.
+*/
+SQLITE_PRIVATE u64 latencyPercentile(sp_histogram *hist, double p){
+  u64 rank = (u64)(p * hist->count + 0.999999);
+  u64 seen = 0;
+  int i;
+
+  if( rank==0 ) rank = 1;
+  for( i=0; i<SP_HIST_BUCKETS; i++ ){
+    seen += hist->buckets[i];
+    if( seen>=rank ){
+      u64 limit = latencyBucketLimit(i);
+      return limit<hist->max_ns ? limit : hist->max_ns;
+    }
+  }
+  return hist->max_ns;
+}
+
+/*
+** Merge the histograms of the connections by procedure name, and compute
+** the rows of the cursor.
+*/
+SQLITE_PRIVATE int spLatencyFilter(
+  sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  sp_latency_cursor *cur = (sp_latency_cursor*) pCursor;
+  sp_latency_vtab *vtab = (sp_latency_vtab*) pCursor->pVtab;
+  sqlite3_mutex *mutex = latencyRegistryMutex();
+  sp_histogram *merged = NULL;
+  sp_connection *conn;
+  int num_merged = 0;
+  bool all = false;
+  int rc = SQLITE_OK;
+  int i, j;
+
+  sqlite3_free(cur->rows);
+  cur->rows = NULL;
+  cur->num_rows = 0;
+  cur->pos = 0;
+
+  if( idxNum==1 ){
+    const char *scope = (const char*) sqlite3_value_text(argv[0]);
+    if( scope && sqlite3_stricmp(scope, "all")==0 ){
+      all = true;
+    }else if( scope==NULL || sqlite3_stricmp(scope, "connection")!=0 ){
+      sqlite3_free(pCursor->pVtab->zErrMsg);
+      pCursor->pVtab->zErrMsg = sqlite3_mprintf(
+                          "sp_latency: the scope must be 'connection' or 'all'");
+      return SQLITE_ERROR;
+    }
+  }
+
+  sqlite3_mutex_enter(mutex);
+  for( conn=latencyRegistry; conn && rc==SQLITE_OK; conn=conn->next_registered ){
+    sp_histogram *hist;
+    if( !all && conn!=vtab->conn ) continue;
+    for( hist=conn->histograms; hist; hist=hist->next ){
+      sp_histogram *dest = NULL;
+      for( j=0; j<num_merged; j++ ){
+        if( strcmp(merged[j].name, hist->name)==0 ){
+          dest = &merged[j];
+          break;
+        }
+      }
+      if( dest==NULL ){
+        sp_histogram *new_merged = (sp_histogram*) sqlite3_realloc64(merged,
+                                     (num_merged + 1) * sizeof(sp_histogram));
+        if( new_merged==NULL ){
+          rc = SQLITE_NOMEM;
+          break;
+        }
+        merged = new_merged;
+        dest = &merged[num_merged++];
+        memset(dest, 0, sizeof(sp_histogram));
+        strcpy(dest->name, hist->name);
+      }
+      // the values can be modified by the other connection meanwhile
+      for( i=0; i<SP_HIST_BUCKETS; i++ ){
+        u64 n = AtomicLoad(&hist->buckets[i]);
+        dest->buckets[i] += n;
+        dest->count += n;
+      }
+      if( AtomicLoad(&hist->max_ns)>dest->max_ns ){
+        dest->max_ns = AtomicLoad(&hist->max_ns);
+      }
+    }
+  }
+  sqlite3_mutex_leave(mutex);
+
+  if( rc==SQLITE_OK && num_merged>0 ){
+    cur->rows = (sp_latency_row*) sqlite3_malloc64(num_merged * sizeof(sp_latency_row));
+    if( cur->rows==NULL ) rc = SQLITE_NOMEM;
+  }
+  if( rc==SQLITE_OK ){
+    for( i=0; i<num_merged; i++ ){
+      sp_latency_row *row = &cur->rows[i];
+      strcpy(row->name, merged[i].name);
+      row->count = merged[i].count;
+      row->p50 = latencyPercentile(&merged[i], 0.50);
+      row->p90 = latencyPercentile(&merged[i], 0.90);
+      row->p99 = latencyPercentile(&merged[i], 0.99);
+      row->p999 = latencyPercentile(&merged[i], 0.999);
+      row->max = merged[i].max_ns;
+    }
+    cur->num_rows = num_merged;
+  }
+
+  sqlite3_free(merged);
+  return rc;
+}
+
+SQLITE_PRIVATE int spLatencyNext(sqlite3_vtab_cursor *pCursor){
+  sp_latency_cursor *cur = (sp_latency_cursor*) pCursor;
+  cur->pos++;
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spLatencyEof(sqlite3_vtab_cursor *pCursor){
+  sp_latency_cursor *cur = (sp_latency_cursor*) pCursor;
+  return cur->pos>=cur->num_rows;
+}
+
+SQLITE_PRIVATE int spLatencyColumn(
+  sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i
+){
+  sp_latency_cursor *cur = (sp_latency_cursor*) pCursor;
+  sp_latency_row *row = &cur->rows[cur->pos];
+
+  switch( i ){
+    case SP_LATENCY_PROCEDURE:
+      sqlite3_result_text(ctx, row->name, -1, SQLITE_TRANSIENT);
+      break;
+    case SP_LATENCY_COUNT:
+      sqlite3_result_int64(ctx, (sqlite3_int64) row->count);
+      break;
+    case SP_LATENCY_P50:
+      sqlite3_result_double(ctx, row->p50 / 1e3);
+      break;
+    case SP_LATENCY_P90:
+      sqlite3_result_double(ctx, row->p90 / 1e3);
+      break;
+    case SP_LATENCY_P99:
+      sqlite3_result_double(ctx, row->p99 / 1e3);
+      break;
+    case SP_LATENCY_P999:
+      sqlite3_result_double(ctx, row->p999 / 1e3);
+      break;
+    case SP_LATENCY_MAX:
+      sqlite3_result_double(ctx, row->max / 1e3);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+SQLITE_PRIVATE int spLatencyRowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid){
+  sp_latency_cursor *cur = (sp_latency_cursor*) pCursor;
+  *pRowid = cur->pos + 1;
+  return SQLITE_OK;
+}
+
+static sqlite3_module spLatencyModule = {
+  0,                       /* iVersion */
+  0,                       /* xCreate - eponymous only */
+  spLatencyConnect,        /* xConnect */
+  spLatencyBestIndex,      /* xBestIndex */
+  spLatencyDisconnect,     /* xDisconnect */
+  0,                       /* xDestroy */
+  spLatencyOpen,           /* xOpen */
+  spLatencyClose,          /* xClose */
+  spLatencyFilter,         /* xFilter */
+  spLatencyNext,           /* xNext */
+  spLatencyEof,            /* xEof */
+  spLatencyColumn,         /* xColumn */
+  spLatencyRowid,          /* xRowid */
+  0,                       /* xUpdate */
+  0,                       /* xBegin */
+  0,                       /* xSync */
+  0,                       /* xCommit */
+  0,                       /* xRollback */
+  0,                       /* xFindFunction */
+  0,                       /* xRename */
+  0,                       /* xSavepoint */
+  0,                       /* xRelease */
+  0,                       /* xRollbackTo */
+  0                        /* xShadowName */
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// CONNECTION STATE AND PROCEDURE CACHE
+////////////////////////////////////////////////////////////////////////////////
+
+// maximum number of idle frames of the same procedure kept on the cache
+#define SP_CACHE_MAX_INSTANCES  4
+
+/*
+** Release all the idle call frames stored on the connection cache.
+*/
+SQLITE_PRIVATE void flushProcedureCache(sp_connection *conn){
+  HashElem *elem;
+
+  releaseFunctionFrames(conn);
+  for( elem=sqliteHashFirst(&conn->procedures); elem; elem=sqliteHashNext(elem) ){
+    call_frame *frame = (call_frame*) sqliteHashData(elem);
+    while( frame ){
+      call_frame *next = frame->next_cached;
+      releaseCallFrame(frame);
+      frame = next;
+    }
+  }
+  sqlite3HashClear(&conn->procedures);
+}
+
+/*
+** Check if the procedure was loaded using the current version of the schema.
+** The replacement of its code is checked on execution, by checkStoredCode().
+*/
+SQLITE_PRIVATE bool isProcedureCurrent(call_frame *frame){
+  Schema *pSchema = frame->db->aDb[0].pSchema;
+  return frame->schema_cookie==pSchema->schema_cookie &&
+         frame->schema_generation==pSchema->iGeneration;
+}
+
+/*
+** Clear the execution state of the frame commands, so the frame can be used
+** by another call. The prepared statements are returned to the statement
+** pool.
+*/
+SQLITE_PRIVATE void resetFrameCommands(call_frame *frame){
+  stored_proc *procedure = frame->procedure;
+  int n;
+
+  for( n=0; n<procedure->num_cmds; n++ ){
+    cmd_state *state = &frame->cmds[n];
+    if( state->stmt ){
+      poolStatement(frame->conn, procedure, n, state->stmt);
+      state->stmt = NULL;
+    }
+    state->current_item = 0;
+  }
+  // the statements of the native implementation follow the commands
+  for( n=0; n<frame->num_native_stmts; n++ ){
+    if( frame->native_stmts[n] ){
+      poolStatement(frame->conn, procedure, procedure->num_cmds + n,
+                    frame->native_stmts[n]);
+      frame->native_stmts[n] = NULL;
+    }
+  }
+  for( n=0; n<frame->num_vars; n++ ){
+    sqlite3VdbeMemSetNull(variableValue(frame, n));
+    variableChanged(frame, n);
+  }
+  frame->result_list = NULL;
+  frame->current_row = 0;
+  frame->result_stmt = NULL;
+  frame->suspended = false;
+  frame->resume_pos = 0;
+  frame->call_start = 0;
+  arenaReset(&frame->arena);
+}
+
+/*
+** Remove an idle frame of the named procedure from the cache and return it.
+** Return NULL if there is none.
+*/
+SQLITE_PRIVATE call_frame* takeCachedFrame(sp_connection *conn, const char *name){
+  call_frame *head, *frame, *prev = NULL;
+
+  if( conn==NULL || !conn->cache_enabled ) return NULL;
+
+  head = (call_frame*) sqlite3HashFind(&conn->procedures, name);
+  if( head==NULL ) return NULL;
+
+  // if the schema was modified, all the cached frames are outdated
+  if( !isProcedureCurrent(head) ){
+    flushProcedureCache(conn);
+    return NULL;
+  }
+
+  // the hash is case insensitive but the procedure names are not
+  for( frame=head; frame; frame=frame->next_cached ){
+    if( strcmp(frame->procedure->name, name)==0 ) break;
+    prev = frame;
+  }
+  if( frame==NULL ) return NULL;
+
+  // remove it from the list
+  if( prev ){
+    prev->next_cached = frame->next_cached;
+  }else{
+    call_frame *next = frame->next_cached;
+    // the hash key points to the name of the first procedure on the list
+    sqlite3HashInsert(&conn->procedures, next ? next->procedure->name : name, next);
+  }
+  frame->next_cached = NULL;
+
+  XTRACE("procedure cache hit: %s\n", name);
+  return frame;
+}
+
+/*
+** Store an idle call frame on the cache, to be used by the next calls.
+** The frame is released if it cannot be cached.
+*/
+SQLITE_PRIVATE void cacheFrame(sp_connection *conn, call_frame *frame){
+  char *name = frame->procedure->name;
+  call_frame *head, *p;
+  int count = 0;
+
+  // keep the prepared statements even if the frame is not cached
+  resetFrameCommands(frame);
+
+  // the aMem array from the Vdbe must be returned first
+  if( conn==NULL || !conn->cache_enabled || frame->aMem!=NULL ||
+      frame->replaced || !isProcedureCurrent(frame) ){
+    releaseCallFrame(frame);
+    return;
+  }
+
+  head = (call_frame*) sqlite3HashFind(&conn->procedures, name);
+  if( head && !isProcedureCurrent(head) ){
+    flushProcedureCache(conn);
+    head = NULL;
+  }
+
+  // limit the number of idle frames of the same procedure
+  for( p=head; p; p=p->next_cached ){
+    if( strcmp(p->procedure->name, name)==0 ) count++;
+  }
+  if( count>=SP_CACHE_MAX_INSTANCES ){
+    releaseCallFrame(frame);
+    return;
+  }
+
+  // add it to the beginning of the list
+  frame->next_cached = head;
+  if( sqlite3HashInsert(&conn->procedures, name, frame)==frame ){
+    // out of memory
+    frame->next_cached = NULL;
+    releaseCallFrame(frame);
+  }
+}
+
+/*
+** sp_config(option [, value])
+**
+** Read or modify a setting of the stored procedures engine on the current
+** connection. Returns the current value of the option.
+**
+** Options:
+**   procedure_cache        - keep the parsed procedures between calls (default: 1)
+**   statement_pool_size    - maximum number of idle prepared statements kept
+**                            from the procedure bodies, 0 disables (default: 256)
+**   statement_pool_memory  - maximum memory used by them, in bytes (default: 8 MB)
+**   profile                - collect the execution statistics of the commands,
+**                            shown on the sp_profile table. enabling it clears
+**                            the previous statistics (default: 0)
+**   latency                - record the latency of the CALLs, shown on the
+**                            sp_latency table (default: 1)
+*/
+SQLITE_PRIVATE void spConfigFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  sp_connection *conn = (sp_connection*) sqlite3_user_data(ctx);
+  const char *option;
+
+  if( argc<1 || argc>2 ){
+    sqlite3_result_error(ctx, "usage: sp_config(option [, value])", -1);
+    return;
+  }
+
+  option = (const char*) sqlite3_value_text(argv[0]);
+  if( option==NULL ){
+    sqlite3_result_error(ctx, "sp_config: invalid option", -1);
+    return;
+  }
+
+  if( sqlite3_stricmp(option, "procedure_cache")==0 ){
+    if( argc==2 ){
+      conn->cache_enabled = sqlite3_value_int(argv[1])!=0;
+      if( !conn->cache_enabled ){
+        flushProcedureCache(conn);
+      }
+    }
+    sqlite3_result_int(ctx, conn->cache_enabled);
+  }else if( sqlite3_stricmp(option, "statement_pool_size")==0 ){
+    if( argc==2 ){
+      int value = sqlite3_value_int(argv[1]);
+      conn->pool_max_count = value>0 ? value : 0;
+      evictPooledStatements(conn);
+    }
+    sqlite3_result_int(ctx, conn->pool_max_count);
+  }else if( sqlite3_stricmp(option, "statement_pool_memory")==0 ){
+    if( argc==2 ){
+      sqlite3_int64 value = sqlite3_value_int64(argv[1]);
+      conn->pool_max_memory = value>0 ? value : 0;
+      evictPooledStatements(conn);
+    }
+    sqlite3_result_int64(ctx, conn->pool_max_memory);
+  }else if( sqlite3_stricmp(option, "profile")==0 ){
+    if( argc==2 ){
+      bool enable = sqlite3_value_int(argv[1])!=0;
+      if( enable && !conn->profile_enabled ){
+        clearProcedureProfiles(conn);
+      }
+      conn->profile_enabled = enable;
+    }
+    sqlite3_result_int(ctx, conn->profile_enabled);
+  }else if( sqlite3_stricmp(option, "latency")==0 ){
+    if( argc==2 ){
+      conn->latency_enabled = sqlite3_value_int(argv[1])!=0;
+    }
+    sqlite3_result_int(ctx, conn->latency_enabled);
+  }else{
+    char *msg = sqlite3_mprintf("sp_config: unknown option: %s", option);
+    sqlite3_result_error(ctx, msg, -1);
+    sqlite3_free(msg);
+  }
+}
+
+/*
+** Release the connection state. Called when the connection is closed.
+*/
+SQLITE_PRIVATE void releaseConnectionContext(void *p){
+  sp_connection *conn = (sp_connection*) p;
+  stored_func *func;
+  flushProcedureCache(conn);
+  // the functions can be released after the connection state
+  for( func=conn->functions; func; func=func->next ){
+    func->conn = NULL;
+  }
+  releaseProcedureProfiles(conn);
+  sqlite3HashClear(&conn->natives);
+  unregisterConnection(conn);
+  // the pool was released when the sp_statements table was disconnected
+  assert( conn->pool_count==0 );
+  sqlite3_free(conn->pool_buckets);
+  sqlite3_free(conn);
+}
+
+/*
+** Create the stored procedures state of a connection, with the functions and
+** the modules that use it. Returns NULL if out of memory.
+*/
+SQLITE_PRIVATE sp_connection* createConnectionContext(sqlite3 *db){
+  sp_connection *conn;
+  int rc, i;
+
+  conn = (sp_connection*) sqlite3MallocZero(sizeof(sp_connection));
+  if( conn==NULL ) return NULL;
+  conn->db = db;
+  conn->cache_enabled = true;
+  sqlite3HashInit(&conn->procedures);
+  sqlite3HashInit(&conn->profiles);
+  sqlite3HashInit(&conn->latencies);
+  sqlite3HashInit(&conn->natives);
+  conn->pool_max_count = SP_POOL_MAX_STATEMENTS;
+  conn->pool_max_memory = SP_POOL_MAX_MEMORY;
+  conn->latency_enabled = true;
+
+  // the destructor is also called if the function cannot be created
+  rc = sqlite3_create_function_v2(db, "sp_config", -1, SQLITE_UTF8, conn,
+                                  spConfigFunc, NULL, NULL,
+                                  releaseConnectionContext);
+  if( rc!=SQLITE_OK ) return NULL;
+
+  // if the module cannot be created the statements are not pooled
+  sqlite3_create_module_v2(db, "sp_statements", &spStatementsModule, conn, NULL);
+
+  // statistics of the commands
+  sqlite3_create_module_v2(db, "sp_profile", &spProfileModule, conn, NULL);
+
+  // latency of the calls, also merged with the other connections
+  registerConnection(conn);
+  sqlite3_create_module_v2(db, "sp_latency", &spLatencyModule, conn, NULL);
+
+  // items of the list variables, for set-based statements
+  sqlite3_create_module_v2(db, "sp_list", &spListModule, NULL, NULL);
+
+  // functions over the list variables
+  for( i=0; i<sizeof(listFunctions)/sizeof(listFunctions[0]); i++ ){
+    list_function *func = &listFunctions[i];
+    sqlite3_create_function_v2(db, func->name, func->num_args, SQLITE_UTF8,
+                               func, func->xFunc, NULL, NULL, NULL);
+  }
+
+  // generator of the native implementations, and their registration
+  sqlite3_create_function_v2(db, "sp_compile_c", 1, SQLITE_UTF8, conn,
+                             spCompileCFunc, NULL, NULL, NULL);
+  sqlite3_create_function_v2(db, "sp_register_native", 1, SQLITE_UTF8, conn,
+                             spRegisterNativeFunc, NULL, NULL, NULL);
+
+  return conn;
+}
+
+/*
+** Return the stored procedures state of the connection. It is created when
+** the connection is opened, and its pointer is kept as the user data of the
+** sp_config() function, so it is found with a single lookup on the hash table
+** of the functions. It is only created here if the connection was opened
+** without the automatic extension, like after sqlite3_reset_auto_extension().
+** Returns NULL if out of memory.
+*/
+SQLITE_PRIVATE sp_connection* getConnectionContext(sqlite3 *db){
+  FuncDef *pDef;
+
+  pDef = (FuncDef*) sqlite3HashFind(&db->aFunc, "sp_config");
+  if( pDef && pDef->xSFunc==spConfigFunc ){
+    return (sp_connection*) pDef->pUserData;
+  }
+  return createConnectionContext(db);
+}
+
+/*
+** Automatic extension: create the stored procedures state when a connection
+** is opened, so it is not created while a statement is being prepared.
+*/
+SQLITE_PRIVATE int openConnectionContext(
+  sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi
+){
+  (void)pzErrMsg; (void)pApi;
+  return createConnectionContext(db) ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+/*
+** Called at the end of sqlite3_initialize(), when the library is compiled
+** with -DSQLITE_EXTRA_INIT=sqlite3_stored_proc_init
+*/
+int sqlite3_stored_proc_init(const char *unused){
+  (void)unused;
+  return sqlite3_auto_extension((void(*)(void))openConnectionContext);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// STORED FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+** The stored functions are registered as SQL functions on the connection, so
+** they can be used in any expression. The first row takes an idle call frame
+** from the procedure cache, with its prepared statements from the pool. The
+** frame stays attached to the function with its statements, like the frame
+** of a nested CALL statement, so the next rows only reset the variables and
+** bind again the ones that changed. The bodies that modify the database make
+** the statement that uses them a writer, so their changes are rolled back
+** with it.
+*/
+
+// maximum nesting level of stored function calls (recursion)
+#define SP_MAX_FUNCTION_DEPTH  64
+
+/*
+** Load and parse a stored function, outside of a statement preparation.
+** On error the message is returned on pzErr.
+*/
+SQLITE_PRIVATE int loadStoredFunction(
+  sp_connection *conn, char *name, call_frame **pframe, char **pzErr
+){
+  sqlite3 *db = conn->db;
+  Parse sParse;
+  int rc;
+
+  sqlite3ParseObjectInit(&sParse, db);
+  rc = loadStoredProcedure(&sParse, conn, name, strlen(name), pframe);
+  if( rc!=SQLITE_OK ){
+    *pzErr = sqlite3_mprintf("%s", sParse.zErrMsg ? sParse.zErrMsg : sqlite3ErrStr(rc));
+  }
+  sqlite3DbFree(db, sParse.zErrMsg);
+  sParse.zErrMsg = NULL;
+  sqlite3ParseObjectReset(&sParse);
+  return rc;
+}
+
+/*
+** Keep the frame of a stored function attached to it for the next row. Only
+** the variables are reset: the prepared statements keep their values bound.
+** The frame is returned to the cache, with the statements to the pool, if
+** the function already has one, like on a recursive call. It is also done if
+** the pool is not attached, as it releases the statements before the
+** connection is closed.
+*/
+SQLITE_PRIVATE void keepFunctionFrame(Vdbe *v, stored_func *func, call_frame *frame){
+  sp_connection *conn = func->conn;
+
+  if( func->frame || !conn->pool_attached || !conn->cache_enabled ){
+    cacheFrame(conn, frame);
+    return;
+  }
+  resetCallFrame(v, frame);
+  func->frame = frame;
+}
+
+/*
+** Release the frames kept by the stored functions, with their statements.
+*/
+SQLITE_PRIVATE void releaseFunctionFrames(sp_connection *conn){
+  stored_func *func;
+
+  for( func=conn->functions; func; func=func->next ){
+    if( func->frame ){
+      releaseCallFrame(func->frame);
+      func->frame = NULL;
+    }
+  }
+}
+
+/*
+** Destructor of a registered stored function.
+*/
+SQLITE_PRIVATE void releaseStoredFunc(void *p){
+  stored_func *func = (stored_func*) p;
+  stored_func **pp;
+
+  if( func->conn ){
+    for( pp=&func->conn->functions; *pp; pp=&(*pp)->next ){
+      if( *pp==func ){
+        *pp = func->next;
+        break;
+      }
+    }
+  }
+  if( func->frame ){
+    releaseCallFrame(func->frame);
+  }
+  sqlite3_free(func);
+}
+
+/*
+** Make the statement that executes a writing stored function a writer, like
+** the ones that modify the database themselves. The write transactions are
+** started on all the databases and, when the statement is not the only one
+** active or a transaction was opened, a statement transaction is opened, so
+** the changes of all the rows are rolled back if the statement fails. On an
+** automatic transaction the body statements are not committed when they
+** finish: the whole transaction is committed or rolled back when this
+** statement halts.
+*/
+SQLITE_PRIVATE int beginFunctionWrite(Vdbe *v){
+  sqlite3 *db = v->db;
+  int i, rc;
+
+  if( v->readOnly ){
+    v->readOnly = 0;
+    db->nVdbeWrite++;
+  }
+  for( i=0; i<db->nDb; i++ ){
+    Btree *pBt = db->aDb[i].pBt;
+    if( pBt==NULL ) continue;
+    rc = sqlite3BtreeBeginTrans(pBt, 1, 0);
+    if( rc!=SQLITE_OK ) return rc;
+  }
+  if( v->iStatement==0 && (db->autoCommit==0 || db->nVdbeRead>1) ){
+    db->nStatement++;
+    v->iStatement = db->nSavepoint + db->nStatement;
+    rc = sqlite3VtabSavepoint(db, SAVEPOINT_BEGIN, v->iStatement-1);
+    if( rc!=SQLITE_OK ) return rc;
+    v->nStmtDefCons = db->nDeferredCons;
+    v->nStmtDefImmCons = db->nDeferredImmCons;
+  }
+  if( v->iStatement ){
+    // also on the databases written for the first time by this statement
+    for( i=0; i<db->nDb; i++ ){
+      Btree *pBt = db->aDb[i].pBt;
+      if( pBt==NULL ) continue;
+      rc = sqlite3BtreeBeginStmt(pBt, v->iStatement);
+      if( rc!=SQLITE_OK ) return rc;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Implementation of the SQL function of a stored function.
+*/
+SQLITE_PRIVATE void storedFunctionFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  stored_func *func = (stored_func*) sqlite3_user_data(ctx);
+  sp_connection *conn = func->conn;
+  sqlite3 *db = conn->db;
+  Vdbe *v = ctx->pVdbe;
+  call_frame *frame;
+  stored_proc *procedure;
+  char *zErr = NULL;
+  char *zSavedErr;
+  int rc, i;
+
+  if( v==NULL ){
+    sqlite3_result_error(ctx, "stored functions cannot be used here", -1);
+    return;
+  }
+  if( conn->function_depth>=SP_MAX_FUNCTION_DEPTH ){
+    sqlite3_result_error(ctx, "too many levels of stored function recursion", -1);
+    return;
+  }
+
+  // use the frame of the last row, if the function was not modified since
+  frame = func->frame;
+  func->frame = NULL;
+  if( frame && !isProcedureCurrent(frame) ){
+    releaseCallFrame(frame);
+    frame = NULL;
+  }
+  // or get an idle frame from the cache
+  if( frame==NULL ){
+    frame = takeCachedFrame(conn, func->name);
+  }
+  // the function can be replaced by modifying the stored_procedures table
+  if( frame ){
+    rc = checkStoredCode(frame, !v->readOnly);
+    if( rc==SQLITE_SCHEMA ){
+      releaseCallFrame(frame);
+      frame = NULL;
+    }else if( rc!=SQLITE_OK ){
+      sqlite3_result_error_code(ctx, rc);
+      cacheFrame(conn, frame);
+      return;
+    }
+  }
+  // or load it again
+  if( frame==NULL ){
+    rc = loadStoredFunction(conn, func->name, &frame, &zErr);
+    if( rc!=SQLITE_OK ){
+      sqlite3_result_error(ctx, zErr ? zErr : "out of memory", -1);
+      sqlite3_result_error_code(ctx, rc);
+      sqlite3_free(zErr);
+      return;
+    }
+  }
+  procedure = frame->procedure;
+
+  if( !procedure->is_function ){
+    zErr = sqlite3_mprintf("not a function: %s", func->name);
+    goto loc_error;
+  }
+  if( argc!=procedure->num_params ){
+    zErr = sqlite3_mprintf("wrong number of arguments to function %s()", func->name);
+    goto loc_error;
+  }
+  // the changes are rolled back with the statement that uses the function
+  if( !procedure->read_only || procedure->has_calls ){
+    rc = beginFunctionWrite(v);
+    if( rc!=SQLITE_OK ){
+      sqlite3_result_error_code(ctx, rc);
+      cacheFrame(conn, frame);
+      return;
+    }
+  }
+
+  // the arguments are valid until this function returns
+  for( i=0; i<argc; i++ ){
+    int slot = procedure->params[i];
+    sqlite3VdbeMemShallowCopy(variableValue(frame, slot), argv[i], MEM_Ephem);
+    variableChanged(frame, slot);
+  }
+
+  // the errors are reported on the Vdbe that executes the function
+  zSavedErr = v->zErrMsg;
+  v->zErrMsg = NULL;
+
+  frame->function_ctx = ctx;
+  conn->function_depth++;
+  rc = executeProcedureBody(v, frame);
+  conn->function_depth--;
+  frame->function_ctx = NULL;
+
+  if( rc!=SQLITE_OK ){
+    if( rc==SQLITE_NOMEM ){
+      sqlite3_result_error_nomem(ctx);
+    }else{
+      sqlite3_result_error(ctx, v->zErrMsg ? v->zErrMsg : sqlite3ErrStr(rc), -1);
+      sqlite3_result_error_code(ctx, rc);
+    }
+  }
+  sqlite3DbFree(db, v->zErrMsg);
+  v->zErrMsg = zSavedErr;
+
+  // keep it for the next row
+  keepFunctionFrame(v, func, frame);
+  return;
+
+loc_error:
+  sqlite3_result_error(ctx, zErr ? zErr : "out of memory", -1);
+  sqlite3_free(zErr);
+  cacheFrame(conn, frame);
+}
+
+/*
+** Return true if the name is the one of a built-in SQL function, with any
+** number of arguments.
+*/
+SQLITE_PRIVATE bool isBuiltinFunction(const char *name){
+  int h = SQLITE_FUNC_HASH(sqlite3UpperToLower[(u8)name[0]], sqlite3Strlen30(name));
+  return sqlite3FunctionSearch(h, name)!=NULL;
+}
+
+/*
+** Return the number of parameters declared on the code of a stored function,
+** that starts with "FUNCTION name(". Returns -1 if it cannot be read.
+*/
+SQLITE_PRIVATE int countFunctionParams(const char *code){
+  const char *sql = strchr(code, '(');
+  int count = 0, depth = 0;
+  int n, tokenType;
+
+  for( ; sql && *sql; sql+=n ){
+    n = sqlite3GetToken((u8*)sql, &tokenType);
+    if( n<=0 ) break;
+    if( tokenType==TK_LP ){
+      depth++;
+    }else if( tokenType==TK_RP ){
+      if( --depth==0 ) return count;
+    }else if( tokenType==TK_VARIABLE && depth==1 && sql[0]=='@' ){
+      count++;
+    }
+  }
+  return -1;
+}
+
+/*
+** Register the stored functions as SQL functions on the connection.
+** It is done again only when the schema is modified.
+*/
+SQLITE_PRIVATE void registerStoredFunctions(Parse *pParse, sp_connection *conn){
+  sqlite3 *db = pParse->db;
+  sqlite3_stmt *stmt = NULL;
+  stored_func *func, *new_funcs = NULL;
+  Schema *pSchema;
+
+  if( conn==NULL ) return;
+
+  // the registered functions are current
+  if( conn->functions_loaded && DbHasProperty(db, 0, DB_SchemaLoaded) ){
+    pSchema = db->aDb[0].pSchema;
+    if( conn->functions_cookie==pSchema->schema_cookie &&
+        conn->functions_generation==pSchema->iGeneration ){
+      goto loc_attach;
+    }
+  }
+
+  if( sqlite3ReadSchema(pParse)!=SQLITE_OK ) return;
+
+  // mark them as current first, as the query below is also prepared here
+  pSchema = db->aDb[0].pSchema;
+  conn->functions_loaded = true;
+  conn->functions_cookie = pSchema->schema_cookie;
+  conn->functions_generation = pSchema->iGeneration;
+
+  if( sqlite3FindTable(db, "stored_procedures", "main")==NULL ) return;
+
+  // read the names first: the functions cannot be created while there is an
+  // active statement
+  if( sqlite3_prepare_v2(db,
+        "SELECT name, code FROM stored_procedures WHERE is_function",
+        -1, &stmt, NULL)!=SQLITE_OK ){
+    return;
+  }
+  while( sqlite3_step(stmt)==SQLITE_ROW ){
+    const char *name = (const char*) sqlite3_column_text(stmt, 0);
+    const char *code = (const char*) sqlite3_column_text(stmt, 1);
+    FuncDef *pDef;
+    int num_args;
+    if( name==NULL || code==NULL || strlen(name)>=sizeof(func->name) ) continue;
+    // created before the built-in names were rejected
+    if( isBuiltinFunction(name) ) continue;
+    // registered with the declared number of parameters, if possible
+    num_args = countFunctionParams(code);
+    if( num_args>SQLITE_MAX_FUNCTION_ARG ) num_args = -1;
+    // already registered
+    pDef = sqlite3FindFunction(db, name, num_args, SQLITE_UTF8, 0);
+    if( pDef && pDef->xSFunc==storedFunctionFunc ) continue;
+    func = (stored_func*) sqlite3MallocZero(sizeof(stored_func));
+    if( func==NULL ) break;
+    func->conn = conn;
+    func->num_args = num_args;
+    strcpy(func->name, name);
+    func->next = new_funcs;
+    new_funcs = func;
+  }
+  sqlite3_finalize(stmt);
+
+  while( new_funcs ){
+    func = new_funcs;
+    new_funcs = func->next;
+    func->next = NULL;
+    // the destructor is also called if the function cannot be created
+    if( sqlite3_create_function_v2(db, func->name, func->num_args, SQLITE_UTF8,
+          func, storedFunctionFunc, NULL, NULL, releaseStoredFunc)==SQLITE_OK ){
+      func->next = conn->functions;
+      conn->functions = func;
+      conn->num_functions++;
+    }
+  }
+
+loc_attach:
+  // the function bodies use the statement pool
+  if( conn->num_functions>0 ){
+    attachStatementPool(pParse, conn);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// NATIVE PROCEDURES
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+** A procedure can be compiled ahead of time into C source, by the
+** sp_compile_c() SQL function or the .compileproc shell command. The
+** generated code uses only the public API: the statements are resolved when
+** the source is generated, the variables are C locals and the control flow
+** uses native branches and loops.
+**
+** It is built as a loadable extension. Once loaded, CALL executes it instead
+** of the parsed procedure, as long as the procedure code stored on the
+** database is the same that was compiled.
+**
+** Supported commands: DECLARE (untyped variables), SET of single values,
+** statements, IF, LOOP, FOREACH over a SELECT, BREAK, CONTINUE, ASSERT, RAISE
+** and RETURN of values or expressions. Procedures using lists cannot be
+** compiled, and calls with list arguments are executed by the engine.
+*/
+
+typedef struct native_call native_call;
+
+/*
+** Context of the API used by a native implementation.
+*/
+struct native_call {
+    Vdbe *v;
+    call_frame *frame;
+    sp_native_proc *native;
+};
+
+/*
+** Return the statement of the native implementation with the given id.
+** It is prepared on the first use or taken from the statement pool, where
+** it is stored after the commands of the procedure.
+*/
+SQLITE_PRIVATE sqlite3_stmt* nativeStatement(void *ctx, int id, const char *sql){
+  native_call *call = (native_call*) ctx;
+  call_frame *frame = call->frame;
+  stored_proc *procedure = frame->procedure;
+  sqlite3_stmt *stmt = NULL;
+
+  if( frame->native_stmts==NULL ){
+    int count = call->native->num_statements;
+    frame->native_stmts = sqlite3MallocZero(count * sizeof(sqlite3_stmt*));
+    if( frame->native_stmts==NULL ) return NULL;
+    frame->num_native_stmts = count;
+  }
+  if( id<0 || id>=frame->num_native_stmts ) return NULL;
+
+  stmt = frame->native_stmts[id];
+  if( stmt ){
+    sqlite3_reset(stmt);
+    return stmt;
+  }
+
+  if( frame->conn ){
+    stmt = takePooledStatement(frame->conn, procedure->version,
+                               procedure->num_cmds + id);
+  }
+  if( stmt==NULL ){
+    if( sqlite3_prepare_v3(frame->db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                           &stmt, NULL)!=SQLITE_OK ){
+      return NULL;
+    }
+  }
+
+  frame->native_stmts[id] = stmt;
+  return stmt;
+}
+
+/*
+** Store the row returned by a native implementation as the result of the
+** CALL statement.
+*/
+SQLITE_PRIVATE int nativeResultRow(void *ctx, int num_cols, sqlite3_value **values){
+  native_call *call = (native_call*) ctx;
+  Vdbe *v = call->v;
+  int rc, i;
+
+  if( num_cols<=0 ) return SQLITE_OK;
 
-//! should the new variables be removed after the foreach command?
+  releaseResultRow(v, call->frame);
+  rc = allocResultRow(v, num_cols);
+  if( rc ) return rc;
 
-  if (has_dynamic_values) {
-    // store the result in new variables
-    for (int ncol = 0; ncol < num_cols; ncol++) {
-      char *col_name = NULL;
-      sqlite3_value *col_value;
-      sqlite3_var *var;
-      col_name = (char *)sqlite3_column_name(cmd->stmt, ncol);
-      col_value = sqlite3_column_value(cmd->stmt, ncol);
-      // add '@' to the column name
-      col_name = sqlite3_mprintf("@%s", col_name);
-      if (col_name == NULL) {
-        rc = SQLITE_NOMEM;
-        goto loc_error;
-      }
-      // add a new variable
-      var = addVariable(procedure, col_name, strlen(col_name), 0, NULL);
-      sqlite3_free(col_name);
-      if (var == NULL) {
-        rc = SQLITE_NOMEM;
-        goto loc_error;
-      }
-      // store the column value in the variable
-      sqlite3VdbeMemMove(&var->value, col_value);
-    }
-  } else {
-    // store the result in the defined variables
-    for (int ncol = 0; ncol < cmd->num_vars; ncol++) {
-      sqlite3_var *var = cmd->vars[ncol];
-      sqlite3_value *col_value;
-      if (row_list) {
-        col_value = &row_list->value[ncol];
-        // copy the content from the column to the variable
-        sqlite3VdbeMemCopy(&var->value, col_value);
-      } else if (row_value) {
-        // copy the content from the row to the variable
-        sqlite3VdbeMemCopy(&var->value, row_value);
-      } else {
-        // copy the content from the column to the variable
-        col_value = sqlite3_column_value(cmd->stmt, ncol);
-        sqlite3VdbeMemMove(&var->value, col_value);
-      }
+  for( i=0; i<num_cols; i++ ){
+    if( values[i] ){
+      rc = sqlite3VdbeMemCopy(&v->aMem[i+1], values[i]);
+      if( rc ) return rc;
     }
   }
 
-loc_exit:
-  return rc;
-loc_error:
-  if( v->zErrMsg==NULL ){
-    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
-  }
-  goto loc_exit;
+  sqlite3VdbeSetNumCols(v, num_cols);
+  sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_ResultRow, 1, num_cols);
+  return SQLITE_OK;
 }
 
 /*
-** Execute a stored procedure.
-** This function is called by the OP_CallProcedure opcode, on the execute step.
+** sp_register_native(descriptor)
+**
+** Register a native implementation on the connection. It is called by the
+** compiled extensions when they are loaded, with their sp_native_proc bound
+** as a pointer of type "sp_native_proc": other values are rejected.
 */
-SQLITE_PRIVATE int executeStoredProcedure(Vdbe *v, procedure_call *call) {
-  stored_proc *procedure = call->procedure;
-  sqlite3 *db = procedure->db;
-  char savepoint_name[32];
-  char sql[48];
-  int rc = SQLITE_OK, rc2;
-  int pos, ifpos;
-  bool result;
-  command *cmd;
+SQLITE_PRIVATE void spRegisterNativeFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  sp_connection *conn = (sp_connection*) sqlite3_user_data(ctx);
+  sp_native_proc *native;
+
+  native = (sp_native_proc*) sqlite3_value_pointer(argv[0], "sp_native_proc");
+  if( native==NULL || native->magic!=SP_NATIVE_MAGIC || native->name==NULL ||
+      strlen(native->name)>=sizeof(((stored_proc*)0)->name) ){
+    sqlite3_result_error(ctx, "sp_register_native: invalid descriptor", -1);
+    return;
+  }
 
-  // reset the procedure
-  //resetStoredProcedure(v, procedure);  -- already called by sqlite3_reset()
+  // the key points to the name on the descriptor, kept by the extension
+  if( sqlite3HashInsert(&conn->natives, native->name, native)==native ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  XTRACE("native procedure registered: %s\n", native->name);
+}
 
-  // reset the OP_ResultRow opcode to OP_Noop
-  sqlite3ChangeOpcode(v, POS_RESULT_ROW, OP_Noop, 0, 0);
-  // reset the OP_NextResult opcode to OP_Noop
-  sqlite3ChangeOpcode(v, POS_NEXT_RESULT, OP_Noop, 0, 0);
+/*
+** Return the native implementation of the procedure, if one was registered
+** on the connection and it was compiled from the current procedure code.
+*/
+SQLITE_PRIVATE sp_native_proc* findNativeProcedure(sp_connection *conn, stored_proc *procedure){
+  sp_native_proc *native;
 
-  // create a random savepoint name
-  do{
-    sqlite3_randomness(sizeof(pos), &pos);
-  }while (pos<0);
-  sqlite3_snprintf(sizeof(savepoint_name), savepoint_name, "sp_%08x", pos);
+  if( conn==NULL ) return NULL;
 
-  // create a savepoint
-  sqlite3_snprintf(sizeof(sql), sql, "SAVEPOINT %s", savepoint_name);
-  rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
-  if (rc != SQLITE_OK) {
-    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
-    return rc;
+  // the hash is case insensitive but the procedure names are not
+  native = (sp_native_proc*) sqlite3HashFind(&conn->natives, procedure->name);
+  if( native==NULL || strcmp(native->name, procedure->name)!=0 ) return NULL;
+  // the procedure was modified after it was compiled
+  if( native->version!=procedure->version ||
+      native->num_params!=(int)procedure->num_params ){
+    return NULL;
   }
 
-  // copy from the cmd->input_list to the parameter values (procedure->params[])
-  // copy the declared variable values from the v->aVar[] array to the parameter values
-  copyProcedureParameters(v, call);
+  XTRACE("native procedure: %s\n", procedure->name);
+  return native;
+}
 
-  // iterate and process each command on the stored_proc object
-  for (pos = 0; pos < procedure->num_cmds; pos++) {
-    cmd = &procedure->cmds[pos];
-    switch (cmd->type) {
-      case CMD_TYPE_DECLARE:
-        // process the DECLARE command
-        // if there are default values, store them in the variable
-        //! TODO: if the variable was declared with a type, apply the affinity
-        // here and on the SET command
-        break;
-      case CMD_TYPE_RETURN:
-        // process the RETURN command
-        rc = executeReturnCommand(v, cmd);
-        if( rc ) goto loc_error;
-        // stop processing the commands
-        pos = procedure->num_cmds;
+/*
+** Execute the native implementation of a procedure.
+** The parameters were already copied to the frame variables.
+*/
+SQLITE_PRIVATE int executeNativeProcedure(Vdbe *v, procedure_call *call){
+  call_frame *frame = call->frame;
+  stored_proc *procedure = frame->procedure;
+  sqlite3_value **params;
+  sp_native_api api;
+  native_call ctx;
+  char *zErr = NULL;
+  int rc, i;
+
+  // the compiled code does not handle lists
+  for( i=0; i<procedure->num_params; i++ ){
+    if( is_list(variableValue(frame, procedure->params[i])) ){
+      return executeProcedureBody(v, frame);
+    }
+  }
 
-        break;
-      case CMD_TYPE_RAISE:
-        // process the RAISE command
-        rc = executeRaiseCommand(v, cmd);
-        if( rc ) goto loc_error;
-        // stop processing the commands
-        pos = procedure->num_cmds;
-        rc = SQLITE_ERROR;
+  params = (sqlite3_value**) arenaAlloc(&frame->arena,
+                   (procedure->num_params + 1) * sizeof(sqlite3_value*));
+  if( params==NULL ) return SQLITE_NOMEM;
+  for( i=0; i<procedure->num_params; i++ ){
+    params[i] = variableValue(frame, procedure->params[i]);
+  }
 
-        break;
-      case CMD_TYPE_ASSERT:
-        // process the ASSERT command
-        rc = executeAssertCommand(v, cmd);
-        if( rc ) goto loc_error;
+  ctx.v = v;
+  ctx.frame = frame;
+  ctx.native = call->native;
+  api.db = frame->db;
+  api.ctx = &ctx;
+  api.xStatement = nativeStatement;
+  api.xResultRow = nativeResultRow;
 
-        break;
-      case CMD_TYPE_SET:
-        // process the SET command
-        rc = executeSetCommand(v, cmd);
-        if( rc ) goto loc_error;
+  rc = call->native->xExecute(&api, params, &zErr);
+  if( rc!=SQLITE_OK ){
+    sqlite3VdbeError(v, "%s", zErr ? zErr : sqlite3ErrStr(rc));
+  }
+  sqlite3_free(zErr);
+  return rc;
+}
 
-        break;
-      case CMD_TYPE_STATEMENT:
-        // process the STATEMENT command
-        rc = executeStatementCommand(v, cmd);
-        if( rc ) goto loc_error;
+/*
+** The code below generates the C source of a native implementation.
+*/
 
-        break;
+typedef struct native_gen native_gen;
 
-      case CMD_TYPE_IF:
-        // evaluate the expression
-        rc = execute_expression(v, cmd, &result);
-        if( rc ) goto loc_error;
-        // does the expression evaluate to true?
-        if( result ){
-          // mark the IF command as executed
-          cmd->flags |= CMD_FLAG_EXECUTED;
-          // continue execution
-        } else {
-          // mark the IF command as not executed
-          cmd->flags &= ~CMD_FLAG_EXECUTED;
-          // skip to the next ELSEIF, ELSE or END IF command
-          pos = cmd->next_if_cmd - 1;
-        }
-        break;
-      case CMD_TYPE_ELSEIF:
-        // if any previous IF or ELSEIF evaluated to true, skip to the next command
-        ifpos = cmd->related_cmd;
-        if( procedure->cmds[ifpos].flags & CMD_FLAG_EXECUTED ) {
-          // skip to the next command
-          pos = cmd->next_if_cmd - 1;
-          break;
-        }
-        // evaluate the expression
-        rc = execute_expression(v, cmd, &result);
-        if( rc ) goto loc_error;
-        // does the expression evaluate to true?
-        if( result ){
-          // mark the IF block as executed
-          ifpos = cmd->related_cmd;
-          procedure->cmds[ifpos].flags |= CMD_FLAG_EXECUTED;
-          // continue execution
-        } else {
-          // skip to the next ELSEIF, ELSE or END IF command
-          pos = cmd->next_if_cmd - 1;
-        }
-        break;
-      case CMD_TYPE_ELSE:
-        // if any previous IF or ELSEIF evaluated to true, skip to the END IF command
-        ifpos = cmd->related_cmd;
-        if( procedure->cmds[ifpos].flags & CMD_FLAG_EXECUTED ) {
-          // skip to the END IF command
-          pos = cmd->next_if_cmd - 1;
-          break;
-        }
-        // otherwise, continue execution
-        procedure->cmds[ifpos].flags |= CMD_FLAG_EXECUTED;
-        break;
-      case CMD_TYPE_ENDIF:
-        // do nothing
-        break;
+struct native_gen {
+    call_frame *frame;              /* variables bound to the statements */
+    stored_proc *procedure;
+    sqlite3_str *body;          /* statements of the execute function */
+    sqlite3_str *tables;        /* tables of bound and assigned variables */
+    sqlite3_str *stmts;         /* entries of the statements table */
+    int num_stmts;
+    int indent;
+    char *error_msg;
+};
 
-      case CMD_TYPE_LOOP:
-        // do nothing
-        break;
-      case CMD_TYPE_ENDLOOP:
-      case CMD_TYPE_CONTINUE:
-        // skip to the LOOP command
-        pos = cmd->related_cmd - 1;
-        break;
-      case CMD_TYPE_BREAK:
-        // get the position of the related LOOP command
-        pos = cmd->related_cmd;
-        cmd = &procedure->cmds[pos];
-        // skip over the END LOOP command
-        pos = cmd->related_cmd;
-        break;
+// definitions shared with the engine, see sp_native_api
+static const char nativeApiCode[] =
+  "#define SP_NATIVE_MAGIC  0x53504e31\n"
+  "\n"
+  "typedef struct sp_native_api {\n"
+  "  sqlite3 *db;\n"
+  "  void *ctx;\n"
+  "  sqlite3_stmt *(*xStatement)(void *ctx, int id, const char *sql);\n"
+  "  int (*xResultRow)(void *ctx, int num_cols, sqlite3_value **values);\n"
+  "} sp_native_api;\n"
+  "\n"
+  "typedef struct sp_native_proc {\n"
+  "  unsigned int magic;\n"
+  "  const char *name;\n"
+  "  sqlite3_uint64 version;\n"
+  "  int num_params;\n"
+  "  int num_statements;\n"
+  "  int (*xExecute)(sp_native_api *api, sqlite3_value **params, char **pzErr);\n"
+  "} sp_native_proc;\n"
+  "\n"
+  "typedef struct sp_stmt_info {\n"
+  "  const char *sql;\n"
+  "  int num_binds;\n"
+  "  const int *binds;           /* variable bound to each parameter, or -1 */\n"
+  "} sp_stmt_info;\n"
+  "\n"
+  "typedef struct sp_frame {\n"
+  "  sp_native_api *api;\n"
+  "  sqlite3_value **var;        /* the variables. NULL is a SQL NULL */\n"
+  "  char **pzErr;\n"
+  "} sp_frame;\n";
+
+// helpers used by the generated code, after the statements table
+static const char nativeHelpersCode[] =
+  "static int sp_error(sp_frame *f, int rc){\n"
+  "  if( *f->pzErr==0 ){\n"
+  "    *f->pzErr = sqlite3_mprintf(\"%s\", sqlite3_errmsg(f->api->db));\n"
+  "  }\n"
+  "  return rc ? rc : SQLITE_ERROR;\n"
+  "}\n"
+  "\n"
+  "static int sp_fail(sp_frame *f, const char *msg){\n"
+  "  if( *f->pzErr==0 ) *f->pzErr = sqlite3_mprintf(\"%s\", msg);\n"
+  "  return SQLITE_ERROR;\n"
+  "}\n"
+  "\n"
+  "static int sp_prepare(sp_frame *f, int id, sqlite3_stmt **pstmt){\n"
+  "  const sp_stmt_info *info = &sp_stmts[id];\n"
+  "  sqlite3_stmt *stmt;\n"
+  "  int i, rc;\n"
+  "  stmt = f->api->xStatement(f->api->ctx, id, info->sql);\n"
+  "  if( stmt==0 ) return sp_error(f, SQLITE_ERROR);\n"
+  "  for( i=0; i<info->num_binds; i++ ){\n"
+  "    int slot = info->binds[i];\n"
+  "    if( slot>=0 && f->var[slot] ){\n"
+  "      rc = sqlite3_bind_value(stmt, i+1, f->var[slot]);\n"
+  "    }else{\n"
+  "      rc = sqlite3_bind_null(stmt, i+1);\n"
+  "    }\n"
+  "    if( rc ) return sp_error(f, rc);\n"
+  "  }\n"
+  "  *pstmt = stmt;\n"
+  "  return SQLITE_OK;\n"
+  "}\n"
+  "\n"
+  "static int sp_store(sp_frame *f, int slot, sqlite3_value *value){\n"
+  "  sqlite3_value_free(f->var[slot]);\n"
+  "  f->var[slot] = 0;\n"
+  "  if( value && sqlite3_value_type(value)!=SQLITE_NULL ){\n"
+  "    f->var[slot] = sqlite3_value_dup(value);\n"
+  "    if( f->var[slot]==0 ) return SQLITE_NOMEM;\n"
+  "  }\n"
+  "  return SQLITE_OK;\n"
+  "}\n"
+  "\n"
+  "static int sp_columns(sp_frame *f, sqlite3_stmt *stmt, int num_vars, const int *slots){\n"
+  "  int i, rc;\n"
+  "  if( sqlite3_column_count(stmt)!=num_vars ){\n"
+  "    *f->pzErr = sqlite3_mprintf(\"statement returns %d values but has %d variables to set\",\n"
+  "                                sqlite3_column_count(stmt), num_vars);\n"
+  "    return SQLITE_ERROR;\n"
+  "  }\n"
+  "  for( i=0; i<num_vars; i++ ){\n"
+  "    rc = sp_store(f, slots[i], sqlite3_column_value(stmt, i));\n"
+  "    if( rc ) return rc;\n"
+  "  }\n"
+  "  return SQLITE_OK;\n"
+  "}\n"
+  "\n"
+  "static int sp_set(sp_frame *f, int id, int num_vars, const int *slots){\n"
+  "  sqlite3_stmt *stmt;\n"
+  "  int i, rc, num_rows = 0;\n"
+  "  rc = sp_prepare(f, id, &stmt);\n"
+  "  if( rc ) return rc;\n"
+  "  while( (rc = sqlite3_step(stmt))==SQLITE_ROW ){\n"
+  "    if( ++num_rows>1 ) return sp_fail(f, \"statement returns more than one row\");\n"
+  "    rc = sp_columns(f, stmt, num_vars, slots);\n"
+  "    if( rc ) return rc;\n"
+  "  }\n"
+  "  if( rc!=SQLITE_DONE ) return sp_error(f, rc);\n"
+  "  for( i=0; num_rows==0 && i<num_vars; i++ ){\n"
+  "    sp_store(f, slots[i], 0);\n"
+  "  }\n"
+  "  return SQLITE_OK;\n"
+  "}\n"
+  "\n"
+  "static int sp_exec(sp_frame *f, int id){\n"
+  "  sqlite3_stmt *stmt;\n"
+  "  int rc = sp_prepare(f, id, &stmt);\n"
+  "  if( rc ) return rc;\n"
+  "  while( (rc = sqlite3_step(stmt))==SQLITE_ROW ){}\n"
+  "  if( rc!=SQLITE_DONE ) return sp_error(f, rc);\n"
+  "  return SQLITE_OK;\n"
+  "}\n"
+  "\n"
+  "static int sp_condition(sp_frame *f, int id, int *result){\n"
+  "  sqlite3_stmt *stmt;\n"
+  "  int rc = sp_prepare(f, id, &stmt);\n"
+  "  if( rc ) return rc;\n"
+  "  rc = sqlite3_step(stmt);\n"
+  "  if( rc==SQLITE_DONE ) return sp_fail(f, \"expression did not return a result\");\n"
+  "  if( rc!=SQLITE_ROW ) return sp_error(f, rc);\n"
+  "  *result = sqlite3_column_int(stmt, 0);\n"
+  "  rc = sqlite3_step(stmt);\n"
+  "  if( rc==SQLITE_ROW ) return sp_fail(f, \"expression returned more than one row\");\n"
+  "  if( rc!=SQLITE_DONE ) return sp_error(f, rc);\n"
+  "  return SQLITE_OK;\n"
+  "}\n"
+  "\n"
+  "static int sp_raise(sp_frame *f, int id, const char *prefix){\n"
+  "  sqlite3_stmt *stmt;\n"
+  "  int rc = sp_prepare(f, id, &stmt);\n"
+  "  if( rc ) return rc;\n"
+  "  rc = sqlite3_step(stmt);\n"
+  "  if( rc!=SQLITE_ROW ) return sp_error(f, rc==SQLITE_DONE ? SQLITE_ERROR : rc);\n"
+  "  *f->pzErr = sqlite3_mprintf(\"%s%s\", prefix, (const char*)sqlite3_column_text(stmt, 0));\n"
+  "  sqlite3_reset(stmt);\n"
+  "  return SQLITE_ERROR;\n"
+  "}\n"
+  "\n"
+  "static int sp_return_vars(sp_frame *f, int num_vars, const int *slots){\n"
+  "  sqlite3_value **row;\n"
+  "  int i, rc;\n"
+  "  row = sqlite3_malloc(num_vars * sizeof(sqlite3_value*));\n"
+  "  if( row==0 ) return SQLITE_NOMEM;\n"
+  "  for( i=0; i<num_vars; i++ ) row[i] = f->var[slots[i]];\n"
+  "  rc = f->api->xResultRow(f->api->ctx, num_vars, row);\n"
+  "  sqlite3_free(row);\n"
+  "  return rc;\n"
+  "}\n"
+  "\n"
+  "static int sp_return_row(sp_frame *f, int id){\n"
+  "  sqlite3_stmt *stmt;\n"
+  "  sqlite3_value **row;\n"
+  "  int i, num_cols, rc;\n"
+  "  rc = sp_prepare(f, id, &stmt);\n"
+  "  if( rc ) return rc;\n"
+  "  rc = sqlite3_step(stmt);\n"
+  "  if( rc==SQLITE_DONE ) return sp_fail(f, \"expression did not return a result\");\n"
+  "  if( rc!=SQLITE_ROW ) return sp_error(f, rc);\n"
+  "  num_cols = sqlite3_column_count(stmt);\n"
+  "  row = sqlite3_malloc(num_cols * sizeof(sqlite3_value*));\n"
+  "  if( row==0 ) return SQLITE_NOMEM;\n"
+  "  for( i=0; i<num_cols; i++ ) row[i] = sqlite3_column_value(stmt, i);\n"
+  "  rc = f->api->xResultRow(f->api->ctx, num_cols, row);\n"
+  "  sqlite3_free(row);\n"
+  "  if( rc ) return rc;\n"
+  "  rc = sqlite3_step(stmt);\n"
+  "  if( rc==SQLITE_ROW ) return sp_fail(f, \"expression returned more than one row\");\n"
+  "  if( rc!=SQLITE_DONE ) return sp_error(f, rc);\n"
+  "  return SQLITE_OK;\n"
+  "}\n";
 
-      case CMD_TYPE_FOREACH:
-        // process the FOREACH command
-        rc = executeForeachCommand(v, procedure, cmd);
-        // if it returned a row, continue execution
-        if( rc==SQLITE_ROW ) {
-          rc = SQLITE_OK;
-        // if it returned DONE, skip to the end of the loop
-        }else if( rc==SQLITE_DONE ) {
-          rc = SQLITE_OK;
-          pos = cmd->related_cmd;
-        // if it returned an error, stop execution
-        }else if( rc ){
-          goto loc_error;
-        }
-        break;
+/*
+** Append a C string literal with the first n bytes of z.
+*/
+SQLITE_PRIVATE void appendCString(sqlite3_str *out, const char *z, int n){
+  int i;
+
+  sqlite3_str_appendchar(out, 1, '"');
+  for( i=0; i<n; i++ ){
+    unsigned char c = (unsigned char) z[i];
+    if( c=='"' || c=='\\' || c=='?' ){
+      // the '?' is escaped to avoid trigraphs
+      sqlite3_str_appendf(out, "\\%c", c);
+    }else if( c=='\n' ){
+      sqlite3_str_appendall(out, "\\n");
+    }else if( c<0x20 || c>=0x7f ){
+      sqlite3_str_appendf(out, "\\%03o", c);
+    }else{
+      sqlite3_str_appendchar(out, 1, c);
     }
   }
+  sqlite3_str_appendchar(out, 1, '"');
+}
 
-loc_exit:
+/*
+** Append an indented line to the body of the execute function.
+*/
+SQLITE_PRIVATE void emitLine(native_gen *gen, const char *zFormat, ...){
+  va_list ap;
+
+  sqlite3_str_appendchar(gen->body, gen->indent * 2, ' ');
+  va_start(ap, zFormat);
+  sqlite3_str_vappendf(gen->body, zFormat, ap);
+  va_end(ap);
+  sqlite3_str_appendchar(gen->body, 1, '\n');
+}
 
-  // release the savepoint
-  sqlite3_snprintf(sizeof(sql), sql, "RELEASE %s", savepoint_name);
-  rc2 = sqlite3_exec(db, sql, NULL, NULL, NULL);
-  if (rc2 != SQLITE_OK) {
-    if (rc == SQLITE_OK) {
-      rc = rc2;
-    }
-    goto loc_error;
+/*
+** Add a statement to the statements table and return its id, or -1 on
+** error. It is prepared here to check the SQL and to resolve the variables
+** bound to its parameters, the same way prepareCommandBinds() does.
+*/
+SQLITE_PRIVATE int emitStatement(native_gen *gen, const char *zFormat, ...){
+  stored_proc *procedure = gen->procedure;
+  sqlite3 *db = gen->frame->db;
+  sqlite3_stmt *stmt = NULL;
+  va_list ap;
+  char *sql;
+  int count, id, i;
+
+  va_start(ap, zFormat);
+  sql = sqlite3_vmprintf(zFormat, ap);
+  va_end(ap);
+  if( sql==NULL ) return -1;
+
+  if( sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)!=SQLITE_OK ||
+      stmt==NULL ){
+    gen->error_msg = sqlite3_mprintf("cannot compile %s: %s", procedure->name,
+                                     sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+    return -1;
   }
 
-  return rc;
-loc_error:
-  if( v->zErrMsg==NULL ){
-    sqlite3VdbeError(v, "%s", sqlite3_errmsg(db));
-  }
-  XTRACE("execution error (%s): %s\n", command_type_str(cmd->type), v->zErrMsg);
-  // rollback to the savepoint
-  sqlite3_snprintf(sizeof(sql), sql, "ROLLBACK TO %s", savepoint_name);
-  rc2 = sqlite3_exec(db, sql, NULL, NULL, NULL);
-  if (rc2 != SQLITE_OK) {
-    if (rc == SQLITE_OK) {
-      rc = rc2;
+  id = gen->num_stmts++;
+  count = sqlite3_bind_parameter_count(stmt);
+  if( count>0 ){
+    sqlite3_str_appendf(gen->tables, "static const int sp_binds_%d[] = {", id);
+    for( i=1; i<=count; i++ ){
+      const char *name = sqlite3_bind_parameter_name(stmt, i);
+      int slot = -1;
+      if( name && strlen(name)<sizeof(((sqlite3_var*)0)->name) ){
+        if( name[0]=='@' ){
+          // the variable can be created later, by a SET command
+          slot = addFrameVariable(gen->frame, (char*)name, strlen(name));
+        }else{
+          slot = findFrameVariable(gen->frame, (char*)name, strlen(name));
+        }
+      }
+      sqlite3_str_appendf(gen->tables, "%s %d", i>1 ? "," : "", slot);
     }
+    sqlite3_str_appendall(gen->tables, " };\n");
   }
-  goto loc_exit;
-}
 
+  sqlite3_str_appendall(gen->stmts, "  { ");
+  appendCString(gen->stmts, sql, strlen(sql));
+  if( count>0 ){
+    sqlite3_str_appendf(gen->stmts, ", %d, sp_binds_%d },\n", count, id);
+  }else{
+    sqlite3_str_appendall(gen->stmts, ", 0, 0 },\n");
+  }
 
-////////////////////////////////////////////////////////////////////////////////
-// RESET AND RELEASE
-////////////////////////////////////////////////////////////////////////////////
+  sqlite3_finalize(stmt);
+  sqlite3_free(sql);
+  return id;
+}
 
 /*
-** Reset the state of a stored procedure.
+** Add the statement that evaluates the expression of a command.
 */
-SQLITE_PRIVATE int resetStoredProcedure(Vdbe *v, stored_proc* procedure) {
-  // if the aMem array was moved to the procedure object
-  if( procedure->aMem!=NULL ){
-    // release memory from the previous result set
-    if( v->aMem ){
-      // release each memory cell
-      for(int i=0; i<v->nMem; i++){
-        sqlite3VdbeMemRelease(&v->aMem[i]);
-      }
-      // release the memory
-      sqlite3DbFree(v->db, v->aMem);
-      v->aMem = NULL;
-      v->nMem = 0;
-    }
-    // move the aMem array back to the Vdbe object
-    v->aMem = procedure->aMem;
-    v->nMem = procedure->nMem;
-    // clear the aMem array from the procedure object
-    procedure->aMem = NULL;
-    procedure->nMem = 0;
-  }
-  // reset the variables
-  sqlite3_var *var;
-  for( var=procedure->vars; var; var=var->next ){
-    sqlite3VdbeMemSetNull(&var->value);
+SQLITE_PRIVATE int emitExpression(native_gen *gen, command *cmd){
+  return emitStatement(gen, "SELECT %.*s", cmd->nsql, cmd->sql);
+}
+
+/*
+** Add the table of the variables assigned by the command at position pos.
+*/
+SQLITE_PRIVATE void emitVariables(native_gen *gen, int pos, int *slots, int num_vars){
+  int i;
+
+  sqlite3_str_appendf(gen->tables, "static const int sp_vars_%d[] = {", pos);
+  for( i=0; i<num_vars; i++ ){
+    sqlite3_str_appendf(gen->tables, "%s %d", i>0 ? "," : "", slots[i]);
   }
-  return SQLITE_OK;
+  sqlite3_str_appendall(gen->tables, " };\n");
 }
 
 /*
-** Reset the state of a procedure call.
+** Generate the body of the execute function, one command at a time.
 */
-SQLITE_PRIVATE int resetProcedureCall(Vdbe *v, procedure_call *call) {
-  stored_proc *procedure = call->procedure;
-  // reset the stored procedure
-  resetStoredProcedure(v, procedure);
-  // reset the parameters
-  for (int n = 0; n < procedure->num_params; n++) {
-    sqlite3_var *param = procedure->params[n];
-    sqlite3VdbeMemSetNull(&param->value);
+SQLITE_PRIVATE int emitProcedureBody(native_gen *gen){
+  stored_proc *procedure = gen->procedure;
+  int *if_stack;      // number of ELSEIF on each open IF block
+  int num_ifs = 0;
+  int pos, id, id2, i;
+
+  if_stack = sqlite3MallocZero((procedure->num_cmds + 1) * sizeof(int));
+  if( if_stack==NULL ) return SQLITE_NOMEM;
+
+  for( pos=0; pos<procedure->num_cmds && gen->error_msg==NULL; pos++ ){
+    command *cmd = &procedure->cmds[pos];
+
+    switch( cmd->type ){
+    case CMD_TYPE_DECLARE:
+      // the variables are declared on the execute function
+      break;
+
+    case CMD_TYPE_SET:
+      if( (cmd->flags & CMD_FLAG_STORE_AS_LIST) || cmd->input_list ){
+        goto loc_list;
+      }
+      if( isSetInputStatement(cmd->sql) ){
+        id = emitStatement(gen, "%.*s", cmd->nsql, cmd->sql);
+      }else{
+        id = emitStatement(gen, "SELECT %.*s", cmd->nsql, cmd->sql);
+      }
+      if( id<0 ) break;
+      emitVariables(gen, pos, cmd->vars, cmd->num_vars);
+      emitLine(gen, "if( (rc = sp_set(&f, %d, %d, sp_vars_%d)) ) goto done;",
+               id, cmd->num_vars, pos);
+      break;
+
+    case CMD_TYPE_STATEMENT:
+      if( forbiddenStatementError(cmd) ){
+        gen->error_msg = sqlite3_mprintf("cannot compile %s: %s", procedure->name,
+                                         forbiddenStatementError(cmd));
+        break;
+      }
+      id = emitStatement(gen, "%.*s", cmd->nsql, cmd->sql);
+      if( id<0 ) break;
+      emitLine(gen, "if( (rc = sp_exec(&f, %d)) ) goto done;", id);
+      break;
+
+    case CMD_TYPE_IF:
+      id = emitExpression(gen, cmd);
+      if( id<0 ) break;
+      emitLine(gen, "if( (rc = sp_condition(&f, %d, &cond)) ) goto done;", id);
+      emitLine(gen, "if( cond ){");
+      gen->indent++;
+      if_stack[num_ifs++] = 0;
+      break;
+
+    case CMD_TYPE_ELSEIF:
+      // the next condition is evaluated on the else branch
+      id = emitExpression(gen, cmd);
+      if( id<0 ) break;
+      gen->indent--;
+      emitLine(gen, "}else{");
+      gen->indent++;
+      emitLine(gen, "if( (rc = sp_condition(&f, %d, &cond)) ) goto done;", id);
+      emitLine(gen, "if( cond ){");
+      gen->indent++;
+      if_stack[num_ifs-1]++;
+      break;
+
+    case CMD_TYPE_ELSE:
+      gen->indent--;
+      emitLine(gen, "}else{");
+      gen->indent++;
+      break;
+
+    case CMD_TYPE_ENDIF:
+      for( i=if_stack[--num_ifs]; i>=0; i-- ){
+        gen->indent--;
+        emitLine(gen, "}");
+      }
+      break;
+
+    case CMD_TYPE_LOOP:
+      emitLine(gen, "for(;;){");
+      gen->indent++;
+      break;
+
+    case CMD_TYPE_FOREACH:
+      if( cmd->input_var>=0 || cmd->input_list || cmd->sql==NULL ){
+        goto loc_list;
+      }
+      if( cmd->num_vars==0 ){
+        gen->error_msg = sqlite3_mprintf("cannot compile %s: FOREACH must "
+                              "declare its variables", procedure->name);
+        break;
+      }
+      id = emitStatement(gen, "%.*s", cmd->nsql, cmd->sql);
+      if( id<0 ) break;
+      emitVariables(gen, pos, cmd->vars, cmd->num_vars);
+      emitLine(gen, "{");
+      gen->indent++;
+      emitLine(gen, "sqlite3_stmt *loop%d;", pos);
+      emitLine(gen, "if( (rc = sp_prepare(&f, %d, &loop%d)) ) goto done;", id, pos);
+      emitLine(gen, "while( (rc = sqlite3_step(loop%d))==SQLITE_ROW ){", pos);
+      gen->indent++;
+      emitLine(gen, "if( (rc = sp_columns(&f, loop%d, %d, sp_vars_%d)) ) goto done;",
+               pos, cmd->num_vars, pos);
+      break;
+
+    case CMD_TYPE_ENDLOOP:
+      gen->indent--;
+      emitLine(gen, "}");
+      if( procedure->cmds[cmd->related_cmd].type==CMD_TYPE_FOREACH ){
+        // left with BREAK (ROW or OK) or when there are no more rows
+        emitLine(gen, "if( rc!=SQLITE_OK && rc!=SQLITE_ROW && rc!=SQLITE_DONE ){");
+        emitLine(gen, "  rc = sp_error(&f, rc);");
+        emitLine(gen, "  goto done;");
+        emitLine(gen, "}");
+        gen->indent--;
+        emitLine(gen, "}");
+      }
+      break;
+
+    case CMD_TYPE_BREAK:
+      emitLine(gen, "break;");
+      break;
+
+    case CMD_TYPE_CONTINUE:
+      emitLine(gen, "continue;");
+      break;
+
+    case CMD_TYPE_ASSERT:
+      id = emitExpression(gen, cmd);
+      if( id<0 ) break;
+      id2 = emitStatement(gen, "SELECT printf(%.*s)", cmd->nsql2, cmd->sql2);
+      if( id2<0 ) break;
+      emitLine(gen, "if( (rc = sp_condition(&f, %d, &cond)) ) goto done;", id);
+      emitLine(gen, "if( !cond ){");
+      emitLine(gen, "  rc = sp_raise(&f, %d, \"Assertion failed: \");", id2);
+      emitLine(gen, "  goto done;");
+      emitLine(gen, "}");
+      break;
+
+    case CMD_TYPE_RAISE:
+      id = emitStatement(gen, "SELECT printf(%.*s)", cmd->nsql, cmd->sql);
+      if( id<0 ) break;
+      emitLine(gen, "rc = sp_raise(&f, %d, \"\");", id);
+      emitLine(gen, "goto done;");
+      break;
+
+    case CMD_TYPE_RETURN:
+      if( cmd->flags & (CMD_FLAG_RETURN_ROWS | CMD_FLAG_RETURN_NEXT) ){
+        gen->error_msg = sqlite3_mprintf("cannot compile %s: returning rows is not supported",
+                                         procedure->name);
+        break;
+      }
+      // the variables of an expression are added by the engine
+      if( cmd->sql ){
+        id = emitExpression(gen, cmd);
+        if( id<0 ) break;
+        emitLine(gen, "rc = sp_return_row(&f, %d);", id);
+      }else if( cmd->num_vars>0 ){
+        emitVariables(gen, pos, cmd->vars, cmd->num_vars);
+        emitLine(gen, "rc = sp_return_vars(&f, %d, sp_vars_%d);", cmd->num_vars, pos);
+      }else{
+        emitLine(gen, "rc = SQLITE_OK;");
+      }
+      emitLine(gen, "goto done;");
+      break;
+
+    default:
+      gen->error_msg = sqlite3_mprintf("cannot compile %s: unsupported command",
+                                       procedure->name);
+    }
+    continue;
+
+loc_list:
+    gen->error_msg = sqlite3_mprintf("cannot compile %s: lists are not supported",
+                                     procedure->name);
   }
-  return SQLITE_OK;
+
+  sqlite3_free(if_stack);
+  return gen->error_msg ? SQLITE_ERROR : SQLITE_OK;
 }
 
 /*
-** Release a command.
+** Generate the C source of a loadable extension with the native
+** implementation of the procedure. On error the message is returned on
+** pzErr.
 */
-SQLITE_PRIVATE void releaseCommand(command* cmd) {
-  if( cmd->flags & CMD_FLAG_DYNAMIC_SQL ){
-    sqlite3_free(cmd->sql);
+SQLITE_PRIVATE int generateNativeSource(call_frame *frame, char **psource, char **pzErr){
+  stored_proc *procedure = frame->procedure;
+  sqlite3 *db = frame->db;
+  native_gen gen;
+  sqlite3_str *out;
+  int num_vars, rc, i;
+
+  *psource = NULL;
+  *pzErr = NULL;
+
+  if( procedure->is_function ){
+    *pzErr = sqlite3_mprintf("cannot compile %s: functions cannot be compiled",
+                             procedure->name);
+    return SQLITE_ERROR;
   }
-  if (cmd->stmt) {
-    sqlite3_finalize(cmd->stmt);
+  for( i=0; i<procedure->num_vars; i++ ){
+    if( procedure->vars[i]->type!=0 ){
+      *pzErr = sqlite3_mprintf("cannot compile %s: typed variables are not supported: %s",
+                               procedure->name, procedure->vars[i]->name);
+      return SQLITE_ERROR;
+    }
   }
-  if (cmd->input_list) {
-    sqlite3_free_list(cmd->input_list);
+
+  memset(&gen, 0, sizeof(gen));
+  gen.frame = frame;
+  gen.procedure = procedure;
+  gen.body = sqlite3_str_new(db);
+  gen.tables = sqlite3_str_new(db);
+  gen.stmts = sqlite3_str_new(db);
+  gen.indent = 1;
+
+  rc = emitProcedureBody(&gen);
+  // the variables bound to the statements were added while generating it
+  num_vars = frame->num_vars>0 ? frame->num_vars : 1;
+
+  out = sqlite3_str_new(db);
+  sqlite3_str_appendf(out,
+    "/*\n"
+    "** Native implementation of the stored procedure %s\n"
+    "** generated by sp_compile_c(). Build it as a loadable extension:\n"
+    "**\n"
+    "**   gcc -O2 -fPIC -shared -I<sqlite source> %s.c -o %s.so\n"
+    "**\n"
+    "** and load it on the connection with .load or load_extension(). CALL uses\n"
+    "** it while the procedure code stored on the database is the same.\n"
+    "*/\n"
+    "#include <string.h>\n"
+    "#include \"sqlite3ext.h\"\n"
+    "SQLITE_EXTENSION_INIT1\n\n",
+    procedure->name, procedure->name, procedure->name);
+  sqlite3_str_appendall(out, nativeApiCode);
+
+  // tables
+  sqlite3_str_appendall(out, "\nstatic const int sp_params[] = {");
+  for( i=0; i<procedure->num_params; i++ ){
+    sqlite3_str_appendf(out, "%s %d", i>0 ? "," : "", procedure->params[i]);
   }
-  if (cmd->vars) {
-    sqlite3_free(cmd->vars);
+  sqlite3_str_appendf(out, "%s };\n", procedure->num_params>0 ? "" : " -1");
+  sqlite3_str_appendf(out, "%s\nstatic const sp_stmt_info sp_stmts[] = {\n",
+                      sqlite3_str_value(gen.tables) ? sqlite3_str_value(gen.tables) : "");
+  sqlite3_str_appendf(out, "%s", sqlite3_str_value(gen.stmts) ?
+                      sqlite3_str_value(gen.stmts) : "  { 0, 0, 0 }\n");
+  sqlite3_str_appendall(out, "};\n\n");
+
+  // helpers and the execute function
+  sqlite3_str_appendall(out, nativeHelpersCode);
+  sqlite3_str_appendf(out,
+    "\n"
+    "static int sp_execute(sp_native_api *api, sqlite3_value **params, char **pzErr){\n"
+    "  sqlite3_value *var[%d];\n"
+    "  sp_frame f;\n"
+    "  int rc = SQLITE_OK, cond = 0, i;\n"
+    "\n"
+    "  memset(var, 0, sizeof(var));\n"
+    "  f.api = api;\n"
+    "  f.var = var;\n"
+    "  f.pzErr = pzErr;\n"
+    "  for( i=0; i<%d; i++ ){\n"
+    "    if( (rc = sp_store(&f, sp_params[i], params[i])) ) goto done;\n"
+    "  }\n"
+    "\n"
+    "%s"
+    "\n"
+    "  rc = SQLITE_OK;\n"
+    "done:\n"
+    "  (void)cond;\n"
+    "  for( i=0; i<%d; i++ ) sqlite3_value_free(var[i]);\n"
+    "  return rc;\n"
+    "}\n\n",
+    num_vars, procedure->num_params,
+    sqlite3_str_value(gen.body) ? sqlite3_str_value(gen.body) : "",
+    num_vars);
+
+  // descriptor and registration
+  sqlite3_str_appendall(out, "static const sp_native_proc sp_procedure = {\n  SP_NATIVE_MAGIC, ");
+  appendCString(out, procedure->name, strlen(procedure->name));
+  sqlite3_str_appendf(out, ", 0x%016llxULL, %d, %d, sp_execute\n};\n\n",
+                      procedure->version, procedure->num_params, gen.num_stmts);
+  sqlite3_str_appendall(out,
+    "#ifdef _WIN32\n"
+    "__declspec(dllexport)\n"
+    "#endif\n"
+    "int sqlite3_extension_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi){\n"
+    "  sqlite3_stmt *stmt;\n"
+    "  int rc;\n"
+    "  SQLITE_EXTENSION_INIT2(pApi);\n"
+    "  rc = sqlite3_prepare_v2(db, \"SELECT sp_register_native(?1)\", -1, &stmt, 0);\n"
+    "  if( rc==SQLITE_OK ){\n"
+    "    sqlite3_bind_pointer(stmt, 1, (void*)&sp_procedure, \"sp_native_proc\", 0);\n"
+    "    sqlite3_step(stmt);\n"
+    "    rc = sqlite3_finalize(stmt);\n"
+    "  }\n"
+    "  if( rc!=SQLITE_OK ) *pzErrMsg = sqlite3_mprintf(\"%s\", sqlite3_errmsg(db));\n"
+    "  return rc;\n"
+    "}\n");
+
+  sqlite3_free(sqlite3_str_finish(gen.body));
+  sqlite3_free(sqlite3_str_finish(gen.tables));
+  sqlite3_free(sqlite3_str_finish(gen.stmts));
+
+  if( rc!=SQLITE_OK || sqlite3_str_errcode(out)!=SQLITE_OK ){
+    sqlite3_free(sqlite3_str_finish(out));
+    *pzErr = gen.error_msg ? gen.error_msg : sqlite3_mprintf("out of memory");
+    return rc ? rc : SQLITE_NOMEM;
   }
+
+  *psource = sqlite3_str_finish(out);
+  return SQLITE_OK;
 }
 
 /*
-** Release a stored procedure.
+** sp_compile_c(name)
+**
+** Return the C source of the native implementation of a stored procedure.
 */
-SQLITE_PRIVATE void releaseProcedure(stored_proc* procedure) {
-    if (procedure->error_msg) {
-        sqlite3_free(procedure->error_msg);
-    }
-    if (procedure->cmds) {
-        for (int n = 0; n < procedure->num_cmds; n++) {
-            releaseCommand(&procedure->cmds[n]);
-        }
-        sqlite3_free(procedure->cmds);
-    }
-    if (procedure->params) {
-        sqlite3_free(procedure->params);
-    }
-    dropAllVariables(procedure);
-    if (procedure->code) {
-      sqlite3_free(procedure->code);
-    }
-    sqlite3_free(procedure);
-}
+SQLITE_PRIVATE void spCompileCFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  sp_connection *conn = (sp_connection*) sqlite3_user_data(ctx);
+  const char *name = (const char*) sqlite3_value_text(argv[0]);
+  call_frame *frame;
+  char *source = NULL, *zErr = NULL;
+  int rc;
+
+  if( name==NULL || strlen(name)>=sizeof(((stored_proc*)0)->name) ){
+    sqlite3_result_error(ctx, "sp_compile_c: invalid procedure name", -1);
+    return;
+  }
 
-SQLITE_PRIVATE void releaseProcedureCall(procedure_call *call) {
-    if (call->procedure) {
-        releaseProcedure(call->procedure);
-    }
-    if (call->input_list) {
-        sqlite3_free_list(call->input_list);
+  // get an idle frame from the cache or load the procedure
+  frame = takeCachedFrame(conn, name);
+  if( frame==NULL ){
+    rc = loadStoredFunction(conn, (char*)name, &frame, &zErr);
+    if( rc!=SQLITE_OK ){
+      sqlite3_result_error(ctx, zErr ? zErr : "out of memory", -1);
+      sqlite3_free(zErr);
+      return;
     }
-    sqlite3_free(call);
+  }
+
+  rc = generateNativeSource(frame, &source, &zErr);
+  cacheFrame(conn, frame);
+
+  if( rc!=SQLITE_OK ){
+    sqlite3_result_error(ctx, zErr ? zErr : "out of memory", -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  sqlite3_result_text(ctx, source, -1, sqlite3_free);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3516,5 +10455,22 @@ SQLITE_PRIVATE int checkSpecialCommand(Parse *pParse, const char **psql){
       return SQLITE_DONE;
     }
 
+    // make the stored functions available to statements with expressions
+    {
+      int tokenType;
+      sqlite3GetToken((u8*)sql, &tokenType);
+      switch (tokenType) {
+        case TK_SELECT:
+        case TK_INSERT:
+        case TK_UPDATE:
+        case TK_DELETE:
+        case TK_REPLACE:
+        case TK_WITH:
+        case TK_VALUES:
+          registerStoredFunctions(pParse, getConnectionContext(pParse->db));
+          break;
+      }
+    }
+
     return SQLITE_OK;
 }
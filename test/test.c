@@ -89,6 +89,94 @@ invalid syntax:
 
 */
 
+/*
+** Interface of the procedures compiled into C, as emitted by sp_compile_c()
+*/
+
+#define SP_NATIVE_MAGIC  0x53504e31
+
+typedef struct sp_native_api {
+  sqlite3 *db;
+  void *ctx;
+  sqlite3_stmt *(*xStatement)(void *ctx, int id, const char *sql);
+  int (*xResultRow)(void *ctx, int num_cols, sqlite3_value **values);
+} sp_native_api;
+
+typedef struct sp_native_proc {
+  unsigned int magic;
+  const char *name;
+  sqlite3_uint64 version;
+  int num_params;
+  int num_statements;
+  int (*xExecute)(sp_native_api *api, sqlite3_value **params, char **pzErr);
+} sp_native_proc;
+
+int native_calls = 0;
+
+/*
+** Hand-written native implementation of native_double(@x)
+*/
+int native_double_execute(sp_native_api *api, sqlite3_value **params, char **pzErr){
+  sqlite3_stmt *stmt;
+  sqlite3_value *row[1];
+  native_calls++;
+  if( sqlite3_value_type(params[0])==SQLITE_TEXT ){
+    *pzErr = sqlite3_mprintf("native error: %s", sqlite3_value_text(params[0]));
+    return SQLITE_ERROR;
+  }
+  stmt = api->xStatement(api->ctx, 0, "SELECT ?1 * 2");
+  if( stmt==NULL ) return SQLITE_ERROR;
+  sqlite3_bind_value(stmt, 1, params[0]);
+  if( sqlite3_step(stmt)!=SQLITE_ROW ) return SQLITE_ERROR;
+  row[0] = sqlite3_column_value(stmt, 0);
+  return api->xResultRow(api->ctx, 1, row);
+}
+
+sp_native_proc native_double = {
+  SP_NATIVE_MAGIC, "native_double", 0, 1, 1, native_double_execute
+};
+
+/*
+** Return the version of a stored procedure: the hash of its name and code
+*/
+sqlite3_uint64 procedure_version(char *name){
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_uint64 h = 0xcbf29ce484222325ULL;
+  const unsigned char *p;
+  int rc;
+
+  rc = sqlite3_prepare_v2(db, "SELECT code FROM stored_procedures WHERE name = ?", -1, &stmt, NULL);
+  assert(rc==SQLITE_OK);
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  assert(rc==SQLITE_ROW);
+
+  for( p=(const unsigned char*)name; *p; p++ ){
+    h = (h ^ *p) * 0x100000001b3ULL;
+  }
+  h = (h ^ 0) * 0x100000001b3ULL;
+  for( p=sqlite3_column_text(stmt, 0); *p; p++ ){
+    h = (h ^ *p) * 0x100000001b3ULL;
+  }
+
+  sqlite3_finalize(stmt);
+  return h;
+}
+
+/*
+** Register a native implementation, like the compiled extensions do
+*/
+int register_native(sp_native_proc *native){
+  sqlite3_stmt *stmt = NULL;
+  int rc;
+
+  rc = sqlite3_prepare_v2(db, "SELECT sp_register_native(?1)", -1, &stmt, NULL);
+  if( rc!=SQLITE_OK ) return rc;
+  sqlite3_bind_pointer(stmt, 1, native, "sp_native_proc", NULL);
+  sqlite3_step(stmt);
+  return sqlite3_finalize(stmt);
+}
+
 int main(){
   int rc;
 
@@ -185,6 +273,23 @@ int main(){
     NULL
   );
 
+  // the arguments are kept as parsed, for the next executions
+  {
+    sqlite3_stmt *stmt = NULL;
+    int n;
+    rc = sqlite3_prepare_v2(db, "CALL echo([7,'seven'])", -1, &stmt, NULL);
+    assert(rc==SQLITE_OK);
+    for( n=0; n<2; n++ ){
+      assert(sqlite3_step(stmt)==SQLITE_ROW);
+      assert(sqlite3_column_int(stmt, 0)==7);
+      assert(sqlite3_step(stmt)==SQLITE_ROW);
+      assert(strcmp((char*)sqlite3_column_text(stmt, 0), "seven")==0);
+      assert(sqlite3_step(stmt)==SQLITE_DONE);
+      sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+  }
+
 
   // RETURN with many literal arguments on the same row
 
@@ -415,6 +520,76 @@ int main(){
   );
 
 
+  // RETURN with SELECT (the rows are read as the CALL is stepped)
+
+  db_execute(
+    "CREATE PROCEDURE return_select(@min) BEGIN "
+    " RETURN SELECT a, c FROM test WHERE a > @min;"
+    "END;"
+  );
+
+  db_check_many("CALL return_select(20)",
+    "22|world!",
+    "33|foo!",
+    "44|bar!",
+    NULL
+  );
+
+  db_check_empty("CALL return_select(100)");
+
+  db_check_many("CALL return_select(40)",
+    "44|bar!",
+    NULL
+  );
+
+  // the error of a row read after the first one fails the CALL, and its
+  // changes are rolled back
+
+  db_execute("CREATE TABLE stream_log (v)");
+  db_execute(
+    "CREATE PROCEDURE return_select_error() BEGIN "
+    " INSERT INTO stream_log VALUES (1);"
+    " RETURN SELECT json(column1) FROM (VALUES ('[1]'), ('bad'));"
+    "END;"
+  );
+
+  {
+    sqlite3_stmt *stmt = NULL;
+    rc = sqlite3_prepare_v2(db, "CALL return_select_error()", -1, &stmt, NULL);
+    assert(rc==SQLITE_OK);
+    assert(sqlite3_step(stmt)==SQLITE_ROW);
+    assert(strcmp((char*)sqlite3_column_text(stmt, 0), "[1]")==0);
+    rc = sqlite3_step(stmt);
+    assert(rc==SQLITE_ERROR);
+    assert(strstr(sqlite3_errmsg(db), "malformed JSON")!=NULL);
+    sqlite3_reset(stmt);
+    // the statement can be executed again
+    assert(sqlite3_step(stmt)==SQLITE_ROW);
+    assert(sqlite3_step(stmt)==SQLITE_ERROR);
+    sqlite3_finalize(stmt);
+  }
+  db_check_int("SELECT count(*) FROM stream_log", 0);
+
+  // RETURN with UPDATE and RETURNING
+
+  db_execute("CREATE TABLE stock (id integer primary key, qty integer)");
+  db_execute("INSERT INTO stock (qty) VALUES (10), (20), (30)");
+
+  db_execute(
+    "CREATE PROCEDURE return_update(@min, @amount) BEGIN "
+    " RETURN (UPDATE stock SET qty = qty - @amount WHERE qty >= @min RETURNING id, qty);"
+    "END;"
+  );
+
+  db_check_many("CALL return_update(20, 5)",
+    "2|15",
+    "3|25",
+    NULL
+  );
+
+  db_check_int("SELECT sum(qty) FROM stock", 50);
+
+
   // SET with INSERT and RETURNING
 #if 0
   db_execute("DROP TABLE IF EXISTS test");
@@ -1182,6 +1357,22 @@ int main(){
   db_check_int("CALL mult(3, 4)", 12);
   db_check_int("CALL mult(9, 3)", 27);
 
+  // recursive CALL - each call has its own variables
+
+  db_execute(
+    "CREATE OR REPLACE PROCEDURE depth_sum(@n) BEGIN"
+    " IF @n = 0 THEN"
+    "   RETURN 0;"
+    " END IF;"
+    " SET @local = @n * 10;"
+    " SET @sub = CALL depth_sum(@n - 1);"
+    " RETURN @local + @sub;"
+    "END"
+  );
+
+  db_check_int("CALL depth_sum(3)", 60);
+  db_check_int("CALL depth_sum(4)", 100);
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1247,6 +1438,34 @@ int main(){
   );
 
 
+  // the blocks must be closed, and an invalid body does not affect the next ones
+
+  db_catch_msg(
+    "CREATE OR REPLACE PROCEDURE test_unclosed(@a) BEGIN"
+    " IF @a > 0 THEN"
+    "   LOOP"
+    "     BREAK;"
+    " END IF;"
+    "END",
+    "LOOP without END LOOP"
+  );
+
+  db_catch_msg(
+    "CREATE OR REPLACE PROCEDURE test_unclosed(@a) BEGIN"
+    " IF @a > 0 THEN"
+    "   RETURN 1;"
+    "END",
+    "IF without END IF"
+  );
+
+  db_catch_msg(
+    "CREATE OR REPLACE PROCEDURE test_unclosed(@a) BEGIN"
+    " BREAK;"
+    "END",
+    "BREAK statement without a LOOP block"
+  );
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // ASSERT
 ////////////////////////////////////////////////////////////////////////////////
@@ -1353,24 +1572,917 @@ int main(){
   db_catch_msg("CALL transfer2(1, 3, 10)", "The destination account was not found");
   db_catch_msg("CALL transfer2(3, 2, 10)", "The source account was not found");
 
+  // procedures that only read can run on read-only connections
+
+  db_execute(
+    "CREATE PROCEDURE total_balance() BEGIN"
+    " SET @total = SELECT sum(balance) FROM balances;"
+    " RETURN @total;"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE report_balance() BEGIN"
+    " SET @total = CALL total_balance();"
+    " RETURN 'total: ' || @total;"
+    "END"
+  );
+
+  db_execute("PRAGMA query_only = 1");
+  db_check_int("CALL total_balance()", 100);
+  db_check_str("CALL report_balance()", "total: 100");
+  db_catch_msg("CALL transfer(1, 2, 10)", "attempt to write a readonly database");
+  db_execute("PRAGMA query_only = 0");
+
+////////////////////////////////////////////////////////////////////////////////
+
+  // the cached procedure must be updated when it is replaced
+
+  db_execute("CREATE OR REPLACE PROCEDURE cached_version() BEGIN RETURN 1; END");
+  db_check_int("CALL cached_version()", 1);
+  db_check_int("CALL cached_version()", 1);
+
+  db_execute("CREATE OR REPLACE PROCEDURE cached_version() BEGIN RETURN 2; END");
+  db_check_int("CALL cached_version()", 2);
+
+  db_check_int("SELECT sp_config('procedure_cache')", 1);
+  db_check_int("SELECT sp_config('procedure_cache', 0)", 0);
+  db_check_int("CALL cached_version()", 2);
+  db_check_int("SELECT sp_config('procedure_cache', 1)", 1);
+
+  // and when its code is modified directly on the stored_procedures table
+
+  db_execute("CREATE PROCEDURE catalog_dml() BEGIN RETURN 1; END");
+  db_check_int("CALL catalog_dml()", 1);
+  db_execute("UPDATE stored_procedures SET code = replace(code, 'RETURN 1', 'RETURN 2') WHERE name = 'catalog_dml'");
+  db_check_int("CALL catalog_dml()", 2);
+
+  {
+    sqlite3_stmt *stmt;
+    // a prepared CALL is prepared again
+    rc = sqlite3_prepare_v2(db, "CALL catalog_dml()", -1, &stmt, NULL);
+    assert(rc==SQLITE_OK);
+    assert(sqlite3_step(stmt)==SQLITE_ROW);
+    assert(sqlite3_column_int(stmt, 0)==2);
+    sqlite3_reset(stmt);
+    db_execute("UPDATE stored_procedures SET code = replace(code, 'RETURN 2', 'RETURN 3') WHERE name = 'catalog_dml'");
+    assert(sqlite3_step(stmt)==SQLITE_ROW);
+    assert(sqlite3_column_int(stmt, 0)==3);
+    sqlite3_finalize(stmt);
+  }
+
+  // the modifications that are rolled back
+  db_execute("BEGIN");
+  db_execute("UPDATE stored_procedures SET code = replace(code, 'RETURN 3', 'RETURN 4') WHERE name = 'catalog_dml'");
+  db_check_int("CALL catalog_dml()", 4);
+  db_check_int("CALL catalog_dml()", 4);
+  db_execute("ROLLBACK");
+  db_check_int("CALL catalog_dml()", 3);
+
+  db_execute("DELETE FROM stored_procedures WHERE name = 'catalog_dml'");
+  db_catch_msg("CALL catalog_dml()", "Stored procedure not found: catalog_dml");
+
+  // and by another connection
+
+  {
+    sqlite3 *db1, *db2;
+    remove("test_catalog.db");
+    rc = sqlite3_open("test_catalog.db", &db1);
+    assert(rc==SQLITE_OK);
+    rc = sqlite3_open("test_catalog.db", &db2);
+    assert(rc==SQLITE_OK);
+    db_execute_fn(db1, "CREATE PROCEDURE other_conn() BEGIN RETURN 1; END", __FUNCTION__, __LINE__);
+    db_check_int_fn(db2, "CALL other_conn()", 1, __FUNCTION__, __LINE__);
+    db_check_int_fn(db2, "CALL other_conn()", 1, __FUNCTION__, __LINE__);
+    db_execute_fn(db1, "CREATE OR REPLACE PROCEDURE other_conn() BEGIN RETURN 2; END", __FUNCTION__, __LINE__);
+    db_check_int_fn(db2, "CALL other_conn()", 2, __FUNCTION__, __LINE__);
+    db_execute_fn(db1, "UPDATE stored_procedures SET code = replace(code, 'RETURN 2', 'RETURN 3')", __FUNCTION__, __LINE__);
+    db_check_int_fn(db2, "CALL other_conn()", 3, __FUNCTION__, __LINE__);
+    sqlite3_close(db2);
+    sqlite3_close(db1);
+    remove("test_catalog.db");
+  }
+
+  // the parsed code is shared with other connections using the same procedure
+
+  {
+    sqlite3 *db2;
+    char *shared_code =
+      "CREATE PROCEDURE shared_code(@n) BEGIN"
+      " SET @res = '';"
+      " FOREACH @num, @name IN [[1, 'one'], [2.5, 'two']] DO"
+      "   SET @res = @res || @num || @name || ',';"
+      " END LOOP;"
+      " RETURN @res || @n;"
+      "END";
+
+    rc = sqlite3_open(":memory:", &db2);
+    assert(rc==SQLITE_OK);
+    // the state is created when the connection is opened
+    db_check_int_fn(db2, "SELECT sp_config('procedure_cache')", 1, __FUNCTION__, __LINE__);
+    db_check_int_fn(db2, "SELECT count(*) FROM sp_statements", 0, __FUNCTION__, __LINE__);
+    db_execute_fn(db2, shared_code, __FUNCTION__, __LINE__);
+    db_check_str_fn(db2, "CALL shared_code(1)", "1one,2.5two,1", __FUNCTION__, __LINE__);
+
+    db_execute(shared_code);
+    db_check_str("CALL shared_code(2)", "1one,2.5two,2");
+
+    // the code is kept while used by the remaining connection
+    sqlite3_close(db2);
+    db_check_str("CALL shared_code(3)", "1one,2.5two,3");
+    db_execute("CREATE OR REPLACE PROCEDURE shared_code(@n) BEGIN RETURN @n * 2; END");
+    db_check_int("CALL shared_code(4)", 8);
+  }
+
+  // the body statements are kept on the pool after the CALL is finalized
+
+  db_execute("CREATE PROCEDURE pooled_sum(@a, @b) BEGIN SET @c = SELECT @a + @b; RETURN @c; END");
+  db_check_int("CALL pooled_sum(1, 2)", 3);
+  db_check_int("SELECT count(*) > 0 FROM sp_statements WHERE procedure = 'pooled_sum'", 1);
+  db_check_int("CALL pooled_sum(3, 4)", 7);
+
+  db_check_int("SELECT sp_config('statement_pool_size')", 256);
+  db_check_int("SELECT sp_config('statement_pool_size', 0)", 0);
+  db_check_int("SELECT count(*) FROM sp_statements", 0);
+  db_check_int("CALL pooled_sum(5, 6)", 11);
+  db_check_int("SELECT count(*) FROM sp_statements", 0);
+  db_check_int("SELECT sp_config('statement_pool_size', 256)", 256);
+
+  // execution statistics of the commands
+
+  db_execute(
+    "CREATE PROCEDURE profiled(@n) BEGIN"
+    " SET @sum = 0;"
+    " FOREACH @x IN SELECT value FROM (WITH RECURSIVE c(value) AS"
+    "   (SELECT 1 UNION ALL SELECT value + 1 FROM c WHERE value < @n) SELECT value FROM c) DO"
+    "   SET @sum = @sum + @x;"
+    " END LOOP;"
+    " RETURN @sum;"
+    "END"
+  );
+
+  db_check_int("SELECT sp_config('profile')", 0);
+  db_check_int("CALL profiled(10)", 55);
+  db_check_int("SELECT count(*) FROM sp_profile", 0);
+
+  db_check_int("SELECT sp_config('profile', 1)", 1);
+  db_check_int("CALL profiled(10)", 55);
+  db_check_int("SELECT count FROM sp_profile WHERE procedure = 'profiled' AND command = 3", 10);
+  db_check_str("SELECT type FROM sp_profile WHERE procedure = 'profiled' AND command = 2", "FOREACH");
+  db_check_int("SELECT rows FROM sp_profile WHERE procedure = 'profiled' AND command = 2", 10);
+  db_check_int("SELECT vm_steps > 0 FROM sp_profile WHERE procedure = 'profiled' AND command = 2", 1);
+  db_check_int("SELECT total_us >= max_us FROM sp_profile WHERE procedure = 'profiled' AND command = 2", 1);
+  db_check_str("SELECT sql FROM sp_profile WHERE procedure = 'profiled' AND command = 3", "@sum + @x");
+
+  // the simple expressions are evaluated without a prepared statement
+  db_check_int("SELECT native_count FROM sp_profile WHERE procedure = 'profiled' AND command = 3", 10);
+  db_check_int("SELECT native_count FROM sp_profile WHERE procedure = 'profiled' AND command = 2", 0);
+  db_execute(
+    "CREATE PROCEDURE profiled_expr(@n) BEGIN"
+    " SET @a = @n * 2;"
+    " SET @b = abs(@n);"
+    " IF @a > @b THEN SET @a = @b; END IF;"
+    " RETURN @a, @b;"
+    "END"
+  );
+  db_check_str("CALL profiled_expr(3)", "3|3");
+  db_check_str("CALL profiled_expr(-3)", "-6|3");
+  db_check_many("SELECT command, type, count, native_count FROM sp_profile WHERE procedure = 'profiled_expr' AND command <= 3",
+    "1|SET|2|2",
+    "2|SET|2|0",
+    "3|IF|2|2",
+    NULL
+  );
+
+  // nothing is collected while disabled, and enabling it clears the statistics
+  db_check_int("SELECT sp_config('profile', 0)", 0);
+  db_check_int("CALL profiled(5)", 15);
+  db_check_int("SELECT count FROM sp_profile WHERE procedure = 'profiled' AND command = 3", 10);
+  db_check_int("SELECT sp_config('profile', 1)", 1);
+  db_check_int("SELECT count FROM sp_profile WHERE procedure = 'profiled' AND command = 3", 0);
+  db_check_int("SELECT sp_config('profile', 0)", 0);
+
+  // latency of the calls
+
+  db_check_int("SELECT sp_config('latency')", 1);
+  db_check_int("SELECT count FROM sp_latency WHERE procedure = 'profiled'", 3);
+  db_check_int("SELECT p50_us <= p99_us AND p99_us <= p999_us AND p999_us <= max_us FROM sp_latency WHERE procedure = 'profiled'", 1);
+  db_check_int("SELECT max_us > 0 FROM sp_latency WHERE procedure = 'profiled'", 1);
+  db_check_int("SELECT count >= 3 FROM sp_latency('all') WHERE procedure = 'profiled'", 1);
+  db_check_int("SELECT count FROM sp_latency('connection') WHERE procedure = 'profiled'", 3);
+  db_catch_msg("SELECT * FROM sp_latency('other')", "the scope must be 'connection' or 'all'");
+
+  // calls are not recorded while disabled
+  db_check_int("SELECT sp_config('latency', 0)", 0);
+  db_check_int("CALL profiled(5)", 15);
+  db_check_int("SELECT count FROM sp_latency WHERE procedure = 'profiled'", 3);
+  db_check_int("SELECT sp_config('latency', 1)", 1);
+  db_check_int("CALL profiled(5)", 15);
+  db_check_int("SELECT count FROM sp_latency WHERE procedure = 'profiled'", 4);
+
+  // the bound values must follow the modified variables
+
+  db_execute("CREATE TABLE bind_log (item, factor, total)");
+  db_execute(
+    "CREATE PROCEDURE bind_changes(@factor) BEGIN"
+    " SET @total = 0;"
+    " FOREACH @item IN [1,2,3,4] DO"
+    "   SET @total = @total + @item * @factor;"
+    "   INSERT INTO bind_log VALUES (@item, @factor, @total);"
+    " END LOOP;"
+    " RETURN @total;"
+    "END"
+  );
+  db_check_int("CALL bind_changes(2)", 20);
+  db_check_int("CALL bind_changes(3)", 30);
+  db_check_int("SELECT count(*) FROM bind_log", 8);
+  db_check_int("SELECT sum(total) FROM bind_log WHERE factor = 2", 40);
+  db_check_int("SELECT sum(total) FROM bind_log WHERE factor = 3", 60);
+  db_check_int("SELECT count(*) FROM bind_log WHERE total <> (item * (item + 1) / 2) * factor", 0);
+
+  // the list variables can be used in set-based statements
+
+  db_execute("CREATE TABLE list_items (order_id INTEGER, name TEXT, qty INTEGER, price REAL)");
+  db_execute(
+    "CREATE PROCEDURE add_order(@order_id, @items) BEGIN"
+    " INSERT INTO list_items SELECT @order_id, c1, c2, c3 FROM sp_list(@items);"
+    " RETURN changes();"
+    "END"
+  );
+  db_check_int("CALL add_order(1, [['ipad',1,1234.00], ['iphone',2,799.90], ['iwatch',3,249.99]])", 3);
+  db_check_int("CALL add_order(2, [['ipod',1,99.00]])", 1);
+  db_check_many("SELECT * FROM list_items",
+    "1|ipad|1|1234.0",
+    "1|iphone|2|799.9",
+    "1|iwatch|3|249.99",
+    "2|ipod|1|99.0",
+    NULL
+  );
+
+  db_execute(
+    "CREATE PROCEDURE delete_orders(@ids) BEGIN"
+    " DELETE FROM list_items WHERE order_id IN (SELECT value FROM sp_list(@ids));"
+    " RETURN changes();"
+    "END"
+  );
+  db_check_int("CALL delete_orders([2,3])", 1);
+  db_check_int("SELECT count(*) FROM list_items", 3);
+
+  db_execute(
+    "CREATE PROCEDURE list_positions(@list, @from, @to) BEGIN"
+    " SET @res = (SELECT position, value FROM sp_list(@list) WHERE position BETWEEN @from AND @to);"
+    " RETURN @res;"
+    "END"
+  );
+  db_check_many("CALL list_positions([11,22,33,44,55], 2, 4)",
+    "2|22",
+    "3|33",
+    "4|44",
+    NULL
+  );
+  db_check_many("CALL list_positions([11,22,33,44,55], 5, 9)",
+    "5|55",
+    NULL
+  );
+  db_check_many("CALL list_positions([11,22,33], 0, 1.5)",
+    "1|11",
+    NULL
+  );
+
+  db_execute(
+    "CREATE PROCEDURE list_item(@list, @pos) BEGIN"
+    " SET @value = SELECT value FROM sp_list(@list) WHERE rowid = @pos;"
+    " RETURN @value;"
+    "END"
+  );
+  db_check_int("CALL list_item([11,22,33], 2)", 22);
+  db_check_str("CALL list_item([11,'abc',33], 2)", "abc");
+
+  db_execute(
+    "CREATE PROCEDURE list_not_list(@value) BEGIN"
+    " SET @count = SELECT count(*) FROM sp_list(@value);"
+    " RETURN @count;"
+    "END"
+  );
+  db_catch_msg("CALL list_not_list(123)", "sp_list: the argument is not a list");
+  db_check_int("CALL list_not_list(NULL)", 0);
+
+  // a FOREACH over a list with a single INSERT is executed as one statement
+
+  db_execute("CREATE TABLE fused_items (id INTEGER PRIMARY KEY, order_id INTEGER, name TEXT UNIQUE, total REAL)");
+  db_execute(
+    "CREATE PROCEDURE add_fused(@order_id, @items) BEGIN"
+    " FOREACH @name, @qty, @price IN @items DO"
+    "   INSERT INTO fused_items (order_id, name, total) VALUES (@order_id, @name, @qty * @price);"
+    " END LOOP;"
+    " RETURN changes(), last_insert_rowid(), @name, @qty;"
+    "END"
+  );
+  db_check_str("CALL add_fused(1, [['ipad',1,1234.00], ['iphone',2,799.90], ['iwatch',3,250.00]])", "1|3|iwatch|3");
+  db_check_str("CALL add_fused(2, [['ipod',4,100.00]])", "1|4|ipod|4");
+  db_check_many("SELECT * FROM fused_items",
+    "1|1|ipad|1234.0",
+    "2|1|iphone|1599.8",
+    "3|1|iwatch|750.0",
+    "4|2|ipod|400.0",
+    NULL
+  );
+
+  // the errors are the same, and no item is inserted
+  db_catch_msg("CALL add_fused(3, [['ipad2',1,1.0], ['ipad',1,2.0]])", "UNIQUE constraint failed: fused_items.name");
+  db_catch_msg("CALL add_fused(3, [['ipad2',1,1.0], ['ipad3',1]])", "statement returns 2 values but has 3 variables to set");
+  db_check_int("SELECT count(*) FROM fused_items", 4);
+
+  // the single statement is shown on the profile
+  db_check_int("SELECT sp_config('profile', 1)", 1);
+  db_check_str("CALL add_fused(3, [['ipad2',1,1.0], ['ipad3',1,2.0]])", "1|6|ipad3|1");
+  db_check_int("SELECT sql LIKE '%FROM sp_list(:sp_items)%' FROM sp_profile WHERE procedure = 'add_fused' AND command = 1", 1);
+  db_check_int("SELECT rows FROM sp_profile WHERE procedure = 'add_fused' AND command = 1", 2);
+  db_check_int("SELECT count FROM sp_profile WHERE procedure = 'add_fused' AND command = 2", 1);
+  db_check_int("SELECT sp_config('profile', 0)", 0);
+
+  // changes() is the one of the last INSERT, also when rows are ignored
+
+  db_execute("CREATE TABLE fused_tags (name TEXT UNIQUE ON CONFLICT IGNORE)");
+  db_execute("CREATE TRIGGER fused_tags_skip BEFORE INSERT ON fused_tags WHEN new.name = 'skip' BEGIN SELECT RAISE(IGNORE); END");
+  db_execute(
+    "CREATE PROCEDURE add_tags(@tags) BEGIN"
+    " FOREACH @tag IN @tags DO"
+    "   INSERT INTO fused_tags (name) VALUES (@tag);"
+    " END LOOP;"
+    " RETURN changes();"
+    "END"
+  );
+  db_check_int("CALL add_tags(['a', 'b', 'a'])", 0);
+  db_check_int("CALL add_tags(['c', 'a', 'd'])", 1);
+  db_check_int("CALL add_tags(['e', 'skip'])", 0);
+  db_check_int("CALL add_tags(['skip', 'f'])", 1);
+  db_check_int("SELECT count(*) FROM fused_tags", 6);
+
+  // the lists are shared by the variables and the loops, without copies
+
+  db_execute(
+    "CREATE PROCEDURE shared_list() BEGIN"
+    " SET @rows = (SELECT name, total FROM fused_items ORDER BY id);"
+    " SET @copy = @rows;"
+    " SET @names = '';"
+    " FOREACH @name, @total IN @copy DO"
+    "   SET @names = @names || @name || ',';"
+    " END LOOP;"
+    " SET @rows = [1,2];"
+    " SET @copy2 = @copy;"
+    " SET @copy = NULL;"
+    " SET @count = SELECT count(*) FROM sp_list(@copy2);"
+    " RETURN @names, @name, @total, @count;"
+    "END"
+  );
+  db_check_str("CALL shared_list()", "ipad,iphone,iwatch,ipod,ipad2,ipad3,|ipad3|2.0|6");
+  db_check_str("CALL shared_list()", "ipad,iphone,iwatch,ipod,ipad2,ipad3,|ipad3|2.0|6");
+
+  db_execute(
+    "CREATE PROCEDURE shared_break() BEGIN"
+    " SET @list = (SELECT name FROM fused_items ORDER BY id);"
+    " FOREACH @item IN @list DO"
+    "   IF @item = 'iwatch' THEN SET @list = NULL; BREAK; END IF;"
+    " END LOOP;"
+    " RETURN @item || '!';"
+    "END"
+  );
+  db_check_str("CALL shared_break()", "iwatch!");
+  db_check_str("CALL shared_break()", "iwatch!");
+
+  db_execute(
+    "CREATE PROCEDURE shared_count(@list) BEGIN"
+    " SET @n = 0;"
+    " FOREACH @item IN @list DO SET @n = @n + 1; END LOOP;"
+    " RETURN @n;"
+    "END"
+  );
+  db_execute(
+    "CREATE PROCEDURE shared_call() BEGIN"
+    " SET @list = (SELECT id FROM fused_items);"
+    " SET @a = CALL shared_count(@list);"
+    " SET @b = @list;"
+    " SET @list = NULL;"
+    " SET @c = CALL shared_count(@b);"
+    " RETURN @a, @c;"
+    "END"
+  );
+  db_check_str("CALL shared_call()", "6|6");
+
+  // the values returned by a nested CALL do not point to its arena
+
+  db_execute(
+    "CREATE PROCEDURE arena_name(@id) BEGIN"
+    " SET @rows = (SELECT id, name FROM fused_items ORDER BY id);"
+    " FOREACH @item_id, @name IN @rows DO"
+    "   IF @item_id = @id THEN SET @found = @name; BREAK; END IF;"
+    " END LOOP;"
+    " RETURN @found;"
+    "END"
+  );
+  db_execute(
+    "CREATE PROCEDURE arena_names() BEGIN"
+    " SET @names = '';"
+    " FOREACH @id IN [1, 2, 3] DO"
+    "   SET @name = CALL arena_name(@id);"
+    "   IF @id = 1 THEN SET @first = @name; END IF;"
+    "   SET @names = @names || @name || ',';"
+    " END LOOP;"
+    " RETURN @first, @name, @names;"
+    "END"
+  );
+  db_check_str("CALL arena_names()", "ipad|iwatch|ipad,iphone,iwatch,");
+
+  // the lists with values of the same type are packed
+
+  db_check_many("CALL echo([11, 22, -33])", "11", "22", "-33", NULL);
+  db_check_many("CALL echo([1.5, 2.25])", "1.5", "2.25", NULL);
+  db_check_many("CALL echo(['first', '', 'third'])", "first", "", "third", NULL);
+  db_check_many("CALL echo([[1,2],[3.5,4.5],['a','b']])", "1|2", "3.5|4.5", "a|b", NULL);
+  db_check_many("CALL echo([11, 'twelve', 13])", "11", "twelve", "13", NULL);
+
+  db_execute(
+    "CREATE PROCEDURE packed_loop(@list) BEGIN"
+    " SET @res = '';"
+    " FOREACH @item IN @list DO"
+    "   SET @res = @res || typeof(@item) || ':' || @item || ',';"
+    " END LOOP;"
+    " RETURN @res, @item;"
+    "END"
+  );
+  db_check_str("CALL packed_loop([1, 2, 3])", "integer:1,integer:2,integer:3,|3");
+  db_check_str("CALL packed_loop([0.5, 1.5])", "real:0.5,real:1.5,|1.5");
+  db_check_str("CALL packed_loop(['ab', 'cd'])", "text:ab,text:cd,|cd");
+
+  db_execute(
+    "CREATE PROCEDURE packed_rows() BEGIN"
+    " SET @rows = (SELECT id, order_id FROM fused_items ORDER BY id DESC);"
+    " SET @sum = 0;"
+    " FOREACH @id, @order_id IN @rows DO SET @sum = @sum + @id * @order_id; END LOOP;"
+    " SET @count = SELECT count(*) FROM sp_list(@rows) WHERE c1 > 3;"
+    " RETURN @sum, @count;"
+    "END"
+  );
+  db_check_str("CALL packed_rows()", "47|3");
+
+  db_execute(
+    "CREATE PROCEDURE packed_return() BEGIN"
+    " SET @rows = (SELECT id, total FROM fused_items WHERE id <= 2 ORDER BY id);"
+    " RETURN @rows;"
+    "END"
+  );
+  db_check_many("CALL packed_return()", "1|1234.0", "2|1599.8", NULL);
+
+  // functions over the list variables
+
+  db_execute(
+    "CREATE PROCEDURE list_stats(@list) BEGIN"
+    " RETURN list_len(@list), list_sum(@list), list_avg(@list), list_min(@list), list_max(@list);"
+    "END"
+  );
+  db_check_str("CALL list_stats([4, 9, 1, 10, 3, 7, 2, 8, 6, 5])", "10|55|5.5|1|10");
+  db_check_str("CALL list_stats([1.5, 2.5, -3.0, 1.0, 0.5])", "5|2.5|0.5|-3.0|2.5");
+  db_check_str("CALL list_stats(['b', 'a', 'c'])", "3|0.0|0.0|a|c");
+  db_check_str("CALL list_stats([3, 1.5, '2'])", "3|6.5|2.16666666666667|1.5|2");
+  db_check_str("CALL list_stats([-9223372036854775807, 9223372036854775807, 5])", "3|5|1.66666666666667|-9223372036854775807|9223372036854775807");
+  db_catch_msg("CALL list_stats([9223372036854775807, 1, -1])", "integer overflow");
+  db_catch_msg("CALL list_stats(5)", "list_len: the argument is not a list");
+
+  db_execute(
+    "CREATE PROCEDURE list_empty() BEGIN"
+    " SET @list = [];"
+    " RETURN list_len(@list), coalesce(list_sum(@list), 'null'), coalesce(list_max(@list), 'null');"
+    "END"
+  );
+  db_check_str("CALL list_empty()", "0|null|null");
+
+  db_execute(
+    "CREATE PROCEDURE list_find(@list, @value) BEGIN"
+    " RETURN list_contains(@list, @value), list_index_of(@list, @value);"
+    "END"
+  );
+  db_check_str("CALL list_find([10, 20, 30, 40, 50, 60], 50)", "1|5");
+  db_check_str("CALL list_find([10, 20, 30, 40, 50, 60], 50.0)", "1|5");
+  db_check_str("CALL list_find([10, 20, 30, 40, 50, 60], 50.5)", "0|0");
+  db_check_str("CALL list_find([10, 20, 30, 40, 50, 60], '50')", "0|0");
+  db_check_str("CALL list_find([0.5, 1.5, 2.5, 3.5, 4.5], 4.5)", "1|5");
+  db_check_str("CALL list_find([0.5, 1.0, 2.5], 1)", "1|2");
+  db_check_str("CALL list_find(['x', 'y', 'z'], 'z')", "1|3");
+  db_check_str("CALL list_find([1, 'y', 2.5], 2.5)", "1|3");
+
+  db_execute(
+    "CREATE PROCEDURE list_rows() BEGIN"
+    " SET @ids = (SELECT id FROM fused_items ORDER BY id);"
+    " RETURN list_len(@ids), list_sum(@ids), list_max(@ids), list_index_of(@ids, 4);"
+    "END"
+  );
+  db_check_str("CALL list_rows()", "6|21|6|4");
+
+  // simple expressions are evaluated without SQLite
+
+  db_execute("CREATE PROCEDURE expr_add(@a, @b) BEGIN RETURN @a + @b; END");
+  db_check_int("CALL expr_add(2, 3)", 5);
+  db_check_double("CALL expr_add(2, 0.5)", 2.5, 0.0001);
+  db_check_double("CALL expr_add(9223372036854775807, 1)", 9223372036854775808.0, 1.0);
+  db_check_int("CALL expr_add('2', 3)", 5);
+  db_check_int("CALL expr_add(4, 5)", 9);
+
+  db_execute(
+    "CREATE PROCEDURE expr_calc(@a, @b) BEGIN"
+    " SET @div = @a / @b;"
+    " IF @div IS NULL THEN RETURN 'null'; END IF;"
+    " RETURN @div || '-' || (@a % @b) || '-' || (-@a + 2 * @b - 1);"
+    "END"
+  );
+  db_check_str("CALL expr_calc(7, 2)", "3-1--4");
+  db_check_str("CALL expr_calc(-7, 2)", "-3--1-10");
+  db_check_str("CALL expr_calc(7, 0)", "null");
+  db_check_str("CALL expr_calc(7.0, 2)", "3.5-1.0--4.0");
+
+  db_execute(
+    "CREATE PROCEDURE expr_logic(@a, @b) BEGIN"
+    " IF @a > 0 AND @b IS NOT NULL OR @a = -1 THEN RETURN 'yes'; END IF;"
+    " IF NOT (@a <> 0) THEN RETURN 'zero'; END IF;"
+    " IF @b ISNULL AND (@a < 0 OR NULL) THEN RETURN 'negative'; END IF;"
+    " RETURN 'no';"
+    "END"
+  );
+  db_check_str("CALL expr_logic(1, 2)", "yes");
+  db_check_str("CALL expr_logic(1, NULL)", "no");
+  db_check_str("CALL expr_logic(-1, NULL)", "yes");
+  db_check_str("CALL expr_logic(0, NULL)", "zero");
+  db_check_str("CALL expr_logic(-2, NULL)", "negative");
+  db_check_str("CALL expr_logic(-2, 5)", "no");
+
+  // a failed call rolls back its own changes, also inside a transaction
+
+  db_execute("CREATE TABLE call_log (v)");
+  db_execute(
+    "CREATE PROCEDURE log_value(@v) BEGIN"
+    " INSERT INTO call_log VALUES (@v);"
+    " IF @v < 0 THEN RAISE EXCEPTION 'negative value'; END IF;"
+    " RETURN @v;"
+    "END"
+  );
+  db_check_int("CALL log_value(1)", 1);
+  db_catch_msg("CALL log_value(-1)", "negative value");
+  db_check_int("SELECT count(*) FROM call_log", 1);
+
+  db_execute("BEGIN");
+  db_check_int("CALL log_value(2)", 2);
+  db_catch_msg("CALL log_value(-2)", "negative value");
+  db_check_int("CALL log_value(3)", 3);
+  db_execute("COMMIT");
+  db_check_int("SELECT count(*) FROM call_log", 3);
+  db_check_int("SELECT sum(v) FROM call_log", 6);
+
+  // also on the attached databases
+
+  db_execute("ATTACH DATABASE ':memory:' AS aux_db");
+  db_execute("CREATE TABLE aux_db.aux_log (v)");
+  db_execute(
+    "CREATE PROCEDURE log_attached(@v) BEGIN"
+    " INSERT INTO aux_db.aux_log VALUES (@v);"
+    " IF @v < 0 THEN RAISE EXCEPTION 'negative value'; END IF;"
+    " RETURN @v;"
+    "END"
+  );
+  db_execute("BEGIN");
+  db_check_int("CALL log_attached(1)", 1);
+  db_catch_msg("CALL log_attached(-1)", "negative value");
+  db_check_int("CALL log_attached(2)", 2);
+  db_execute("COMMIT");
+  db_check_int("SELECT count(*) FROM aux_db.aux_log", 2);
+  db_check_int("SELECT sum(v) FROM aux_db.aux_log", 3);
+  db_execute("DETACH DATABASE aux_db");
+
+  // lists with many items
+
+  db_execute(
+    "CREATE PROCEDURE big_list(@n) BEGIN"
+    " SET @rows = (SELECT x FROM (WITH RECURSIVE c(x) AS"
+    "   (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < @n) SELECT x FROM c));"
+    " SET @total = 0;"
+    " FOREACH @x IN @rows DO"
+    "   SET @total = @total + @x;"
+    " END LOOP;"
+    " FOREACH @y IN [1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17] DO"
+    "   SET @total = @total + @y;"
+    " END LOOP;"
+    " RETURN @total;"
+    "END"
+  );
+  db_check_int("CALL big_list(1000)", 500500 + 153);
+  db_check_int("CALL big_list(10)", 55 + 153);
+  db_check_int("CALL big_list(2000)", 2001000 + 153);
+
+  // temporary lists use the call arena, and the heap when it is full
+
+  db_execute(
+    "CREATE PROCEDURE arena_rows(@n, @times) BEGIN"
+    " SET @i = 0;"
+    " SET @total = 0;"
+    " LOOP"
+    "   SET @i = @i + 1;"
+    "   IF @i > @times THEN BREAK; END IF;"
+    "   SET @rows = (SELECT x, 'item ' || x FROM (WITH RECURSIVE c(x) AS"
+    "     (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < @n) SELECT x FROM c));"
+    "   FOREACH @x, @name IN @rows DO"
+    "     SET @total = @total + length(@name);"
+    "   END LOOP;"
+    " END LOOP;"
+    " IF @n > 10 THEN RETURN @total; END IF;"
+    " RETURN @rows;"
+    "END"
+  );
+  db_check_many("CALL arena_rows(3, 2)",
+    "1|item 1",
+    "2|item 2",
+    "3|item 3",
+    NULL
+  );
+  db_check_int("CALL arena_rows(1000, 50)", 7893 * 50);
+  db_check_many("CALL arena_rows(2, 1)",
+    "1|item 1",
+    "2|item 2",
+    NULL
+  );
+
+  // the compiled program and the interpreter return the same results
+
+  db_execute(
+    "CREATE PROCEDURE control_flow(@n) BEGIN"
+    " SET @i = 0;"
+    " SET @result = '';"
+    " LOOP"
+    "   SET @i = @i + 1;"
+    "   IF @i > @n THEN"
+    "     BREAK;"
+    "   ELSEIF @i % 3 = 0 THEN"
+    "     SET @result = @result || 'f';"
+    "     CONTINUE;"
+    "   ELSEIF @i % 5 = 0 THEN"
+    "     SET @result = @result || 'b';"
+    "   ELSE"
+    "     SET @result = @result || @i;"
+    "   END IF;"
+    "   FOREACH @item IN [1,2,3] DO"
+    "     IF @item = 2 THEN CONTINUE; END IF;"
+    "     SET @result = @result || '.';"
+    "   END LOOP;"
+    " END LOOP;"
+    " RETURN @result;"
+    "END"
+  );
+
+  db_check_str("CALL control_flow(10)", "1..2..f4..b..f7..8..fb..");
+  db_check_str("CALL control_flow(0)", "");
+  db_check_int("CALL loop_basic(10)", 11);
+  db_catch_msg("SELECT sp_config('execution_mode')", "sp_config: unknown option");
+
+  // generator procedures: RETURN NEXT returns a row and continues the
+  // execution when the next row is read
+
+  db_execute(
+    "CREATE PROCEDURE gen_squares(@n) BEGIN"
+    " SET @i = 0;"
+    " LOOP"
+    "   SET @i = @i + 1;"
+    "   IF @i > @n THEN BREAK; END IF;"
+    "   IF @i % 2 = 0 THEN"
+    "     RETURN NEXT @i, @i * @i;"
+    "   END IF;"
+    " END LOOP;"
+    "END"
+  );
+
+  db_execute(
+    "CREATE PROCEDURE gen_select(@min) BEGIN"
+    " FOREACH @x IN SELECT value FROM (WITH RECURSIVE c(value) AS"
+    "   (SELECT 1 UNION ALL SELECT value + 1 FROM c WHERE value < 5) SELECT value FROM c) DO"
+    "   IF @x >= @min THEN"
+    "     RETURN NEXT 'item ' || @x;"
+    "   END IF;"
+    " END LOOP;"
+    " RETURN 'end';"
+    "END"
+  );
+
+  db_check_many("CALL gen_squares(7)",
+    "2|4",
+    "4|16",
+    "6|36",
+    NULL
+  );
+  db_check_empty("CALL gen_squares(1)");
+
+  db_check_many("CALL gen_select(3)",
+    "item 3",
+    "item 4",
+    "item 5",
+    "end",
+    NULL
+  );
+
+  // the caller can stop reading the rows before the procedure ends
+  {
+    sqlite3_stmt *stmt = NULL;
+    rc = sqlite3_prepare_v2(db, "CALL gen_select(2)", -1, &stmt, NULL);
+    assert(rc==SQLITE_OK);
+    assert(sqlite3_step(stmt)==SQLITE_ROW);
+    assert(strcmp((char*)sqlite3_column_text(stmt, 0), "item 2")==0);
+    sqlite3_reset(stmt);
+    assert(sqlite3_step(stmt)==SQLITE_ROW);
+    assert(strcmp((char*)sqlite3_column_text(stmt, 0), "item 2")==0);
+    assert(sqlite3_step(stmt)==SQLITE_ROW);
+    assert(strcmp((char*)sqlite3_column_text(stmt, 0), "item 3")==0);
+    sqlite3_finalize(stmt);
+  }
+
+  // an error after a row was returned fails the CALL, and the changes made
+  // by the generator are rolled back
+  db_execute("CREATE TABLE gen_log (v)");
+  db_execute(
+    "CREATE PROCEDURE gen_error() BEGIN"
+    " RETURN NEXT 1;"
+    " INSERT INTO gen_log VALUES (1);"
+    " RAISE EXCEPTION 'generator failed';"
+    "END"
+  );
+  {
+    sqlite3_stmt *stmt = NULL;
+    rc = sqlite3_prepare_v2(db, "CALL gen_error()", -1, &stmt, NULL);
+    assert(rc==SQLITE_OK);
+    assert(sqlite3_step(stmt)==SQLITE_ROW);
+    assert(sqlite3_column_int(stmt, 0)==1);
+    rc = sqlite3_step(stmt);
+    assert(rc==SQLITE_ERROR);
+    assert(strstr(sqlite3_errmsg(db), "generator failed")!=NULL);
+    sqlite3_finalize(stmt);
+  }
+  db_check_int("SELECT count(*) FROM gen_log", 0);
+
+  db_catch_msg("CREATE FUNCTION gen_func() BEGIN RETURN NEXT 1; END",
+               "RETURN NEXT cannot be used in functions");
+
+  // procedures compiled to C
+
+  db_execute(
+    "CREATE PROCEDURE native_sum(@n) BEGIN"
+    " SET @sum = 0;"
+    " FOREACH @x IN SELECT value FROM (WITH RECURSIVE c(value) AS"
+    "   (SELECT 1 UNION ALL SELECT value + 1 FROM c WHERE value < @n) SELECT value FROM c) DO"
+    "   IF @x % 2 = 0 THEN CONTINUE; END IF;"
+    "   SET @sum = @sum + @x;"
+    " END LOOP;"
+    " ASSERT @sum > 0, 'empty sum: %d', @n;"
+    " RETURN @sum, @n;"
+    "END"
+  );
+  db_check_int("SELECT instr(sp_compile_c('native_sum'), 'int sqlite3_extension_init(') > 0", 1);
+  db_check_int("SELECT instr(sp_compile_c('native_sum'), 'sp_register_native(?1)') > 0", 1);
+  db_check_int("SELECT instr(sp_compile_c('native_sum'), 'sp_condition(') > 0", 1);
+  db_catch_msg("SELECT sp_compile_c('control_flow')", "lists are not supported");
+  db_catch_msg("SELECT sp_compile_c('no_such_procedure')", "not found");
+
+  // CALL uses the native implementation only while the code is the same
+
+  db_execute(
+    "CREATE PROCEDURE native_double(@x) BEGIN"
+    " RETURN @x * 2;"
+    "END"
+  );
+  native_double.version = procedure_version("native_double");
+  rc = register_native(&native_double);
+  assert(rc==SQLITE_OK);
+  db_check_int("CALL native_double(21)", 42);
+  db_check_int("CALL native_double(5)", 10);
+  assert(native_calls==2);
+  db_catch_msg("CALL native_double('abc')", "native error: abc");
+  assert(native_calls==3);
+
+  db_execute(
+    "CREATE OR REPLACE PROCEDURE native_double(@x) BEGIN"
+    " RETURN @x * 2 + 1;"
+    "END"
+  );
+  db_check_int("CALL native_double(21)", 43);
+  assert(native_calls==3);
+
+  // only the descriptors bound as sp_native_proc pointers are registered
+  db_catch_msg("SELECT sp_register_native(1)", "sp_register_native: invalid descriptor");
+  db_catch_msg("SELECT sp_register_native(NULL)", "sp_register_native: invalid descriptor");
+
 ////////////////////////////////////////////////////////////////////////////////
 
   // functions!
+
+  db_execute(
+    "CREATE FUNCTION add_tax(@price, @rate) BEGIN"
+    " IF @price IS NULL THEN RETURN; END IF;"
+    " RETURN @price + @price * @rate / 100;"
+    "END"
+  );
+  db_check_int("SELECT add_tax(100, 10)", 110);
+  db_check_str("SELECT CASE WHEN add_tax(NULL, 10) IS NULL THEN 'null' END", "null");
+
+  db_execute("CREATE TABLE tax_items (price)");
+  db_execute("INSERT INTO tax_items VALUES (100), (200), (300)");
+  db_check_int("SELECT sum(add_tax(price, 10)) FROM tax_items", 660);
+  db_check_int("SELECT count(*) FROM tax_items WHERE add_tax(price, 50) > 250", 2);
+  db_execute("UPDATE tax_items SET price = add_tax(price, 100)");
+  db_check_int("SELECT sum(price) FROM tax_items", 1200);
+
+  db_catch_msg("SELECT add_tax(1)", "wrong number of arguments to function add_tax()");
+  db_catch_msg("CALL add_tax(1, 2)", "Cannot call a function");
+
+  // functions that read from tables
+
+  db_execute("CREATE TABLE tax_rates (code, rate)");
+  db_execute("INSERT INTO tax_rates VALUES ('A', 10), ('B', 20)");
+  db_execute(
+    "CREATE FUNCTION tax_rate(@code) BEGIN"
+    " SET @rate = SELECT rate FROM tax_rates WHERE code = @code;"
+    " RETURN coalesce(@rate, 0);"
+    "END"
+  );
+  db_check_int("SELECT tax_rate('B')", 20);
+  db_check_int("SELECT tax_rate('C')", 0);
+  db_check_int("SELECT sum(tax_rate(code)) FROM tax_rates", 30);
+  db_execute("UPDATE tax_items SET price = add_tax(price, tax_rate('A'))");
+  db_check_int("SELECT sum(price) FROM tax_items", 1320);
+
+  // the frame is kept with its statements for the next rows, and only the
+  // variables are reset
+
+  db_execute(
+    "CREATE FUNCTION rate_note(@code) BEGIN"
+    " IF @code = 'A' THEN SET @note = 'first'; END IF;"
+    " SET @rate = SELECT rate FROM tax_rates WHERE code = @code;"
+    " RETURN coalesce(@note, '-') || ':' || coalesce(@rate, 0);"
+    "END"
+  );
+  db_check_str("SELECT group_concat(rate_note(code), ',') FROM (SELECT 'A' AS code UNION ALL SELECT 'B' UNION ALL SELECT 'C')",
+               "first:10,-:20,-:0");
+  db_check_int("SELECT count(*) FROM sp_statements WHERE procedure = 'rate_note'", 0);
+  db_check_str("SELECT rate_note('B')", "-:20");
+
+  db_execute(
+    "CREATE OR REPLACE FUNCTION rate_note(@code) BEGIN"
+    " SET @rate = SELECT rate * 2 FROM tax_rates WHERE code = @code;"
+    " RETURN @code || ':' || coalesce(@rate, 0);"
+    "END"
+  );
+  db_check_str("SELECT group_concat(rate_note(code), ',') FROM tax_rates", "A:20,B:40");
+
   // recursive functions
 
+  db_execute(
+    "CREATE FUNCTION fib(@n) BEGIN"
+    " IF @n < 1 THEN"
+    "   SET @n = 0;"
+    " ELSEIF @n > 1 THEN"
+    "   SET @n = fib(@n - 1) + fib(@n - 2);"
+    " END IF;"
+    " RETURN @n;"
+    "END"
+  );
+  db_check_int("SELECT fib(1)", 1);
+  db_check_int("SELECT fib(10)", 55);
+  db_catch_msg("SELECT fib(1000)", "too many levels of stored function recursion");
 
-/*
+  // functions that modify the database. the changes are rolled back with
+  // the statement that uses them
+
+  db_execute("CREATE TABLE func_log (v)");
+  db_execute(
+    "CREATE FUNCTION log_item(@v) BEGIN"
+    " INSERT INTO func_log VALUES (@v);"
+    " IF @v < 0 THEN RAISE EXCEPTION 'negative value'; END IF;"
+    " RETURN @v;"
+    "END"
+  );
+  db_check_int("SELECT log_item(1)", 1);
+  db_check_int("SELECT count(*) FROM func_log", 1);
+  db_catch_msg("SELECT log_item(column1) FROM (VALUES (2), (-2))", "negative value");
+  db_check_int("SELECT count(*) FROM func_log", 1);
 
-CREATE FUNCTION fib (@n) BEGIN
- IF @n < 1 THEN
-   SET @n = 0;
- ELSEIF @n > 1 THEN
-   SET @n = fib(@n - 1) + fib(@n - 2);
- END IF;
- RETURN @n;
-END
+  db_execute("BEGIN");
+  db_check_int("SELECT log_item(3)", 3);
+  db_catch_msg("SELECT log_item(column1) FROM (VALUES (4), (-4))", "negative value");
+  db_check_int("SELECT sum(log_item(column1)) FROM (VALUES (5), (6))", 11);
+  db_execute("COMMIT");
+  db_check_int("SELECT count(*) FROM func_log", 4);
+  db_check_int("SELECT sum(v) FROM func_log", 15);
 
-*/
+  // the built-in functions cannot be replaced
+
+  db_catch_msg("CREATE FUNCTION lower(@s) BEGIN RETURN @s; END",
+               "cannot replace the built-in function lower()");
+  db_catch_msg("CREATE FUNCTION ABS(@a, @b) BEGIN RETURN @a; END",
+               "cannot replace the built-in function ABS()");
+  db_check_str("SELECT lower('AbC'), abs(-2)", "abc|2");
 
 
 
@@ -1499,7 +2611,11 @@ END
 
 
 
-  sqlite3_close(db);
+  // the statement pool must not keep the connection busy
+  if( sqlite3_close(db)!=SQLITE_OK ){
+    puts("FAILED: the database connection could not be closed");
+    return 1;
+  }
 
   /* release global memory - to make valgrind happy */
   sqlite3_shutdown();